@@ -93,7 +93,7 @@ main(void)
           printf( "From %s/lib1.so, CPF_call_func_by_name() concat_char_int: \"%s\"\n",
                   cpf->path,
                   cp);
-          FREE(cp)
+          CPF_mem_free( cp );
         }
         break;
       case 5:
@@ -0,0 +1,480 @@
+/*
+  libcpf - C Plugin Framework
+
+  ab.c - side-by-side plugin versions with A/B latency comparison
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "ab.h"
+#include "plugin_manager.h"
+
+
+static plugin_t *
+find_plugin( cpf_t * cpf, char * plugin_name )
+{
+  uint16_t i;
+
+
+  for ( i = 0 ; i < cpf->num_plugins ; i++ ) {
+    if ( strcmp( cpf->plugin[i].name, plugin_name ) == 0 ) {
+      return &cpf->plugin[i];
+    }
+  }
+  return NULL;
+}
+
+
+/*
+ * The handle calls use an experiment without lock (see handle.c): once
+ * unloaded, the candidate stays mapped and its statistics allocated until
+ * CPF_free().
+*/
+static void
+retire( cpf_t * cpf, struct cpf_ab * ab )
+{
+  ab->next = cpf->ab_retired;
+  cpf->ab_retired = ab;
+}
+
+
+struct cpf_ab *
+ab_find( cpf_t * cpf, char * plugin_name )
+{
+  struct cpf_ab * ab;
+
+
+  for ( ab = cpf->ab ; ab != NULL ; ab = ab->next ) {
+    if ( strcmp( ab->candidate.name, plugin_name ) == 0 ) {
+      return ab;
+    }
+  }
+  return NULL;
+}
+
+
+void *
+ab_get_func_addr( struct cpf_ab * ab, char * func_name, enum func_prototype_t fproto )
+{
+  func_t * f;
+
+
+  for ( f = ab->candidate.lib_func ; f->func_addr != NULL ; f++ ) {
+    if ( ( f->func_name != NULL ) && ( strcmp( f->func_name, func_name ) == 0 ) ) {
+      return ( check_func_proto( f, ab->candidate.name, fproto ) == true ) ? f->func_addr : NULL;
+    }
+  }
+  return NULL;
+}
+
+
+/*
+ * Log-linear histogram: values below 2^(AB_HIST_SUB_BITS+1) have their own
+ * bucket, then each power of 2 is split in 2^AB_HIST_SUB_BITS buckets
+ * (relative error < 12.5%).
+*/
+static uint16_t
+hist_index( uint64_t ns )
+{
+  int msb;
+
+
+  if ( ns < ( 2 << AB_HIST_SUB_BITS ) ) {
+    return (uint16_t)ns;
+  }
+  msb = 63 - __builtin_clzll( ns );
+  return (uint16_t)( ( ( msb - AB_HIST_SUB_BITS + 1 ) << AB_HIST_SUB_BITS ) |
+                     ( ( ns >> ( msb - AB_HIST_SUB_BITS ) ) & ( ( 1 << AB_HIST_SUB_BITS ) - 1 ) ) );
+}
+
+
+// middle value of a histogram bucket
+static uint64_t
+hist_value( uint16_t idx )
+{
+  int      msb;
+  uint64_t low;
+
+
+  if ( idx < ( 2 << AB_HIST_SUB_BITS ) ) {
+    return idx;
+  }
+  msb = ( idx >> AB_HIST_SUB_BITS ) + AB_HIST_SUB_BITS - 1;
+  low = (uint64_t)( ( 1 << AB_HIST_SUB_BITS ) | ( idx & ( ( 1 << AB_HIST_SUB_BITS ) - 1 ) ) )
+        << ( msb - AB_HIST_SUB_BITS );
+  return low + ( ( 1ULL << ( msb - AB_HIST_SUB_BITS ) ) >> 1 );
+}
+
+
+static uint64_t
+hist_percentile( ab_stats_t * s, uint64_t calls, uint32_t percent )
+{
+  uint64_t target = ( calls * percent + 99 ) / 100,
+           sum = 0;
+  uint16_t i;
+
+
+  if ( calls == 0 ) {
+    return 0;
+  }
+  for ( i = 0 ; i < AB_HIST_SIZE ; i++ ) {
+    sum += atomic_load_explicit( &s->hist[i], memory_order_relaxed );
+    if ( sum >= target ) {
+      return hist_value( i );
+    }
+  }
+  return atomic_load_explicit( &s->max_ns, memory_order_relaxed );
+}
+
+
+uint64_t
+ab_percentile( ab_stats_t * s, uint32_t percent )
+{
+  return hist_percentile( s, atomic_load_explicit( &s->calls, memory_order_relaxed ), percent );
+}
+
+
+void
+ab_record( ab_stats_t * s, uint64_t ns )
+{
+  uint64_t max = atomic_load_explicit( &s->max_ns, memory_order_relaxed );
+
+
+  atomic_fetch_add_explicit( &s->calls, 1, memory_order_relaxed );
+  atomic_fetch_add_explicit( &s->total_ns, ns, memory_order_relaxed );
+  atomic_fetch_add_explicit( &s->hist[hist_index( ns )], 1, memory_order_relaxed );
+  while ( ( ns > max ) &&
+          !atomic_compare_exchange_weak_explicit( &s->max_ns, &max, ns,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed ) );
+}
+
+
+// zero "s" while calls may still record in it
+void
+ab_reset( ab_stats_t * s )
+{
+  uint16_t i;
+
+
+  atomic_store_explicit( &s->calls, 0, memory_order_relaxed );
+  atomic_store_explicit( &s->errors, 0, memory_order_relaxed );
+  atomic_store_explicit( &s->total_ns, 0, memory_order_relaxed );
+  atomic_store_explicit( &s->max_ns, 0, memory_order_relaxed );
+  for ( i = 0 ; i < AB_HIST_SIZE ; i++ ) {
+    atomic_store_explicit( &s->hist[i], 0, memory_order_relaxed );
+  }
+}
+
+
+/*
+ * Called after a reload: bind the candidates dependencies to the new plugin
+ * list and restart the version A statistics if version A was replaced.
+*/
+void
+ab_bind_deps( cpf_t * cpf )
+{
+  struct cpf_ab * ab;
+  plugin_t      * p;
+
+
+  for ( ab = cpf->ab ; ab != NULL ; ab = ab->next ) {
+    if ( bind_plugin_deps( cpf, &ab->candidate ) == false ) {
+      LOG_ERROR( "A/B candidate \"%s\" has unresolved dependencies!", ab->candidate.path )
+    }
+    p = find_plugin( cpf, ab->candidate.name );
+    if ( ( p != NULL ) &&
+         ( memcmp( p->blake2s256, ab->blake2s256, sizeof( ab->blake2s256 ) ) != 0 ) ) {
+      LOG_INFO( "A/B \"%s\": loaded version changed, statistics restarted",
+                ab->candidate.name )
+      memcpy( ab->blake2s256, p->blake2s256, sizeof( ab->blake2s256 ) );
+      ab_reset( &ab->stats[0] );
+    }
+  }
+}
+
+
+void
+ab_call_dtor( cpf_t * cpf )
+{
+  struct cpf_ab * ab;
+  ctor_dtor_t     ctor_dtor;
+
+
+  for ( ab = cpf->ab ; ab != NULL ; ab = ab->next ) {
+    if ( ab->candidate.dtor != NULL ) {
+      ctor_dtor = ab->candidate.dtor;
+      ctor_dtor( &ab->candidate );
+    }
+  }
+}
+
+
+// unload the experiments (the destructors are called by CPF_call_dtor())
+void
+ab_retire_all( cpf_t * cpf )
+{
+  struct cpf_ab * ab;
+
+
+  while ( ( ab = cpf->ab ) != NULL ) {
+    cpf->ab = ab->next;
+    retire( cpf, ab );
+  }
+}
+
+
+// free the experiments, unloaded or not
+void
+ab_free_all( cpf_t * cpf )
+{
+  struct cpf_ab * ab;
+
+
+  ab_retire_all( cpf );
+  while ( ( ab = cpf->ab_retired ) != NULL ) {
+    cpf->ab_retired = ab->next;
+    close_plugin( &ab->candidate );
+    FREE( ab )
+  }
+}
+
+
+/*
+ * Load "candidate_path" side by side with the loaded plugin "plugin_name" and
+ * send "percent" % of the calls made through resolved handles (CPF_resolve())
+ * to it. Both versions are timed until CPF_ab_unload().
+*/
+int
+CPF_ab_load( cpf_t ** cpf, char * plugin_name, char * candidate_path, uint8_t percent )
+{
+  struct cpf_ab * ab;
+  plugin_t      * p;
+  ctor_dtor_t     ctor_dtor;
+  int             ret = EXIT_FAILURE;
+
+
+  if ( ( (*cpf) == NULL ) || ( plugin_name == NULL ) || ( candidate_path == NULL ) ) {
+    LOG_ERROR( "CPF_ab_load(): Parameters cannot be NULL!" )
+    return EXIT_FAILURE;
+  }
+  if ( percent > 100 ) {
+    LOG_ERROR( "CPF_ab_load(): Traffic split must be between 0 and 100%%!" )
+    return EXIT_FAILURE;
+  }
+  if ( ( strlen( candidate_path ) + 1 > sizeof( ab->candidate.path ) ) ||
+       ( strlen( plugin_name ) + 1 > sizeof( ab->candidate.name ) ) ) {
+    LOG_ERROR( "CPF_ab_load(): Plugin path or name too long!" )
+    return EXIT_FAILURE;
+  }
+  if ( access( candidate_path, R_OK ) != 0 ) {
+    LOG_ERROR( "CPF_ab_load(): Cannot read \"%s\"!", candidate_path )
+    return EXIT_FAILURE;
+  }
+
+  reload_wrlock();
+  if ( ( p = find_plugin( *cpf, plugin_name ) ) == NULL ) {
+    LOG_ERROR( "CPF_ab_load(): Plugin \"%s\" is not loaded!", plugin_name )
+    goto out;
+  }
+  if ( ab_find( *cpf, plugin_name ) != NULL ) {
+    LOG_ERROR( "CPF_ab_load(): Plugin \"%s\" already has a candidate!", plugin_name )
+    goto out;
+  }
+  if ( ( ab = (struct cpf_ab *)calloc( 1, sizeof( struct cpf_ab ) ) ) == NULL ) {
+    LOG_ERROR( "CPF_ab_load(): Cannot allocate memory!" )
+    exit( EXIT_FAILURE );
+  }
+  strcpy( ab->candidate.path, candidate_path );
+  strcpy( ab->candidate.name, plugin_name );
+  if ( load_single_plugin( *cpf, &ab->candidate ) == false ) {
+    FREE( ab )
+    goto out;
+  }
+
+  if ( memcmp( ab->candidate.blake2s256, p->blake2s256, sizeof( p->blake2s256 ) ) == 0 ) {
+    LOG_ERROR( "CPF_ab_load(): \"%s\" is the loaded build of \"%s\"!",
+               candidate_path, plugin_name )
+    close_plugin( &ab->candidate );
+    FREE( ab )
+    goto out;
+  }
+  if ( bind_plugin_deps( *cpf, &ab->candidate ) == false ) {
+    close_plugin( &ab->candidate );
+    FREE( ab )
+    goto out;
+  }
+  if ( ab->candidate.ctor != NULL ) {
+    ctor_dtor = ab->candidate.ctor;
+    ctor_dtor( &ab->candidate );
+  }
+  memcpy( ab->blake2s256, p->blake2s256, sizeof( ab->blake2s256 ) );
+  atomic_store( &ab->percent, percent );
+  ab->next = (*cpf)->ab;
+  (*cpf)->ab = ab;
+  (*cpf)->generation++; // resolved handles pick up the candidate
+  LOG_INFO( "A/B \"%s\": version \"%s\" loaded beside version \"%s\" (%u%% of the calls)",
+            plugin_name, ab->candidate.ctx->version, p->ctx->version, percent )
+  ret = EXIT_SUCCESS;
+
+out:
+  reload_unlock();
+  return ret;
+}
+
+
+int
+CPF_ab_set_split( cpf_t * cpf, char * plugin_name, uint8_t percent )
+{
+  struct cpf_ab * ab;
+  int             ret = EXIT_FAILURE;
+
+
+  if ( percent > 100 ) {
+    LOG_ERROR( "CPF_ab_set_split(): Traffic split must be between 0 and 100%%!" )
+    return EXIT_FAILURE;
+  }
+  reload_rdlock();
+  if ( ( ab = ab_find( cpf, plugin_name ) ) != NULL ) {
+    atomic_store_explicit( &ab->percent, percent, memory_order_relaxed );
+    ret = EXIT_SUCCESS;
+  } else {
+    LOG_ERROR( "CPF_ab_set_split(): There is no candidate for \"%s\"!", plugin_name )
+  }
+  reload_unlock();
+  return ret;
+}
+
+
+static void
+get_stats( ab_stats_t * s, char * version, cpf_ab_stats_t * out )
+{
+  memset( out, 0, sizeof( cpf_ab_stats_t ) );
+  snprintf( out->version, sizeof( out->version ), "%s", version );
+  out->calls = atomic_load_explicit( &s->calls, memory_order_relaxed );
+  out->errors = atomic_load_explicit( &s->errors, memory_order_relaxed );
+  out->max_ns = atomic_load_explicit( &s->max_ns, memory_order_relaxed );
+  if ( out->calls > 0 ) {
+    out->mean_ns = atomic_load_explicit( &s->total_ns, memory_order_relaxed ) / out->calls;
+    out->p50_ns = hist_percentile( s, out->calls, 50 );
+    out->p99_ns = hist_percentile( s, out->calls, 99 );
+  }
+}
+
+
+// stats[0] = loaded version (A), stats[1] = candidate (B)
+int
+CPF_ab_get_stats( cpf_t * cpf, char * plugin_name, cpf_ab_stats_t stats[2] )
+{
+  struct cpf_ab * ab;
+  plugin_t      * p;
+  int             ret = EXIT_FAILURE;
+
+
+  reload_rdlock();
+  if ( ( ab = ab_find( cpf, plugin_name ) ) != NULL ) {
+    p = find_plugin( cpf, plugin_name );
+    get_stats( &ab->stats[0], ( p != NULL ) ? p->ctx->version : NOT_DEFINED, &stats[0] );
+    get_stats( &ab->stats[1], ab->candidate.ctx->version, &stats[1] );
+    ret = EXIT_SUCCESS;
+  } else {
+    LOG_ERROR( "CPF_ab_get_stats(): There is no candidate for \"%s\"!", plugin_name )
+  }
+  reload_unlock();
+  return ret;
+}
+
+
+static double
+delta_percent( uint64_t a, uint64_t b )
+{
+  return ( a == 0 ) ? 0.0 : ( ( (double)b - (double)a ) * 100.0 / (double)a );
+}
+
+
+static double
+error_rate( cpf_ab_stats_t * s )
+{
+  return ( s->calls == 0 ) ? 0.0 : (double)s->errors * 100.0 / (double)s->calls;
+}
+
+
+// report all experiments if "plugin_name" is NULL
+void
+CPF_ab_report( cpf_t * cpf, char * plugin_name )
+{
+  struct cpf_ab  * ab;
+  cpf_ab_stats_t   s[2];
+  uint8_t          v;
+
+
+  for ( ab = cpf->ab ; ab != NULL ; ab = ab->next ) {
+    if ( ( plugin_name != NULL ) && ( strcmp( ab->candidate.name, plugin_name ) != 0 ) ) {
+      continue;
+    }
+    if ( CPF_ab_get_stats( cpf, ab->candidate.name, s ) != EXIT_SUCCESS ) {
+      continue;
+    }
+    LOG_INFO( "A/B report for \"%s\" (%u%% of the calls to B, \"%s\"):",
+              ab->candidate.name,
+              atomic_load( &ab->percent ),
+              ab->candidate.path )
+    for ( v = 0 ; v < 2 ; v++ ) {
+      LOG_INFO( "  %c) version \"%s\": %lu calls, %lu errors (%.2f%%), "
+                "mean %lu ns, p50 %lu ns, p99 %lu ns, max %lu ns",
+                'A' + v, s[v].version, s[v].calls, s[v].errors, error_rate( &s[v] ),
+                s[v].mean_ns, s[v].p50_ns, s[v].p99_ns, s[v].max_ns )
+    }
+    LOG_INFO( "  B vs A: mean %+.1f%%, p50 %+.1f%%, p99 %+.1f%%, errors %+.2f points",
+              delta_percent( s[0].mean_ns, s[1].mean_ns ),
+              delta_percent( s[0].p50_ns, s[1].p50_ns ),
+              delta_percent( s[0].p99_ns, s[1].p99_ns ),
+              error_rate( &s[1] ) - error_rate( &s[0] ) )
+  }
+}
+
+
+int
+CPF_ab_unload( cpf_t ** cpf, char * plugin_name )
+{
+  struct cpf_ab ** prev,
+                 * ab;
+  ctor_dtor_t      ctor_dtor;
+  int              ret = EXIT_FAILURE;
+
+
+  reload_wrlock();
+  for ( prev = &(*cpf)->ab ; ( ab = *prev ) != NULL ; prev = &ab->next ) {
+    if ( strcmp( ab->candidate.name, plugin_name ) == 0 ) {
+      *prev = ab->next;
+      if ( ab->candidate.dtor != NULL ) {
+        ctor_dtor = ab->candidate.dtor;
+        ctor_dtor( &ab->candidate );
+      }
+      retire( (*cpf), ab );
+      (*cpf)->generation++; // resolved handles drop the candidate
+      ret = EXIT_SUCCESS;
+      break;
+    }
+  }
+  if ( ret != EXIT_SUCCESS ) {
+    LOG_ERROR( "CPF_ab_unload(): There is no candidate for \"%s\"!", plugin_name )
+  }
+  reload_unlock();
+  return ret;
+}
@@ -0,0 +1,59 @@
+/*
+  libcpf - C Plugin Framework
+
+  ab.h - header file
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __AB_H__
+#define __AB_H__
+
+#include <stdatomic.h>
+#include "cpf.h"
+
+#define AB_HIST_SUB_BITS        3         // linear sub-buckets per power of 2
+#define AB_HIST_SIZE            ( 64 << AB_HIST_SUB_BITS )
+
+
+typedef struct {                          // latency/error statistics of one version
+  _Atomic uint64_t calls;
+  _Atomic uint64_t errors;
+  _Atomic uint64_t total_ns;
+  _Atomic uint64_t max_ns;
+  _Atomic uint64_t hist[AB_HIST_SIZE];    // log-linear latency histogram (ns)
+} ab_stats_t;
+
+struct cpf_ab {                           // one A/B experiment
+  struct cpf_ab  * next;
+  plugin_t         candidate;             // version B, loaded side by side
+  uint8_t          blake2s256[BLAKE2S256SIZE]; // version A measured by stats[0]
+  _Atomic uint32_t percent;               // share of the handle calls sent to B
+  ab_stats_t       stats[2];              // [0] = loaded version A, [1] = candidate B
+};
+
+struct cpf_ab * ab_find( cpf_t * cpf, char * plugin_name );
+void *          ab_get_func_addr( struct cpf_ab * ab,
+                                  char * func_name,
+                                  enum func_prototype_t fproto );
+void            ab_record( ab_stats_t * s, uint64_t ns );
+uint64_t        ab_percentile( ab_stats_t * s, uint32_t percent );
+void            ab_reset( ab_stats_t * s );
+void            ab_bind_deps( cpf_t * cpf );
+void            ab_call_dtor( cpf_t * cpf );
+void            ab_retire_all( cpf_t * cpf );
+void            ab_free_all( cpf_t * cpf );
+
+#endif
@@ -0,0 +1,136 @@
+/*
+  libcpf - C Plugin Framework
+
+  atfork.c - fork hooks of the plugins (CPF_FLAG_FORK_SAFE)
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include "atfork.h"
+#include "intercept.h"
+#include "memo.h"
+#include "plugin_manager.h"
+
+
+// fork-safe registries: their plugins get the fork hooks
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t  atfork_once = PTHREAD_ONCE_INIT;
+static cpf_t        ** registry = NULL;
+static uint16_t        num_registries = 0;
+
+
+static void
+call_hooks( size_t hook_offset )
+{
+  ctor_dtor_t hook;
+  uint16_t    i, j;
+
+
+  for ( i = 0 ; i < num_registries ; i++ ) {
+    for ( j = 0 ; j < registry[i]->num_plugins ; j++ ) {
+      if ( ( hook = *(ctor_dtor_t *)( (char *)&registry[i]->plugin[j] + hook_offset ) ) != NULL ) {
+        hook( &registry[i]->plugin[j] );
+      }
+    }
+  }
+}
+
+
+/*
+ * Before fork(): no reload of another thread, memoization or interceptor
+ * change is in progress, so the child gets consistent registries and no lock
+ * held by a thread that doesn't exist in the child. The reload lock itself
+ * isn't taken: the forking thread may hold it (see reload_fork_prepare()).
+ * The plugins quiesce (CPF_prefork()).
+*/
+static void
+atfork_prepare( void )
+{
+  reload_fork_prepare();
+  pthread_mutex_lock( &registry_lock );
+  intercept_lock();
+  memo_lock_all();
+  call_hooks( offsetof( plugin_t, prefork ) );
+}
+
+
+static void
+atfork_parent( void )
+{
+  call_hooks( offsetof( plugin_t, postfork_parent ) );
+  memo_unlock_all();
+  intercept_unlock();
+  pthread_mutex_unlock( &registry_lock );
+  reload_fork_parent();
+}
+
+
+// the child re-opens what it must not share with the parent (CPF_constructor_child())
+static void
+atfork_child( void )
+{
+  memo_unlock_all();
+  intercept_lock_reset();
+  call_hooks( offsetof( plugin_t, ctor_child ) );
+  pthread_mutex_unlock( &registry_lock );
+  reload_fork_child();
+}
+
+
+static void
+atfork_init( void )
+{
+  pthread_atfork( atfork_prepare, atfork_parent, atfork_child );
+}
+
+
+// called for the registries created with CPF_FLAG_FORK_SAFE, and after their reloads
+void
+atfork_register( cpf_t * cpf )
+{
+  cpf_t ** r;
+
+
+  pthread_once( &atfork_once, atfork_init );
+  pthread_mutex_lock( &registry_lock );
+  r = (cpf_t **)realloc( registry, ( num_registries + 1 ) * sizeof( cpf_t * ) );
+  if ( r == NULL ) {
+    LOG_ERROR( "Cannot allocate memory for the fork-safe registries!" )
+    exit( EXIT_FAILURE );
+  }
+  registry = r;
+  registry[num_registries++] = cpf;
+  pthread_mutex_unlock( &registry_lock );
+}
+
+
+void
+atfork_unregister( cpf_t * cpf )
+{
+  uint16_t i;
+
+
+  pthread_mutex_lock( &registry_lock );
+  for ( i = 0 ; i < num_registries ; i++ ) {
+    if ( registry[i] == cpf ) {
+      registry[i] = registry[--num_registries];
+      break;
+    }
+  }
+  pthread_mutex_unlock( &registry_lock );
+}
@@ -0,0 +1,29 @@
+/*
+  libcpf - C Plugin Framework
+
+  atfork.h - header file
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __ATFORK_H__
+#define __ATFORK_H__
+
+#include "cpf.h"
+
+void atfork_register( cpf_t * cpf );
+void atfork_unregister( cpf_t * cpf );
+
+#endif
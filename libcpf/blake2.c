@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include "blake2.h"
 #include "log.h"
+#include "usdt.h"
 
 
 void
@@ -35,6 +36,7 @@ calc_blake2( plugin_t * p )
   size_t          i;                          /* loop variables */
 
 
+  USDT_PROBE2( hash_start, p->name, p->path );
   f = fopen( p->path, "r" );
   if ( f == NULL ) {
     LOG_ERROR( "Couldn't open plugin \"%s\"", p->path )
@@ -67,6 +69,31 @@ calc_blake2( plugin_t * p )
   }
 
   fclose(f);
+  USDT_PROBE2( hash_end, p->name, p->blake2s256 );
+}
+
+
+// hash of a plugin loaded from memory (CPF_load_from_buffer())
+void
+calc_blake2_buffer( plugin_t * p, const void * data, size_t len )
+{
+  unsigned int    md_len;
+  EVP_MD_CTX      * mdctx;
+
+
+  USDT_PROBE2( hash_start, p->name, p->path );
+  if ( ( mdctx = EVP_MD_CTX_new() ) == NULL ) {
+    LOG_ERROR( "Couldn't init context for \"%s\"", p->path )
+    exit( EXIT_FAILURE );
+  }
+  if ( ( EVP_DigestInit_ex( mdctx, EVP_blake2s256(), NULL ) == 0 ) ||
+       ( EVP_DigestUpdate( mdctx, data, len ) == 0 ) ||
+       ( EVP_DigestFinal_ex( mdctx, p->blake2s256, &md_len ) == 0 ) ) {
+    LOG_ERROR( "Couldn't digest \"%s\"", p->path )
+    exit( EXIT_FAILURE );
+  }
+  EVP_MD_CTX_free( mdctx );
+  USDT_PROBE2( hash_end, p->name, p->blake2s256 );
 }
 
 
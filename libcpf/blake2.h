@@ -24,6 +24,7 @@
 #include "cpf.h"
 
 void calc_blake2( plugin_t * plugin );
+void calc_blake2_buffer( plugin_t * plugin, const void * data, size_t len );
 void print_blake2( plugin_t * plugin );
 
 #endif
\ No newline at end of file
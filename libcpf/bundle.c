@@ -0,0 +1,236 @@
+/*
+  libcpf - C Plugin Framework
+
+  bundle.c - plugins packed in one file with an mmap'd index
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bundle.h"
+#include "plugin_manager.h"
+#include "log.h"
+
+
+// the plugin directory path is a regular file: a bundle
+bool
+bundle_is_bundle( const char * path )
+{
+  struct stat st;
+
+
+  return ( stat( path, &st ) == 0 ) && S_ISREG( st.st_mode );
+}
+
+
+// NUL terminated plugin name inside the bundle, or NULL if the offset is invalid
+static const char *
+bundle_str( struct cpf_bundle * b, uint64_t off )
+{
+  size_t max;
+
+
+  if ( ( off < sizeof( bundle_hdr_t ) ) || ( off >= b->size ) ) {
+    return NULL;
+  }
+  max = b->size - off;
+  if ( max > MAX_PLUGIN_NAME_SIZE ) {
+    max = MAX_PLUGIN_NAME_SIZE;
+  }
+  if ( memchr( (char *)b->map + off, '\0', max ) == NULL ) {
+    return NULL; // not terminated, or too long for plugin_t.name
+  }
+  return (char *)b->map + off;
+}
+
+
+static bool
+bundle_valid( struct cpf_bundle * b )
+{
+  const bundle_entry_t * e;
+  const char * name,
+             * prev = NULL;
+  uint32_t     i;
+
+
+  if ( b->size < sizeof( bundle_hdr_t ) ) {
+    return false;
+  }
+  b->hdr = (const bundle_hdr_t *)b->map;
+  if ( ( memcmp( b->hdr->magic, BUNDLE_MAGIC, sizeof( b->hdr->magic ) ) != 0 ) ||
+       ( b->hdr->version != BUNDLE_VERSION ) ||
+       ( b->hdr->file_size != b->size ) ||
+       ( (uint64_t)b->hdr->num_entries * sizeof( bundle_entry_t ) >
+         b->size - sizeof( bundle_hdr_t ) ) ) {
+    return false;
+  }
+  e = (const bundle_entry_t *)( b->hdr + 1 );
+  for ( i = 0 ; i < b->hdr->num_entries ; i++ ) {
+    if ( ( ( name = bundle_str( b, e[i].name_off ) ) == NULL ) ||
+         ( name[0] == '\0' ) ||
+         ( ( prev != NULL ) && ( strcmp( prev, name ) >= 0 ) ) || // sorted, no duplicates
+         ( ( e[i].offset % BUNDLE_ALIGN ) != 0 ) ||
+         ( e[i].size == 0 ) ||
+         ( e[i].offset > b->size ) ||
+         ( e[i].size > b->size - e[i].offset ) ) {
+      return false;
+    }
+    prev = name;
+  }
+  return true;
+}
+
+
+/*
+ * Map the bundle and bind its plugins (names and paths), as dir_content() does
+ * for a directory. The bundle stays mapped until bundle_load_plugins(), so the
+ * plugins are loaded from the same file even if it's renamed over meanwhile.
+*/
+void
+bundle_bind_plugins( cpf_t * cpf )
+{
+  struct cpf_bundle    * b;
+  const bundle_entry_t * e;
+  struct stat            st;
+  uint32_t               i;
+  int                    fd;
+
+
+  cpf->num_plugins = 0;
+  if ( ( fd = open( cpf->path, O_RDONLY | O_CLOEXEC ) ) == -1 ) {
+    LOG_ERROR( "Cannot open bundle \"%s\"!", cpf->path )
+    return;
+  }
+  if ( ( fstat( fd, &st ) == -1 ) || ( st.st_size == 0 ) ) {
+    LOG_ERROR( "Cannot read bundle \"%s\"!", cpf->path )
+    close( fd );
+    return;
+  }
+  if ( ( b = (struct cpf_bundle *)calloc( 1, sizeof( struct cpf_bundle ) ) ) == NULL ) {
+    LOG_ERROR( "Cannot allocate memory for bundle \"%s\"!", cpf->path )
+    exit( EXIT_FAILURE );
+  }
+  b->size = st.st_size;
+  b->map = mmap( NULL, b->size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if ( b->map == MAP_FAILED ) {
+    LOG_ERROR( "Cannot map bundle \"%s\"!", cpf->path )
+    FREE( b )
+    return;
+  }
+  if ( ( bundle_valid( b ) == false ) || ( b->hdr->num_entries > UINT16_MAX ) ) {
+    LOG_ERROR( "Invalid bundle \"%s\"!", cpf->path )
+    munmap( b->map, b->size );
+    FREE( b )
+    return;
+  }
+  // the images are read once, in file order
+  madvise( b->map, b->size, MADV_SEQUENTIAL );
+  madvise( b->map, b->size, MADV_WILLNEED );
+  cpf->bundle = b;
+
+  if ( ( cpf->num_plugins = b->hdr->num_entries ) == 0 ) {
+    return;
+  }
+  cpf->plugin = ( plugin_t * )calloc( cpf->num_plugins, sizeof( plugin_t ) );
+  if ( cpf->plugin == NULL ) {
+    LOG_ERROR( "bind_plugins(): Cannot allocate memory for plugins!" )
+    exit( EXIT_FAILURE );
+  }
+  e = (const bundle_entry_t *)( b->hdr + 1 );
+  for ( i = 0 ; i < cpf->num_plugins ; i++ ) {
+    snprintf( cpf->plugin[i].name, sizeof( cpf->plugin[i].name ), "%s",
+              bundle_str( b, e[i].name_off ) );
+    if ( snprintf( cpf->plugin[i].path, sizeof( cpf->plugin[i].path ),
+                   "%s/%s"PLUGIN_EXTENSION,
+                   cpf->path,
+                   cpf->plugin[i].name ) >= (int)sizeof( cpf->plugin[i].path ) ) {
+      LOG_ERROR( "Plugin full path will be truncated!" )
+      exit( EXIT_FAILURE );
+    }
+    cpf->plugin[i].origin = CPF_ORIGIN_BUNDLE;
+  }
+}
+
+
+static const bundle_entry_t *
+bundle_find( struct cpf_bundle * b, const char * name )
+{
+  const bundle_entry_t * e = (const bundle_entry_t *)( b->hdr + 1 );
+  uint32_t lo = 0,
+           hi = b->hdr->num_entries,
+           mid;
+  int      cmp;
+
+
+  while ( lo < hi ) {
+    mid = lo + ( hi - lo ) / 2;
+    if ( ( cmp = strcmp( name, bundle_str( b, e[mid].name_off ) ) ) == 0 ) {
+      return &e[mid];
+    }
+    if ( cmp < 0 ) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return NULL;
+}
+
+
+/*
+ * Load the bound plugins from the bundle images, through memfds. The hashes
+ * come from the index: the images aren't hashed again.
+*/
+void
+bundle_load_plugins( cpf_t * cpf )
+{
+  const bundle_entry_t * e;
+  uint16_t               p_count; // plugin counter
+
+
+  for ( p_count = 0 ; p_count < cpf->num_plugins ; p_count++ ) {
+    if ( ( e = bundle_find( cpf->bundle, cpf->plugin[p_count].name ) ) == NULL ) {
+      LOG_ERROR( "Plugin \"%s\" not found in bundle \"%s\"!",
+                 cpf->plugin[p_count].name, cpf->path )
+      exit( EXIT_FAILURE );
+    }
+    if ( load_buffer_plugin( cpf,
+                             &cpf->plugin[p_count],
+                             (uint8_t *)cpf->bundle->map + e->offset,
+                             e->size,
+                             e->blake2s256 ) == false ) {
+      exit( EXIT_FAILURE );
+    }
+  }
+  bundle_close( cpf );
+}
+
+
+void
+bundle_close( cpf_t * cpf )
+{
+  if ( cpf->bundle == NULL ) {
+    return;
+  }
+  munmap( cpf->bundle->map, cpf->bundle->size );
+  FREE( cpf->bundle )
+}
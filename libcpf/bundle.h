@@ -0,0 +1,64 @@
+/*
+  libcpf - C Plugin Framework
+
+  bundle.h - header file
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __BUNDLE_H__
+#define __BUNDLE_H__
+
+#include "cpf.h"
+
+/*
+ * Plugin bundle file layout (all offsets are relative to the file start),
+ * written by tools/cpf-bundle:
+ *
+ *   bundle_hdr_t
+ *   bundle_entry_t[num_entries]    <== sorted by plugin name
+ *   char[]                         <== NUL terminated plugin names
+ *   plugin images                  <== each one aligned on BUNDLE_ALIGN
+*/
+#define BUNDLE_MAGIC            "CPFBNDL"
+#define BUNDLE_VERSION          1
+#define BUNDLE_ALIGN            4096
+
+typedef struct {
+  char     magic[8];
+  uint32_t version;
+  uint32_t num_entries;
+  uint64_t file_size;
+} bundle_hdr_t;
+
+typedef struct {
+  uint8_t  blake2s256[BLAKE2S256SIZE];    // hash of the plugin image
+  uint64_t name_off;                      // plugin name without extension, e.g. "dir1/myplugin"
+  uint64_t offset;                        // plugin image
+  uint64_t size;
+} bundle_entry_t;
+
+struct cpf_bundle {                       // bundle mapped between bind and load
+  void                 * map;
+  size_t                 size;
+  const bundle_hdr_t   * hdr;
+};
+
+bool bundle_is_bundle( const char * path );
+void bundle_bind_plugins( cpf_t * cpf );
+void bundle_load_plugins( cpf_t * cpf );
+void bundle_close( cpf_t * cpf );
+
+#endif
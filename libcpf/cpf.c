@@ -18,7 +18,11 @@
   You should have received a copy of the GNU General Public License
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <dlfcn.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -27,6 +31,107 @@
 #include "cpf.h"
 #include "plugin_manager.h"
 #include "blake2.h"
+#include "ab.h"
+#include "atfork.h"
+#include "bundle.h"
+#include "hotpatch.h"
+#include "memo.h"
+#include "profile.h"
+#include "rdeps.h"
+#include "record.h"
+#include "shared_registry.h"
+#include "usdt.h"
+
+#define RELOAD_NOT_HELD         0
+#define RELOAD_READ             1
+#define RELOAD_WRITE            2
+
+
+// Held for writing while the plugins are reloaded or unloaded, and for reading
+// by libcpf threads while they resolve functions (the executor, see
+// pin_plugin()) or resolve and call them (a pipeline stage).
+static pthread_rwlock_t reload_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+// Held with the write lock: fork() waits for the registry changes of the other
+// threads, without taking the reload lock (see atfork.c).
+static pthread_mutex_t  fork_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread uint8_t reload_held = RELOAD_NOT_HELD; // by this thread
+
+
+void
+reload_rdlock( void )
+{
+  pthread_rwlock_rdlock( &reload_lock );
+  reload_held = RELOAD_READ;
+}
+
+
+void
+reload_wrlock( void )
+{
+  pthread_rwlock_wrlock( &reload_lock );
+  pthread_mutex_lock( &fork_lock );
+  reload_held = RELOAD_WRITE;
+}
+
+
+void
+reload_unlock( void )
+{
+  if ( reload_held == RELOAD_WRITE ) {
+    pthread_mutex_unlock( &fork_lock );
+  }
+  reload_held = RELOAD_NOT_HELD;
+  pthread_rwlock_unlock( &reload_lock );
+}
+
+
+/*
+ * fork() handlers. A thread may fork while it holds the reload lock: a call of
+ * the executor or of a pipeline stage (read), a constructor or destructor run
+ * by a reload (write). It doesn't wait for itself: only the changes of the
+ * other threads are waited for.
+*/
+void
+reload_fork_prepare( void )
+{
+  if ( reload_held != RELOAD_WRITE ) {
+    pthread_mutex_lock( &fork_lock );
+  }
+}
+
+
+void
+reload_fork_parent( void )
+{
+  if ( reload_held != RELOAD_WRITE ) {
+    pthread_mutex_unlock( &fork_lock );
+  }
+}
+
+
+/*
+ * fork() child: the threads holding the lock for reading don't exist anymore,
+ * the lock is reset. If the forking thread held it, the child keeps it as it
+ * is: the child can't reload, it's expected to exec() or exit() (as system()
+ * and popen() do).
+*/
+void
+reload_fork_child( void )
+{
+  pthread_rwlockattr_t attr;
+
+
+  if ( reload_held == RELOAD_WRITE ) {
+    return;
+  }
+  pthread_mutex_unlock( &fork_lock );
+  if ( reload_held == RELOAD_NOT_HELD ) {
+    pthread_rwlockattr_init( &attr );
+    pthread_rwlockattr_setkind_np( &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP );
+    pthread_rwlock_init( &reload_lock, &attr );
+    pthread_rwlockattr_destroy( &attr );
+  }
+}
 
 
 static void
@@ -35,8 +140,7 @@ CPF_free_close_plugin( plugin_t * p )
   if ( p == NULL ) {
     return;
   }
-  DLCLOSE( p->dlhandle )
-  FREE( p->lib_func )
+  close_plugin( p );
 }
 
 
@@ -55,6 +159,7 @@ CPF_free_plugins( cpf_t * cpf )
   }
   FREE( cpf->plugin )
   cpf->num_plugins = 0;
+  rdeps_free( cpf );
 }
 
 
@@ -65,6 +170,14 @@ CPF_free( cpf_t ** cpf )
     return;
   }
   CPF_free_plugins( (*cpf) );
+  ab_free_all( (*cpf) );
+  bundle_close( (*cpf) );
+  shreg_detach( (*cpf) );
+  hotpatch_free( (*cpf) );
+  DLCLOSE( (*cpf)->lmid_anchor )
+  if ( ( (*cpf)->flags & CPF_FLAG_FORK_SAFE ) != 0 ) {
+    atfork_unregister( (*cpf) );
+  }
   FREE( (*cpf) )
 }
 
@@ -79,7 +192,9 @@ CPF_call_plugin_dtor( plugin_t * p )
   }
   if ( p->dtor != NULL ) {
     ctor_dtor = p->dtor;
+    USDT_PROBE1( plugin_dtor_entry, p->name );
     ctor_dtor( p );
+    USDT_PROBE1( plugin_dtor_exit, p->name );
   }
 }
 
@@ -97,6 +212,7 @@ CPF_call_dtor( cpf_t * cpf )
   for ( p_count = 0 ; p_count < cpf->num_plugins ; p_count++ ) {
     CPF_call_plugin_dtor( &(cpf->plugin[p_count]) );
   }
+  ab_call_dtor( cpf );
 }
 
 
@@ -110,7 +226,9 @@ CPF_call_plugin_ctor( plugin_t * p )
   }
   if ( p->ctor != NULL ) {
     ctor_dtor = p->ctor;
+    USDT_PROBE1( plugin_ctor_entry, p->name );
     ctor_dtor( p );
+    USDT_PROBE1( plugin_ctor_exit, p->name );
   }
 }
 
@@ -129,8 +247,44 @@ call_ctor( cpf_t * cpf )
   }
 }
 
+/*
+ * (R)eload: replace the loaded plugin "old" by the new version "p". If both
+ * versions define the state functions, the old state is handed over to the
+ * new version, which is constructed while the old one is still mapped.
+ * With CPF_FLAG_HOT_PATCH, the old version stays mapped and its functions
+ * jump to the new version.
+ * The old version is returned in "prev": the caller closes it once the plugins
+ * that depend on it are bound to the new functions.
+*/
+static void
+replace_plugin( cpf_t * cpf, plugin_t * old, plugin_t * p, plugin_t * prev )
+{
+  export_state_t export_state = old->export_state;
+  import_state_t import_state = p->import_state;
+  char           old_version[MAX_VERSIN_SIZE_NAME];
+  void         * state = NULL;
+
+
+  if ( ( export_state != NULL ) && ( import_state != NULL ) ) {
+    state = export_state( old );
+    snprintf( old_version, sizeof( old_version ), "%s", old->ctx->version );
+  }
+  CPF_call_plugin_dtor( old );
+  memo_invalidate( memo_plugin_tag( old ) );
+  memcpy( prev, old, sizeof( plugin_t ) );
+  memcpy( old, p, sizeof( plugin_t ) );
+  CPF_call_plugin_ctor( old );
+  if ( ( export_state != NULL ) && ( import_state != NULL ) ) {
+    import_state( old, state, old_version );
+  }
+  if ( ( cpf->flags & CPF_FLAG_HOT_PATCH ) != 0 ) {
+    hotpatch_retire( cpf, prev, old ); // takes prev->dlhandle
+  }
+}
+
+
 static cpf_t *
-init_general( char * directory_name )
+init_general( char * directory_name, uint32_t flags )
 {
   cpf_t * cpf;
 
@@ -140,6 +294,11 @@ init_general( char * directory_name )
     LOG_ERROR( "Cannot allocate memory for plugin framework!" )
     exit( EXIT_FAILURE );
   }
+  if ( ( ( flags & CPF_FLAG_HOT_PATCH ) != 0 ) && ( hotpatch_supported() == false ) ) {
+    LOG_ERROR( "CPF_FLAG_HOT_PATCH: the code cannot be patched on this system, flag ignored!" )
+    flags &= ~CPF_FLAG_HOT_PATCH;
+  }
+  cpf->flags = flags;
 
   if ( directory_name == NULL ) { // local directory with default PLUGIN_DIRNAME path
     if ( getcwd( cpf->path, sizeof( cpf->path ) ) == NULL) {
@@ -203,10 +362,11 @@ init_general( char * directory_name )
 
 
 static cpf_t *
-init_to_reload( char * directory_name )
+init_to_reload( char * directory_name, uint32_t flags, long lmid )
 {
   cpf_t * cpf;
-  cpf = init_general( directory_name );
+  cpf = init_general( directory_name, flags );
+  cpf->lmid = lmid; // same dlmopen() namespace as the loaded plugins
   load_plugins_2_reload( cpf );
 
   return cpf;
@@ -214,17 +374,27 @@ init_to_reload( char * directory_name )
 
 
 cpf_t *
-CPF_init( char * directory_name )
+CPF_init_flags( char * directory_name, uint32_t flags )
 {
   cpf_t * cpf;
-  cpf = init_general( directory_name );
+  cpf = init_general( directory_name, flags );
   load_plugins( cpf );
   call_ctor( cpf );
+  if ( ( flags & CPF_FLAG_FORK_SAFE ) != 0 ) {
+    atfork_register( cpf );
+  }
 
   return cpf;
 }
 
 
+cpf_t *
+CPF_init( char * directory_name )
+{
+  return CPF_init_flags( directory_name, CPF_DEFAULT_FLAGS );
+}
+
+
 static uint16_t
 calc_num_dep( deps_t * d )
 {
@@ -333,13 +503,13 @@ CPF_get_plugin_base_addr( cpf_t * cpf, char * plugin_name )
 }
 
 
-static void *
-get_func_addr_by_func( func_t * func, char * func_name )
+static func_t *
+get_func_by_func( func_t * func, char * func_name )
 {
   uint16_t f, i;
 
   if ( ( func == NULL ) || ( func_name == NULL ) ) {
-    LOG_ERROR( "get_func_addr_by_func(): function name cannot be NULL!" )
+    LOG_ERROR( "get_func_by_func(): function name cannot be NULL!" )
     return NULL;
   }
 
@@ -347,18 +517,19 @@ get_func_addr_by_func( func_t * func, char * func_name )
   for ( i=0 ; i < f; i++ ) {
     if ( ( func[i].func_name != NULL ) &&
           ( strcmp( func_name, func[i].func_name ) == 0 ) ) {
-      return func[i].func_addr;
+      return &func[i];
     }
   }
   return NULL;
 }
 
 
-void *
-CPF_get_func_addr( cpf_t * cpf, char * plugin_name, char * func_name )
+// function "func_name" of "plugin_name", and the plugin (if "plugin" isn't NULL)
+static func_t *
+get_func( cpf_t * cpf, char * plugin_name, char * func_name, plugin_t ** plugin )
 {
   uint16_t i;
-  void *   func_addr;
+  func_t * func;
 
   if ( cpf->num_plugins == 0 ) {
     LOG_ERROR( "CPF_get_func_addr(): There is no plugin loaded!" )
@@ -372,12 +543,15 @@ CPF_get_func_addr( cpf_t * cpf, char * plugin_name, char * func_name )
 
   for ( i=0 ; i < cpf->num_plugins ; i++ ) {
     if ( strcmp( plugin_name, cpf->plugin[i].name ) == 0 ) {
-      func_addr = get_func_addr_by_func( cpf->plugin[i].lib_func, 
-                                         func_name );
-      if ( func_addr == NULL ) {
+      func = get_func_by_func( cpf->plugin[i].lib_func, 
+                               func_name );
+      if ( func == NULL ) {
         break;
       }
-      return func_addr;
+      if ( plugin != NULL ) {
+        *plugin = &cpf->plugin[i];
+      }
+      return func;
     }
   }
   LOG_ERROR( "CPF_get_func_addr(): Cannot get function address!" )
@@ -385,11 +559,75 @@ CPF_get_func_addr( cpf_t * cpf, char * plugin_name, char * func_name )
 }
 
 
+void *
+CPF_get_func_addr( cpf_t * cpf, char * plugin_name, char * func_name )
+{
+  func_t * func = get_func( cpf, plugin_name, func_name, NULL );
+
+
+  return ( func != NULL ) ? func->func_addr : NULL;
+}
+
+
+// reject a call whose prototype differs from the one exported by the plugin
+bool
+check_func_proto( func_t * func, char * plugin_name, enum func_prototype_t fproto )
+{
+  const fp_desc_t * declared, * called;
+
+
+  if ( ( func->fproto == FP_UNDEFINED ) || ( func->fproto == fproto ) ) {
+    return true;
+  }
+  declared = CPF_wrapper_get_desc( func->fproto );
+  called = CPF_wrapper_get_desc( fproto );
+  LOG_ERROR( "Prototype mismatch: \"%s\" from \"%s\" is %s, not %s!",
+             func->func_name,
+             plugin_name,
+             ( declared != NULL ) ? declared->name : NOT_DEFINED,
+             ( called != NULL ) ? called->name : NOT_DEFINED )
+  return false;
+}
+
+
+// get_func() with the prototype check (bind time)
+func_t *
+get_func_proto( cpf_t * cpf,
+                char * plugin_name,
+                char * func_name,
+                enum func_prototype_t fproto,
+                plugin_t ** plugin )
+{
+  func_t * func = get_func( cpf, plugin_name, func_name, plugin );
+
+
+  if ( ( func == NULL ) || ( check_func_proto( func, plugin_name, fproto ) == false ) ) {
+    return NULL;
+  }
+  return func;
+}
+
+
+// CPF_get_func_addr() with the prototype check (bind time)
+void *
+get_func_addr_proto( cpf_t * cpf,
+                     char * plugin_name,
+                     char * func_name,
+                     enum func_prototype_t fproto )
+{
+  func_t * func = get_func_proto( cpf, plugin_name, func_name, fproto, NULL );
+
+
+  return ( func != NULL ) ? func->func_addr : NULL;
+}
+
+
 void *
 CPF_get_extern_lib_func_by_dep( deps_t * d,
                                 char * plugin_name,
                                 char * func_name )
 {
+  func_t  * funcs;
   uint16_t  i, j;
 
 
@@ -401,15 +639,17 @@ CPF_get_extern_lib_func_by_dep( deps_t * d,
   for ( i = 0; (void *)(*(uint64_t *)(d+i)) != NULL ; i++ ) {
   //for ( i = 0; d[i].dep_lib_name != NULL ; i++ ) {
     if ( strcmp( d[i].dep_lib_name, plugin_name ) == 0 ) {
-      if ( d[i].funcs == NULL ) {
+      // rebound by the reloads while the plugins run
+      funcs = __atomic_load_n( &d[i].funcs, __ATOMIC_ACQUIRE );
+      if ( funcs == NULL ) {
         LOG_ERROR("Functions are not defined!" )
         exit( EXIT_FAILURE );
       }
       // Search for function name
-      //for ( j = 0 ; d[i].funcs[j].func_addr != NULL ; j++ ) {
-      for ( j = 0 ; (void *)(*(uint64_t *)((d[i].funcs)+j)) != NULL ; j++ ) {
-        if ( strcmp( d[i].funcs[j].func_name, func_name ) == 0 ) {
-          return d[i].funcs[j].func_addr;
+      //for ( j = 0 ; funcs[j].func_addr != NULL ; j++ ) {
+      for ( j = 0 ; (void *)(*(uint64_t *)(funcs+j)) != NULL ; j++ ) {
+        if ( strcmp( funcs[j].func_name, func_name ) == 0 ) {
+          return funcs[j].func_addr;
         }
       }
       LOG_ERROR("Function \"%s\" is not defined in plugin \"%s\"!",
@@ -468,10 +708,56 @@ CPF_call_func_by_addr( void * func_addr, enum func_prototype_t fproto, ... )
     return NULL;
   }
 
+  USDT_PROBE3( call_entry, NULL, NULL, func_addr );
   va_start( varglist, fproto );
   ret = CPF_wrapper_call_func_by_addr( func_addr, fproto, varglist );
   va_end( varglist );
+  USDT_PROBE3( call_return, NULL, NULL, ret );
+
+  return ret;
+}
+
+
+// name of the function at "func_offset" (call recording), NULL if unknown
+static char *
+get_func_name_by_offset( cpf_t * cpf, char * plugin_name, uint64_t func_offset )
+{
+  func_t * f;
+  uint16_t i;
+
+
+  for ( i = 0 ; i < cpf->num_plugins ; i++ ) {
+    if ( strcmp( plugin_name, cpf->plugin[i].name ) == 0 ) {
+      for ( f = cpf->plugin[i].lib_func ; f->func_addr != NULL ; f++ ) {
+        if ( f->func_offset == func_offset ) {
+          return f->func_name;
+        }
+      }
+      break;
+    }
+  }
+  return NULL;
+}
+
+
+// call made while recording (see CPF_record_start())
+static void *
+record_call( char * plugin_name,
+             char * func_name,
+             void * func_addr,
+             enum func_prototype_t fproto,
+             va_list varglist )
+{
+  record_ctx_t r;
+  void       * ret;
 
+
+  if ( func_name == NULL ) {
+    return CPF_wrapper_call_func_by_addr( func_addr, fproto, varglist );
+  }
+  record_begin( &r, plugin_name, func_name, fproto, varglist );
+  ret = CPF_wrapper_call_func_by_args( func_addr, &r.args );
+  record_end( &r );
   return ret;
 }
 
@@ -494,9 +780,19 @@ CPF_call_func_by_offset( cpf_t * cpf,
   if ( ( base_addr = CPF_get_plugin_base_addr( cpf, plugin_name ) ) == NULL )
     return NULL;
 
+  USDT_PROBE3( call_entry, plugin_name, NULL, base_addr + func_offset );
   va_start( varglist, fproto );
-  ret = CPF_wrapper_call_func_by_addr( base_addr + func_offset, fproto, varglist );
+  if ( RECORDING() ) {
+    ret = record_call( plugin_name,
+                       get_func_name_by_offset( cpf, plugin_name, func_offset ),
+                       base_addr + func_offset,
+                       fproto,
+                       varglist );
+  } else {
+    ret = CPF_wrapper_call_func_by_addr( base_addr + func_offset, fproto, varglist );
+  }
   va_end( varglist );
+  USDT_PROBE3( call_return, plugin_name, NULL, ret );
 
   return ret;
 }
@@ -514,12 +810,18 @@ CPF_call_func_by_name( cpf_t * cpf,
   void * ret = NULL;
 
 
-  if ( ( func_addr = CPF_get_func_addr( cpf, plugin_name, func_name ) ) == NULL )
+  if ( ( func_addr = get_func_addr_proto( cpf, plugin_name, func_name, fproto ) ) == NULL )
     return NULL;
 
+  USDT_PROBE3( call_entry, plugin_name, func_name, func_addr );
   va_start( varglist, fproto );
-  ret = CPF_wrapper_call_func_by_addr( func_addr, fproto, varglist );
+  if ( RECORDING() ) {
+    ret = record_call( plugin_name, func_name, func_addr, fproto, varglist );
+  } else {
+    ret = CPF_wrapper_call_func_by_addr( func_addr, fproto, varglist );
+  }
   va_end( varglist );
+  USDT_PROBE3( call_return, plugin_name, func_name, ret );
 
   return ret;
 }
@@ -532,8 +834,8 @@ CPF_call_func_by_name( cpf_t * cpf,
  * Old libs will be removed.
  * Modified libs will be updated in memory.
 */
-int
-CPF_reload_libs( cpf_t ** cpf, bool display_report )
+static int
+reload_libs( cpf_t ** cpf, bool display_report )
 {
   cpf_t * cpf_reloaded;
   cpf_t * cpf_tmp;
@@ -543,6 +845,7 @@ CPF_reload_libs( cpf_t ** cpf, bool display_report )
            r;
   uint8_t * status_l; // loaded: currently in use
   uint8_t * status_r; // reloaded: will be loaded
+  plugin_t * prev;    // (R)eloaded: the old versions, closed at the end
 
 
   if ( (*cpf) == NULL ) {
@@ -550,7 +853,7 @@ CPF_reload_libs( cpf_t ** cpf, bool display_report )
     return EXIT_FAILURE;
   }
 
-  if ( ( cpf_reloaded = init_to_reload( (*cpf)->path ) ) == NULL ) {
+  if ( ( cpf_reloaded = init_to_reload( (*cpf)->path, (*cpf)->flags, (*cpf)->lmid ) ) == NULL ) {
     LOG_ERROR( "CPF_reload_libs(): Cannot initialize plugin framework to reload shared libs!" )
     return EXIT_FAILURE;
   }
@@ -572,6 +875,11 @@ CPF_reload_libs( cpf_t ** cpf, bool display_report )
     LOG_ERROR( "CPF_reload_libs(): Cannot allocate memory for reload plugins!" )
     exit( EXIT_FAILURE );
   }
+  prev = (plugin_t *)calloc( (*cpf)->num_plugins, sizeof( plugin_t ) );
+  if ( prev == NULL ) {
+    LOG_ERROR( "CPF_reload_libs(): Cannot allocate memory for reload plugins!" )
+    exit( EXIT_FAILURE );
+  }
   if ( display_report == true ) {
     LOG_INFO( "Reloaded libs in \"%s\":", (*cpf)->path )
   }
@@ -615,34 +923,44 @@ CPF_reload_libs( cpf_t ** cpf, bool display_report )
         status_r[r] = 'R';
         // Do the (R)eload process:
 
-        // Call the possible destructor, before (R)eload
-        CPF_call_plugin_dtor( &((*cpf)->plugin[l]) );
-        // Free current lib dynamic allocation and close dlhandle
-        CPF_free_close_plugin( &((*cpf)->plugin[l]) );
-        // Copy all plugins struct
-        memcpy( &(*cpf)->plugin[l], &cpf_reloaded->plugin[r], sizeof( plugin_t ) );
+        // Call the possible destructor and constructor, hand the possible
+        // state over and copy all plugins struct. The old dlhandle is closed
+        // at the end, when the dependencies are bound to the new version.
+        replace_plugin( (*cpf), &((*cpf)->plugin[l]), &cpf_reloaded->plugin[r], &prev[l] );
         // Set to NULL the "old" reloaded allocated structs, to avoid FREE
         // on these fields (the new dlhandle and funcs will be used).
         // Protect cpf_tmp against CPF_free( &cpf_reloaded ) at the end.
         cpf_reloaded->plugin[r].dlhandle = NULL;
         cpf_reloaded->plugin[r].lib_func = NULL;
-        // Call the possible constructor, after (R)eload
-        CPF_call_plugin_ctor( &((*cpf)->plugin[l]) );
         break;
       }
     }
   }
 
+  // Plugins loaded from memory (CPF_load_from_buffer()) or linked into the binary
+  // aren't in the directory: they stay loaded, unless a file with the same name
+  // was found above.
+  for ( l = 0 ; l < (*cpf)->num_plugins ; l++ ) {
+    if ( ( status_l[l] == 'D' ) &&
+         ( ( (*cpf)->plugin[l].origin == CPF_ORIGIN_MEMORY ) ||
+           ( (*cpf)->plugin[l].origin == CPF_ORIGIN_STATIC ) ) ) {
+      status_l[l] = 'U';
+    }
+  }
+
   // Calculate the new plugins' total number and alloc dynamic memory:
   // From current lib: 'R' and 'U' flags status
   // From reloaded lib: 'N' flag status
   num_plugins = 0;
   for ( l = 0 ; l < (*cpf)->num_plugins ; l++ ) {
+    USDT_PROBE2( reload_classify, (*cpf)->plugin[l].name, status_l[l] );
     if ( status_l[l] != 'D' ) { // only 'R' and 'U' flags
       num_plugins++;
     }
     if ( status_l[l] == 'D' ) { // Call the destructor for marked (D)eleted lib
        CPF_call_plugin_dtor( &((*cpf)->plugin[l]) );
+       memo_invalidate( memo_plugin_tag( &((*cpf)->plugin[l]) ) );
+       hotpatch_unlink( (*cpf), (*cpf)->plugin[l].name );
     }
     if ( display_report == true ) {
       switch( status_l[l] )
@@ -666,6 +984,7 @@ CPF_reload_libs( cpf_t ** cpf, bool display_report )
   // count the (N)ew plugins
   for ( r = 0 ; r < cpf_reloaded->num_plugins ; r++ ) {
     if ( status_r[r] == 'N' ) {
+      USDT_PROBE2( reload_classify, cpf_reloaded->plugin[r].name, status_r[r] );
       num_plugins++;
       // call the constructor for the (N)ew plugin
       CPF_call_plugin_ctor( &(cpf_reloaded->plugin[r]) );
@@ -691,6 +1010,19 @@ CPF_reload_libs( cpf_t ** cpf, bool display_report )
     exit( EXIT_FAILURE );
   }
   cpf_tmp->num_plugins = num_plugins;
+  cpf_tmp->flags = (*cpf)->flags;
+  cpf_tmp->generation = (*cpf)->generation + 1;
+  cpf_tmp->lmid = cpf_reloaded->lmid; // a new namespace, if the registry had none
+  cpf_tmp->lmid_anchor = ( (*cpf)->lmid_anchor != NULL ) ? (*cpf)->lmid_anchor : cpf_reloaded->lmid_anchor;
+  (*cpf)->lmid_anchor = NULL;
+  cpf_reloaded->lmid_anchor = NULL;
+  cpf_tmp->shared_generation = cpf_reloaded->shared_generation;
+  cpf_tmp->ab = (*cpf)->ab; // the A/B candidates stay loaded
+  (*cpf)->ab = NULL;
+  cpf_tmp->ab_retired = (*cpf)->ab_retired;
+  (*cpf)->ab_retired = NULL;
+  cpf_tmp->hotpatch = (*cpf)->hotpatch; // the retired versions stay mapped
+  (*cpf)->hotpatch = NULL;
   // cpf_tmp will receive only (R), (U) and (N) plugins, as calculated in num_plugins
   cpf_tmp->plugin = ( plugin_t * )calloc( num_plugins, sizeof( plugin_t ) );
   if ( cpf_tmp->plugin == NULL ) {
@@ -706,6 +1038,7 @@ CPF_reload_libs( cpf_t ** cpf, bool display_report )
         // Protect cpf_tmp against CPF_free( cpf ) below
         (*cpf)->plugin[l].dlhandle = NULL;
         (*cpf)->plugin[l].lib_func = NULL;
+        (*cpf)->plugin[l].pin = NULL;
         c++;
       }
     }
@@ -720,13 +1053,304 @@ CPF_reload_libs( cpf_t ** cpf, bool display_report )
     }
   }
 
+  // bind the dependencies to the new versions before the old ones are closed:
+  // the plugins read them without the reload lock
+  sort_plugins( cpf_tmp );
+  check_and_set_dep( cpf_tmp );
+  ab_bind_deps( cpf_tmp );
+  for ( l = 0 ; l < (*cpf)->num_plugins ; l++ ) {
+    if ( status_l[l] == 'R' ) {
+      CPF_free_close_plugin( &prev[l] );
+    }
+  }
+  FREE( prev )
   FREE( status_r )
   FREE( status_l )
   CPF_free( &cpf_reloaded );
   CPF_free( cpf );
-  sort_plugins( cpf_tmp );
-  check_and_set_dep( cpf_tmp );
+  if ( ( cpf_tmp->flags & CPF_FLAG_FORK_SAFE ) != 0 ) {
+    atfork_register( cpf_tmp );
+  }
   *cpf = cpf_tmp;
+  profile_rebuild( cpf_tmp );
+  return EXIT_SUCCESS;
+}
+
+
+int
+CPF_reload_libs( cpf_t ** cpf, bool display_report )
+{
+  int ret;
+
+
+  reload_wrlock();
+  ret = reload_libs( cpf, display_report );
+  reload_unlock();
+  return ret;
+}
+
+
+static plugin_t *
+find_plugin( cpf_t * cpf, char * plugin_name )
+{
+  uint16_t i;
+
+
+  for ( i = 0 ; i < cpf->num_plugins ; i++ ) {
+    if ( strcmp( cpf->plugin[i].name, plugin_name ) == 0 ) {
+      return &cpf->plugin[i];
+    }
+  }
+  return NULL;
+}
+
+
+// replace "old" by the loaded plugin "p" (R), or add "p" to the registry (N)
+static void
+install_plugin( cpf_t * cpf, plugin_t * old, plugin_t * p )
+{
+  plugin_t * plugin,
+             prev = { 0 };
+
+
+  if ( old != NULL ) { // (R)eload
+    rdeps_unlink( cpf, old );
+    replace_plugin( cpf, old, p, &prev );
+    rdeps_link( cpf, old );
+    rdeps_rebind( cpf, old ); // only the plugins that depend on it
+  } else {             // (N)ew
+    plugin = (plugin_t *)realloc( cpf->plugin, ( cpf->num_plugins + 1 ) * sizeof( plugin_t ) );
+    if ( plugin == NULL ) {
+      LOG_ERROR( "Cannot allocate memory for plugins!" )
+      exit( EXIT_FAILURE );
+    }
+    cpf->plugin = plugin;
+    memcpy( &cpf->plugin[cpf->num_plugins], p, sizeof( plugin_t ) );
+    rdeps_link( cpf, &cpf->plugin[cpf->num_plugins] );
+    CPF_call_plugin_ctor( &cpf->plugin[cpf->num_plugins] );
+    cpf->num_plugins++;
+    sort_plugins( cpf );
+  }
+  ab_bind_deps( cpf );
+  CPF_free_close_plugin( &prev ); // (R): no dependency points to the old version anymore
+  cpf->generation++;
+  profile_rebuild( cpf );
+}
+
+
+/*
+ * Load (or replace) the plugin "plugin_name" from the "data" buffer, without
+ * writing it in the filesystem. A plugin with the same name is replaced if the
+ * hash is different, as in CPF_reload_libs().
+*/
+int
+CPF_load_from_buffer( cpf_t * cpf, char * plugin_name, const void * data, size_t len )
+{
+  plugin_t   p;
+  plugin_t * old;
+
+
+  if ( ( cpf == NULL ) || ( plugin_name == NULL ) || ( data == NULL ) || ( len == 0 ) ) {
+    LOG_ERROR( "CPF_load_from_buffer(): Invalid parameters!" )
+    return EXIT_FAILURE;
+  }
+  if ( strlen( plugin_name ) + sizeof( "memfd:" ) > sizeof( p.path ) ) {
+    LOG_ERROR( "CPF_load_from_buffer(): Plugin name too long!" )
+    return EXIT_FAILURE;
+  }
+  memset( &p, 0, sizeof( p ) );
+  snprintf( p.name, sizeof( p.name ), "%s", plugin_name );
+  snprintf( p.path, sizeof( p.path ), "memfd:%s", plugin_name );
+  p.origin = CPF_ORIGIN_MEMORY;
+
+  reload_wrlock();
+  if ( load_buffer_plugin( cpf, &p, data, len, NULL ) == false ) {
+    reload_unlock();
+    return EXIT_FAILURE;
+  }
+  old = find_plugin( cpf, plugin_name );
+  if ( ( old != NULL ) &&
+       ( memcmp( old->blake2s256, p.blake2s256, sizeof( p.blake2s256 ) ) == 0 ) ) {
+    CPF_free_close_plugin( &p ); // (U)nmodified
+    reload_unlock();
+    return EXIT_SUCCESS;
+  }
+  if ( bind_plugin_deps( cpf, &p ) == false ) {
+    CPF_free_close_plugin( &p );
+    reload_unlock();
+    return EXIT_FAILURE;
+  }
+
+  install_plugin( cpf, old, &p );
+  reload_unlock();
+  return EXIT_SUCCESS;
+}
+
+
+/*
+ * Reload one plugin file, without scanning the plugin directory. Only the
+ * plugin destructor/constructor are called, and only the plugins that depend
+ * on it are rebound.
+*/
+int
+CPF_reload_plugin( cpf_t * cpf, char * plugin_name )
+{
+  plugin_t   p;
+  plugin_t * old;
+
+
+  if ( ( cpf == NULL ) || ( plugin_name == NULL ) ) {
+    LOG_ERROR( "CPF_reload_plugin(): Invalid parameters!" )
+    return EXIT_FAILURE;
+  }
+  reload_wrlock();
+  if ( ( old = find_plugin( cpf, plugin_name ) ) == NULL ) {
+    LOG_ERROR( "CPF_reload_plugin(): Plugin \"%s\" not loaded!", plugin_name )
+    reload_unlock();
+    return EXIT_FAILURE;
+  }
+  if ( old->origin != CPF_ORIGIN_FILE ) {
+    LOG_ERROR( "CPF_reload_plugin(): Plugin \"%s\" isn't a file in the plugin directory!",
+               plugin_name )
+    reload_unlock();
+    return EXIT_FAILURE;
+  }
+  if ( access( old->path, R_OK ) == -1 ) {
+    LOG_ERROR( "CPF_reload_plugin(): Cannot read \"%s\"!", old->path )
+    reload_unlock();
+    return EXIT_FAILURE;
+  }
+  memset( &p, 0, sizeof( p ) );
+  memcpy( p.name, old->name, sizeof( p.name ) );
+  memcpy( p.path, old->path, sizeof( p.path ) );
+  calc_blake2( &p );
+  if ( memcmp( old->blake2s256, p.blake2s256, sizeof( p.blake2s256 ) ) == 0 ) {
+    reload_unlock(); // (U)nmodified
+    return EXIT_SUCCESS;
+  }
+  if ( ( load_single_plugin( cpf, &p ) == false ) ||
+       ( bind_plugin_deps( cpf, &p ) == false ) ) {
+    CPF_free_close_plugin( &p );
+    reload_unlock();
+    return EXIT_FAILURE;
+  }
+  install_plugin( cpf, old, &p );
+  reload_unlock();
+  return EXIT_SUCCESS;
+}
+
+
+/*
+ * Load one new plugin file. A relative "path" is relative to the plugin
+ * directory. The plugin name is its path in the plugin directory without
+ * extension (as in CPF_init()), or its file name without extension.
+*/
+int
+CPF_load_plugin( cpf_t * cpf, char * path )
+{
+  plugin_t     p;
+  const char * name;
+  size_t       len;
+
+
+  if ( ( cpf == NULL ) || ( path == NULL ) ) {
+    LOG_ERROR( "CPF_load_plugin(): Invalid parameters!" )
+    return EXIT_FAILURE;
+  }
+  memset( &p, 0, sizeof( p ) );
+  if ( path[0] == '/' ) {
+    len = snprintf( p.path, sizeof( p.path ), "%s", path );
+  } else {
+    len = snprintf( p.path, sizeof( p.path ), "%s/%s", cpf->path, path );
+  }
+  if ( len >= sizeof( p.path ) ) {
+    LOG_ERROR( "CPF_load_plugin(): Plugin path too long!" )
+    return EXIT_FAILURE;
+  }
+  len = strlen( p.path );
+  if ( ( len < sizeof( PLUGIN_EXTENSION ) ) ||
+       ( strcmp( p.path + len - ( sizeof( PLUGIN_EXTENSION ) - 1 ), PLUGIN_EXTENSION ) != 0 ) ) {
+    LOG_ERROR( "CPF_load_plugin(): \"%s\" isn't a \""PLUGIN_EXTENSION"\" file!", p.path )
+    return EXIT_FAILURE;
+  }
+  if ( ( strncmp( p.path, cpf->path, strlen( cpf->path ) ) == 0 ) &&
+       ( p.path[strlen( cpf->path )] == '/' ) ) {
+    name = p.path + strlen( cpf->path ) + 1;
+  } else {
+    name = ( strrchr( p.path, '/' ) != NULL ) ? strrchr( p.path, '/' ) + 1 : p.path;
+  }
+  if ( strlen( name ) - ( sizeof( PLUGIN_EXTENSION ) - 1 ) + 1 > sizeof( p.name ) ) {
+    LOG_ERROR( "CPF_load_plugin(): Plugin name too long!" )
+    return EXIT_FAILURE;
+  }
+  snprintf( p.name, strlen( name ) - ( sizeof( PLUGIN_EXTENSION ) - 1 ) + 1, "%s", name );
+  if ( access( p.path, R_OK ) == -1 ) {
+    LOG_ERROR( "CPF_load_plugin(): Cannot read \"%s\"!", p.path )
+    return EXIT_FAILURE;
+  }
+
+  reload_wrlock();
+  if ( find_plugin( cpf, p.name ) != NULL ) {
+    LOG_ERROR( "CPF_load_plugin(): Plugin \"%s\" already loaded!", p.name )
+    reload_unlock();
+    return EXIT_FAILURE;
+  }
+  if ( cpf->num_plugins == UINT16_MAX ) {
+    LOG_ERROR( "CPF_load_plugin(): Too many plugins!" )
+    reload_unlock();
+    return EXIT_FAILURE;
+  }
+  if ( ( load_single_plugin( cpf, &p ) == false ) ||
+       ( bind_plugin_deps( cpf, &p ) == false ) ) {
+    CPF_free_close_plugin( &p );
+    reload_unlock();
+    return EXIT_FAILURE;
+  }
+  install_plugin( cpf, NULL, &p );
+  reload_unlock();
+  return EXIT_SUCCESS;
+}
+
+
+// Unload one plugin. It must not be a dependency of another loaded plugin.
+int
+CPF_unload_plugin( cpf_t * cpf, char * plugin_name )
+{
+  plugin_t * p;
+  uint16_t   n;
+
+
+  if ( ( cpf == NULL ) || ( plugin_name == NULL ) ) {
+    LOG_ERROR( "CPF_unload_plugin(): Invalid parameters!" )
+    return EXIT_FAILURE;
+  }
+  reload_wrlock();
+  if ( ( p = find_plugin( cpf, plugin_name ) ) == NULL ) {
+    LOG_ERROR( "CPF_unload_plugin(): Plugin \"%s\" not loaded!", plugin_name )
+    reload_unlock();
+    return EXIT_FAILURE;
+  }
+  if ( ( n = rdeps_count( cpf, plugin_name ) ) > 0 ) {
+    LOG_ERROR( "CPF_unload_plugin(): %d dependencies on \"%s\"!", n, plugin_name )
+    reload_unlock();
+    return EXIT_FAILURE;
+  }
+  if ( ab_find( cpf, plugin_name ) != NULL ) {
+    LOG_ERROR( "CPF_unload_plugin(): Unload the A/B experiment of \"%s\" first!", plugin_name )
+    reload_unlock();
+    return EXIT_FAILURE;
+  }
+  CPF_call_plugin_dtor( p );
+  memo_invalidate( memo_plugin_tag( p ) );
+  rdeps_unlink( cpf, p );
+  hotpatch_unlink( cpf, p->name );
+  CPF_free_close_plugin( p );
+  // the plugins stay sorted
+  memmove( p, p + 1, ( cpf->num_plugins - ( p - cpf->plugin ) - 1 ) * sizeof( plugin_t ) );
+  cpf->num_plugins--;
+  cpf->generation++;
+  profile_rebuild( cpf );
+  reload_unlock();
   return EXIT_SUCCESS;
 }
 
@@ -738,6 +1362,12 @@ CPF_unload_libs( cpf_t * cpf )
     LOG_INFO( "CPF_unload_libs(): There is no plugins loaded in memory!" )
     return;
   }
+  reload_wrlock();
   CPF_call_dtor( cpf );
+  hotpatch_unlink( cpf, NULL );
   CPF_free_plugins( cpf );
+  ab_retire_all( cpf );
+  cpf->generation++;
+  profile_rebuild( cpf );
+  reload_unlock();
 }
\ No newline at end of file
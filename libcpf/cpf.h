@@ -26,6 +26,10 @@
 #include "fp_prototype.h"
 #include "log.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 // macros
 #define FREE( ptr ) do { free( ptr ); ptr = NULL; } while (0); // avoid dangling pointer
 #define DLCLOSE( ptr ) do { if ( ptr != NULL ) { dlclose( ptr ); ptr = NULL; } } while (0);
@@ -42,7 +46,73 @@
 #define PLUGIN_INIT_CTX_FUNC    "CPF_init_ctx"    // default plugin init context func name
 #define PLUGIN_CONSTRUCTOR_FUNC "CPF_constructor" // default plugin constructor func name
 #define PLUGIN_DESTRUCTOR_FUNC  "CPF_destructor"  // default plugin destructor func name
+#define PLUGIN_EXPORT_STATE_FUNC "CPF_export_state" // optional: state handed over on reload
+#define PLUGIN_IMPORT_STATE_FUNC "CPF_import_state" // optional: state received on reload
+#define PLUGIN_PREFORK_FUNC     "CPF_prefork"     // optional: called before fork() (CPF_FLAG_FORK_SAFE)
+#define PLUGIN_POSTFORK_FUNC    "CPF_postfork_parent" // optional: called in the parent after fork()
+#define PLUGIN_CTOR_CHILD_FUNC  "CPF_constructor_child" // optional: called in the child after fork()
 #define NOT_DEFINED             "<NOT DEFINED>"
+#define CPF_ORIGIN_FILE         0                 // plugin_t.origin: file in the plugin directory
+#define CPF_ORIGIN_MEMORY       1                 // CPF_load_from_buffer()
+#define CPF_ORIGIN_BUNDLE       2                 // member of a plugin bundle file
+#define CPF_ORIGIN_STATIC       3                 // linked into the binary (CPF_STATIC_PLUGIN())
+#define MANIFEST_EXTENSION      ".cpfcache"       // manifest cache: "<plugin dir>.cpfcache"
+
+// registry flags, used by CPF_init_flags()
+#define CPF_FLAG_NONE           0x00000000
+#define CPF_FLAG_MANIFEST_CACHE 0x00000001        // persistent on-disk manifest cache
+#define CPF_FLAG_PREFAULT       0x00000002        // prefault the plugin segments when loaded
+#define CPF_FLAG_MLOCK          0x00000004        // mlock() the plugin segments
+#define CPF_FLAG_HUGEPAGE_TEXT  0x00000008        // remap plugin text onto transparent huge pages
+#define CPF_FLAG_SHADOW_COPY    0x00000010        // dlopen a memfd copy of each plugin file
+#define CPF_FLAG_RTLD_LOCAL     0x00000020        // keep plugin symbols out of the global scope
+#define CPF_FLAG_DLMOPEN        0x00000040        // load the plugins in their own link-map namespace
+#define CPF_FLAG_MEMOIZE        0x00000080        // cache the results of the pure functions (handles)
+#define CPF_FLAG_SHARED_PUBLISH 0x00000100        // publish the registry metadata in shared memory
+#define CPF_FLAG_SHARED_ATTACH  0x00000200        // load from the published metadata, if any
+#define CPF_FLAG_FORK_SAFE      0x00000400        // call the fork hooks of the plugins (pthread_atfork())
+#define CPF_FLAG_HOT_PATCH      0x00000800        // on reload, old function entries jump to the new version
+#define CPF_DEFAULT_FLAGS       CPF_FLAG_MANIFEST_CACHE // flags used by CPF_init()
+
+// exported function flags, used by CPF_EXPORT()
+#define CPF_EXPORT_NONE         0x00000000
+#define CPF_EXPORT_PURE         0x00000001        // result depends only on the parameters
+#define CPF_EXPORT_THREAD_SAFE  0x00000002        // can be called concurrently
+#define CPF_EXPORT_BATCH        0x00000004        // can process batches of items
+
+/*
+ * Export manifest: a plugin that lists its functions with CPF_EXPORT() gets
+ * only these functions bound, without scanning the dynamic symbol table:
+ *
+ *   int do_operation( int i ) { ... }
+ *   CPF_EXPORT( do_operation, FP_INT_INT, CPF_EXPORT_PURE | CPF_EXPORT_THREAD_SAFE )
+ *
+ * Each CPF_EXPORT() emits one ELF note (owner "CPF") in the ".note.cpf"
+ * section. The loader reads the notes through the PT_NOTE program headers.
+*/
+#define CPF_NOTE_NAME           "CPF"
+#define CPF_NOTE_EXPORT         1                 // note type
+#define CPF_EXPORT_PROTO_SIZE   32
+#define CPF_EXPORT_NAME_SIZE    96
+
+typedef struct {                          // ELF note of one exported function
+  uint32_t namesz;                        // sizeof( CPF_NOTE_NAME )
+  uint32_t descsz;                        // sizeof( flags + proto + name )
+  uint32_t type;                          // CPF_NOTE_EXPORT
+  char     owner[4];                      // CPF_NOTE_NAME
+  uint32_t flags;                         // CPF_EXPORT_* flags
+  char     proto[CPF_EXPORT_PROTO_SIZE];  // enum func_prototype_t name, e.g. "FP_INT_INT"
+  char     name[CPF_EXPORT_NAME_SIZE];    // function name
+} cpf_export_note_t;
+
+#define CPF_EXPORT( FUNC, FPROTO, FLAGS ) \
+  __attribute__(( section( ".note.cpf" ), used, aligned( 4 ) )) \
+  static const cpf_export_note_t cpf_export_ ## FUNC = { \
+    sizeof( CPF_NOTE_NAME ), \
+    sizeof( cpf_export_note_t ) - 3 * sizeof( uint32_t ) - 4, \
+    CPF_NOTE_EXPORT, CPF_NOTE_NAME, (FLAGS), #FPROTO, #FUNC }; \
+  _Static_assert( sizeof( #FUNC ) <= CPF_EXPORT_NAME_SIZE, "CPF_EXPORT(): function name too long" ); \
+  _Static_assert( sizeof( #FPROTO ) <= CPF_EXPORT_PROTO_SIZE, "CPF_EXPORT(): prototype name too long" );
 
 
 // typedefs and structs
@@ -50,6 +120,8 @@ typedef struct {                          // functions definitions
   void *   func_addr;                     // 1st struct field!!!
   uint64_t func_offset;
   char *   func_name;                     // Can be NULL! Can't be 1st struct element!!!
+  uint32_t flags;                         // CPF_EXPORT_* flags (export manifest only)
+  enum func_prototype_t fproto;           // FP_UNDEFINED = not declared (not checked)
 } func_t;
 
 typedef struct {                          // Dependencies
@@ -57,11 +129,56 @@ typedef struct {                          // Dependencies
   func_t * funcs;
 } deps_t;
 
+/*
+ * Host services, set in the plugin context before the constructor is called.
+ * Plugins allocate through them instead of malloc():
+ *
+ *   char * s = CPF_ALLOC( p_ctx, 100 );                 // host frees it with CPF_mem_free()
+ *   char * t = CPF_ARENA_ALLOC( p_ctx, 100 );           // freed by CPF_arena_reset()
+ *   char * u = CPF_OUT_BUFFER( p_ctx, 100 );            // caller's buffer, or NULL
+ *   int ( *f )( int ) = CPF_DEP_FUNC( p_ctx, "lib2", "do_operation" ); // dependency function
+ *
+ * The plugins reach libcpf only through this table, so they don't import any
+ * libcpf symbol and can be loaded in their own namespace (CPF_FLAG_DLMOPEN).
+*/
+typedef struct cpf_services cpf_services_t;
+struct cpf_services {
+  uint32_t version;                       // CPF_SERVICES_VERSION
+  // per-thread pooled allocation, freed by the plugin or by the host
+  void * ( *alloc ) ( const cpf_services_t * s, size_t size );
+  void   ( *free ) ( const cpf_services_t * s, void * ptr );
+  // allocation in the request arena of the calling thread (CPF_arena_set_current()),
+  // NULL if there's none. Freed all at once by the host.
+  void * ( *arena_alloc ) ( const cpf_services_t * s, size_t size );
+  // output buffer supplied by the caller (CPF_set_out_buffer()), NULL if there's
+  // none or if it's smaller than "size". The buffer is handed out once.
+  void * ( *out_buffer ) ( const cpf_services_t * s, size_t size );
+  // function of a dependency, as CPF_get_extern_lib_func_by_dep()
+  void * ( *dep_func ) ( const cpf_services_t * s, deps_t * d, char * plugin_name, char * func_name );
+};
+#define CPF_SERVICES_VERSION    2
+
+#define CPF_ALLOC( ctx, size )        (ctx).services->alloc( (ctx).services, size )
+#define CPF_MEM_FREE( ctx, ptr )      (ctx).services->free( (ctx).services, ptr )
+#define CPF_ARENA_ALLOC( ctx, size )  (ctx).services->arena_alloc( (ctx).services, size )
+#define CPF_OUT_BUFFER( ctx, size )   (ctx).services->out_buffer( (ctx).services, size )
+#define CPF_DEP_FUNC( ctx, plugin_name, func_name ) \
+  (ctx).services->dep_func( (ctx).services, (ctx).deps, plugin_name, func_name )
+
 typedef struct {
   char     version[MAX_VERSIN_SIZE_NAME]; // optional plugin version
   deps_t * deps;
+  const cpf_services_t * services;        // set by libcpf before the constructor
 } plugin_ctx_t;
 
+typedef struct {                          // plugin file identity (manifest cache key)
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t  mtime_sec;
+  int64_t  mtime_nsec;
+} file_id_t;
+
 typedef struct {
   void         * dlhandle;                // ptr to "dl" functions
   void         * base_addr;               // plugin (.so) base addr when loaded into memory
@@ -76,19 +193,152 @@ typedef struct {
                                           //     /tmp/app/plugins/dir1/myplugin.so
   char     name[MAX_PLUGIN_NAME_SIZE];    // base path + plugin name without extension
                                           // Ex: "myplugin" and "dir1/myplugin"
+  file_id_t file_id;                      // inode/size/mtime when the plugin was loaded
+  uint32_t origin;                        // CPF_ORIGIN_*
+  int      memfd;                         // memfd mapped by dlopen(), 0 = none
+  void   * export_state;                  // ptr to PLUGIN_EXPORT_STATE_FUNC function
+  void   * import_state;                  // ptr to PLUGIN_IMPORT_STATE_FUNC function
+  void   * prefork;                       // ptr to PLUGIN_PREFORK_FUNC function
+  void   * postfork_parent;               // ptr to PLUGIN_POSTFORK_FUNC function
+  void   * ctor_child;                    // ptr to PLUGIN_CTOR_CHILD_FUNC function
+  struct cpf_pin * pin;                   // calls running this version without the reload lock
 } plugin_t;
 
 typedef struct {
   plugin_t * plugin;
-  char path[MAX_PLUGIN_PATH_SIZE];        // plugin path without plugin name
+  char path[MAX_PLUGIN_PATH_SIZE];        // plugin path without plugin name (or bundle file)
   uint16_t num_plugins;                   // number of plugins loaded
+  uint32_t flags;                         // CPF_FLAG_* registry flags
+  uint32_t generation;                    // incremented on every reload/unload
+  struct cpf_ab * ab;                     // A/B experiments (see CPF_ab_load())
+  struct cpf_bundle * bundle;             // bundle mapped while its plugins are loaded
+  long     lmid;                          // dlmopen() namespace (CPF_FLAG_DLMOPEN), 0 = none yet
+  struct cpf_rdeps * rdeps;               // reverse dependency index: who depends on a plugin
+  uint32_t shared_generation;             // shared registry generation loaded or published, 0 = none
+  struct cpf_shreg * shreg;               // shared registry image mapped while the plugins are loaded
+  struct cpf_hotpatch * hotpatch;         // retired plugin versions, patched (CPF_FLAG_HOT_PATCH)
+  void   * lmid_anchor;                   // keeps the dlmopen() namespace while the registry lives
+  struct cpf_ab * ab_retired;             // unloaded A/B experiments, freed by CPF_free()
 } cpf_t;
 
 // constructor and destructor typedef
 typedef void ( *ctor_dtor_t ) ( plugin_t * );
 
+/*
+ * State handoff on reload: when both versions define these functions, the
+ * state returned by the old version is passed to the new one, after the new
+ * constructor and before the old plugin is closed. "state" can be a live
+ * pointer: the new version owns it, and the old destructor must not free it.
+*/
+typedef void * ( *export_state_t ) ( plugin_t * );
+typedef void ( *import_state_t ) ( plugin_t *, void * state, const char * old_version );
+
+/*
+ * Static plugin: a plugin linked into the binary, used through the same API as
+ * the plugins of the directory (no dlopen(), no symbol scan, no hash):
+ *
+ *   static const cpf_static_func_t lib9_funcs[] = {
+ *     { "do_operation", do_operation, FP_INT_INT, CPF_EXPORT_PURE },
+ *     { NULL }
+ *   };
+ *   CPF_STATIC_PLUGIN( lib9, CPF_init_ctx, CPF_constructor, NULL, lib9_funcs )
+ *
+ * Each CPF_STATIC_PLUGIN() defines its descriptor and an ELF constructor that
+ * registers it before main(): libcpf is a shared object, so it can't walk a
+ * section of the binary by itself.
+*/
+typedef struct {                          // function of a static plugin
+  const char          * func_name;        // NULL = end of the table
+  void                * func_addr;
+  enum func_prototype_t fproto;
+  uint32_t              flags;            // CPF_EXPORT_* flags
+} cpf_static_func_t;
+
+typedef struct {                          // descriptor of a static plugin
+  const char              * name;
+  plugin_ctx_t          * ( *init_ctx ) ( void );
+  ctor_dtor_t               ctor;         // can be NULL
+  ctor_dtor_t               dtor;         // can be NULL
+  const cpf_static_func_t * funcs;
+} cpf_static_plugin_t;
+
+extern void CPF_register_static_plugin( const cpf_static_plugin_t * plugin );
+
+#define CPF_STATIC_PLUGIN( NAME, INIT_CTX, CTOR, DTOR, FUNCS ) \
+  static const cpf_static_plugin_t cpf_static_plugin_ ## NAME = { \
+    #NAME, (INIT_CTX), (CTOR), (DTOR), (FUNCS) }; \
+  __attribute__(( constructor )) \
+  static void cpf_static_register_ ## NAME( void ) \
+  { \
+    CPF_register_static_plugin( &cpf_static_plugin_ ## NAME ); \
+  }
+
+// per-request memory arena (see CPF_arena_create())
+typedef struct cpf_arena cpf_arena_t;
+
+typedef struct {                          // memory used by a plugin (see CPF_get_alloc_stats())
+  uint64_t allocs;                        // pooled allocations
+  uint64_t frees;
+  uint64_t alloc_bytes;
+  uint64_t pool_hits;                     // allocations served by the thread pool
+  uint64_t arena_allocs;
+  uint64_t arena_bytes;
+  uint64_t out_buffers;                   // caller buffers used
+} cpf_alloc_stats_t;
+
+// plugins loaded in a child process (see CPF_isolated_init())
+typedef struct cpf_isolated cpf_isolated_t;
+
+// resolved function handle (see CPF_resolve())
+typedef struct cpf_handle cpf_handle_t;
+
+// call interceptor (see CPF_intercept())
+typedef struct cpf_interceptor cpf_interceptor_t;
+typedef struct {                          // intercepted call
+  const char * plugin_name;
+  const char * func_name;
+  void       * func_addr;
+  fp_args_t  * args;                      // parameters, can be changed by "pre"
+  void       * ret;                       // return value, can be changed by "post"
+  bool         skip;                      // set by "pre": the function isn't called,
+                                          // "ret" is returned (e.g. fault injection)
+} cpf_call_t;
+typedef void ( *cpf_intercept_cb_t ) ( cpf_call_t * call, void * user_data );
+
+typedef struct {                          // memoization cache statistics (see CPF_memo_get_stats())
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;                     // entries replaced by another key
+  uint64_t entries;                       // entries in use
+  uint64_t capacity;
+} cpf_memo_stats_t;
+
+typedef struct {                          // A/B statistics of one version (see CPF_ab_get_stats())
+  char     version[MAX_VERSIN_SIZE_NAME]; // plugin ctx->version
+  uint64_t calls;
+  uint64_t errors;                        // reported with CPF_handle_report_error()
+  uint64_t mean_ns;
+  uint64_t p50_ns;
+  uint64_t p99_ns;
+  uint64_t max_ns;
+} cpf_ab_stats_t;
+
+// asynchronous call (see CPF_call_async())
+typedef struct cpf_future cpf_future_t;
+typedef void ( *cpf_future_cb_t ) ( cpf_future_t * future, void * user_data );
+
+// pipeline of plugin functions (see CPF_pipeline_create())
+typedef struct cpf_pipeline cpf_pipeline_t;
+typedef struct {                          // one pipeline stage
+  char                * plugin_name;      // NULL = end of stages array
+  char                * func_name;
+  enum func_prototype_t fproto;           // one parameter: the previous stage item
+  uint16_t              num_threads;      // stage thread group size (0 = 1 thread)
+} cpf_stage_t;
+
 
 extern cpf_t *   CPF_init( char * directory_name );
+extern cpf_t *   CPF_init_flags( char * directory_name, uint32_t flags );
 extern void      CPF_call_ctor( cpf_t * cpf );
 extern void      CPF_free( cpf_t ** cpf );
 extern void      CPF_call_dtor( cpf_t * cpf );
@@ -111,6 +361,111 @@ extern void *    CPF_get_extern_lib_func_by_dep( deps_t * d,
 extern uint64_t  CPF_get_func_offset( cpf_t * cpf, char * plugin_name, char * func_name );
 extern void      CPF_print_loaded_libs( cpf_t * cpf );
 extern int       CPF_reload_libs( cpf_t ** cpf, bool display_report );
+extern int       CPF_load_from_buffer( cpf_t * cpf,
+                                       char * plugin_name,
+                                       const void * data,
+                                       size_t len );
+extern int       CPF_reload_plugin( cpf_t * cpf, char * plugin_name );
+extern int       CPF_load_plugin( cpf_t * cpf, char * path );
+extern int       CPF_unload_plugin( cpf_t * cpf, char * plugin_name );
 extern void      CPF_unload_libs( cpf_t * cpf );
 
+extern void          CPF_mem_free( void * ptr );
+extern cpf_arena_t *  CPF_arena_create( size_t chunk_size );
+extern void           CPF_arena_reset( cpf_arena_t * arena );
+extern void           CPF_arena_destroy( cpf_arena_t ** arena );
+extern void           CPF_arena_set_current( cpf_arena_t * arena );
+extern void           CPF_set_out_buffer( void * buffer, size_t size );
+extern int            CPF_get_alloc_stats( char * plugin_name, cpf_alloc_stats_t * stats );
+
+extern cpf_isolated_t * CPF_isolated_init( char * directory_name,
+                                           uint32_t flags,
+                                           uint32_t ring_size );
+extern void *           CPF_isolated_call( cpf_isolated_t * iso,
+                                           char * plugin_name,
+                                           char * func_name,
+                                           enum func_prototype_t fproto,
+                                           ... );
+extern uint32_t         CPF_isolated_restarts( cpf_isolated_t * iso );
+extern void             CPF_isolated_free( cpf_isolated_t ** iso );
+
+extern cpf_handle_t * CPF_resolve( cpf_t ** cpf,
+                                   char * plugin_name,
+                                   char * func_name,
+                                   enum func_prototype_t fproto );
+extern cpf_handle_t * CPF_resolve_tuned( cpf_t ** cpf,
+                                         char * func_name,
+                                         enum func_prototype_t fproto );
+extern void *         CPF_call_handle( cpf_handle_t * handle, ... );
+extern void           CPF_handle_report_error( cpf_handle_t * handle );
+extern void           CPF_handle_free( cpf_handle_t ** handle );
+extern const char *   CPF_tune_selected( cpf_handle_t * handle );
+extern void           CPF_tune_report( cpf_handle_t * handle );
+
+extern cpf_interceptor_t * CPF_intercept( cpf_t ** cpf,
+                                           char * plugin_name,
+                                           char * func_name,
+                                           cpf_intercept_cb_t pre,
+                                           cpf_intercept_cb_t post,
+                                           void * user_data );
+extern int                 CPF_intercept_enable( cpf_interceptor_t * interceptor,
+                                                 bool enable );
+extern void                CPF_intercept_free( cpf_interceptor_t ** interceptor );
+
+extern int                 CPF_record_start( const char * path );
+extern void                CPF_record_stop( void );
+
+extern int                 CPF_profile_start( cpf_t ** cpf, uint32_t hz );
+extern void                CPF_profile_stop( void );
+extern void                CPF_profile_report( void );
+extern void                CPF_profile_reset( void );
+
+extern void                CPF_memo_get_stats( cpf_memo_stats_t * stats );
+extern void                CPF_memo_clear( void );
+
+extern bool                CPF_shared_changed( cpf_t * cpf );
+extern void                CPF_shared_unlink( cpf_t * cpf );
+
+extern int            CPF_ab_load( cpf_t ** cpf,
+                                   char * plugin_name,
+                                   char * candidate_path,
+                                   uint8_t percent );
+extern int            CPF_ab_set_split( cpf_t * cpf, char * plugin_name, uint8_t percent );
+extern int            CPF_ab_get_stats( cpf_t * cpf,
+                                        char * plugin_name,
+                                        cpf_ab_stats_t stats[2] );
+extern void           CPF_ab_report( cpf_t * cpf, char * plugin_name );
+extern int            CPF_ab_unload( cpf_t ** cpf, char * plugin_name );
+
+extern int            CPF_executor_start( uint16_t num_threads );
+extern void           CPF_executor_stop( void );
+extern cpf_future_t * CPF_call_async( cpf_t ** cpf,
+                                      char * plugin_name,
+                                      char * func_name,
+                                      enum func_prototype_t fproto,
+                                      ... );
+extern bool           CPF_future_poll( cpf_future_t * future );
+extern void *         CPF_future_wait( cpf_future_t * future );
+extern void *         CPF_future_result( cpf_future_t * future );
+extern void           CPF_future_then( cpf_future_t * future,
+                                       cpf_future_cb_t then,
+                                       void * user_data );
+extern void           CPF_future_free( cpf_future_t ** future );
+
+extern cpf_pipeline_t * CPF_pipeline_create( cpf_t ** cpf,
+                                             cpf_stage_t * stages,
+                                             uint32_t queue_size,
+                                             uint16_t batch_size );
+extern void             CPF_pipeline_push( cpf_pipeline_t * pipeline, void * item );
+extern bool             CPF_pipeline_try_push( cpf_pipeline_t * pipeline, void * item );
+extern bool             CPF_pipeline_pop( cpf_pipeline_t * pipeline, void ** item );
+extern bool             CPF_pipeline_try_pop( cpf_pipeline_t * pipeline, void ** item );
+extern void             CPF_pipeline_close( cpf_pipeline_t * pipeline );
+extern uint64_t         CPF_pipeline_dropped( cpf_pipeline_t * pipeline );
+extern void             CPF_pipeline_free( cpf_pipeline_t ** pipeline );
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,108 @@
+/*
+  libcpf - C Plugin Framework
+
+  cpf_async.hpp - C++20 awaitable of the asynchronous calls (header only)
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __CPF_ASYNC_HPP__
+#define __CPF_ASYNC_HPP__
+
+#include <coroutine>
+#include <cstdint>
+#include <type_traits>
+#include "cpf.h"
+
+namespace cpf {
+
+/*
+ * enum func_prototype_t of a function signature: one specialization per
+ * prototype of fp_prototype.h.
+*/
+template < typename Signature > struct fproto_of;
+template <> struct fproto_of< int( int ) >            { static constexpr func_prototype_t value = FP_INT_INT; };
+template <> struct fproto_of< char *() >              { static constexpr func_prototype_t value = FP_CHARPTR; };
+template <> struct fproto_of< void *( char *, int ) > { static constexpr func_prototype_t value = FP_VOIDPTR_CHARPTR_INT; };
+
+
+/*
+ * co_await of a CPF_call_async() call: the coroutine is suspended until the
+ * call completes, and resumed by the executor worker that ran it (through
+ * CPF_future_then()), or right away if the call is already completed.
+ *
+ *   int ret = co_await cpf::async_call< int( int ) >( &cpf, "lib2", "do_operation", 3 );
+ *
+ * The future is freed with the awaitable, at the end of the co_await expression.
+*/
+template < typename Signature > class async_call;
+
+template < typename R, typename... Args >
+class async_call< R( Args... ) > {
+public:
+  async_call( cpf_t ** cpf, const char * plugin_name, const char * func_name, Args... args )
+    : future_( CPF_call_async( cpf,
+                               const_cast< char * >( plugin_name ),
+                               const_cast< char * >( func_name ),
+                               fproto_of< R( Args... ) >::value,
+                               args... ) )
+  {
+  }
+
+  async_call( const async_call & ) = delete;
+  async_call & operator=( const async_call & ) = delete;
+
+  ~async_call()
+  {
+    CPF_future_free( &future_ );
+  }
+
+  bool await_ready() const noexcept
+  {
+    return ( future_ == nullptr ) || CPF_future_poll( future_ );
+  }
+
+  void await_suspend( std::coroutine_handle<> handle ) noexcept
+  {
+    handle_ = handle;
+    // the coroutine can be resumed before CPF_future_then() returns: "this" isn't used after it
+    CPF_future_then( future_, resume, this );
+  }
+
+  R await_resume() const noexcept
+  {
+    void * ret = CPF_future_result( future_ );
+
+
+    if constexpr ( std::is_pointer_v< R > ) {
+      return static_cast< R >( ret );
+    } else {
+      return static_cast< R >( reinterpret_cast< std::uintptr_t >( ret ) );
+    }
+  }
+
+private:
+  static void resume( cpf_future_t *, void * self )
+  {
+    static_cast< async_call * >( self )->handle_.resume();
+  }
+
+  cpf_future_t          * future_;        // NULL if the call couldn't be queued
+  std::coroutine_handle<> handle_;
+};
+
+} // namespace cpf
+
+#endif
@@ -0,0 +1,460 @@
+/*
+  libcpf - C Plugin Framework
+
+  executor.c - work-stealing executor for asynchronous plugin calls
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cpf.h"
+#include "plugin_manager.h"
+
+
+struct cpf_future {
+  cpf_t           ** cpf;                 // resolved by the worker: follows reloads
+  char             * plugin_name;         // stored after the struct
+  char             * func_name;           // stored after the struct
+  fp_args_t          args;
+  void             * ret;
+  _Atomic uint32_t   done;                // futex word
+  pthread_mutex_t    lock;                // protects "completing", "then" and "then_data"
+  bool               completing;
+  cpf_future_cb_t    then;
+  void             * then_data;
+};
+
+typedef struct {                          // work-stealing deque of one worker
+  pthread_mutex_t   lock;
+  cpf_future_t   ** task;
+  uint32_t          size;                 // capacity, power of 2
+  uint32_t          top;                  // thieves steal here (FIFO)
+  uint32_t          bottom;               // owner pushes and pops here (LIFO)
+} deque_t;
+
+typedef struct {
+  pthread_t         thread;
+  deque_t           deque;
+} worker_t;
+
+
+static worker_t        * workers = NULL;
+static uint16_t          num_workers = 0;
+static _Atomic bool      running = false;
+static _Atomic uint32_t  next_worker = 0;     // round robin for external submits
+static _Atomic uint32_t  num_queued = 0;
+static pthread_mutex_t   idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t    idle_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t   start_lock = PTHREAD_MUTEX_INITIALIZER;
+// read by CPF_call_async() while it pushes to a worker, written by
+// CPF_executor_stop() before it frees the workers
+static pthread_rwlock_t  submit_lock = PTHREAD_RWLOCK_INITIALIZER;
+static __thread int      worker_id = -1;      // >= 0 inside a worker thread
+
+
+static void
+deque_push( deque_t * d, cpf_future_t * f )
+{
+  cpf_future_t ** task;
+  uint32_t        i, n;
+
+
+  pthread_mutex_lock( &d->lock );
+  if ( d->bottom - d->top == d->size ) { // full: grow
+    n = d->size * 2;
+    if ( ( task = (cpf_future_t **)malloc( n * sizeof( cpf_future_t * ) ) ) == NULL ) {
+      LOG_ERROR( "Cannot allocate memory for the executor queue!" )
+      exit( EXIT_FAILURE );
+    }
+    for ( i = d->top ; i != d->bottom ; i++ ) {
+      task[i & ( n - 1 )] = d->task[i & ( d->size - 1 )];
+    }
+    FREE( d->task )
+    d->task = task;
+    d->size = n;
+  }
+  d->task[d->bottom & ( d->size - 1 )] = f;
+  d->bottom++;
+  pthread_mutex_unlock( &d->lock );
+}
+
+
+static cpf_future_t *
+deque_pop( deque_t * d, bool steal )
+{
+  cpf_future_t * f = NULL;
+
+
+  pthread_mutex_lock( &d->lock );
+  if ( d->bottom != d->top ) {
+    if ( steal == true ) {
+      f = d->task[d->top & ( d->size - 1 )];
+      d->top++;
+    } else {
+      d->bottom--;
+      f = d->task[d->bottom & ( d->size - 1 )];
+    }
+  }
+  pthread_mutex_unlock( &d->lock );
+  return f;
+}
+
+
+static cpf_future_t *
+next_task( int id )
+{
+  cpf_future_t * f;
+  uint16_t       i;
+
+
+  if ( ( f = deque_pop( &workers[id].deque, false ) ) != NULL ) {
+    return f;
+  }
+  for ( i = 1 ; i < num_workers ; i++ ) {
+    if ( ( f = deque_pop( &workers[( id + i ) % num_workers].deque, true ) ) != NULL ) {
+      return f;
+    }
+  }
+  return NULL;
+}
+
+
+/*
+ * "done" is set and the waiters woken with the lock held: CPF_future_free()
+ * takes the lock after the wait, so the future isn't freed before the worker
+ * is done with it. The callback owns the future, "f" isn't used after it.
+*/
+static void
+complete( cpf_future_t * f )
+{
+  cpf_future_cb_t then;
+  void          * then_data;
+
+
+  pthread_mutex_lock( &f->lock );
+  f->completing = true;
+  then = f->then;
+  then_data = f->then_data;
+  atomic_store_explicit( &f->done, 1, memory_order_release );
+  syscall( SYS_futex, &f->done, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0 );
+  pthread_mutex_unlock( &f->lock );
+  if ( then != NULL ) {
+    then( f, then_data );
+  }
+}
+
+
+/*
+ * The function is resolved under the reload lock, and its plugin version is
+ * pinned for the call: the call runs without the lock, so it can wait for a
+ * nested CPF_call_async() while a reload is waiting for the lock. A reload
+ * meanwhile closes the version (destructor included), which stays mapped
+ * until the call returns.
+*/
+static void
+run_task( cpf_future_t * f )
+{
+  struct cpf_pin * pin = NULL;
+  plugin_t       * p;
+  func_t         * func;
+  void           * func_addr;
+
+
+  reload_rdlock();
+  if ( ( *f->cpf != NULL ) &&
+       ( ( func = get_func_proto( *f->cpf, f->plugin_name, f->func_name,
+                                  f->args.fproto, &p ) ) != NULL ) ) {
+    func_addr = func->func_addr; // "func" is freed with the registry entry
+    pin = pin_plugin( p );
+  }
+  reload_unlock();
+  if ( pin != NULL ) {
+    f->ret = CPF_wrapper_call_func_by_args( func_addr, &f->args );
+    unpin_plugin( pin );
+  }
+  complete( f );
+}
+
+
+static void *
+worker_thread( void * arg )
+{
+  cpf_future_t * f;
+
+
+  worker_id = (int)(uint64_t)arg;
+  for (;;) {
+    if ( ( f = next_task( worker_id ) ) != NULL ) {
+      atomic_fetch_sub( &num_queued, 1 );
+      run_task( f );
+      continue;
+    }
+    pthread_mutex_lock( &idle_lock );
+    while ( ( atomic_load( &num_queued ) == 0 ) && atomic_load( &running ) ) {
+      pthread_cond_wait( &idle_cond, &idle_lock );
+    }
+    pthread_mutex_unlock( &idle_lock );
+    if ( ( atomic_load( &running ) == false ) && ( atomic_load( &num_queued ) == 0 ) ) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+
+// the workers don't exist in a forked child: the child can start its own
+static void
+executor_atfork_child( void )
+{
+  uint16_t i;
+
+
+  for ( i = 0 ; i < num_workers ; i++ ) {
+    FREE( workers[i].deque.task ) // the queued calls are dropped
+  }
+  FREE( workers )
+  num_workers = 0;
+  atomic_store( &running, false );
+  atomic_store( &num_queued, 0 );
+  pthread_mutex_init( &idle_lock, NULL );
+  pthread_cond_init( &idle_cond, NULL );
+  pthread_mutex_init( &start_lock, NULL );
+  pthread_rwlock_init( &submit_lock, NULL );
+}
+
+
+int
+CPF_executor_start( uint16_t num_threads )
+{
+  static bool atfork_set = false;
+  uint16_t    i;
+
+
+  pthread_mutex_lock( &start_lock );
+  if ( atomic_load( &running ) == true ) {
+    pthread_mutex_unlock( &start_lock );
+    return EXIT_SUCCESS;
+  }
+  if ( num_threads == 0 ) {
+    num_threads = ( sysconf( _SC_NPROCESSORS_ONLN ) > 0 ) ?
+                  (uint16_t)sysconf( _SC_NPROCESSORS_ONLN ) : 1;
+  }
+  if ( ( workers = (worker_t *)calloc( num_threads, sizeof( worker_t ) ) ) == NULL ) {
+    LOG_ERROR( "CPF_executor_start(): Cannot allocate memory for workers!" )
+    exit( EXIT_FAILURE );
+  }
+  for ( i = 0 ; i < num_threads ; i++ ) {
+    pthread_mutex_init( &workers[i].deque.lock, NULL );
+    workers[i].deque.size = 64;
+    workers[i].deque.task = (cpf_future_t **)calloc( 64, sizeof( cpf_future_t * ) );
+    if ( workers[i].deque.task == NULL ) {
+      LOG_ERROR( "CPF_executor_start(): Cannot allocate memory for workers!" )
+      exit( EXIT_FAILURE );
+    }
+  }
+  num_workers = num_threads;
+  atomic_store( &running, true );
+  if ( atfork_set == false ) {
+    pthread_atfork( NULL, NULL, executor_atfork_child );
+    atfork_set = true;
+  }
+  for ( i = 0 ; i < num_threads ; i++ ) {
+    if ( pthread_create( &workers[i].thread, NULL, worker_thread, (void *)(uint64_t)i ) != 0 ) {
+      LOG_ERROR( "CPF_executor_start(): Cannot create worker thread!" )
+      exit( EXIT_FAILURE );
+    }
+  }
+  pthread_mutex_unlock( &start_lock );
+  return EXIT_SUCCESS;
+}
+
+
+/*
+ * The queued calls are executed before the workers exit. The calls submitted
+ * while they exit are completed with a NULL result, without being run.
+*/
+void
+CPF_executor_stop( void )
+{
+  cpf_future_t * f;
+  uint16_t       i;
+
+
+  pthread_mutex_lock( &start_lock );
+  if ( atomic_load( &running ) == false ) {
+    pthread_mutex_unlock( &start_lock );
+    return;
+  }
+  pthread_mutex_lock( &idle_lock );
+  atomic_store( &running, false );
+  pthread_cond_broadcast( &idle_cond );
+  pthread_mutex_unlock( &idle_lock );
+  for ( i = 0 ; i < num_workers ; i++ ) {
+    pthread_join( workers[i].thread, NULL );
+  }
+  pthread_rwlock_wrlock( &submit_lock ); // no submit is using the workers
+  for ( i = 0 ; i < num_workers ; i++ ) {
+    while ( ( f = deque_pop( &workers[i].deque, true ) ) != NULL ) {
+      atomic_fetch_sub( &num_queued, 1 );
+      complete( f );
+    }
+    pthread_mutex_destroy( &workers[i].deque.lock );
+    FREE( workers[i].deque.task )
+  }
+  FREE( workers )
+  num_workers = 0;
+  pthread_rwlock_unlock( &submit_lock );
+  pthread_mutex_unlock( &start_lock );
+}
+
+
+cpf_future_t *
+CPF_call_async( cpf_t ** cpf,
+                char * plugin_name,
+                char * func_name,
+                enum func_prototype_t fproto,
+                ... )
+{
+  cpf_future_t * f;
+  va_list        varglist;
+  size_t         plugin_len, func_len;
+  int            id;
+
+
+  if ( ( cpf == NULL ) || ( *cpf == NULL ) || ( plugin_name == NULL ) || ( func_name == NULL ) ) {
+    LOG_ERROR( "CPF_call_async(): Parameters cannot be NULL!" )
+    return NULL;
+  }
+  // the names are copied: the call can run after the caller's strings are gone
+  plugin_len = strlen( plugin_name ) + 1;
+  func_len = strlen( func_name ) + 1;
+  if ( ( f = (cpf_future_t *)calloc( 1, sizeof( cpf_future_t ) + plugin_len + func_len ) ) == NULL ) {
+    LOG_ERROR( "CPF_call_async(): Cannot allocate memory for the call!" )
+    return NULL;
+  }
+  f->cpf = cpf;
+  f->plugin_name = (char *)( f + 1 );
+  f->func_name = f->plugin_name + plugin_len;
+  memcpy( f->plugin_name, plugin_name, plugin_len );
+  memcpy( f->func_name, func_name, func_len );
+  pthread_mutex_init( &f->lock, NULL );
+
+  va_start( varglist, fproto );
+  CPF_wrapper_get_args( &f->args, fproto, varglist );
+  va_end( varglist );
+
+  // the workers can't be freed while the call is pushed. A worker submits
+  // (nested calls) to its own deque, even while stopping: it runs them.
+  pthread_rwlock_rdlock( &submit_lock );
+  while ( ( worker_id < 0 ) && ( atomic_load( &running ) == false ) ) {
+    pthread_rwlock_unlock( &submit_lock );
+    if ( CPF_executor_start( 0 ) == EXIT_FAILURE ) {
+      pthread_mutex_destroy( &f->lock );
+      FREE( f )
+      return NULL;
+    }
+    pthread_rwlock_rdlock( &submit_lock );
+  }
+  id = ( worker_id >= 0 ) ? worker_id :
+       (int)( atomic_fetch_add( &next_worker, 1 ) % num_workers );
+  deque_push( &workers[id].deque, f );
+  pthread_mutex_lock( &idle_lock );
+  atomic_fetch_add( &num_queued, 1 );
+  pthread_cond_signal( &idle_cond );
+  pthread_mutex_unlock( &idle_lock );
+  pthread_rwlock_unlock( &submit_lock );
+
+  return f;
+}
+
+
+bool
+CPF_future_poll( cpf_future_t * f )
+{
+  return ( f != NULL ) && ( atomic_load_explicit( &f->done, memory_order_acquire ) == 1 );
+}
+
+
+void *
+CPF_future_wait( cpf_future_t * f )
+{
+  if ( f == NULL ) {
+    return NULL;
+  }
+  while ( atomic_load_explicit( &f->done, memory_order_acquire ) == 0 ) {
+    syscall( SYS_futex, &f->done, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0 );
+  }
+  return f->ret;
+}
+
+
+/*
+ * Register a completion callback, called by the worker thread when the call
+ * completes (or by the caller, if it's already completed). It's the hook to
+ * resume coroutines and event loops. The callback owns the future: free it
+ * there, with CPF_future_free().
+*/
+void
+CPF_future_then( cpf_future_t * f, cpf_future_cb_t then, void * user_data )
+{
+  bool completing;
+
+
+  if ( f == NULL ) {
+    return;
+  }
+  pthread_mutex_lock( &f->lock );
+  completing = f->completing;
+  if ( completing == false ) {
+    f->then_data = user_data;
+    f->then = then;
+  }
+  pthread_mutex_unlock( &f->lock );
+  if ( ( completing == true ) && ( then != NULL ) ) {
+    CPF_future_wait( f );
+    then( f, user_data );
+  }
+}
+
+
+void *
+CPF_future_result( cpf_future_t * f )
+{
+  return ( CPF_future_poll( f ) == true ) ? f->ret : NULL;
+}
+
+
+void
+CPF_future_free( cpf_future_t ** f )
+{
+  if ( (*f) == NULL ) {
+    return;
+  }
+  CPF_future_wait( *f );
+  pthread_mutex_lock( &(*f)->lock ); // the worker left complete()'s critical section
+  pthread_mutex_unlock( &(*f)->lock );
+  pthread_mutex_destroy( &(*f)->lock );
+  FREE( (*f) )
+}
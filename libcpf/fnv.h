@@ -0,0 +1,85 @@
+/*
+  libcpf - C Plugin Framework
+
+  fnv.h - FNV-1a hash (header only)
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __FNV_H__
+#define __FNV_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The hash of several fields is chained: start with the offset basis, and
+ * pass the result of one field to the next. The 64-bit hash of the manifest
+ * cache checksum and of the shared registry names is persistent: don't change it.
+*/
+#define FNV32_BASIS             2166136261U
+#define FNV32_PRIME             16777619U
+#define FNV64_BASIS             0xcbf29ce484222325ULL
+#define FNV64_PRIME             0x100000001b3ULL
+
+
+static inline uint32_t
+fnv1a_32( uint32_t h, const void * data, size_t len )
+{
+  const uint8_t * b = (const uint8_t *)data;
+  size_t          i;
+
+
+  for ( i = 0 ; i < len ; i++ ) {
+    h = ( h ^ b[i] ) * FNV32_PRIME;
+  }
+  return h;
+}
+
+
+static inline uint32_t
+fnv1a_32_str( uint32_t h, const char * s )
+{
+  for ( ; *s != '\0' ; s++ ) {
+    h = ( h ^ (uint8_t)*s ) * FNV32_PRIME;
+  }
+  return h;
+}
+
+
+static inline uint64_t
+fnv1a_64( uint64_t h, const void * data, size_t len )
+{
+  const uint8_t * b = (const uint8_t *)data;
+  size_t          i;
+
+
+  for ( i = 0 ; i < len ; i++ ) {
+    h = ( h ^ b[i] ) * FNV64_PRIME;
+  }
+  return h;
+}
+
+
+static inline uint64_t
+fnv1a_64_str( uint64_t h, const char * s )
+{
+  for ( ; *s != '\0' ; s++ ) {
+    h = ( h ^ (uint8_t)*s ) * FNV64_PRIME;
+  }
+  return h;
+}
+
+#endif
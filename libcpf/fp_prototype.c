@@ -22,7 +22,9 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include "fp_prototype.h"
+#include "intercept.h"
 #include "log.h"
 
 //////////////////////////////////////////////////////////////////////////
@@ -41,25 +43,117 @@ FP_WRAPPER( FP_VOIDPTR_CHARPTR_INT,
 //////////////////////////////////////////////////////////////////////////
 
 
+//////////////////////////////////////////////////////////////////////////
+// Function pointer prototypes must be described here!
+static const fp_desc_t fp_desc[] = {
+  { FP_INT_INT, "FP_INT_INT", PT_INT, 1, { PT_INT } },
+  { FP_CHARPTR, "FP_CHARPTR", PT_POINTER_TO_CHAR, 0, { PT_UNDEFINED } },
+  { FP_VOIDPTR_CHARPTR_INT, "FP_VOIDPTR_CHARPTR_INT", PT_POINTER_TO_VOID,
+    2, { PT_POINTER_TO_CHAR, PT_INT }, FP_IN_STR( 0 ) },
+  { FP_UNDEFINED, NULL, PT_UNDEFINED, 0, { PT_UNDEFINED } } // end of array
+};
+//////////////////////////////////////////////////////////////////////////
+
+
+const fp_desc_t *
+CPF_wrapper_get_desc( enum func_prototype_t fproto )
+{
+  uint16_t i;
+
+
+  for ( i = 0 ; fp_desc[i].name != NULL ; i++ ) {
+    if ( fp_desc[i].fproto == fproto ) {
+      return &fp_desc[i];
+    }
+  }
+  return NULL;
+}
+
+
+// prototype by its enum name, e.g. "FP_INT_INT" (export manifest)
+const fp_desc_t *
+CPF_wrapper_get_desc_by_name( const char * name )
+{
+  uint16_t i;
+
+
+  for ( i = 0 ; fp_desc[i].name != NULL ; i++ ) {
+    if ( strcmp( fp_desc[i].name, name ) == 0 ) {
+      return &fp_desc[i];
+    }
+  }
+  return NULL;
+}
+
+
+void
+CPF_wrapper_get_args( fp_args_t * args,
+                      enum func_prototype_t fproto,
+                      va_list varglist )
+{
+  const fp_desc_t * desc;
+  uint8_t           i;
+
+
+  args->fproto = fproto;
+  args->num_args = 0;
+  if ( ( desc = CPF_wrapper_get_desc( fproto ) ) == NULL ) {
+    return;
+  }
+
+  // the "default argument promotions" apply to the optional parameters
+  for ( i = 0 ; i < desc->num_args ; i++ ) {
+    switch( desc->arg[i] ) {
+      case PT_BOOL:
+      case PT_CHAR:
+      case PT_UNSIGNED_CHAR:
+      case PT_SHORT_INT:
+      case PT_UNSIGNED_SHORT_INT:
+      case PT_INT:
+        args->arg[i].i = va_arg( varglist, int );
+        break;
+      case PT_UNSIGNED_INT:
+        args->arg[i].u64 = va_arg( varglist, unsigned int );
+        break;
+      case PT_LONG:
+        args->arg[i].l = va_arg( varglist, long );
+        break;
+      case PT_UNSIGNED_LONG:
+        args->arg[i].u64 = va_arg( varglist, unsigned long );
+        break;
+      case PT_FLOAT:
+      case PT_DOUBLE:
+        args->arg[i].d = va_arg( varglist, double );
+        break;
+      case PT_LONG_DOUBLE:
+        LOG_ERROR( "\"long double\" parameter is not supported!" )
+        return;
+      default: // pointers
+        args->arg[i].vp = va_arg( varglist, void * );
+        break;
+    }
+  }
+  args->num_args = desc->num_args;
+}
+
+
+// call the function, without the interceptors
 void *
-CPF_wrapper_call_func_by_addr( void * func_addr,
-                               enum func_prototype_t fproto,
-                               va_list varglist )
+CPF_wrapper_call_func_direct( void * func_addr, fp_args_t * args )
 {
   void * ret = NULL;
 
-  switch( fproto ) {
+  switch( args->fproto ) {
     case FP_INT_INT: {
-        int    i   = va_arg( varglist, int );
-        ret = (void *)(uint64_t)FP_INT_INT_wrapper ( func_addr, i );
+        ret = (void *)(uint64_t)FP_INT_INT_wrapper ( func_addr, args->arg[0].i );
       } break;
     case FP_CHARPTR: {
         ret = (void *)FP_CHARPTR_wrapper ( func_addr );
       } break;
     case FP_VOIDPTR_CHARPTR_INT: {
-        char * cp  = va_arg( varglist, char * );
-        int    i   = va_arg( varglist, int );
-        ret = FP_VOIDPTR_CHARPTR_INT_wrapper ( func_addr, cp, i );
+        ret = FP_VOIDPTR_CHARPTR_INT_wrapper ( func_addr,
+                                               args->arg[0].cp,
+                                               args->arg[1].i );
       } break;
     default:
       LOG_ERROR( "Function prototype not found!" )
@@ -67,4 +161,33 @@ CPF_wrapper_call_func_by_addr( void * func_addr,
   }
 
   return ret;
-}
\ No newline at end of file
+}
+
+
+/*
+ * All the calls go through here. The interceptors (see CPF_intercept()) are
+ * looked up only while at least one is enabled: otherwise the static branch
+ * is a NOP, and there's no check on the call path.
+*/
+void *
+CPF_wrapper_call_func_by_args( void * func_addr, fp_args_t * args )
+{
+  STATIC_BRANCH_UNLIKELY( intercepted );
+  return CPF_wrapper_call_func_direct( func_addr, args );
+
+intercepted:
+  return intercept_call( func_addr, args );
+}
+
+
+void *
+CPF_wrapper_call_func_by_addr( void * func_addr,
+                               enum func_prototype_t fproto,
+                               va_list varglist )
+{
+  fp_args_t args;
+
+
+  CPF_wrapper_get_args( &args, fproto, varglist );
+  return CPF_wrapper_call_func_by_args( func_addr, &args );
+}
@@ -21,6 +21,13 @@
 #ifndef __FP_PROTOTYPE_H__
 #define __FP_PROTOTYPE_H__
 
+#include <stdarg.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*
 ****************************************************************
   CREATING A FUNCTION PROTOTYPE
@@ -67,24 +74,38 @@ For the "func_name()" above, this format/pattern is: VOIDPTR_CHARPTR_INT
 
   After the expansion, the macro format became more clear to understand.
 
-3) In "fp_prototype.c" file, modify the CPF_wrapper_call_func_by_addr() function,
-   adding a case statement to call the specific wrapper function, previously
-   created with FP_WRAPPER macro (see item 2):
+3) In "fp_prototype.c" file, add the prototype description to the fp_desc[]
+   array: the enum, its name, the return type, the parameters type (see
+   enum param_type_t) and the parameters that are NUL terminated input strings
+   (FP_IN_STR(), optional):
+  ...
+  { FP_VOIDPTR_CHARPTR_INT, "FP_VOIDPTR_CHARPTR_INT", PT_POINTER_TO_VOID,
+    2, { PT_POINTER_TO_CHAR, PT_INT }, FP_IN_STR( 0 ) },
+  ...
+
+  Only the input strings are read by the call recording (see record.h): a char
+  pointer can also be an output buffer, with no terminating NUL yet.
+
+  The parameters type is important to read each optional parameter correctly
+  (see CPF_wrapper_get_args()): the parameters are copied into the fp_args_t
+  struct, using the fp_arg_t union field with the same type of the parameter
+  ("i" for int and smaller types, "l" for long, "d" for float and double, "u64"
+  for unsigned int and unsigned long, and "vp"/"cp" for pointers).
+
+4) Modify the CPF_wrapper_call_func_direct() function, adding a case
+  statement to call the specific wrapper function, previously created with
+  FP_WRAPPER macro (see item 2):
   ...
   case FP_VOIDPTR_CHARPTR_INT: {
-      char * cp  = va_arg( varglist, char * );
-      int    i   = va_arg( varglist, int );
-      ret = FP_VOIDPTR_CHARPTR_INT_wrapper ( func_addr, cp, i );
+      ret = FP_VOIDPTR_CHARPTR_INT_wrapper ( func_addr,
+                                             args->arg[0].cp,
+                                             args->arg[1].i );
     } break;
   ...
 
   The name of the wrapper function is formed by enum func_prototype_t, followed by
   "_wrapper".
 
-  The optional parameters must be set before the wrapper function call, binding
-  each parameter with one variable declared inside the case statement. The
-  variable data type is important to bind it correctly.
-
   The "{" and "}" are important to avoid variable name conflict with other "case"
   declarations.
 
@@ -93,14 +114,16 @@ For the "func_name()" above, this format/pattern is: VOIDPTR_CHARPTR_INT
   the wrapper function returns "void *" and the "ret" variable is declared as
   "void *".
 
-4) You are not required to use the wrapper function call, if you don't want to.
+  The parameters are copied into fp_args_t, instead of reading the va_list
+  directly, so the call can be executed later or in another thread (see
+  CPF_call_async()).
+
+5) You are not required to use the wrapper function call, if you don't want to.
    Instead of that, you can use the classic way to call a function pointer:
     ...
     case FP_VOIDPTR_CHARPTR_INT: {
-        char * cp  = va_arg( varglist, char * );
-        int    i   = va_arg( varglist, int );
         void * (*some_func_prototype_t)(char *, int) = func_addr;
-        ret = (*some_func_prototype_t)( cp, i );
+        ret = (*some_func_prototype_t)( args->arg[0].cp, args->arg[1].i );
       } break;
     ...
 
@@ -137,8 +160,6 @@ enum func_prototype_t {
   FP_VOIDPTR_CHARPTR_INT
 };
 
-/*
-// NOT USED!
 enum param_type_t {
   PT_UNDEFINED=0,
   PT_VOID,
@@ -167,11 +188,47 @@ enum param_type_t {
   PT_POINTER_TO_DOUBLE,
   PT_POINTER_TO_LONG_DOUBLE
 };
-*/
 
+#define FP_MAX_ARGS             8                 // max number of function parameters
+#define FP_IN_STR( i )          ( 1U << (i) )     // parameter "i" is a NUL terminated input string
+
+typedef union {                           // one function parameter
+  int      i;
+  long     l;
+  double   d;
+  char   * cp;
+  void   * vp;
+  uint64_t u64;
+} fp_arg_t;
+
+typedef struct {                          // function parameters, copied from va_list
+  enum func_prototype_t fproto;
+  uint8_t               num_args;
+  fp_arg_t              arg[FP_MAX_ARGS];
+} fp_args_t;
+
+typedef struct {                          // function prototype description
+  enum func_prototype_t fproto;
+  const char          * name;             // enum name, e.g. "FP_INT_INT"
+  enum param_type_t     ret;              // return type
+  uint8_t               num_args;
+  enum param_type_t     arg[FP_MAX_ARGS]; // parameters type
+  uint8_t               in_str;           // FP_IN_STR() of the input strings
+} fp_desc_t;
+
+const fp_desc_t * CPF_wrapper_get_desc( enum func_prototype_t fproto );
+const fp_desc_t * CPF_wrapper_get_desc_by_name( const char * name );
+void   CPF_wrapper_get_args( fp_args_t * args,
+                             enum func_prototype_t fproto,
+                             va_list varglist );
+void * CPF_wrapper_call_func_by_args( void * func_addr, fp_args_t * args );
+void * CPF_wrapper_call_func_direct( void * func_addr, fp_args_t * args );
 void * CPF_wrapper_call_func_by_addr( void * func_addr,
                                       enum func_prototype_t fproto,
                                       va_list varglist );
 
+#ifdef __cplusplus
+}
+#endif
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,358 @@
+/*
+  libcpf - C Plugin Framework
+
+  handle.c - resolved function handles
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ab.h"
+#include "memo.h"
+#include "plugin_manager.h"
+#include "record.h"
+#include "tune.h"
+#include "usdt.h"
+
+
+typedef struct handle_res {              // resolution of a handle, never modified once published
+  uint64_t              stamp;            // ( generation << 1 ) | 1
+  void                * func_addr[2];     // [0] = loaded version, [1] = A/B candidate
+  struct cpf_ab       * ab;               // A/B experiment, NULL if none
+  uint64_t              memo_tag;         // memoized calls (CPF_FLAG_MEMOIZE), 0 = none
+  struct cpf_tune     * tune;             // providers of a tuned handle (CPF_resolve_tuned())
+  struct handle_res   * retired;          // previous resolution, freed with the handle
+} handle_res_t;
+
+struct cpf_handle {
+  cpf_t              ** cpf;              // re-resolved when the registry generation changes
+  char                * plugin_name;      // stored after the struct, NULL = tuned
+  char                * func_name;        // stored after the struct
+  enum func_prototype_t fproto;
+  pthread_mutex_t       lock;             // serializes the re-resolution
+  handle_res_t * _Atomic res;             // current resolution, swapped as a whole
+};
+
+
+static __thread uint32_t       rnd_state = 0;
+static __thread cpf_handle_t * last_handle = NULL; // last A/B call of this thread
+static __thread ab_stats_t   * last_stats = NULL;
+static __thread uint64_t       last_stamp = 0;
+
+
+static inline uint64_t
+handle_stamp( cpf_t * cpf )
+{
+  return ( (uint64_t)cpf->generation << 1 ) | 1;
+}
+
+
+/*
+ * The calls read the resolution without lock: a new one is built and
+ * published with one pointer store, the previous one is kept until the
+ * handle is freed (a call started before the reload may still use it).
+*/
+static handle_res_t *
+resolve_handle( cpf_handle_t * h )
+{
+  cpf_t        * cpf;
+  func_t       * func;
+  plugin_t     * p;
+  handle_res_t * prev,
+               * r;
+
+
+  pthread_mutex_lock( &h->lock );
+  cpf = *h->cpf;
+  prev = atomic_load_explicit( &h->res, memory_order_relaxed );
+  if ( ( prev != NULL ) && ( prev->stamp == handle_stamp( cpf ) ) ) {
+    pthread_mutex_unlock( &h->lock );
+    return prev;
+  }
+  if ( ( r = (handle_res_t *)calloc( 1, sizeof( handle_res_t ) ) ) == NULL ) {
+    LOG_ERROR( "Cannot allocate memory for the function handle!" )
+    exit( EXIT_FAILURE );
+  }
+  r->stamp = handle_stamp( cpf );
+  r->retired = prev;
+  if ( h->plugin_name == NULL ) { // tuned: the providers may have changed, explore again
+    r->tune = tune_resolve( cpf, h->func_name, h->fproto, ( prev != NULL ) ? prev->tune : NULL );
+    r->tune->retired = ( prev != NULL ) ? prev->tune : NULL;
+    r->func_addr[0] = ( r->tune->num_providers > 0 ) ? r->tune->provider[r->tune->selected].func_addr : NULL;
+  } else {
+    func = get_func_proto( cpf, h->plugin_name, h->func_name, h->fproto, &p );
+    r->func_addr[0] = ( func != NULL ) ? func->func_addr : NULL;
+    if ( ( func != NULL ) && ( ( cpf->flags & CPF_FLAG_MEMOIZE ) != 0 ) ) {
+      r->memo_tag = memo_tag( p, func );
+    }
+    if ( ( r->ab = ab_find( cpf, h->plugin_name ) ) != NULL ) {
+      if ( ( r->func_addr[1] = ab_get_func_addr( r->ab, h->func_name, h->fproto ) ) == NULL ) {
+        LOG_INFO( "A/B candidate of \"%s\" cannot bind \"%s\": calls go to version A",
+                  h->plugin_name, h->func_name )
+        r->ab = NULL;
+      }
+    }
+  }
+  atomic_store_explicit( &h->res, r, memory_order_release );
+  pthread_mutex_unlock( &h->lock );
+  return r;
+}
+
+
+// per-thread xorshift32: the traffic split costs no shared cache line
+static inline uint32_t
+next_rnd( void )
+{
+  uint32_t x = rnd_state;
+
+
+  if ( x == 0 ) {
+    x = (uint32_t)(uintptr_t)&rnd_state ^ (uint32_t)time( NULL ) ^ 0x9e3779b9;
+  }
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  rnd_state = x;
+  return x;
+}
+
+
+static cpf_handle_t *
+new_handle( cpf_t ** cpf, char * plugin_name, char * func_name, enum func_prototype_t fproto )
+{
+  cpf_handle_t * h;
+  size_t         plen, flen;
+
+
+  plen = ( plugin_name != NULL ) ? strlen( plugin_name ) + 1 : 0;
+  flen = strlen( func_name ) + 1;
+  if ( ( h = (cpf_handle_t *)calloc( 1, sizeof( cpf_handle_t ) + plen + flen ) ) == NULL ) {
+    LOG_ERROR( "Cannot allocate memory for the function handle!" )
+    exit( EXIT_FAILURE );
+  }
+  h->cpf = cpf;
+  h->func_name = (char *)( h + 1 ) + plen;
+  if ( plugin_name != NULL ) {
+    h->plugin_name = (char *)( h + 1 );
+    memcpy( h->plugin_name, plugin_name, plen );
+  }
+  memcpy( h->func_name, func_name, flen );
+  h->fproto = fproto;
+  pthread_mutex_init( &h->lock, NULL );
+  resolve_handle( h );
+  return h;
+}
+
+
+/*
+ * Resolve "func_name" of "plugin_name" once. The handle follows the reloads
+ * (CPF_reload_libs()) and the A/B experiments (CPF_ab_load()) of "cpf".
+*/
+cpf_handle_t *
+CPF_resolve( cpf_t ** cpf,
+             char * plugin_name,
+             char * func_name,
+             enum func_prototype_t fproto )
+{
+  if ( ( cpf == NULL ) || ( (*cpf) == NULL ) || ( plugin_name == NULL ) || ( func_name == NULL ) ) {
+    LOG_ERROR( "CPF_resolve(): Parameters cannot be NULL!" )
+    return NULL;
+  }
+  if ( get_func_addr_proto( *cpf, plugin_name, func_name, fproto ) == NULL ) {
+    return NULL;
+  }
+  return new_handle( cpf, plugin_name, func_name, fproto );
+}
+
+
+/*
+ * Resolve "func_name" among all the loaded plugins exporting it: the calls are
+ * timed in exploration rounds and go to the fastest implementation in between
+ * (see tune.c). The providers are explored again after every reload.
+*/
+cpf_handle_t *
+CPF_resolve_tuned( cpf_t ** cpf, char * func_name, enum func_prototype_t fproto )
+{
+  cpf_handle_t * h;
+
+
+  if ( ( cpf == NULL ) || ( (*cpf) == NULL ) || ( func_name == NULL ) ) {
+    LOG_ERROR( "CPF_resolve_tuned(): Parameters cannot be NULL!" )
+    return NULL;
+  }
+  h = new_handle( cpf, NULL, func_name, fproto );
+  if ( atomic_load( &h->res )->func_addr[0] == NULL ) {
+    LOG_ERROR( "CPF_resolve_tuned(): No plugin exports \"%s\"!", func_name )
+    CPF_handle_free( &h );
+  }
+  return h;
+}
+
+
+// call through a resolved handle, "varglist" is consumed
+static void *
+call_handle( cpf_handle_t * h, handle_res_t * r, va_list varglist )
+{
+  fp_args_t         args;
+  struct cpf_ab   * ab;
+  struct timespec   t0, t1;
+  uint8_t           v = 0;
+  void            * ret;
+
+
+  if ( r->tune != NULL ) {
+    return tune_call( r->tune, h->fproto, varglist );
+  }
+  if ( ( r->memo_tag != 0 ) && ( r->ab == NULL ) ) {
+    memset( &args, 0, sizeof( args ) ); // the memoization key is all the bytes
+    CPF_wrapper_get_args( &args, h->fproto, varglist );
+    if ( memo_lookup( r->func_addr[0], r->memo_tag, &args, &ret ) == false ) {
+      ret = CPF_wrapper_call_func_by_args( r->func_addr[0], &args );
+      memo_store( r->func_addr[0], r->memo_tag, &args, ret );
+    }
+    return ret;
+  }
+  if ( ( ab = r->ab ) == NULL ) { // no experiment: no timing
+    return CPF_wrapper_call_func_by_addr( r->func_addr[0], h->fproto, varglist );
+  }
+  if ( ( next_rnd() % 100 ) < atomic_load_explicit( &ab->percent, memory_order_relaxed ) ) {
+    v = 1;
+  }
+  clock_gettime( CLOCK_MONOTONIC, &t0 );
+  ret = CPF_wrapper_call_func_by_addr( r->func_addr[v], h->fproto, varglist );
+  clock_gettime( CLOCK_MONOTONIC, &t1 );
+
+  ab_record( &ab->stats[v],
+             (uint64_t)( t1.tv_sec - t0.tv_sec ) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec );
+  last_handle = h;
+  last_stats = &ab->stats[v];
+  last_stamp = r->stamp;
+  return ret;
+}
+
+
+void *
+CPF_call_handle( cpf_handle_t * h, ... )
+{
+  va_list        varglist, record_args;
+  record_ctx_t   rec;
+  handle_res_t * r;
+  void         * ret;
+
+
+  if ( h == NULL ) {
+    LOG_ERROR( "CPF_call_handle(): handle cannot be NULL!" )
+    return NULL;
+  }
+  r = atomic_load_explicit( &h->res, memory_order_acquire );
+  if ( r->stamp != handle_stamp( *h->cpf ) ) {
+    r = resolve_handle( h );
+  }
+  if ( r->func_addr[0] == NULL ) {
+    return NULL;
+  }
+
+  USDT_PROBE3( call_entry, h->plugin_name, h->func_name, r->func_addr[0] );
+  va_start( varglist, h );
+  if ( RECORDING() ) { // the recorded latency is the one of the handle (A/B, tuning, memoization)
+    va_copy( record_args, varglist );
+    record_begin( &rec, ( h->plugin_name != NULL ) ? h->plugin_name : "", h->func_name, h->fproto, record_args );
+    va_end( record_args );
+    ret = call_handle( h, r, varglist );
+    record_end( &rec );
+  } else {
+    ret = call_handle( h, r, varglist );
+  }
+  va_end( varglist );
+  USDT_PROBE3( call_return, h->plugin_name, h->func_name, ret );
+  return ret;
+}
+
+
+// count the last call of this thread through "h" as an error (A/B statistics)
+void
+CPF_handle_report_error( cpf_handle_t * h )
+{
+  // the experiment may be gone if the registry changed since the call
+  if ( ( h != NULL ) && ( h == last_handle ) && ( last_stats != NULL ) &&
+       ( last_stamp == handle_stamp( *h->cpf ) ) ) {
+    atomic_fetch_add_explicit( &last_stats->errors, 1, memory_order_relaxed );
+    last_stats = NULL;
+  }
+}
+
+
+void
+CPF_handle_free( cpf_handle_t ** h )
+{
+  handle_res_t * r,
+               * retired;
+
+
+  if ( (*h) == NULL ) {
+    return;
+  }
+  pthread_mutex_destroy( &(*h)->lock );
+  r = atomic_load( &(*h)->res );
+  if ( r != NULL ) {
+    tune_free( &r->tune ); // the last tuning frees the retired ones
+  }
+  for ( ; r != NULL ; r = retired ) {
+    retired = r->retired;
+    FREE( r )
+  }
+  FREE( (*h) )
+}
+
+
+// tuning of the current resolution, NULL if "h" isn't tuned
+static struct cpf_tune *
+handle_tune( cpf_handle_t * h )
+{
+  return ( h != NULL ) ? atomic_load_explicit( &h->res, memory_order_acquire )->tune : NULL;
+}
+
+
+// plugin whose implementation a tuned handle calls, NULL if none
+const char *
+CPF_tune_selected( cpf_handle_t * h )
+{
+  struct cpf_tune * t = handle_tune( h );
+
+
+  if ( t == NULL ) {
+    return NULL;
+  }
+  return tune_selected( t );
+}
+
+
+// median latency of each provider in the last exploration round
+void
+CPF_tune_report( cpf_handle_t * h )
+{
+  struct cpf_tune * t = handle_tune( h );
+
+
+  if ( t == NULL ) {
+    LOG_ERROR( "CPF_tune_report(): Not a tuned handle!" )
+    return;
+  }
+  tune_report( t, h->func_name );
+}
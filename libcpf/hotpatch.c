@@ -0,0 +1,611 @@
+/*
+  libcpf - C Plugin Framework
+
+  hotpatch.c - redirect the old function entries to the reloaded plugin
+               (CPF_FLAG_HOT_PATCH)
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <link.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include "hotpatch.h"
+#include "log.h"
+
+
+typedef struct {                          // int3 being replaced by an instruction
+  uintptr_t site;
+  uintptr_t resume;                       // where the thread goes on
+} hotpatch_trap_t;
+
+typedef struct hotpatch_traps {           // sites of the last patch, read by the SIGTRAP handler
+  struct hotpatch_traps * _Atomic retired; // previous sites, freed by the next patch
+  uint32_t                num_traps;
+  hotpatch_trap_t         trap[];
+} hotpatch_traps_t;
+
+
+static hotpatch_traps_t * _Atomic current_traps = NULL;
+static _Atomic uint32_t           handler_epoch = 0;
+static _Atomic uint32_t           in_handler[2];    // handlers running, per epoch parity
+static pthread_mutex_t            poke_lock = PTHREAD_MUTEX_INITIALIZER; // hot patch and interceptors
+static pthread_once_t             membarrier_once = PTHREAD_ONCE_INIT;
+static struct sigaction           old_action;
+static bool                       handler_set = false;
+static bool                       membarrier_ok = false;
+
+
+/*
+ * SIGTRAP handler: a thread reached an int3 written over an instruction
+ * (function entry, static branch), before the new instruction was complete.
+ * The thread goes on where the new instruction would send it. The sites of
+ * the previous patch are searched too: a trap can be delivered late.
+*/
+static void
+trap_handler( int sig, siginfo_t * info, void * context )
+{
+  hotpatch_traps_t * t;
+  greg_t           * rip = &( (ucontext_t *)context )->uc_mcontext.gregs[REG_RIP];
+  uint32_t           epoch = atomic_load( &handler_epoch ) & 1,
+                     i;
+
+
+  // the trap sets read here are freed after the handlers of this epoch (see hotpatch_poke())
+  atomic_fetch_add( &in_handler[epoch], 1 );
+  for ( t = atomic_load( &current_traps ) ; t != NULL ; t = atomic_load( &t->retired ) ) {
+    for ( i = 0 ; i < t->num_traps ; i++ ) {
+      if ( t->trap[i].site + 1 == (uintptr_t)*rip ) {
+        *rip = (greg_t)t->trap[i].resume;
+        atomic_fetch_sub( &in_handler[epoch], 1 );
+        return;
+      }
+    }
+  }
+  atomic_fetch_sub( &in_handler[epoch], 1 );
+  // not a hot patch site
+  if ( ( old_action.sa_flags & SA_SIGINFO ) != 0 ) {
+    old_action.sa_sigaction( sig, info, context );
+  } else if ( old_action.sa_handler == SIG_DFL ) {
+    sigaction( SIGTRAP, &old_action, NULL );
+    raise( SIGTRAP );
+  } else if ( old_action.sa_handler != SIG_IGN ) {
+    old_action.sa_handler( sig );
+  }
+}
+
+
+// serialize the instruction stream of all the threads after a code change
+static void
+sync_cores( void )
+{
+  syscall( __NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE, 0 );
+}
+
+
+static void
+membarrier_register( void )
+{
+  membarrier_ok = ( syscall( __NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE, 0 ) == 0 );
+  if ( membarrier_ok == false ) {
+    LOG_INFO( "Hot patch: no core serializing membarrier (Linux 4.16 or later), the code is not patched" )
+  }
+}
+
+
+/*
+ * Can the code be patched while other threads run it? A memory barrier
+ * doesn't flush the instruction stream of the other cores: without the core
+ * serializing membarrier, a core could run a stale or partial instruction.
+*/
+bool
+hotpatch_supported( void )
+{
+  pthread_once( &membarrier_once, membarrier_register );
+  return membarrier_ok;
+}
+
+
+static bool
+protect_code( uint8_t * addr, size_t len, int prot )
+{
+  uintptr_t page_size = (uintptr_t)sysconf( _SC_PAGESIZE );
+  uintptr_t start = (uintptr_t)addr & ~( page_size - 1 );
+
+
+  return ( mprotect( (void *)start, (uintptr_t)addr + len - start, prot ) == 0 );
+}
+
+
+// 5-byte NOP at the entry of the function, NULL if not patchable
+static uint8_t *
+entry_site( void * func_addr, const char * nop )
+{
+  uint8_t * c = (uint8_t *)func_addr;
+
+
+  if ( memcmp( c, HOTPATCH_ENDBR64, sizeof( HOTPATCH_ENDBR64 ) - 1 ) == 0 ) {
+    c += sizeof( HOTPATCH_ENDBR64 ) - 1;
+  }
+  return ( memcmp( c, nop, HOTPATCH_JMP_SIZE ) == 0 ) ? c : NULL;
+}
+
+
+// file offset of "vaddr" in an executable segment, 0 if none
+static size_t
+text_offset( const ElfW(Ehdr) * ehdr, size_t len, ElfW(Addr) vaddr )
+{
+  const ElfW(Phdr) * phdr = (const ElfW(Phdr) *)( (const uint8_t *)ehdr + ehdr->e_phoff );
+  uint16_t           i;
+
+
+  for ( i = 0 ; i < ehdr->e_phnum ; i++ ) {
+    if ( ( phdr[i].p_type == PT_LOAD ) && ( ( phdr[i].p_flags & PF_X ) != 0 ) &&
+         ( vaddr >= phdr[i].p_vaddr ) &&
+         ( vaddr + HOTPATCH_JMP_SIZE + sizeof( HOTPATCH_ENDBR64 ) - 1 <= phdr[i].p_vaddr + phdr[i].p_filesz ) &&
+         ( phdr[i].p_offset + phdr[i].p_filesz <= len ) ) {
+      return vaddr - phdr[i].p_vaddr + phdr[i].p_offset;
+    }
+  }
+  return 0;
+}
+
+
+/*
+ * Plugin image in the memfd "fd", not mapped by dlopen() yet: merge the
+ * padding NOPs of the exported function entries into one instruction. No
+ * plugin code has run, not even its ELF constructors, so no thread can be in
+ * the middle of the padding.
+*/
+void
+hotpatch_prepare( int fd, const char * plugin_name )
+{
+  struct stat        st;
+  uint8_t          * image;
+  const ElfW(Ehdr) * ehdr;
+  const ElfW(Shdr) * shdr;
+  const ElfW(Sym)  * sym;
+  size_t             off,
+                     num_syms;
+  uint16_t           i;
+
+
+  if ( ( fstat( fd, &st ) == -1 ) || ( (size_t)st.st_size < sizeof( ElfW(Ehdr) ) ) ||
+       ( ( image = mmap( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 ) ) == MAP_FAILED ) ) {
+    LOG_ERROR( "Hot patch: cannot map the image of \"%s\"!", plugin_name )
+    return;
+  }
+  ehdr = (const ElfW(Ehdr) *)image;
+  if ( ( ehdr->e_shoff == 0 ) ||
+       ( ehdr->e_shoff + (size_t)ehdr->e_shnum * sizeof( ElfW(Shdr) ) > (size_t)st.st_size ) ||
+       ( ehdr->e_phoff + (size_t)ehdr->e_phnum * sizeof( ElfW(Phdr) ) > (size_t)st.st_size ) ) {
+    LOG_INFO( "Hot patch: \"%s\" has no section headers, entries not prepared", plugin_name )
+    munmap( image, st.st_size );
+    return;
+  }
+  shdr = (const ElfW(Shdr) *)( image + ehdr->e_shoff );
+  for ( i = 0 ; i < ehdr->e_shnum ; i++ ) {
+    if ( ( shdr[i].sh_type != SHT_DYNSYM ) ||
+         ( shdr[i].sh_offset + shdr[i].sh_size > (size_t)st.st_size ) ) {
+      continue;
+    }
+    sym = (const ElfW(Sym) *)( image + shdr[i].sh_offset );
+    for ( num_syms = shdr[i].sh_size / sizeof( ElfW(Sym) ) ; num_syms > 0 ; num_syms--, sym++ ) {
+      if ( ( ELF64_ST_TYPE( sym->st_info ) != STT_FUNC ) || ( sym->st_shndx == SHN_UNDEF ) ||
+           ( ( off = text_offset( ehdr, st.st_size, sym->st_value ) ) == 0 ) ) {
+        continue;
+      }
+      if ( memcmp( image + off, HOTPATCH_ENDBR64, sizeof( HOTPATCH_ENDBR64 ) - 1 ) == 0 ) {
+        off += sizeof( HOTPATCH_ENDBR64 ) - 1;
+      }
+      if ( memcmp( image + off, HOTPATCH_PAD, HOTPATCH_JMP_SIZE ) == 0 ) {
+        memcpy( image + off, HOTPATCH_NOP, HOTPATCH_JMP_SIZE );
+      }
+    }
+  }
+  munmap( image, st.st_size );
+}
+
+
+static bool
+in_range( uintptr_t region, size_t size, uintptr_t lo, uintptr_t hi )
+{
+  int64_t d1 = (int64_t)( region + size ) - (int64_t)lo;
+  int64_t d2 = (int64_t)( hi + HOTPATCH_JMP_SIZE ) - (int64_t)region;
+
+
+  return ( ( d1 < INT32_MAX ) && ( d1 > -INT32_MAX ) && ( d2 < INT32_MAX ) && ( d2 > -INT32_MAX ) );
+}
+
+
+// trampoline region within a rel32 jump of all the sites in [lo, hi]
+static uint8_t *
+alloc_near( uintptr_t lo, uintptr_t hi, size_t size )
+{
+  uintptr_t hint;
+  void    * region;
+  uint32_t  i;
+
+
+  for ( i = 0 ; i < HOTPATCH_NEAR_TRIES ; i++ ) {
+    if ( i % 2 == 0 ) { // below the code, then above
+      hint = ( lo & ~( HOTPATCH_NEAR_STEP - 1 ) ) - ( i / 2 + 1 ) * HOTPATCH_NEAR_STEP;
+      if ( hint > lo ) {
+        continue;
+      }
+    } else {
+      hint = ( ( hi + HOTPATCH_NEAR_STEP ) & ~( HOTPATCH_NEAR_STEP - 1 ) ) + ( i / 2 ) * HOTPATCH_NEAR_STEP;
+    }
+    region = mmap( (void *)hint, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if ( region == MAP_FAILED ) {
+      continue;
+    }
+    if ( in_range( (uintptr_t)region, size, lo, hi ) == true ) {
+      return (uint8_t *)region;
+    }
+    munmap( region, size );
+  }
+  return NULL;
+}
+
+
+// address of "func_name" in the current version, the old code if gone
+static uintptr_t
+site_target( plugin_t * p, hotpatch_site_t * s )
+{
+  func_t * f;
+
+
+  for ( f = p->lib_func ; ( f != NULL ) && ( f->func_addr != NULL ) ; f++ ) {
+    if ( ( f->func_name != NULL ) && ( strcmp( f->func_name, s->func_name ) == 0 ) ) {
+      return (uintptr_t)f->func_addr;
+    }
+  }
+  return (uintptr_t)s->site + HOTPATCH_JMP_SIZE;
+}
+
+
+/*
+ * Write the 5-byte instructions of "poke" over the ones of their sites, through
+ * an int3: a thread reaching a site while it's written is sent to its "resume"
+ * address by trap_handler(), and never runs a partial instruction. The code
+ * pages are writable only for the time of the patch.
+*/
+bool
+hotpatch_poke( hotpatch_poke_t * poke, uint32_t num_pokes )
+{
+  struct sigaction   action;
+  hotpatch_traps_t * t, * old, * older;
+  uint32_t           i, j, epoch;
+
+
+  if ( num_pokes == 0 ) {
+    return true;
+  }
+  if ( hotpatch_supported() == false ) {
+    return false;
+  }
+  pthread_mutex_lock( &poke_lock );
+  for ( i = 0 ; i < num_pokes ; i++ ) {
+    if ( protect_code( poke[i].site, HOTPATCH_JMP_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC ) == false ) {
+      LOG_ERROR( "Cannot patch the code: mprotect() failed!" )
+      for ( j = 0 ; j < i ; j++ ) {
+        protect_code( poke[j].site, HOTPATCH_JMP_SIZE, PROT_READ | PROT_EXEC );
+      }
+      pthread_mutex_unlock( &poke_lock );
+      return false;
+    }
+  }
+  t = (hotpatch_traps_t *)malloc( sizeof( hotpatch_traps_t ) + num_pokes * sizeof( hotpatch_trap_t ) );
+  if ( t == NULL ) {
+    LOG_ERROR( "Cannot allocate memory for the hot patch!" )
+    exit( EXIT_FAILURE );
+  }
+  t->num_traps = num_pokes;
+  for ( i = 0 ; i < num_pokes ; i++ ) {
+    t->trap[i].site = (uintptr_t)poke[i].site;
+    t->trap[i].resume = poke[i].resume;
+  }
+  /*
+   * Only the sites of the previous patch are kept: the older ones are
+   * unlinked, then freed once the handlers that could have reached them are
+   * done (same grace period as the profiler index, see profile.c).
+  */
+  old = atomic_load( &current_traps );
+  atomic_init( &t->retired, old );
+  atomic_store( &current_traps, t );
+  if ( ( old != NULL ) && ( ( older = atomic_exchange( &old->retired, NULL ) ) != NULL ) ) {
+    epoch = atomic_fetch_add( &handler_epoch, 1 ) & 1;
+    while ( atomic_load( &in_handler[epoch] ) != 0 ) {
+      sched_yield();
+    }
+    FREE( older )
+  }
+
+  if ( handler_set == false ) {
+    memset( &action, 0, sizeof( action ) );
+    action.sa_sigaction = trap_handler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset( &action.sa_mask );
+    if ( sigaction( SIGTRAP, &action, &old_action ) == -1 ) {
+      LOG_ERROR( "Hot patch: sigaction() failed!" )
+      exit( EXIT_FAILURE );
+    }
+    handler_set = true; // kept: a late trap must still be redirected
+  }
+
+  for ( i = 0 ; i < num_pokes ; i++ ) {
+    __atomic_store_n( poke[i].site, 0xcc, __ATOMIC_RELEASE );
+  }
+  sync_cores();
+  for ( i = 0 ; i < num_pokes ; i++ ) {
+    memcpy( poke[i].site + 1, poke[i].insn + 1, HOTPATCH_JMP_SIZE - 1 );
+  }
+  sync_cores();
+  for ( i = 0 ; i < num_pokes ; i++ ) {
+    __atomic_store_n( poke[i].site, poke[i].insn[0], __ATOMIC_RELEASE );
+  }
+  sync_cores();
+
+  for ( i = 0 ; i < num_pokes ; i++ ) {
+    protect_code( poke[i].site, HOTPATCH_JMP_SIZE, PROT_READ | PROT_EXEC );
+  }
+  pthread_mutex_unlock( &poke_lock );
+  return true;
+}
+
+
+/*
+ * Write the 5-byte instructions of "poke" as is: only while no other thread
+ * can run the code of the sites (e.g. the ELF constructor of the library).
+*/
+bool
+hotpatch_write( hotpatch_poke_t * poke, uint32_t num_pokes )
+{
+  uint32_t i;
+  bool     ret = true;
+
+
+  for ( i = 0 ; i < num_pokes ; i++ ) {
+    if ( protect_code( poke[i].site, HOTPATCH_JMP_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC ) == false ) {
+      LOG_ERROR( "Cannot patch the code: mprotect() failed!" )
+      ret = false;
+      continue;
+    }
+    memcpy( poke[i].site, poke[i].insn, HOTPATCH_JMP_SIZE );
+    protect_code( poke[i].site, HOTPATCH_JMP_SIZE, PROT_READ | PROT_EXEC );
+  }
+  return ret;
+}
+
+
+// replace the NOPs of the sites by a jump to their trampolines
+static bool
+patch_sites( struct cpf_hotpatch * h )
+{
+  hotpatch_poke_t * poke;
+  int32_t           rel;
+  uint32_t          i;
+  bool              ret;
+
+
+  if ( ( poke = (hotpatch_poke_t *)malloc( h->num_sites * sizeof( hotpatch_poke_t ) ) ) == NULL ) {
+    LOG_ERROR( "Cannot allocate memory for the hot patch!" )
+    exit( EXIT_FAILURE );
+  }
+  for ( i = 0 ; i < h->num_sites ; i++ ) {
+    rel = (int32_t)( (intptr_t)h->site[i].tramp - (intptr_t)( h->site[i].site + HOTPATCH_JMP_SIZE ) );
+    poke[i].site = h->site[i].site;
+    poke[i].insn[0] = 0xe9;               // jmp rel32
+    memcpy( poke[i].insn + 1, &rel, sizeof( rel ) );
+    poke[i].resume = (uintptr_t)h->site[i].tramp;
+  }
+  if ( ( ret = hotpatch_poke( poke, h->num_sites ) ) == false ) {
+    LOG_ERROR( "Hot patch: cannot patch \"%s\"!", h->plugin_name )
+  }
+  FREE( poke )
+  return ret;
+}
+
+
+static int
+site_comparator( const void * a, const void * b )
+{
+  const hotpatch_site_t * sa = (const hotpatch_site_t *)a;
+  const hotpatch_site_t * sb = (const hotpatch_site_t *)b;
+
+
+  return ( sa->site > sb->site ) - ( sa->site < sb->site );
+}
+
+
+static void
+free_record( struct cpf_hotpatch * h )
+{
+  uint32_t i;
+
+
+  for ( i = 0 ; i < h->num_sites ; i++ ) {
+    FREE( h->site[i].func_name )
+  }
+  if ( h->region != NULL ) {
+    munmap( h->region, h->region_size );
+  }
+  FREE( h )
+}
+
+
+/*
+ * "prev" is replaced by "p": redirect the function entries of "prev", and of
+ * its retired versions, to "p". On success, the mapping of "prev" is kept
+ * until CPF_free() (prev->dlhandle is taken): the cached pointers can still
+ * reach it. False if nothing could be patched, "prev" is closed as usual.
+*/
+bool
+hotpatch_retire( cpf_t * cpf, plugin_t * prev, plugin_t * p )
+{
+  struct cpf_hotpatch * h, * r;
+  func_t              * f;
+  uint8_t             * site;
+  size_t                page_size = (size_t)sysconf( _SC_PAGESIZE ),
+                        code_size;
+  uint32_t              num_funcs = 0,
+                        i, n;
+
+
+  if ( prev->dlhandle == p->dlhandle ) { // same mapping: the entries would jump to themselves
+    return false;
+  }
+  // the sites are matched by name in the new version: the unnamed functions are skipped
+  for ( f = prev->lib_func ; ( f != NULL ) && ( f->func_addr != NULL ) ; f++ ) {
+    if ( f->func_name != NULL ) {
+      num_funcs++;
+    }
+  }
+  h = (struct cpf_hotpatch *)calloc( 1, sizeof( struct cpf_hotpatch ) + num_funcs * sizeof( hotpatch_site_t ) );
+  if ( h == NULL ) {
+    LOG_ERROR( "Cannot allocate memory for the hot patch!" )
+    exit( EXIT_FAILURE );
+  }
+  snprintf( h->plugin_name, sizeof( h->plugin_name ), "%s", prev->name );
+  for ( f = prev->lib_func ; ( f != NULL ) && ( f->func_addr != NULL ) ; f++ ) {
+    if ( ( f->func_name != NULL ) && ( ( site = entry_site( f->func_addr, HOTPATCH_NOP ) ) != NULL ) ) {
+      h->site[h->num_sites].site = site;
+      if ( ( h->site[h->num_sites].func_name = strdup( f->func_name ) ) == NULL ) {
+        LOG_ERROR( "Cannot allocate memory for the hot patch!" )
+        exit( EXIT_FAILURE );
+      }
+      h->num_sites++;
+    }
+  }
+  if ( h->num_sites < num_funcs ) {
+    LOG_INFO( "Hot patch: %u of %u functions of \"%s\" without patchable entry "
+              "(-fpatchable-function-entry=5)",
+              num_funcs - h->num_sites, num_funcs, prev->name )
+  }
+  if ( h->num_sites == 0 ) {
+    free_record( h );
+    return false;
+  }
+  // aliases: one site per address
+  qsort( h->site, h->num_sites, sizeof( hotpatch_site_t ), site_comparator );
+  for ( i = 1, n = 1 ; i < h->num_sites ; i++ ) {
+    if ( h->site[i].site == h->site[n - 1].site ) {
+      FREE( h->site[i].func_name )
+    } else {
+      h->site[n++] = h->site[i];
+    }
+  }
+  h->num_sites = n;
+
+  code_size = ( h->num_sites * HOTPATCH_TRAMP_SIZE + page_size - 1 ) & ~( page_size - 1 );
+  h->region_size = 2 * code_size;
+  if ( ( h->region = alloc_near( (uintptr_t)h->site[0].site,
+                                 (uintptr_t)h->site[h->num_sites - 1].site,
+                                 h->region_size ) ) == NULL ) {
+    LOG_ERROR( "Hot patch: no room for the trampolines of \"%s\"!", prev->name )
+    free_record( h );
+    return false;
+  }
+  for ( i = 0 ; i < h->num_sites ; i++ ) {
+    h->site[i].tramp = h->region + i * HOTPATCH_TRAMP_SIZE;
+    h->site[i].slot = (_Atomic uintptr_t *)( h->region + code_size + i * sizeof( uintptr_t ) );
+    atomic_store_explicit( h->site[i].slot, site_target( p, &h->site[i] ), memory_order_relaxed );
+    // notrack jmp *slot(%rip): the target can be a site + 5 (no endbr64)
+    memcpy( h->site[i].tramp, "\x3e\xff\x25", 3 );
+    *(int32_t *)( h->site[i].tramp + 3 ) =
+      (int32_t)( (uint8_t *)h->site[i].slot - ( h->site[i].tramp + 7 ) );
+    h->site[i].tramp[7] = 0xcc;
+  }
+  if ( ( mprotect( h->region, code_size, PROT_READ | PROT_EXEC ) == -1 ) ||
+       ( patch_sites( h ) == false ) ) {
+    free_record( h );
+    return false;
+  }
+
+  // the older versions jump to "p" directly
+  for ( r = cpf->hotpatch ; r != NULL ; r = r->next ) {
+    if ( strcmp( r->plugin_name, prev->name ) == 0 ) {
+      for ( i = 0 ; i < r->num_sites ; i++ ) {
+        atomic_store_explicit( r->site[i].slot, site_target( p, &r->site[i] ), memory_order_release );
+      }
+    }
+  }
+  h->dlhandle = prev->dlhandle;
+  h->memfd = prev->memfd;
+  prev->dlhandle = NULL;
+  prev->memfd = 0;
+  h->next = cpf->hotpatch;
+  cpf->hotpatch = h;
+  return true;
+}
+
+
+/*
+ * The plugin "plugin_name" is closed (all the plugins if NULL): its retired
+ * versions run their own code again.
+*/
+void
+hotpatch_unlink( cpf_t * cpf, const char * plugin_name )
+{
+  struct cpf_hotpatch * h;
+  uint32_t              i;
+
+
+  for ( h = cpf->hotpatch ; h != NULL ; h = h->next ) {
+    if ( ( plugin_name == NULL ) || ( strcmp( h->plugin_name, plugin_name ) == 0 ) ) {
+      for ( i = 0 ; i < h->num_sites ; i++ ) {
+        atomic_store_explicit( h->site[i].slot,
+                               (uintptr_t)h->site[i].site + HOTPATCH_JMP_SIZE,
+                               memory_order_release );
+      }
+    }
+  }
+}
+
+
+void
+hotpatch_free( cpf_t * cpf )
+{
+  struct cpf_hotpatch * h;
+
+
+  while ( ( h = cpf->hotpatch ) != NULL ) {
+    cpf->hotpatch = h->next;
+    if ( h->dlhandle != NULL ) {
+      dlclose( h->dlhandle );
+    }
+    if ( h->memfd > 0 ) {
+      close( h->memfd );
+    }
+    free_record( h );
+  }
+}
@@ -0,0 +1,76 @@
+/*
+  libcpf - C Plugin Framework
+
+  hotpatch.h - header file
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __HOTPATCH_H__
+#define __HOTPATCH_H__
+
+#include <stdatomic.h>
+#include "cpf.h"
+
+/*
+ * Patchable function entry (plugins built with -fpatchable-function-entry=5):
+ * the five 1-byte NOPs of gcc are merged into one 5-byte NOP in the memfd
+ * image, before dlopen(), so a thread is never in the middle of the patched
+ * bytes. When
+ * the plugin is replaced, the NOP becomes a "jmp rel32" to a trampoline near
+ * the old code, which jumps through a slot to the new version of the function.
+*/
+#define HOTPATCH_PAD            "\x90\x90\x90\x90\x90"         // gcc padding
+#define HOTPATCH_NOP            "\x0f\x1f\x44\x00\x00"         // nopl 0x0(%rax,%rax,1)
+#define HOTPATCH_ENDBR64        "\xf3\x0f\x1e\xfa"
+#define HOTPATCH_JMP_SIZE       5
+#define HOTPATCH_TRAMP_SIZE     8         // notrack jmp *slot(%rip) + int3
+#define HOTPATCH_NEAR_STEP      ( 1UL << 20 ) // trampoline placement tries, around the old code
+#define HOTPATCH_NEAR_TRIES     1024
+
+
+typedef struct {                          // entry of a function of a retired version
+  char               * func_name;
+  uint8_t            * site;              // the 5-byte NOP, then the jump
+  uint8_t            * tramp;
+  _Atomic uintptr_t  * slot;              // target: the current version, or site + 5
+} hotpatch_site_t;
+
+typedef struct {                          // 5-byte instruction written by hotpatch_poke()
+  uint8_t            * site;
+  uint8_t              insn[HOTPATCH_JMP_SIZE];
+  uintptr_t            resume;            // next instruction of a thread reaching the site meanwhile
+} hotpatch_poke_t;
+
+struct cpf_hotpatch {                     // retired version of a plugin, kept mapped
+  struct cpf_hotpatch * next;
+  char                  plugin_name[MAX_PLUGIN_NAME_SIZE];
+  void                * dlhandle;
+  int                   memfd;            // 0 = none
+  uint8_t             * region;           // trampolines, then slots
+  size_t                region_size;
+  uint32_t              num_sites;
+  hotpatch_site_t       site[];
+};
+
+bool hotpatch_supported( void );
+void hotpatch_prepare( int fd, const char * plugin_name );
+bool hotpatch_poke( hotpatch_poke_t * poke, uint32_t num_pokes );
+bool hotpatch_write( hotpatch_poke_t * poke, uint32_t num_pokes );
+bool hotpatch_retire( cpf_t * cpf, plugin_t * prev, plugin_t * p );
+void hotpatch_unlink( cpf_t * cpf, const char * plugin_name );
+void hotpatch_free( cpf_t * cpf );
+
+#endif
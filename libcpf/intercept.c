@@ -0,0 +1,434 @@
+/*
+  libcpf - C Plugin Framework
+
+  intercept.c - call interceptors (tracing, fault injection, argument rewriting)
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpf.h"
+#include "hotpatch.h"
+#include "intercept.h"
+
+#define INTERCEPT_SNAPSHOT      16        // interceptors of a call kept on the stack
+
+
+struct cpf_interceptor {
+  cpf_interceptor_t   * next;
+  cpf_interceptor_t   * prev;
+  cpf_t              ** cpf;              // re-resolved when the registry generation changes
+  char                * plugin_name;      // stored after the struct
+  char                * func_name;        // stored after the struct
+  cpf_intercept_cb_t    pre;
+  cpf_intercept_cb_t    post;
+  void                * user_data;
+  bool                  enabled;
+  pthread_mutex_t       lock;             // serializes the re-resolution and the puts
+  _Atomic uint64_t      stamp;            // ( generation << 1 ) | 1 when resolved
+  void                * func_addr;
+  _Atomic uint32_t      refs;             // calls running the callbacks
+  pthread_cond_t        idle;             // refs == 0, waited by CPF_intercept_free()
+};
+
+
+// interceptors in add order: the list is read by the calls, changed under the
+// write lock. The callbacks run without the lock, on a snapshot of the list.
+static pthread_rwlock_t    list_lock = PTHREAD_RWLOCK_INITIALIZER;
+static cpf_interceptor_t * head = NULL,
+                         * tail = NULL;
+static uint32_t            num_enabled = 0;
+
+#if defined(__x86_64__)
+extern static_branch_t __start_cpf_static_branch[];
+extern static_branch_t __stop_cpf_static_branch[];
+static bool            branch_fixed = false; // the static branches always jump, to the flag test
+#endif
+bool                   intercept_enabled = false;
+
+
+static inline uint64_t
+interceptor_stamp( cpf_t * cpf )
+{
+  return ( (uint64_t)cpf->generation << 1 ) | 1;
+}
+
+
+static void *
+interceptor_addr( cpf_interceptor_t * i )
+{
+  cpf_t * cpf = *i->cpf;
+
+
+  if ( atomic_load_explicit( &i->stamp, memory_order_acquire ) != interceptor_stamp( cpf ) ) {
+    pthread_mutex_lock( &i->lock );
+    if ( atomic_load_explicit( &i->stamp, memory_order_relaxed ) != interceptor_stamp( cpf ) ) {
+      i->func_addr = CPF_get_func_addr( cpf, i->plugin_name, i->func_name );
+      atomic_store_explicit( &i->stamp, interceptor_stamp( cpf ), memory_order_release );
+    }
+    pthread_mutex_unlock( &i->lock );
+  }
+  return i->func_addr;
+}
+
+
+static inline bool
+interceptor_match( cpf_interceptor_t * i, void * func_addr )
+{
+  return ( __atomic_load_n( &i->enabled, __ATOMIC_RELAXED ) == true ) &&
+         ( interceptor_addr( i ) == func_addr );
+}
+
+
+#if defined(__x86_64__)
+// instructions of the static branches: jmp to the interceptors (on) or NOP
+static hotpatch_poke_t *
+static_branch_pokes( bool on, uint32_t * num_pokes )
+{
+  static_branch_t * b;
+  hotpatch_poke_t * poke;
+  uint32_t          n = 0;
+  int32_t           rel;
+
+
+  if ( ( poke = (hotpatch_poke_t *)malloc( ( __stop_cpf_static_branch - __start_cpf_static_branch ) *
+                                           sizeof( hotpatch_poke_t ) ) ) == NULL ) {
+    LOG_ERROR( "Cannot allocate memory to patch the call path!" )
+    exit( EXIT_FAILURE );
+  }
+  for ( b = __start_cpf_static_branch ; b < __stop_cpf_static_branch ; b++, n++ ) {
+    poke[n].site = (uint8_t *)b->code;
+    if ( on == true ) {
+      rel = (int32_t)( b->target - ( b->code + HOTPATCH_JMP_SIZE ) );
+      poke[n].insn[0] = 0xe9;             // jmp rel32
+      memcpy( poke[n].insn + 1, &rel, sizeof( rel ) );
+      poke[n].resume = b->target;
+    } else {
+      memcpy( poke[n].insn, HOTPATCH_NOP, HOTPATCH_JMP_SIZE );
+      poke[n].resume = b->code + HOTPATCH_JMP_SIZE;
+    }
+  }
+  *num_pokes = n;
+  return poke;
+}
+
+
+/*
+ * Without the core serializing membarrier, the static branches can't be
+ * patched while the call path runs (see hotpatch_supported()). They are
+ * turned into jumps once, when libcpf is loaded: no thread can run its code
+ * yet. The calls then test the flag in intercept_call().
+*/
+__attribute__((constructor)) static void
+static_branch_setup( void )
+{
+  hotpatch_poke_t * poke;
+  uint32_t          n;
+
+
+  if ( ( ( __stop_cpf_static_branch - __start_cpf_static_branch ) == 0 ) || ( hotpatch_supported() == true ) ) {
+    return;
+  }
+  poke = static_branch_pokes( true, &n );
+  branch_fixed = hotpatch_write( poke, n );
+  FREE( poke )
+}
+#endif
+
+
+/*
+ * Turn the static branches on (jmp to the interceptors) or off (NOP), with the
+ * int3 sequence of the hot patch (hotpatch_poke()): a thread running the call
+ * path meanwhile takes the branch, or not, but never a partial instruction.
+ * The code pages are made writable for the time of the patch: a system that
+ * forbids writable code (W^X) refuses it. Without code patching, the flag
+ * tested by the call path is set.
+*/
+static int
+patch_static_branches( bool on )
+{
+#if defined(__x86_64__)
+  hotpatch_poke_t * poke;
+  uint32_t          n;
+  int               ret = 0;
+
+
+  if ( ( __stop_cpf_static_branch - __start_cpf_static_branch ) == 0 ) {
+    return 0;
+  }
+  if ( hotpatch_supported() == false ) {
+    if ( branch_fixed == false ) {
+      LOG_ERROR( "Cannot patch the call path!" )
+      return -1;
+    }
+    __atomic_store_n( &intercept_enabled, on, __ATOMIC_RELEASE );
+    return 0;
+  }
+  poke = static_branch_pokes( on, &n );
+  if ( hotpatch_poke( poke, n ) == false ) {
+    LOG_ERROR( "Cannot patch the call path!" )
+    ret = -1;
+  }
+  FREE( poke )
+  return ret;
+#else
+  __atomic_store_n( &intercept_enabled, on, __ATOMIC_RELEASE );
+  return 0;
+#endif
+}
+
+
+/*
+ * End of a call running the callbacks of "i". The last reference is dropped
+ * under the lock: CPF_intercept_free() can't see refs == 0 and free "i" before
+ * this call is done with it.
+*/
+static void
+interceptor_put( cpf_interceptor_t * i )
+{
+  pthread_mutex_lock( &i->lock );
+  if ( atomic_fetch_sub( &i->refs, 1 ) == 1 ) {
+    pthread_cond_broadcast( &i->idle );
+  }
+  pthread_mutex_unlock( &i->lock );
+}
+
+
+/*
+ * Slow path of CPF_wrapper_call_func_by_args(), taken while an interceptor is
+ * enabled. The matching interceptors are referenced under the read lock, and
+ * their callbacks run without it: a callback can take as long as it needs, or
+ * call an intercepted function, without blocking the interceptor changes.
+*/
+void *
+intercept_call( void * func_addr, fp_args_t * args )
+{
+  cpf_interceptor_t * snapshot[INTERCEPT_SNAPSHOT],
+                   ** match = snapshot,
+                   ** grown,
+                    * i;
+  cpf_call_t          call;
+  uint32_t            num_match = 0,
+                      size = INTERCEPT_SNAPSHOT,
+                      n;
+
+
+#if defined(__x86_64__)
+  if ( ( branch_fixed == true ) && ( __atomic_load_n( &intercept_enabled, __ATOMIC_ACQUIRE ) == false ) ) {
+    return CPF_wrapper_call_func_direct( func_addr, args );
+  }
+#endif
+  pthread_rwlock_rdlock( &list_lock );
+  for ( i = head ; i != NULL ; i = i->next ) {
+    if ( interceptor_match( i, func_addr ) == false ) {
+      continue;
+    }
+    if ( num_match == size ) {
+      size *= 2;
+      if ( ( grown = (cpf_interceptor_t **)malloc( size * sizeof( cpf_interceptor_t * ) ) ) == NULL ) {
+        LOG_ERROR( "Cannot allocate memory for the interceptors!" )
+        exit( EXIT_FAILURE );
+      }
+      memcpy( grown, match, num_match * sizeof( cpf_interceptor_t * ) );
+      if ( match != snapshot ) {
+        free( match );
+      }
+      match = grown;
+    }
+    atomic_fetch_add( &i->refs, 1 );
+    match[num_match++] = i;
+  }
+  pthread_rwlock_unlock( &list_lock );
+  if ( num_match == 0 ) {
+    return CPF_wrapper_call_func_direct( func_addr, args );
+  }
+
+  memset( &call, 0, sizeof( call ) );
+  call.plugin_name = match[0]->plugin_name;
+  call.func_name = match[0]->func_name;
+  call.func_addr = func_addr;
+  call.args = args;
+  for ( n = 0 ; n < num_match ; n++ ) {
+    i = match[n];
+    if ( ( i->pre != NULL ) && ( __atomic_load_n( &i->enabled, __ATOMIC_RELAXED ) == true ) ) {
+      i->pre( &call, i->user_data );
+    }
+  }
+  if ( call.skip == false ) {
+    call.ret = CPF_wrapper_call_func_direct( func_addr, args );
+  }
+  for ( n = num_match ; n-- > 0 ; ) {
+    i = match[n];
+    if ( ( i->post != NULL ) && ( __atomic_load_n( &i->enabled, __ATOMIC_RELAXED ) == true ) ) {
+      i->post( &call, i->user_data );
+    }
+    interceptor_put( i );
+  }
+  if ( match != snapshot ) {
+    free( match );
+  }
+  return call.ret;
+}
+
+
+// fork(): no call is running the interceptors (see atfork.c)
+void
+intercept_lock( void )
+{
+  pthread_rwlock_wrlock( &list_lock );
+}
+
+
+void
+intercept_unlock( void )
+{
+  pthread_rwlock_unlock( &list_lock );
+}
+
+
+// fork() child: the write lock can't be released by the child thread, and
+// the calls of the other threads don't exist in the child
+void
+intercept_lock_reset( void )
+{
+  cpf_interceptor_t * i;
+
+
+  pthread_rwlock_init( &list_lock, NULL );
+  for ( i = head ; i != NULL ; i = i->next ) {
+    atomic_store( &i->refs, 0 );
+    pthread_mutex_init( &i->lock, NULL );
+    pthread_cond_init( &i->idle, NULL );
+  }
+}
+
+
+/*
+ * Intercept the calls to "func_name" of "plugin_name", by name, offset, address,
+ * handle, or from the executor and the pipelines. "pre" is called before the
+ * function and "post" after it (both can be NULL). The interceptor is enabled.
+*/
+cpf_interceptor_t *
+CPF_intercept( cpf_t ** cpf,
+               char * plugin_name,
+               char * func_name,
+               cpf_intercept_cb_t pre,
+               cpf_intercept_cb_t post,
+               void * user_data )
+{
+  cpf_interceptor_t * i;
+  size_t              plen, flen;
+
+
+  if ( ( cpf == NULL ) || ( (*cpf) == NULL ) || ( plugin_name == NULL ) || ( func_name == NULL ) ) {
+    LOG_ERROR( "CPF_intercept(): Parameters cannot be NULL!" )
+    return NULL;
+  }
+  if ( CPF_get_func_addr( *cpf, plugin_name, func_name ) == NULL ) {
+    return NULL;
+  }
+  plen = strlen( plugin_name ) + 1;
+  flen = strlen( func_name ) + 1;
+  if ( ( i = (cpf_interceptor_t *)calloc( 1, sizeof( cpf_interceptor_t ) + plen + flen ) ) == NULL ) {
+    LOG_ERROR( "CPF_intercept(): Cannot allocate memory!" )
+    exit( EXIT_FAILURE );
+  }
+  i->cpf = cpf;
+  i->plugin_name = (char *)( i + 1 );
+  i->func_name = i->plugin_name + plen;
+  memcpy( i->plugin_name, plugin_name, plen );
+  memcpy( i->func_name, func_name, flen );
+  i->pre = pre;
+  i->post = post;
+  i->user_data = user_data;
+  pthread_mutex_init( &i->lock, NULL );
+  pthread_cond_init( &i->idle, NULL );
+
+  pthread_rwlock_wrlock( &list_lock );
+  i->prev = tail;
+  if ( tail != NULL ) {
+    tail->next = i;
+  } else {
+    head = i;
+  }
+  tail = i;
+  pthread_rwlock_unlock( &list_lock );
+
+  if ( CPF_intercept_enable( i, true ) != 0 ) {
+    CPF_intercept_free( &i );
+  }
+  return i;
+}
+
+
+int
+CPF_intercept_enable( cpf_interceptor_t * i, bool enable )
+{
+  int ret = 0;
+
+
+  if ( i == NULL ) {
+    LOG_ERROR( "CPF_intercept_enable(): interceptor cannot be NULL!" )
+    return -1;
+  }
+  pthread_rwlock_wrlock( &list_lock );
+  if ( i->enabled != enable ) {
+    if ( ( enable == true ) && ( num_enabled == 0 ) ) {
+      ret = patch_static_branches( true );
+    } else if ( ( enable == false ) && ( num_enabled == 1 ) ) {
+      ret = patch_static_branches( false );
+    }
+    if ( ret == 0 ) {
+      __atomic_store_n( &i->enabled, enable, __ATOMIC_RELAXED );
+      num_enabled += ( enable == true ) ? 1 : -1;
+    }
+  }
+  pthread_rwlock_unlock( &list_lock );
+  return ret;
+}
+
+
+void
+CPF_intercept_free( cpf_interceptor_t ** i )
+{
+  if ( (*i) == NULL ) {
+    return;
+  }
+  CPF_intercept_enable( *i, false );
+  pthread_rwlock_wrlock( &list_lock ); // no new call can reference the interceptor
+  if ( (*i)->prev != NULL ) {
+    (*i)->prev->next = (*i)->next;
+  } else {
+    head = (*i)->next;
+  }
+  if ( (*i)->next != NULL ) {
+    (*i)->next->prev = (*i)->prev;
+  } else {
+    tail = (*i)->prev;
+  }
+  pthread_rwlock_unlock( &list_lock );
+  // wait for the calls running its callbacks
+  pthread_mutex_lock( &(*i)->lock );
+  while ( atomic_load( &(*i)->refs ) != 0 ) {
+    pthread_cond_wait( &(*i)->idle, &(*i)->lock );
+  }
+  pthread_mutex_unlock( &(*i)->lock );
+  pthread_cond_destroy( &(*i)->idle );
+  pthread_mutex_destroy( &(*i)->lock );
+  FREE( (*i) )
+}
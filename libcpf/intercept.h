@@ -0,0 +1,61 @@
+/*
+  libcpf - C Plugin Framework
+
+  intercept.h - header file
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __INTERCEPT_H__
+#define __INTERCEPT_H__
+
+#include "fp_prototype.h"
+
+#if defined(__x86_64__)
+/*
+ * Static branch: a 5 bytes NOP, patched into a "jmp <label>" while at least one
+ * interceptor is enabled, through an int3 (hotpatch_poke()). The NOP is 8 bytes
+ * aligned, so it never crosses a page. Each site is recorded in the
+ * "cpf_static_branch" section.
+*/
+#define STATIC_BRANCH_UNLIKELY( label ) \
+  asm goto ( ".balign 8\n" \
+             "1: .byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n" \
+             ".pushsection cpf_static_branch, \"aw\"\n" \
+             ".balign 8\n" \
+             ".quad 1b, %l[" #label "]\n" \
+             ".popsection\n" \
+             : : : : label )
+
+typedef struct {                          // record of a static branch site
+  uint64_t code;                          // address of the NOP
+  uint64_t target;                        // address of the label
+} static_branch_t;
+#else
+// no code patching: a flag test
+extern bool intercept_enabled;
+
+#define STATIC_BRANCH_UNLIKELY( label ) \
+  if ( __builtin_expect( __atomic_load_n( &intercept_enabled, __ATOMIC_RELAXED ), 0 ) ) { \
+    goto label; \
+  }
+#endif
+
+void * intercept_call( void * func_addr, fp_args_t * args );
+void   intercept_lock( void );
+void   intercept_unlock( void );
+void   intercept_lock_reset( void );
+
+#endif
@@ -0,0 +1,584 @@
+/*
+  libcpf - C Plugin Framework
+
+  isolated.c - out-of-process plugin execution over a shared-memory ring
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cpf.h"
+#include "isolated.h"
+#include "plugin_manager.h"
+
+#define ISO_NAME_SIZE           128
+#define ISO_DATA_SIZE           4096      // marshalled strings of one call
+#define ISO_SPIN                4000      // busy polls before sleeping on a futex
+#define ISO_DEFAULT_RING_SIZE   64
+#define ISO_RESTART_DELAY_MS    10
+#define ISO_MAX_INIT_FAILURES   5         // consecutive restarts that can't load the plugins
+#define ISO_SHUTDOWN_TIMEOUT_MS 1000      // then the child is killed
+
+// slot sequence: ( ticket << 2 ) | phase
+#define ISO_FREE                0
+#define ISO_POSTED              1
+#define ISO_DONE                2
+#define ISO_FAILED              3
+#define ISO_SEQ( t, phase )     ( (uint32_t)( (t) << 2 ) | (phase) )
+
+
+typedef struct {                          // one call, in shared memory
+  _Atomic uint32_t seq;                   // futex word
+  uint32_t         ret_len;               // returned string size, 0 = not a string
+  char             plugin_name[ISO_NAME_SIZE];
+  char             func_name[ISO_NAME_SIZE];
+  fp_args_t        args;                  // char * args: offsets in "data"
+  uint64_t         ret;
+  char             data[ISO_DATA_SIZE];
+} iso_slot_t;
+
+typedef struct {                          // ring shared by the host and the child
+  _Atomic uint32_t head;                  // next ticket (callers)
+  _Atomic uint32_t tail;                  // next ticket to run (child)
+  _Atomic uint32_t child_sleeping;        // futex word
+  _Atomic uint32_t ready;                 // futex word: child registry loaded
+  _Atomic uint32_t shutdown;
+  uint32_t         mask;                  // ring size - 1
+  iso_slot_t       slot[];
+} iso_ring_t;
+
+struct cpf_isolated {
+  iso_ring_t       * ring;
+  size_t             ring_bytes;
+  char               path[MAX_PLUGIN_PATH_SIZE];
+  uint32_t           flags;
+  _Atomic pid_t      pid;                 // 0 once reaped
+  pthread_t          monitor;
+  _Atomic uint32_t   restarts;
+  _Atomic bool       dead;                // child cannot be (re)started
+  int                ring_fd;             // memfd of the ring, passed to the helper
+  char               helper[MAX_PLUGIN_PATH_SIZE];
+};
+
+
+static __thread char ret_buffer[ISO_DATA_SIZE]; // char * results of this thread
+static uint32_t      spin_count = ISO_SPIN;       // 0 on a single CPU: spinning delays the peer
+
+
+static void
+futex_wait( _Atomic uint32_t * addr, uint32_t val, long timeout_ms )
+{
+  struct timespec timeout = { timeout_ms / 1000, ( timeout_ms % 1000 ) * 1000000 };
+
+
+  // shared futex: the waiter and the waker are in different processes
+  syscall( SYS_futex, addr, FUTEX_WAIT, val, &timeout, NULL, 0 );
+}
+
+
+static void
+futex_wake( _Atomic uint32_t * addr )
+{
+  syscall( SYS_futex, addr, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0 );
+}
+
+
+static inline void
+cpu_relax( void )
+{
+#if defined( __x86_64__ ) || defined( __i386__ )
+  __builtin_ia32_pause();
+#endif
+}
+
+
+// wait while "*addr == val", spinning first
+static void
+spin_wait( cpf_isolated_t * iso, _Atomic uint32_t * addr, uint32_t val )
+{
+  uint32_t i;
+
+
+  for ( i = 0 ; i < spin_count ; i++ ) {
+    if ( atomic_load_explicit( addr, memory_order_acquire ) != val ) {
+      return;
+    }
+    cpu_relax();
+  }
+  while ( ( atomic_load_explicit( addr, memory_order_acquire ) == val ) &&
+          ( ( iso == NULL ) || !atomic_load( &iso->dead ) ) ) {
+    futex_wait( addr, val, 100 );
+  }
+}
+
+
+static bool
+run_call( cpf_t * cpf, iso_slot_t * s )
+{
+  const fp_desc_t * desc = CPF_wrapper_get_desc( s->args.fproto );
+  void            * func_addr;
+  uint8_t           i;
+  size_t            len;
+
+
+  s->ret = 0;
+  s->ret_len = 0;
+  if ( ( desc == NULL ) || // marshalling failed
+       ( ( func_addr = get_func_addr_proto( cpf, s->plugin_name, s->func_name,
+                                            s->args.fproto ) ) == NULL ) ) {
+    return false;
+  }
+  for ( i = 0 ; i < desc->num_args ; i++ ) {
+    if ( desc->arg[i] == PT_POINTER_TO_CHAR ) {
+      s->args.arg[i].cp = ( s->args.arg[i].u64 == UINT64_MAX ) ?
+                          NULL : s->data + s->args.arg[i].u64;
+    }
+  }
+  s->ret = (uint64_t)CPF_wrapper_call_func_by_args( func_addr, &s->args );
+  if ( ( desc->ret == PT_POINTER_TO_CHAR ) && ( s->ret != 0 ) ) {
+    len = strnlen( (char *)s->ret, sizeof( s->data ) - 1 );
+    memcpy( s->data, (char *)s->ret, len );
+    s->data[len] = '\0';
+    s->ret_len = len + 1;
+  }
+  return true;
+}
+
+
+// child process: run the posted calls in ticket order
+static void
+serve( cpf_t * cpf, iso_ring_t * ring )
+{
+  iso_slot_t * s;
+  uint32_t     t, seq, i = 0;
+  int32_t      d;
+
+
+  for ( ;; ) {
+    t = atomic_load_explicit( &ring->tail, memory_order_relaxed );
+    s = &ring->slot[t & ring->mask];
+    seq = atomic_load_explicit( &s->seq, memory_order_acquire );
+    d = (int32_t)( ( seq & ~3U ) - ISO_SEQ( t, 0 ) );
+    if ( seq == ISO_SEQ( t, ISO_POSTED ) ) {
+      atomic_store_explicit( &s->seq,
+                             ( run_call( cpf, s ) == true ) ? ISO_SEQ( t, ISO_DONE ) :
+                             ISO_SEQ( t, ISO_FAILED ),
+                             memory_order_release );
+      futex_wake( &s->seq );
+      atomic_store_explicit( &ring->tail, t + 1, memory_order_release );
+      i = 0;
+      continue;
+    }
+    if ( ( d > 0 ) || ( seq == ISO_SEQ( t, ISO_DONE ) ) || ( seq == ISO_SEQ( t, ISO_FAILED ) ) ) {
+      // failed by the host when the previous child crashed
+      atomic_store_explicit( &ring->tail, t + 1, memory_order_release );
+      continue;
+    }
+    // nothing posted yet
+    if ( atomic_load( &ring->shutdown ) ) {
+      return;
+    }
+    if ( ++i < spin_count ) {
+      cpu_relax();
+      continue;
+    }
+    atomic_store( &ring->child_sleeping, 1 );
+    if ( ( atomic_load( &s->seq ) != ISO_SEQ( t, ISO_POSTED ) ) &&
+         !atomic_load( &ring->shutdown ) ) {
+      futex_wait( &ring->child_sleeping, 1, 100 );
+    }
+    atomic_store( &ring->child_sleeping, 0 );
+    i = 0;
+  }
+}
+
+
+/*
+ * Isolated plugin process (main of the helper, tools/cpf-isolated): map the
+ * ring of the host, load the plugins and run the posted calls until shutdown.
+*/
+int
+isolated_serve( int ring_fd, char * directory_name, uint32_t flags )
+{
+  iso_ring_t * ring;
+  struct stat  st;
+  cpf_t      * cpf;
+
+
+  if ( ( fstat( ring_fd, &st ) == -1 ) || ( st.st_size < (off_t)sizeof( iso_ring_t ) ) ||
+       ( ( ring = mmap( NULL, st.st_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, ring_fd, 0 ) ) == MAP_FAILED ) ) {
+    LOG_ERROR( "Cannot map the isolated call ring (fd %d)!", ring_fd )
+    return EXIT_FAILURE;
+  }
+  close( ring_fd );
+  if ( sizeof( iso_ring_t ) + ( (size_t)ring->mask + 1 ) * sizeof( iso_slot_t ) != (size_t)st.st_size ) {
+    LOG_ERROR( "Invalid isolated call ring!" )
+    return EXIT_FAILURE;
+  }
+  if ( sysconf( _SC_NPROCESSORS_ONLN ) == 1 ) {
+    spin_count = 0;
+  }
+  cpf = CPF_init_flags( directory_name, flags );
+  atomic_store( &ring->ready, 1 );
+  futex_wake( &ring->ready );
+  serve( cpf, ring );
+  CPF_call_dtor( cpf );
+  CPF_free( &cpf );
+  return EXIT_SUCCESS;
+}
+
+
+/*
+ * Fork and exec the helper: the host may be multithreaded, so the child only
+ * makes async-signal-safe calls before execve(), and loads the plugins in the
+ * new program.
+*/
+static pid_t
+spawn_child( cpf_isolated_t * iso )
+{
+  char    fd_arg[16],
+          flags_arg[16];
+  char  * argv[] = { iso->helper, fd_arg, iso->path, flags_arg, NULL };
+  pid_t   pid,
+          parent = getpid();
+
+
+  snprintf( fd_arg, sizeof( fd_arg ), "%d", iso->ring_fd );
+  snprintf( flags_arg, sizeof( flags_arg ), "%u", iso->flags );
+  atomic_store( &iso->ring->ready, 0 ); // set by the new child
+  if ( ( pid = fork() ) == 0 ) {
+    prctl( PR_SET_PDEATHSIG, SIGKILL ); // kept by execve()
+    if ( ( getppid() == parent ) && // else the host died before prctl()
+         ( fcntl( iso->ring_fd, F_SETFD, 0 ) != -1 ) ) {
+      execve( iso->helper, argv, environ );
+    }
+    _exit( ISOLATED_EXEC_FAILED );
+  }
+  if ( pid == -1 ) {
+    LOG_ERROR( "Cannot fork the isolated plugin process: %s", strerror( errno ) )
+  }
+  return pid;
+}
+
+
+/*
+ * Start the child and restart it when it dies, failing the call it was
+ * running. The children are forked by this thread: PR_SET_PDEATHSIG is bound
+ * to the thread that forks. A restarted child that can't load the plugins
+ * (e.g. a plugin file being replaced) is retried with a growing delay, up to
+ * ISO_MAX_INIT_FAILURES times; the first child is not retried.
+*/
+static void *
+monitor_thread( void * arg )
+{
+  cpf_isolated_t * iso = (cpf_isolated_t *)arg;
+  iso_slot_t     * s;
+  struct timespec  delay;
+  uint32_t         t, seq,
+                   init_failures = 0;
+  long             delay_ms = ISO_RESTART_DELAY_MS;
+  int              status;
+  pid_t            pid;
+
+
+  while ( !atomic_load( &iso->ring->shutdown ) && ( ( pid = spawn_child( iso ) ) != -1 ) ) {
+    atomic_store( &iso->pid, pid );
+    while ( waitpid( pid, &status, 0 ) == -1 ) {
+      if ( errno != EINTR ) {
+        LOG_ERROR( "waitpid(): %s", strerror( errno ) )
+        goto out;
+      }
+    }
+    atomic_store( &iso->pid, 0 ); // the pid can be reused: not killed by CPF_isolated_free()
+    if ( atomic_load( &iso->ring->shutdown ) ) {
+      break;
+    }
+    if ( atomic_load( &iso->ring->ready ) == 0 ) {
+      if ( WIFEXITED( status ) && ( WEXITSTATUS( status ) == ISOLATED_EXEC_FAILED ) ) {
+        LOG_ERROR( "Cannot run the isolated plugin helper \"%s\"!", iso->helper )
+        break;
+      }
+      if ( ( atomic_load( &iso->restarts ) == 0 ) || ( ++init_failures > ISO_MAX_INIT_FAILURES ) ) {
+        LOG_ERROR( "Isolated plugins \"%s\" cannot be loaded!", iso->path )
+        break;
+      }
+      LOG_ERROR( "Isolated plugins \"%s\" cannot be loaded: retrying in %ldms",
+                 iso->path, delay_ms )
+      delay_ms *= 4;
+    } else {
+      if ( WIFSIGNALED( status ) ) {
+        LOG_ERROR( "Isolated plugin process %d killed by signal %d: restarting",
+                   pid, WTERMSIG( status ) )
+      } else {
+        LOG_ERROR( "Isolated plugin process %d exited (%d): restarting",
+                   pid, WEXITSTATUS( status ) )
+      }
+      init_failures = 0;
+      delay_ms = ISO_RESTART_DELAY_MS;
+    }
+    t = atomic_load( &iso->ring->tail );
+    s = &iso->ring->slot[t & iso->ring->mask];
+    seq = ISO_SEQ( t, ISO_POSTED );
+    if ( atomic_compare_exchange_strong( &s->seq, &seq, ISO_SEQ( t, ISO_FAILED ) ) ) {
+      futex_wake( &s->seq );
+    }
+    atomic_store( &iso->ring->child_sleeping, 0 );
+    atomic_fetch_add( &iso->restarts, 1 );
+    delay.tv_sec = delay_ms / 1000;
+    delay.tv_nsec = ( delay_ms % 1000 ) * 1000000;
+    nanosleep( &delay, NULL );
+  }
+
+out:
+  atomic_store( &iso->dead, true );
+  futex_wake( &iso->ring->ready );
+  return NULL;
+}
+
+
+/*
+ * Load the plugins of "directory_name" in a child process (the helper program,
+ * see isolated.h). The calls made with CPF_isolated_call() are run by the
+ * child, and a crash of a plugin kills the child only: it's restarted, and the
+ * call that was running returns NULL.
+*/
+cpf_isolated_t *
+CPF_isolated_init( char * directory_name, uint32_t flags, uint32_t ring_size )
+{
+  cpf_isolated_t * iso;
+  uint32_t         i;
+
+
+  if ( ring_size == 0 ) {
+    ring_size = ISO_DEFAULT_RING_SIZE;
+  }
+  if ( sysconf( _SC_NPROCESSORS_ONLN ) == 1 ) {
+    spin_count = 0;
+  }
+  if ( ( ring_size & ( ring_size - 1 ) ) != 0 ) {
+    LOG_ERROR( "CPF_isolated_init(): ring size must be a power of 2!" )
+    return NULL;
+  }
+  if ( ( iso = (cpf_isolated_t *)calloc( 1, sizeof( cpf_isolated_t ) ) ) == NULL ) {
+    LOG_ERROR( "CPF_isolated_init(): Cannot allocate memory!" )
+    exit( EXIT_FAILURE );
+  }
+  if ( directory_name != NULL ) {
+    snprintf( iso->path, sizeof( iso->path ), "%s", directory_name );
+  } else {
+    snprintf( iso->path, sizeof( iso->path ), "%s", PLUGIN_DIRNAME );
+  }
+  iso->flags = flags;
+  snprintf( iso->helper, sizeof( iso->helper ), "%s",
+            ( getenv( ISOLATED_HELPER_ENV ) != NULL ) ? getenv( ISOLATED_HELPER_ENV ) : ISOLATED_HELPER );
+  if ( access( iso->helper, X_OK ) == -1 ) {
+    LOG_ERROR( "CPF_isolated_init(): Cannot run the helper \"%s\"!", iso->helper )
+    FREE( iso )
+    return NULL;
+  }
+  // a memfd, not an anonymous mapping: the ring must survive the exec of the child
+  iso->ring_bytes = sizeof( iso_ring_t ) + ring_size * sizeof( iso_slot_t );
+  if ( ( ( iso->ring_fd = memfd_create( "cpf-isolated", MFD_CLOEXEC ) ) == -1 ) ||
+       ( ftruncate( iso->ring_fd, iso->ring_bytes ) == -1 ) ||
+       ( ( iso->ring = mmap( NULL, iso->ring_bytes, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, iso->ring_fd, 0 ) ) == MAP_FAILED ) ) {
+    LOG_ERROR( "CPF_isolated_init(): Cannot map the call ring: %s", strerror( errno ) )
+    if ( iso->ring_fd != -1 ) {
+      close( iso->ring_fd );
+    }
+    FREE( iso )
+    return NULL;
+  }
+  iso->ring->mask = ring_size - 1;
+  for ( i = 0 ; i < ring_size ; i++ ) {
+    atomic_init( &iso->ring->slot[i].seq, ISO_SEQ( i, ISO_FREE ) );
+  }
+
+  if ( pthread_create( &iso->monitor, NULL, monitor_thread, iso ) != 0 ) {
+    LOG_ERROR( "CPF_isolated_init(): Cannot create monitor thread!" )
+    exit( EXIT_FAILURE );
+  }
+  // wait for the plugins to be loaded in the child
+  while ( ( atomic_load( &iso->ring->ready ) == 0 ) && !atomic_load( &iso->dead ) ) {
+    futex_wait( &iso->ring->ready, 0, 100 );
+  }
+  if ( atomic_load( &iso->dead ) ) {
+    CPF_isolated_free( &iso );
+  }
+  return iso;
+}
+
+
+void *
+CPF_isolated_call( cpf_isolated_t * iso,
+                   char * plugin_name,
+                   char * func_name,
+                   enum func_prototype_t fproto,
+                   ... )
+{
+  const fp_desc_t * desc;
+  iso_slot_t      * s;
+  va_list           varglist;
+  fp_args_t         args;
+  uint32_t          t, seq, used = 0, sleeping = 1;
+  size_t            len;
+  uint8_t           i;
+  void            * ret = NULL;
+
+
+  if ( ( iso == NULL ) || ( plugin_name == NULL ) || ( func_name == NULL ) ) {
+    LOG_ERROR( "CPF_isolated_call(): Parameters cannot be NULL!" )
+    return NULL;
+  }
+  if ( ( strlen( plugin_name ) >= ISO_NAME_SIZE ) || ( strlen( func_name ) >= ISO_NAME_SIZE ) ) {
+    LOG_ERROR( "CPF_isolated_call(): Plugin or function name too long!" )
+    return NULL;
+  }
+  if ( ( desc = CPF_wrapper_get_desc( fproto ) ) == NULL ) {
+    LOG_ERROR( "CPF_isolated_call(): Unknown function prototype!" )
+    return NULL;
+  }
+  // a returned string is copied, any other pointer is an address of the child
+  if ( ( desc->ret >= PT_POINTER_TO_VOID ) && ( desc->ret != PT_POINTER_TO_CHAR ) ) {
+    LOG_ERROR( "CPF_isolated_call(): \"%s\" pointer result cannot be isolated!", func_name )
+    return NULL;
+  }
+  va_start( varglist, fproto );
+  CPF_wrapper_get_args( &args, fproto, varglist );
+  va_end( varglist );
+  if ( atomic_load( &iso->dead ) ) {
+    return NULL;
+  }
+
+  // take a ticket and wait for its slot
+  t = atomic_fetch_add( &iso->ring->head, 1 );
+  s = &iso->ring->slot[t & iso->ring->mask];
+  while ( ( ( seq = atomic_load_explicit( &s->seq, memory_order_acquire ) ) != ISO_SEQ( t, ISO_FREE ) ) &&
+          !atomic_load( &iso->dead ) ) {
+    spin_wait( iso, &s->seq, seq );
+  }
+  if ( atomic_load( &iso->dead ) ) {
+    return NULL;
+  }
+
+  // marshal: strings are copied in the slot
+  strcpy( s->plugin_name, plugin_name );
+  strcpy( s->func_name, func_name );
+  for ( i = 0 ; i < desc->num_args ; i++ ) {
+    if ( desc->arg[i] == PT_POINTER_TO_CHAR ) {
+      if ( args.arg[i].cp == NULL ) {
+        args.arg[i].u64 = UINT64_MAX;
+        continue;
+      }
+      len = strlen( args.arg[i].cp ) + 1;
+      if ( used + len > sizeof( s->data ) ) {
+        LOG_ERROR( "CPF_isolated_call(): \"%s\" parameters are too large!", func_name )
+        args.fproto = FP_UNDEFINED; // failed by the child
+        break;
+      }
+      memcpy( s->data + used, args.arg[i].cp, len );
+      args.arg[i].u64 = used;
+      used += len;
+    } else if ( ( desc->arg[i] >= PT_POINTER_TO_VOID ) && ( args.fproto != FP_UNDEFINED ) ) {
+      LOG_ERROR( "CPF_isolated_call(): \"%s\" pointer parameters cannot be isolated!", func_name )
+      args.fproto = FP_UNDEFINED;
+    }
+  }
+  memcpy( &s->args, &args, sizeof( args ) );
+  atomic_store_explicit( &s->seq, ISO_SEQ( t, ISO_POSTED ), memory_order_release );
+  if ( atomic_compare_exchange_strong( &iso->ring->child_sleeping, &sleeping, 0 ) ) {
+    futex_wake( &iso->ring->child_sleeping );
+  }
+
+  // wait for the result
+  spin_wait( iso, &s->seq, ISO_SEQ( t, ISO_POSTED ) );
+  if ( atomic_load_explicit( &s->seq, memory_order_acquire ) == ISO_SEQ( t, ISO_DONE ) ) {
+    if ( s->ret_len > 0 ) { // copy the returned string: valid until the next call
+      memcpy( ret_buffer, s->data, s->ret_len );
+      ret = ret_buffer;
+    } else {
+      ret = (void *)s->ret;
+    }
+  }
+  atomic_store_explicit( &s->seq, ISO_SEQ( t + iso->ring->mask + 1, ISO_FREE ), memory_order_release );
+  futex_wake( &s->seq );
+  return ret;
+}
+
+
+uint32_t
+CPF_isolated_restarts( cpf_isolated_t * iso )
+{
+  return atomic_load( &iso->restarts );
+}
+
+
+/*
+ * Stop the child: a child still running a plugin call after
+ * ISO_SHUTDOWN_TIMEOUT_MS is killed.
+*/
+void
+CPF_isolated_free( cpf_isolated_t ** iso )
+{
+  struct timespec deadline;
+  pid_t           pid;
+
+
+  if ( (*iso) == NULL ) {
+    return;
+  }
+  atomic_store( &(*iso)->ring->shutdown, 1 );
+  atomic_store( &(*iso)->ring->child_sleeping, 0 );
+  futex_wake( &(*iso)->ring->child_sleeping );
+  for ( ;; ) {
+    clock_gettime( CLOCK_REALTIME, &deadline );
+    deadline.tv_sec += ISO_SHUTDOWN_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += ( ISO_SHUTDOWN_TIMEOUT_MS % 1000 ) * 1000000;
+    if ( deadline.tv_nsec >= 1000000000 ) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    if ( pthread_timedjoin_np( (*iso)->monitor, NULL, &deadline ) == 0 ) {
+      break;
+    }
+    // killed while waited by the monitor: the pid can't be reused yet
+    if ( ( pid = atomic_load( &(*iso)->pid ) ) > 0 ) {
+      LOG_ERROR( "Isolated plugin process %d does not stop: killed", pid )
+      kill( pid, SIGKILL );
+    }
+  }
+  munmap( (*iso)->ring, (*iso)->ring_bytes );
+  close( (*iso)->ring_fd );
+  FREE( (*iso) )
+}
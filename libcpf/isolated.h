@@ -0,0 +1,39 @@
+/*
+  libcpf - C Plugin Framework
+
+  isolated.h - header file
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __ISOLATED_H__
+#define __ISOLATED_H__
+
+#include <stdint.h>
+
+/*
+ * Program run by the isolated plugin process (tools/cpf-isolated): the child
+ * of a multithreaded host can't load plugins before an exec. Set at build time
+ * (see libcpf/Makefile), or by the CPF_ISOLATED_HELPER environment variable.
+*/
+#ifndef ISOLATED_HELPER
+#define ISOLATED_HELPER         "/usr/local/libexec/cpf-isolated"
+#endif
+#define ISOLATED_HELPER_ENV     "CPF_ISOLATED_HELPER"
+#define ISOLATED_EXEC_FAILED    127       // exit status of a child that can't exec the helper
+
+int isolated_serve( int ring_fd, char * directory_name, uint32_t flags );
+
+#endif
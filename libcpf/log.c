@@ -0,0 +1,375 @@
+/*
+  libcpf - C Plugin Framework
+
+  log.c - level-filtered logging with an optional asynchronous backend
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+
+
+typedef struct {
+  int  level;
+  char msg[LOG_MSG_SIZE];
+} log_entry_t;
+
+// single producer (the logging thread), single consumer (the drain thread)
+typedef struct log_ring {
+  struct log_ring * next;
+  _Atomic uint32_t  head;                 // written by the producer thread
+  _Atomic uint32_t  tail;                 // written by the drain thread
+  _Atomic bool      orphan;               // producer thread exited
+  log_entry_t       entry[LOG_RING_SIZE];
+} log_ring_t;
+
+
+int CPF_log_runtime_level = CPF_LOG_LEVEL;
+
+static cpf_log_sink_t  log_sink = NULL;   // NULL = default sink (stdout/stderr)
+static void          * log_sink_user_data = NULL;
+static pthread_mutex_t log_sink_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Atomic(log_ring_t *) log_rings = NULL;
+static pthread_mutex_t log_rings_lock = PTHREAD_MUTEX_INITIALIZER; // ring unlinking vs rings_empty()
+static __thread log_ring_t * log_tl_ring = NULL;
+static pthread_key_t   log_ring_key;
+static pthread_once_t  log_once = PTHREAD_ONCE_INIT;
+
+static _Atomic bool     log_async = false;
+static _Atomic uint32_t log_sleeping = 0; // futex word: drain thread is sleeping
+static _Atomic uint64_t log_num_dropped = 0;
+static pthread_t        log_thread;
+
+
+static void
+default_sink( int level, const char * msg )
+{
+  switch( level ) {
+    case CPF_LOG_LEVEL_ERROR:
+      fprintf( stderr, "[ERROR] %s\n", msg );
+      break;
+    case CPF_LOG_LEVEL_DEBUG:
+      fprintf( stdout, "[DEBUG] %s\n", msg );
+      break;
+    default:
+      fprintf( stdout, "[INFO] %s\n", msg );
+      break;
+  }
+}
+
+
+static void
+deliver( int level, const char * msg )
+{
+  pthread_mutex_lock( &log_sink_lock );
+  if ( log_sink == NULL ) {
+    default_sink( level, msg );
+  } else {
+    log_sink( level, msg, log_sink_user_data );
+  }
+  pthread_mutex_unlock( &log_sink_lock );
+}
+
+
+static void
+ring_release( void * ring )
+{
+  atomic_store_explicit( &((log_ring_t *)ring)->orphan, true, memory_order_release );
+  log_tl_ring = NULL;
+}
+
+
+static void
+log_init_once( void )
+{
+  pthread_key_create( &log_ring_key, ring_release );
+}
+
+
+static log_ring_t *
+get_ring( void )
+{
+  log_ring_t * ring;
+
+
+  if ( log_tl_ring != NULL ) {
+    return log_tl_ring;
+  }
+  pthread_once( &log_once, log_init_once );
+  if ( ( ring = (log_ring_t *)calloc( 1, sizeof( log_ring_t ) ) ) == NULL ) {
+    return NULL;
+  }
+  // lock-free push in front of the ring list
+  ring->next = atomic_load( &log_rings );
+  while ( !atomic_compare_exchange_weak( &log_rings, &ring->next, ring ) );
+  pthread_setspecific( log_ring_key, ring );
+  log_tl_ring = ring;
+  return ring;
+}
+
+
+static void
+wake_drainer( void )
+{
+  uint32_t sleeping = 1;
+
+
+  atomic_thread_fence( memory_order_seq_cst );
+  if ( ( atomic_load_explicit( &log_sleeping, memory_order_relaxed ) == 1 ) &&
+       ( atomic_compare_exchange_strong( &log_sleeping, &sleeping, 0 ) ) ) {
+    syscall( SYS_futex, &log_sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0 );
+  }
+}
+
+
+static bool
+ring_push( log_ring_t * ring, int level, const char * msg )
+{
+  uint32_t head = atomic_load_explicit( &ring->head, memory_order_relaxed );
+  uint32_t tail = atomic_load_explicit( &ring->tail, memory_order_acquire );
+
+
+  if ( head - tail == LOG_RING_SIZE ) {
+    return false; // full: never block the caller
+  }
+  ring->entry[head % LOG_RING_SIZE].level = level;
+  strcpy( ring->entry[head % LOG_RING_SIZE].msg, msg );
+  atomic_store_explicit( &ring->head, head + 1, memory_order_release );
+  return true;
+}
+
+
+void
+CPF_log( int level, const char * fmt, ... )
+{
+  char         msg[LOG_MSG_SIZE];
+  va_list      varglist;
+  log_ring_t * ring;
+
+
+  va_start( varglist, fmt );
+  vsnprintf( msg, sizeof( msg ), fmt, varglist );
+  va_end( varglist );
+
+  if ( atomic_load_explicit( &log_async, memory_order_acquire ) &&
+       ( ( ring = get_ring() ) != NULL ) ) {
+    if ( ring_push( ring, level, msg ) == false ) {
+      atomic_fetch_add_explicit( &log_num_dropped, 1, memory_order_relaxed );
+      return;
+    }
+    wake_drainer();
+    return;
+  }
+  deliver( level, msg );
+}
+
+
+// drain all rings and free the empty ones whose thread exited
+static bool
+drain_rings( void )
+{
+  log_ring_t * ring,
+             * prev = NULL,
+             * next;
+  uint32_t     head, tail;
+  bool         drained = false;
+
+
+  for ( ring = atomic_load( &log_rings ) ; ring != NULL ; ring = next ) {
+    next = ring->next;
+    tail = atomic_load_explicit( &ring->tail, memory_order_relaxed );
+    head = atomic_load_explicit( &ring->head, memory_order_acquire );
+    for ( ; tail != head ; tail++ ) {
+      deliver( ring->entry[tail % LOG_RING_SIZE].level,
+               ring->entry[tail % LOG_RING_SIZE].msg );
+      drained = true;
+    }
+    atomic_store_explicit( &ring->tail, tail, memory_order_release );
+
+    // only the list head is modified by the producers: other nodes can be
+    // unlinked safely by this (single) consumer. CPF_log_flush() walks the
+    // list too (rings_empty()): the ring is freed under the lock it takes.
+    if ( ( prev != NULL ) &&
+         atomic_load_explicit( &ring->orphan, memory_order_acquire ) &&
+         ( atomic_load( &ring->head ) == tail ) ) {
+      pthread_mutex_lock( &log_rings_lock );
+      prev->next = next;
+      pthread_mutex_unlock( &log_rings_lock );
+      free( ring );
+      continue;
+    }
+    prev = ring;
+  }
+  return drained;
+}
+
+
+static bool
+rings_empty( void )
+{
+  log_ring_t * ring;
+  bool         empty = true;
+
+
+  pthread_mutex_lock( &log_rings_lock );
+  for ( ring = atomic_load( &log_rings ) ; ring != NULL ; ring = ring->next ) {
+    if ( atomic_load( &ring->head ) != atomic_load( &ring->tail ) ) {
+      empty = false;
+      break;
+    }
+  }
+  pthread_mutex_unlock( &log_rings_lock );
+  return empty;
+}
+
+
+static void *
+drain_thread( void * arg )
+{
+  struct timespec timeout = { 0, 100 * 1000 * 1000 }; // 100ms
+
+
+  while ( atomic_load( &log_async ) ) {
+    if ( drain_rings() == true ) {
+      continue;
+    }
+    atomic_store( &log_sleeping, 1 );
+    atomic_thread_fence( memory_order_seq_cst );
+    if ( rings_empty() && atomic_load( &log_async ) ) {
+      syscall( SYS_futex, &log_sleeping, FUTEX_WAIT_PRIVATE, 1, &timeout, NULL, 0 );
+    }
+    atomic_store( &log_sleeping, 0 );
+  }
+  drain_rings();
+  return NULL;
+}
+
+
+static void
+log_atexit( void )
+{
+  CPF_log_stop_async();
+}
+
+
+// the drain thread doesn't exist in a forked child: log synchronously
+static void
+log_atfork_child( void )
+{
+  atomic_store( &log_async, false );
+  atomic_store( &log_sleeping, 0 );
+  pthread_mutex_init( &log_sink_lock, NULL );
+  pthread_mutex_init( &log_rings_lock, NULL );
+}
+
+
+int
+CPF_log_start_async( void )
+{
+  static bool atexit_set = false;
+  bool        running = false;
+
+
+  if ( !atomic_compare_exchange_strong( &log_async, &running, true ) ) {
+    return EXIT_SUCCESS; // already running
+  }
+  if ( pthread_create( &log_thread, NULL, drain_thread, NULL ) != 0 ) {
+    atomic_store( &log_async, false );
+    LOG_ERROR( "CPF_log_start_async(): Cannot create log thread!" )
+    return EXIT_FAILURE;
+  }
+  if ( atexit_set == false ) {
+    atexit( log_atexit ); // LOG_ERROR() followed by exit() is not lost
+    pthread_atfork( NULL, NULL, log_atfork_child );
+    atexit_set = true;
+  }
+  return EXIT_SUCCESS;
+}
+
+
+void
+CPF_log_stop_async( void )
+{
+  bool running = true;
+
+
+  if ( !atomic_compare_exchange_strong( &log_async, &running, false ) ) {
+    return;
+  }
+  atomic_store( &log_sleeping, 1 );
+  wake_drainer();
+  pthread_join( log_thread, NULL );
+  drain_rings(); // messages pushed while the thread was stopping
+  fflush( stdout );
+  fflush( stderr );
+}
+
+
+void
+CPF_log_flush( void )
+{
+  struct timespec delay = { 0, 100 * 1000 }; // 100us
+  int             tries;
+
+
+  // wait up to 1s for the drain thread
+  for ( tries = 0 ; atomic_load( &log_async ) && !rings_empty() && tries < 10000 ; tries++ ) {
+    atomic_store( &log_sleeping, 1 );
+    wake_drainer();
+    nanosleep( &delay, NULL );
+  }
+  pthread_mutex_lock( &log_sink_lock );
+  fflush( stdout );
+  fflush( stderr );
+  pthread_mutex_unlock( &log_sink_lock );
+}
+
+
+void
+CPF_log_set_level( int level )
+{
+  CPF_log_runtime_level = level;
+}
+
+
+void
+CPF_log_set_sink( cpf_log_sink_t sink, void * user_data )
+{
+  CPF_log_flush();
+  pthread_mutex_lock( &log_sink_lock );
+  log_sink = sink;
+  log_sink_user_data = user_data;
+  pthread_mutex_unlock( &log_sink_lock );
+}
+
+
+uint64_t
+CPF_log_dropped( void )
+{
+  return atomic_load_explicit( &log_num_dropped, memory_order_relaxed );
+}
@@ -21,10 +21,61 @@
 #ifndef __LOG_H__
 #define __LOG_H__
 
-#define LOG_INFO( MSG, ... ) \
-  fprintf( stdout, "[INFO] "MSG"\n", ##__VA_ARGS__ );
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
 
-#define LOG_ERROR( MSG, ... ) \
-  fprintf( stderr, "[ERROR] "MSG"\n", ##__VA_ARGS__ );
+#ifdef __cplusplus
+extern "C" {
+#endif
 
-#endif
\ No newline at end of file
+// log levels
+#define CPF_LOG_LEVEL_NONE      0
+#define CPF_LOG_LEVEL_ERROR     1
+#define CPF_LOG_LEVEL_INFO      2
+#define CPF_LOG_LEVEL_DEBUG     3
+
+// compile-time filter: messages above this level aren't compiled at all
+#ifndef CPF_LOG_LEVEL
+#define CPF_LOG_LEVEL           CPF_LOG_LEVEL_INFO
+#endif
+
+#define LOG_RING_SIZE           128               // messages per thread ring buffer
+#define LOG_MSG_SIZE            512               // max message size (truncated)
+
+/*
+ * The runtime filter (CPF_log_set_level()) is checked before the message is
+ * formatted. With CPF_log_start_async(), messages are copied into a lock-free
+ * per-thread ring buffer and written to the sink by a background thread: the
+ * caller never blocks on terminal or pipe writes. If the ring buffer is full,
+ * the message is dropped and counted (see CPF_log_dropped()).
+*/
+#define LOG_MSG( LEVEL, MSG, ... ) \
+  do { \
+    if ( ( CPF_LOG_LEVEL >= LEVEL ) && ( CPF_log_runtime_level >= LEVEL ) ) \
+      CPF_log( LEVEL, MSG, ##__VA_ARGS__ ); \
+  } while (0);
+
+#define LOG_DEBUG( MSG, ... ) LOG_MSG( CPF_LOG_LEVEL_DEBUG, MSG, ##__VA_ARGS__ )
+#define LOG_INFO( MSG, ... )  LOG_MSG( CPF_LOG_LEVEL_INFO, MSG, ##__VA_ARGS__ )
+#define LOG_ERROR( MSG, ... ) LOG_MSG( CPF_LOG_LEVEL_ERROR, MSG, ##__VA_ARGS__ )
+
+// log sink: receives the level and the message without "[LEVEL]" prefix and "\n"
+typedef void ( *cpf_log_sink_t ) ( int level, const char * msg, void * user_data );
+
+extern int       CPF_log_runtime_level;
+
+extern void      CPF_log( int level, const char * fmt, ... )
+                   __attribute__(( format( printf, 2, 3 ) ));
+extern void      CPF_log_set_level( int level );
+extern void      CPF_log_set_sink( cpf_log_sink_t sink, void * user_data );
+extern int       CPF_log_start_async( void );
+extern void      CPF_log_stop_async( void );
+extern void      CPF_log_flush( void );
+extern uint64_t  CPF_log_dropped( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,541 @@
+/*
+  libcpf - C Plugin Framework
+
+  manifest.c - persistent on-disk manifest cache of the loaded plugins
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fnv.h"
+#include "manifest.h"
+#include "shared_registry.h"
+#include "log.h"
+
+
+static void
+manifest_path( cpf_t * cpf, char * path, size_t size )
+{
+  if ( snprintf( path, size, "%s"MANIFEST_EXTENSION, cpf->path ) >= (int)size ) {
+    path[0] = '\0';
+  }
+}
+
+
+// NUL terminated string inside the manifest, or NULL if the offset is invalid
+static const char *
+manifest_str( manifest_t * m, uint64_t off )
+{
+  if ( ( off < sizeof( manifest_hdr_t ) ) || ( off >= m->size ) ) {
+    return NULL;
+  }
+  if ( memchr( (char *)m->map + off, '\0', m->size - off ) == NULL ) {
+    return NULL;
+  }
+  return (char *)m->map + off;
+}
+
+
+static bool
+manifest_valid( manifest_t * m )
+{
+  const manifest_entry_t * e;
+  uint32_t i;
+
+
+  if ( m->size < sizeof( manifest_hdr_t ) ) {
+    return false;
+  }
+  m->hdr = (const manifest_hdr_t *)m->map;
+  if ( ( memcmp( m->hdr->magic, MANIFEST_MAGIC, sizeof( m->hdr->magic ) ) != 0 ) ||
+       ( m->hdr->version != MANIFEST_VERSION ) ||
+       ( m->hdr->file_size != m->size ) ||
+       ( (uint64_t)m->hdr->num_entries * sizeof( manifest_entry_t ) >
+         m->size - sizeof( manifest_hdr_t ) ) ) {
+    return false;
+  }
+  if ( fnv1a_64( FNV64_BASIS, (uint8_t *)m->map + sizeof( manifest_hdr_t ),
+                 m->size - sizeof( manifest_hdr_t ) ) != m->hdr->checksum ) {
+    return false;
+  }
+  e = (const manifest_entry_t *)( m->hdr + 1 );
+  for ( i = 0 ; i < m->hdr->num_entries ; i++ ) {
+    if ( ( manifest_str( m, e[i].path_off ) == NULL ) ||
+         ( e[i].funcs_off > m->size ) ||
+         ( (uint64_t)e[i].num_funcs * sizeof( manifest_func_t ) > m->size - e[i].funcs_off ) ||
+         ( e[i].deps_off > m->size ) ||
+         ( (uint64_t)e[i].num_deps * sizeof( uint64_t ) > m->size - e[i].deps_off ) ) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+void
+manifest_open( cpf_t * cpf, manifest_t * m )
+{
+  char        path[MAX_PLUGIN_PATH_SIZE + sizeof( MANIFEST_EXTENSION )];
+  struct stat st;
+  int         fd;
+
+
+  memset( m, 0, sizeof( manifest_t ) );
+  if ( cpf->shreg != NULL ) { // validated by manifest_bind_plugins()
+    m->map = cpf->shreg->map;
+    m->size = cpf->shreg->size;
+    m->hdr = (const manifest_hdr_t *)m->map;
+    m->shared = true;
+    return;
+  }
+  if ( ( cpf->flags & CPF_FLAG_MANIFEST_CACHE ) == 0 ) {
+    return;
+  }
+  m->dirty = true; // until a valid manifest is found
+
+  manifest_path( cpf, path, sizeof( path ) );
+  if ( ( fd = open( path, O_RDONLY | O_CLOEXEC ) ) == -1 ) {
+    return;
+  }
+  if ( ( fstat( fd, &st ) == -1 ) || ( st.st_size == 0 ) ) {
+    close( fd );
+    return;
+  }
+  m->size = st.st_size;
+  m->map = mmap( NULL, m->size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if ( m->map == MAP_FAILED ) {
+    m->map = NULL;
+    return;
+  }
+  if ( manifest_valid( m ) == false ) {
+    LOG_INFO( "Manifest cache \"%s\" is stale or corrupt. Rebuilding it...", path )
+    munmap( m->map, m->size );
+    m->map = NULL;
+    m->hdr = NULL;
+    return;
+  }
+  m->dirty = false;
+}
+
+
+bool
+manifest_stat_plugin( plugin_t * p )
+{
+  struct stat st;
+
+
+  if ( stat( p->path, &st ) == -1 ) {
+    memset( &p->file_id, 0, sizeof( file_id_t ) );
+    return false;
+  }
+  p->file_id.dev = st.st_dev;
+  p->file_id.ino = st.st_ino;
+  p->file_id.size = st.st_size;
+  p->file_id.mtime_sec = st.st_mtim.tv_sec;
+  p->file_id.mtime_nsec = st.st_mtim.tv_nsec;
+  return true;
+}
+
+
+/*
+ * Is the plugin file still the one stat'ed by manifest_stat_plugin()? Called
+ * once it's opened: the same identity before and after the open means that
+ * the file opened is that one, not a file renamed over the path meanwhile.
+*/
+bool
+manifest_check_plugin( plugin_t * p )
+{
+  file_id_t id = p->file_id;
+
+
+  return ( manifest_stat_plugin( p ) == true ) && ( memcmp( &id, &p->file_id, sizeof( id ) ) == 0 );
+}
+
+
+const manifest_entry_t *
+manifest_find( manifest_t * m, plugin_t * p )
+{
+  const manifest_entry_t * e;
+  uint32_t lo, hi, mid;
+  int      cmp;
+
+
+  if ( m->map == NULL ) {
+    return NULL;
+  }
+  e = (const manifest_entry_t *)( m->hdr + 1 );
+  lo = 0;
+  hi = m->hdr->num_entries;
+  while ( lo < hi ) {
+    mid = lo + ( hi - lo ) / 2;
+    cmp = strcmp( p->path, manifest_str( m, e[mid].path_off ) );
+    if ( cmp == 0 ) {
+      if ( memcmp( &e[mid].file_id, &p->file_id, sizeof( file_id_t ) ) == 0 ) {
+        return &e[mid];
+      }
+      break;
+    }
+    if ( cmp < 0 ) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  m->dirty = true; // new or modified plugin
+  return NULL;
+}
+
+
+// true if "path" has a ".." component
+static bool
+has_dot_dot( const char * path )
+{
+  const char * c;
+
+
+  for ( c = path ; ( c = strstr( c, ".." ) ) != NULL ; c += 2 ) {
+    if ( ( ( c == path ) || ( c[-1] == '/' ) ) && ( ( c[2] == '/' ) || ( c[2] == '\0' ) ) ) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/*
+ * Set the plugins of "cpf" from the entries of a manifest image, in place of
+ * the plugin directory walk (shared registry). The image must describe the
+ * plugin directory of "cpf": its paths can't leave it.
+*/
+bool
+manifest_bind_plugins( cpf_t * cpf, void * map, size_t size )
+{
+  manifest_t               m = { .map = map, .size = size };
+  const manifest_entry_t * e;
+  const char             * path;
+  size_t                   dir_len = strlen( cpf->path ),
+                           len;
+  uint32_t                 i;
+
+
+  if ( ( manifest_valid( &m ) == false ) || ( m.hdr->num_entries == 0 ) ||
+       ( m.hdr->num_entries > UINT16_MAX ) ) {
+    return false;
+  }
+  e = (const manifest_entry_t *)( m.hdr + 1 );
+  for ( i = 0 ; i < m.hdr->num_entries ; i++ ) {
+    path = manifest_str( &m, e[i].path_off );
+    len = strlen( path );
+    if ( ( strncmp( path, cpf->path, dir_len ) != 0 ) || ( path[dir_len] != '/' ) ||
+         ( has_dot_dot( path + dir_len ) == true ) ||
+         ( len < dir_len + sizeof( PLUGIN_EXTENSION ) ) || ( len >= sizeof( cpf->plugin->path ) ) ||
+         ( strcmp( path + len - strlen( PLUGIN_EXTENSION ), PLUGIN_EXTENSION ) != 0 ) ) {
+      return false;
+    }
+  }
+
+  cpf->plugin = ( plugin_t * )calloc( m.hdr->num_entries, sizeof( plugin_t ) );
+  if ( cpf->plugin == NULL ) {
+    LOG_ERROR( "Cannot allocate memory for plugins!" )
+    exit( EXIT_FAILURE );
+  }
+  for ( i = 0 ; i < m.hdr->num_entries ; i++ ) {
+    path = manifest_str( &m, e[i].path_off );
+    len = strlen( path ) - dir_len - 1 - strlen( PLUGIN_EXTENSION );
+    snprintf( cpf->plugin[i].path, sizeof( cpf->plugin[i].path ), "%s", path );
+    snprintf( cpf->plugin[i].name, sizeof( cpf->plugin[i].name ), "%.*s",
+              (int)len, path + dir_len + 1 );
+  }
+  cpf->num_plugins = m.hdr->num_entries;
+  return true;
+}
+
+
+// Build the plugin functions from the manifest entry. The function names are
+// stored in the same allocation as lib_func, so FREE( lib_func ) releases both.
+bool
+manifest_apply( manifest_t * m, const manifest_entry_t * e, plugin_t * p )
+{
+  const manifest_func_t * mf;
+  const char * name;
+  size_t   names_size = 0;
+  char   * names;
+  uint32_t i;
+
+
+  mf = (const manifest_func_t *)( (char *)m->map + e->funcs_off );
+  if ( ( e->num_funcs == 0 ) || ( e->init_ctx_offset == 0 ) ) {
+    goto invalid;
+  }
+  for ( i = 0 ; i < e->num_funcs ; i++ ) {
+    if ( mf[i].name_off == 0 ) {
+      continue;
+    }
+    if ( ( name = manifest_str( m, mf[i].name_off ) ) == NULL ) {
+      goto invalid;
+    }
+    names_size += strlen( name ) + 1;
+  }
+
+  // num_funcs + 1 = will be used to detect the end of struct (NULL value)
+  p->lib_func = (func_t *)calloc( 1, ( e->num_funcs + 1 ) * sizeof( func_t ) + names_size );
+  if ( p->lib_func == NULL ) {
+    LOG_ERROR( "Cannot allocate memory for plugins' functions!!" )
+    exit( EXIT_FAILURE );
+  }
+  names = (char *)( p->lib_func + e->num_funcs + 1 );
+  for ( i = 0 ; i < e->num_funcs ; i++ ) {
+    p->lib_func[i].func_addr = p->base_addr + mf[i].func_offset;
+    p->lib_func[i].func_offset = mf[i].func_offset;
+    p->lib_func[i].flags = mf[i].flags;
+    p->lib_func[i].fproto = (enum func_prototype_t)mf[i].fproto;
+    if ( mf[i].name_off != 0 ) {
+      name = manifest_str( m, mf[i].name_off );
+      strcpy( names, name );
+      p->lib_func[i].func_name = names;
+      names += strlen( name ) + 1;
+    }
+  }
+  p->ctor = ( e->ctor_offset != 0 ) ? p->base_addr + e->ctor_offset : NULL;
+  p->dtor = ( e->dtor_offset != 0 ) ? p->base_addr + e->dtor_offset : NULL;
+  p->init_ctx = p->base_addr + e->init_ctx_offset;
+  p->export_state = ( e->export_state_offset != 0 ) ? p->base_addr + e->export_state_offset : NULL;
+  p->import_state = ( e->import_state_offset != 0 ) ? p->base_addr + e->import_state_offset : NULL;
+  p->prefork = ( e->prefork_offset != 0 ) ? p->base_addr + e->prefork_offset : NULL;
+  p->postfork_parent = ( e->postfork_parent_offset != 0 ) ? p->base_addr + e->postfork_parent_offset : NULL;
+  p->ctor_child = ( e->ctor_child_offset != 0 ) ? p->base_addr + e->ctor_child_offset : NULL;
+  memcpy( p->blake2s256, e->blake2s256, sizeof( p->blake2s256 ) );
+  return true;
+
+invalid:
+  m->dirty = true;
+  return false;
+}
+
+
+static uint16_t
+plugin_num_funcs( func_t * f )
+{
+  uint16_t c;
+
+
+  for ( c = 0 ; f[c].func_addr != NULL ; c++ );
+
+  return c;
+}
+
+
+static uint16_t
+plugin_num_deps( deps_t * d )
+{
+  uint16_t c;
+
+
+  for ( c = 0 ; d[c].dep_lib_name != NULL ; c++ );
+
+  return c;
+}
+
+
+static uint64_t
+put_str( uint8_t * buf, uint64_t * str_off, const char * s )
+{
+  uint64_t off = *str_off;
+
+
+  strcpy( (char *)buf + off, s );
+  *str_off += strlen( s ) + 1;
+  return off;
+}
+
+
+// manifest image of the loaded plugins, NULL on error
+static uint8_t *
+manifest_build( cpf_t * cpf, uint64_t * image_size )
+{
+  uint8_t  * buf;
+  manifest_hdr_t   * hdr;
+  manifest_entry_t * e;
+  manifest_func_t  * mf;
+  uint64_t * md;
+  uint64_t num_funcs = 0,
+           num_deps = 0,
+           str_size = 0,
+           size,
+           func_off,
+           dep_off,
+           str_off;
+  uint16_t i, j, nf, nd;
+  plugin_t * p;
+
+
+  for ( i = 0 ; i < cpf->num_plugins ; i++ ) {
+    p = &cpf->plugin[i];
+    str_size += strlen( p->path ) + 1;
+    nf = plugin_num_funcs( p->lib_func );
+    for ( j = 0 ; j < nf ; j++ ) {
+      if ( p->lib_func[j].func_name != NULL ) {
+        str_size += strlen( p->lib_func[j].func_name ) + 1;
+      }
+    }
+    nd = plugin_num_deps( p->ctx->deps );
+    for ( j = 0 ; j < nd ; j++ ) {
+      str_size += strlen( p->ctx->deps[j].dep_lib_name ) + 1;
+    }
+    num_funcs += nf;
+    num_deps += nd;
+  }
+  func_off = sizeof( manifest_hdr_t ) + cpf->num_plugins * sizeof( manifest_entry_t );
+  dep_off = func_off + num_funcs * sizeof( manifest_func_t );
+  str_off = dep_off + num_deps * sizeof( uint64_t );
+  size = str_off + str_size;
+
+  if ( ( buf = (uint8_t *)calloc( 1, size ) ) == NULL ) {
+    LOG_ERROR( "Cannot allocate memory for the manifest cache!" )
+    return NULL;
+  }
+  hdr = (manifest_hdr_t *)buf;
+  e = (manifest_entry_t *)( hdr + 1 );
+  // plugins are sorted by path (see sort_plugins()), so the entries are too
+  for ( i = 0 ; i < cpf->num_plugins ; i++ ) {
+    p = &cpf->plugin[i];
+    e[i].file_id = p->file_id;
+    memcpy( e[i].blake2s256, p->blake2s256, sizeof( e[i].blake2s256 ) );
+    e[i].ctor_offset = ( p->ctor != NULL ) ? (uint64_t)( p->ctor - p->base_addr ) : 0;
+    e[i].dtor_offset = ( p->dtor != NULL ) ? (uint64_t)( p->dtor - p->base_addr ) : 0;
+    e[i].init_ctx_offset = (uint64_t)( p->init_ctx - p->base_addr );
+    e[i].export_state_offset = ( p->export_state != NULL ) ?
+                               (uint64_t)( p->export_state - p->base_addr ) : 0;
+    e[i].import_state_offset = ( p->import_state != NULL ) ?
+                               (uint64_t)( p->import_state - p->base_addr ) : 0;
+    e[i].prefork_offset = ( p->prefork != NULL ) ? (uint64_t)( p->prefork - p->base_addr ) : 0;
+    e[i].postfork_parent_offset = ( p->postfork_parent != NULL ) ?
+                                  (uint64_t)( p->postfork_parent - p->base_addr ) : 0;
+    e[i].ctor_child_offset = ( p->ctor_child != NULL ) ? (uint64_t)( p->ctor_child - p->base_addr ) : 0;
+    e[i].path_off = put_str( buf, &str_off, p->path );
+
+    e[i].num_funcs = plugin_num_funcs( p->lib_func );
+    e[i].funcs_off = func_off;
+    mf = (manifest_func_t *)( buf + func_off );
+    for ( j = 0 ; j < e[i].num_funcs ; j++ ) {
+      mf[j].func_offset = p->lib_func[j].func_offset;
+      mf[j].flags = p->lib_func[j].flags;
+      mf[j].fproto = (uint32_t)p->lib_func[j].fproto;
+      if ( p->lib_func[j].func_name != NULL ) {
+        mf[j].name_off = put_str( buf, &str_off, p->lib_func[j].func_name );
+      }
+    }
+    func_off += e[i].num_funcs * sizeof( manifest_func_t );
+
+    e[i].num_deps = plugin_num_deps( p->ctx->deps );
+    e[i].deps_off = dep_off;
+    md = (uint64_t *)( buf + dep_off );
+    for ( j = 0 ; j < e[i].num_deps ; j++ ) {
+      md[j] = put_str( buf, &str_off, p->ctx->deps[j].dep_lib_name );
+    }
+    dep_off += e[i].num_deps * sizeof( uint64_t );
+  }
+  memcpy( hdr->magic, MANIFEST_MAGIC, sizeof( hdr->magic ) );
+  hdr->version = MANIFEST_VERSION;
+  hdr->num_entries = cpf->num_plugins;
+  hdr->file_size = size;
+  hdr->checksum = fnv1a_64( FNV64_BASIS, buf + sizeof( manifest_hdr_t ), size - sizeof( manifest_hdr_t ) );
+  *image_size = size;
+  return buf;
+}
+
+
+static void
+manifest_write( cpf_t * cpf, uint8_t * buf, uint64_t size )
+{
+  char     path[MAX_PLUGIN_PATH_SIZE + sizeof( MANIFEST_EXTENSION )];
+  char     tmp_path[sizeof( path ) + 32];
+  FILE   * f;
+
+
+  // write a temporary file and rename it: readers never see a partial manifest
+  manifest_path( cpf, path, sizeof( path ) );
+  snprintf( tmp_path, sizeof( tmp_path ), "%s.%d", path, (int)getpid() );
+  if ( ( f = fopen( tmp_path, "w" ) ) == NULL ) {
+    LOG_ERROR( "Cannot write manifest cache \"%s\"!", tmp_path )
+    return;
+  }
+  if ( fwrite( buf, 1, size, f ) != size ) {
+    fclose( f );
+    f = NULL;
+  }
+  if ( ( f == NULL ) || ( fclose( f ) != 0 ) ) {
+    LOG_ERROR( "Cannot write manifest cache \"%s\"!", tmp_path )
+    unlink( tmp_path );
+    return;
+  }
+  if ( rename( tmp_path, path ) == -1 ) {
+    LOG_ERROR( "Cannot rename manifest cache \"%s\"!", tmp_path )
+    unlink( tmp_path );
+  }
+}
+
+
+/*
+ * Rewrite the manifest cache if it's stale, and publish the registry metadata
+ * if the registry is the publisher of a shared registry (see shreg_publish()).
+*/
+void
+manifest_close( cpf_t * cpf, manifest_t * m )
+{
+  uint8_t  * buf;
+  uint64_t   size;
+  bool       write = false;
+
+
+  if ( m->shared == true ) {
+    m->map = NULL;
+    m->hdr = NULL;
+    shreg_detach( cpf );
+    return;
+  }
+  if ( ( cpf->flags & CPF_FLAG_MANIFEST_CACHE ) != 0 ) {
+    if ( ( m->map != NULL ) && ( m->hdr->num_entries != cpf->num_plugins ) ) {
+      m->dirty = true; // deleted plugins
+    }
+    if ( m->map != NULL ) {
+      munmap( m->map, m->size );
+      m->map = NULL;
+      m->hdr = NULL;
+    }
+    write = m->dirty;
+    m->dirty = false;
+  }
+  if ( ( write == false ) && ( ( cpf->flags & CPF_FLAG_SHARED_PUBLISH ) == 0 ) ) {
+    return;
+  }
+  if ( ( buf = manifest_build( cpf, &size ) ) == NULL ) {
+    return;
+  }
+  if ( write == true ) {
+    manifest_write( cpf, buf, size );
+  }
+  if ( ( cpf->flags & CPF_FLAG_SHARED_PUBLISH ) != 0 ) {
+    shreg_publish( cpf, buf, size );
+  }
+  FREE( buf )
+}
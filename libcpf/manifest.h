@@ -0,0 +1,87 @@
+/*
+  libcpf - C Plugin Framework
+
+  manifest.h - header file
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __MANIFEST_H__
+#define __MANIFEST_H__
+
+#include "cpf.h"
+
+/*
+ * Manifest cache file layout (all offsets are relative to the file start):
+ *
+ *   manifest_hdr_t
+ *   manifest_entry_t[num_entries]  <== sorted by plugin path
+ *   manifest_func_t[]              <== functions of every entry
+ *   uint64_t[]                     <== dependency name offsets of every entry
+ *   char[]                         <== NUL terminated strings
+*/
+#define MANIFEST_MAGIC          "CPFMNFST"
+#define MANIFEST_VERSION        4
+
+typedef struct {
+  char     magic[8];
+  uint32_t version;
+  uint32_t num_entries;
+  uint64_t file_size;
+  uint64_t checksum;                      // FNV-1a of everything after the header
+} manifest_hdr_t;
+
+typedef struct {
+  file_id_t file_id;                      // cache key, with the plugin path
+  uint8_t   blake2s256[BLAKE2S256SIZE];
+  uint64_t  ctor_offset;                  // 0 = not defined
+  uint64_t  dtor_offset;                  // 0 = not defined
+  uint64_t  init_ctx_offset;
+  uint64_t  export_state_offset;          // 0 = not defined
+  uint64_t  import_state_offset;          // 0 = not defined
+  uint64_t  prefork_offset;               // 0 = not defined
+  uint64_t  postfork_parent_offset;       // 0 = not defined
+  uint64_t  ctor_child_offset;            // 0 = not defined
+  uint64_t  path_off;
+  uint64_t  funcs_off;
+  uint64_t  deps_off;
+  uint32_t  num_funcs;
+  uint32_t  num_deps;
+} manifest_entry_t;
+
+typedef struct {
+  uint64_t func_offset;
+  uint64_t name_off;                      // 0 = function name not defined
+  uint32_t flags;                         // CPF_EXPORT_* flags
+  uint32_t fproto;                        // enum func_prototype_t
+} manifest_func_t;
+
+typedef struct {
+  void                 * map;             // mmap'd manifest, NULL if there's no valid one
+  size_t                 size;
+  const manifest_hdr_t * hdr;
+  bool                   dirty;           // the manifest must be rewritten
+  bool                   shared;          // image of the shared registry, never written
+} manifest_t;
+
+void manifest_open( cpf_t * cpf, manifest_t * m );
+void manifest_close( cpf_t * cpf, manifest_t * m );
+bool manifest_stat_plugin( plugin_t * p );
+bool manifest_check_plugin( plugin_t * p );
+const manifest_entry_t * manifest_find( manifest_t * m, plugin_t * p );
+bool manifest_apply( manifest_t * m, const manifest_entry_t * e, plugin_t * p );
+bool manifest_bind_plugins( cpf_t * cpf, void * map, size_t size );
+
+#endif
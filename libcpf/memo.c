@@ -0,0 +1,238 @@
+/*
+  libcpf - C Plugin Framework
+
+  memo.c - memoization cache of the pure functions (CPF_EXPORT_PURE)
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "fnv.h"
+#include "memo.h"
+
+
+static memo_shard_t shard[MEMO_NUM_SHARDS] = {
+  [0 ... MEMO_NUM_SHARDS-1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+
+static uint64_t
+memo_hash( void * func_addr, uint64_t tag, fp_args_t * args )
+{
+  uint64_t h;
+
+
+  h = fnv1a_64( FNV64_BASIS, &func_addr, sizeof( func_addr ) );
+  h = fnv1a_64( h, &tag, sizeof( tag ) );
+  h = fnv1a_64( h, args->arg, args->num_args * sizeof( fp_arg_t ) );
+  return h ^ ( h >> 29 );
+}
+
+
+static inline bool
+memo_match( memo_entry_t * e, void * func_addr, uint64_t tag, fp_args_t * args )
+{
+  return ( e->func_addr == (uint64_t)(uintptr_t)func_addr ) &&
+         ( e->tag == tag ) &&
+         ( e->num_args == args->num_args ) &&
+         ( memcmp( e->arg, args->arg, args->num_args * sizeof( fp_arg_t ) ) == 0 );
+}
+
+
+/*
+ * Tag of a function that can be memoized, 0 if it can't: the function must be
+ * exported as CPF_EXPORT_PURE, take no pointer (the key is the parameters
+ * value, not what they point to) and return no pointer (an allocated result
+ * would be handed to every caller, and freed by each one). The tag comes from the plugin hash, so the
+ * results of a replaced plugin never match its new version, even if the new
+ * version is mapped at the same address; they are also dropped on replace
+ * (memo_invalidate()).
+*/
+uint64_t
+memo_tag( plugin_t * p, func_t * func )
+{
+  const fp_desc_t * desc;
+  uint8_t           i;
+
+
+  if ( ( ( func->flags & CPF_EXPORT_PURE ) == 0 ) ||
+       ( ( desc = CPF_wrapper_get_desc( func->fproto ) ) == NULL ) ||
+       ( desc->ret >= PT_POINTER_TO_VOID ) ) {
+    return 0;
+  }
+  for ( i = 0 ; i < desc->num_args ; i++ ) {
+    if ( desc->arg[i] >= PT_LONG_DOUBLE ) {
+      return 0;
+    }
+  }
+  return memo_plugin_tag( p );
+}
+
+
+uint64_t
+memo_plugin_tag( plugin_t * p )
+{
+  uint64_t tag;
+
+
+  memcpy( &tag, p->blake2s256, sizeof( tag ) );
+  return tag | 1;
+}
+
+
+// drop the results of the plugin with this tag (replaced or unloaded)
+void
+memo_invalidate( uint64_t tag )
+{
+  uint16_t i, j;
+
+
+  for ( i = 0 ; i < MEMO_NUM_SHARDS ; i++ ) {
+    pthread_mutex_lock( &shard[i].lock );
+    for ( j = 0 ; ( shard[i].entry != NULL ) && ( j < MEMO_SHARD_SIZE ) ; j++ ) {
+      if ( ( shard[i].entry[j].func_addr != 0 ) && ( shard[i].entry[j].tag == tag ) ) {
+        shard[i].entry[j].func_addr = 0;
+        shard[i].entries--;
+      }
+    }
+    pthread_mutex_unlock( &shard[i].lock );
+  }
+}
+
+
+// "args" must be zeroed before CPF_wrapper_get_args(): all the bytes are compared
+bool
+memo_lookup( void * func_addr, uint64_t tag, fp_args_t * args, void ** ret )
+{
+  uint64_t       h = memo_hash( func_addr, tag, args );
+  memo_shard_t * s = &shard[h & ( MEMO_NUM_SHARDS - 1 )];
+  memo_entry_t * e;
+  bool           hit = false;
+
+
+  pthread_mutex_lock( &s->lock );
+  if ( s->entry != NULL ) {
+    e = &s->entry[( h >> 8 ) & ( MEMO_SHARD_SIZE - 1 )];
+    if ( memo_match( e, func_addr, tag, args ) == true ) {
+      *ret = e->ret;
+      hit = true;
+    }
+  }
+  if ( hit == true ) {
+    s->hits++;
+  } else {
+    s->misses++;
+  }
+  pthread_mutex_unlock( &s->lock );
+  return hit;
+}
+
+
+void
+memo_store( void * func_addr, uint64_t tag, fp_args_t * args, void * ret )
+{
+  uint64_t       h = memo_hash( func_addr, tag, args );
+  memo_shard_t * s = &shard[h & ( MEMO_NUM_SHARDS - 1 )];
+  memo_entry_t * e;
+
+
+  pthread_mutex_lock( &s->lock );
+  if ( s->entry == NULL ) {
+    if ( ( s->entry = (memo_entry_t *)calloc( MEMO_SHARD_SIZE, sizeof( memo_entry_t ) ) ) == NULL ) {
+      LOG_ERROR( "Cannot allocate memory for the memoization cache!" )
+      exit( EXIT_FAILURE );
+    }
+  }
+  e = &s->entry[( h >> 8 ) & ( MEMO_SHARD_SIZE - 1 )];
+  if ( e->func_addr == 0 ) {
+    s->entries++;
+  } else if ( memo_match( e, func_addr, tag, args ) == false ) {
+    s->evictions++;
+  }
+  e->func_addr = (uint64_t)(uintptr_t)func_addr;
+  e->tag = tag;
+  e->num_args = args->num_args;
+  memcpy( e->arg, args->arg, args->num_args * sizeof( fp_arg_t ) );
+  e->ret = ret;
+  pthread_mutex_unlock( &s->lock );
+}
+
+
+// fork(): no shard lock can be held by another thread (see atfork.c)
+void
+memo_lock_all( void )
+{
+  uint16_t i;
+
+
+  for ( i = 0 ; i < MEMO_NUM_SHARDS ; i++ ) {
+    pthread_mutex_lock( &shard[i].lock );
+  }
+}
+
+
+void
+memo_unlock_all( void )
+{
+  uint16_t i;
+
+
+  for ( i = MEMO_NUM_SHARDS ; i > 0 ; i-- ) {
+    pthread_mutex_unlock( &shard[i-1].lock );
+  }
+}
+
+
+void
+CPF_memo_get_stats( cpf_memo_stats_t * stats )
+{
+  uint16_t i;
+
+
+  if ( stats == NULL ) {
+    LOG_ERROR( "CPF_memo_get_stats(): Parameter cannot be NULL!" )
+    return;
+  }
+  memset( stats, 0, sizeof( cpf_memo_stats_t ) );
+  for ( i = 0 ; i < MEMO_NUM_SHARDS ; i++ ) {
+    pthread_mutex_lock( &shard[i].lock );
+    stats->hits += shard[i].hits;
+    stats->misses += shard[i].misses;
+    stats->evictions += shard[i].evictions;
+    stats->entries += shard[i].entries;
+    pthread_mutex_unlock( &shard[i].lock );
+  }
+  stats->capacity = MEMO_NUM_SHARDS * MEMO_SHARD_SIZE;
+}
+
+
+// drop all the cached results and reset the statistics
+void
+CPF_memo_clear( void )
+{
+  uint16_t i;
+
+
+  for ( i = 0 ; i < MEMO_NUM_SHARDS ; i++ ) {
+    pthread_mutex_lock( &shard[i].lock );
+    FREE( shard[i].entry )
+    shard[i].hits = 0;
+    shard[i].misses = 0;
+    shard[i].evictions = 0;
+    shard[i].entries = 0;
+    pthread_mutex_unlock( &shard[i].lock );
+  }
+}
@@ -0,0 +1,56 @@
+/*
+  libcpf - C Plugin Framework
+
+  memo.h - header file
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __MEMO_H__
+#define __MEMO_H__
+
+#include <pthread.h>
+#include "cpf.h"
+
+#define MEMO_NUM_SHARDS         16                // power of 2
+#define MEMO_SHARD_SIZE         1024              // entries per shard, power of 2
+
+
+typedef struct {                          // one cached result
+  uint64_t  func_addr;                    // 0 = free
+  uint64_t  tag;                          // plugin image tag (see memo_tag())
+  uint8_t   num_args;
+  fp_arg_t  arg[FP_MAX_ARGS];
+  void    * ret;
+} memo_entry_t;
+
+typedef struct {                          // direct-mapped table, one lock
+  pthread_mutex_t lock;
+  memo_entry_t  * entry;                  // allocated on the first store
+  uint64_t        hits;
+  uint64_t        misses;
+  uint64_t        evictions;
+  uint64_t        entries;
+} memo_shard_t;
+
+uint64_t memo_tag( plugin_t * p, func_t * func );
+uint64_t memo_plugin_tag( plugin_t * p );
+void     memo_invalidate( uint64_t tag );
+bool     memo_lookup( void * func_addr, uint64_t tag, fp_args_t * args, void ** ret );
+void     memo_store( void * func_addr, uint64_t tag, fp_args_t * args, void * ret );
+void     memo_lock_all( void );
+void     memo_unlock_all( void );
+
+#endif
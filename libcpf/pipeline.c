@@ -0,0 +1,485 @@
+/*
+  libcpf - C Plugin Framework
+
+  pipeline.c - chain of plugin functions connected by lock-free queues
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cpf.h"
+#include "plugin_manager.h"
+
+#define CACHE_LINE_SIZE         64
+
+
+typedef struct {
+  _Atomic uint64_t  seq;
+  void            * item;
+} cell_t;
+
+typedef struct {                          // eventcount: futex word + waiters
+  _Atomic uint32_t  seq;
+  _Atomic uint32_t  waiters;
+} event_t;
+
+// bounded MPMC ring buffer (D. Vyukov), blocking through eventcounts
+typedef struct {
+  cell_t          * cell;
+  uint64_t          mask;
+  _Alignas( CACHE_LINE_SIZE ) _Atomic uint64_t enqueue_pos;
+  _Alignas( CACHE_LINE_SIZE ) _Atomic uint64_t dequeue_pos;
+  _Alignas( CACHE_LINE_SIZE ) event_t not_empty;
+  event_t           not_full;
+  _Atomic bool      closed;               // no more items will be pushed
+} queue_t;
+
+typedef struct {
+  cpf_pipeline_t  * pipeline;
+  char            * plugin_name;
+  char            * func_name;
+  enum func_prototype_t fproto;
+  enum param_type_t item_type;            // type of the stage function parameter
+  uint16_t          num_threads;
+  _Atomic uint16_t  running;              // running threads: the last one closes "out"
+  pthread_t       * thread;
+  queue_t         * in;
+  queue_t         * out;
+  _Atomic uint64_t  dropped;              // items not run: the function isn't loaded
+} stage_t;
+
+struct cpf_pipeline {
+  cpf_t          ** cpf;
+  uint16_t          num_stages;
+  uint16_t          batch_size;
+  stage_t         * stage;
+  queue_t         * queue;                // num_stages + 1 queues
+};
+
+
+static void
+event_wait( event_t * ev, uint32_t seq )
+{
+  atomic_fetch_add( &ev->waiters, 1 );
+  if ( atomic_load( &ev->seq ) == seq ) {
+    syscall( SYS_futex, &ev->seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0 );
+  }
+  atomic_fetch_sub( &ev->waiters, 1 );
+}
+
+
+static void
+event_signal( event_t * ev )
+{
+  atomic_fetch_add( &ev->seq, 1 );
+  if ( atomic_load( &ev->waiters ) > 0 ) {
+    syscall( SYS_futex, &ev->seq, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0 );
+  }
+}
+
+
+static bool
+queue_init( queue_t * q, uint32_t size )
+{
+  uint64_t i;
+
+
+  // size: power of 2
+  for ( q->mask = 1 ; q->mask < size ; q->mask <<= 1 );
+  if ( ( q->cell = (cell_t *)calloc( q->mask, sizeof( cell_t ) ) ) == NULL ) {
+    return false;
+  }
+  for ( i = 0 ; i < q->mask ; i++ ) {
+    atomic_store_explicit( &q->cell[i].seq, i, memory_order_relaxed );
+  }
+  q->mask--;
+  return true;
+}
+
+
+static bool
+queue_try_push( queue_t * q, void * item )
+{
+  cell_t   * c;
+  uint64_t   pos = atomic_load_explicit( &q->enqueue_pos, memory_order_relaxed ),
+             seq;
+  int64_t    diff;
+
+
+  for (;;) {
+    c = &q->cell[pos & q->mask];
+    seq = atomic_load_explicit( &c->seq, memory_order_acquire );
+    diff = (int64_t)seq - (int64_t)pos;
+    if ( diff == 0 ) {
+      if ( atomic_compare_exchange_weak_explicit( &q->enqueue_pos, &pos, pos + 1,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed ) ) {
+        break;
+      }
+    } else if ( diff < 0 ) {
+      return false; // full
+    } else {
+      pos = atomic_load_explicit( &q->enqueue_pos, memory_order_relaxed );
+    }
+  }
+  c->item = item;
+  atomic_store_explicit( &c->seq, pos + 1, memory_order_release );
+  return true;
+}
+
+
+static bool
+queue_try_pop( queue_t * q, void ** item )
+{
+  cell_t   * c;
+  uint64_t   pos = atomic_load_explicit( &q->dequeue_pos, memory_order_relaxed ),
+             seq;
+  int64_t    diff;
+
+
+  for (;;) {
+    c = &q->cell[pos & q->mask];
+    seq = atomic_load_explicit( &c->seq, memory_order_acquire );
+    diff = (int64_t)seq - (int64_t)( pos + 1 );
+    if ( diff == 0 ) {
+      if ( atomic_compare_exchange_weak_explicit( &q->dequeue_pos, &pos, pos + 1,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed ) ) {
+        break;
+      }
+    } else if ( diff < 0 ) {
+      return false; // empty
+    } else {
+      pos = atomic_load_explicit( &q->dequeue_pos, memory_order_relaxed );
+    }
+  }
+  *item = c->item;
+  atomic_store_explicit( &c->seq, pos + q->mask + 1, memory_order_release );
+  return true;
+}
+
+
+// blocks while the queue is full (backpressure)
+static void
+queue_push( queue_t * q, void * item )
+{
+  uint32_t seq;
+
+
+  for (;;) {
+    seq = atomic_load( &q->not_full.seq );
+    if ( queue_try_push( q, item ) == true ) {
+      event_signal( &q->not_empty );
+      return;
+    }
+    event_wait( &q->not_full, seq );
+  }
+}
+
+
+// blocks while the queue is empty. Returns false if it's empty and closed.
+static bool
+queue_pop( queue_t * q, void ** item )
+{
+  uint32_t seq;
+
+
+  for (;;) {
+    seq = atomic_load( &q->not_empty.seq );
+    if ( queue_try_pop( q, item ) == true ) {
+      event_signal( &q->not_full );
+      return true;
+    }
+    if ( atomic_load( &q->closed ) == true ) {
+      // an item may have been pushed right before close
+      if ( queue_try_pop( q, item ) == true ) {
+        event_signal( &q->not_full );
+        return true;
+      }
+      return false;
+    }
+    event_wait( &q->not_empty, seq );
+  }
+}
+
+
+static void
+queue_close( queue_t * q )
+{
+  atomic_store( &q->closed, true );
+  event_signal( &q->not_empty );
+}
+
+
+static void *
+stage_thread( void * arg )
+{
+  stage_t  * s = (stage_t *)arg;
+  void    ** batch;
+  void     * func_addr = NULL;
+  fp_args_t  args;
+  uint32_t   generation = 0;
+  uint16_t   n, i;
+  bool       resolved = false;
+
+
+  if ( ( batch = (void **)malloc( s->pipeline->batch_size * sizeof( void * ) ) ) == NULL ) {
+    LOG_ERROR( "Cannot allocate memory for the pipeline stage!" )
+    exit( EXIT_FAILURE );
+  }
+  memset( &args, 0, sizeof( args ) );
+  args.fproto = s->fproto;
+  args.num_args = 1;
+
+  while ( queue_pop( s->in, &batch[0] ) == true ) {
+    // batch: take what is already queued, without blocking
+    for ( n = 1 ; ( n < s->pipeline->batch_size ) && queue_try_pop( s->in, &batch[n] ) ; n++ );
+    if ( n > 1 ) {
+      event_signal( &s->in->not_full );
+    }
+
+    // the plugins can't be reloaded while the batch is running. After a
+    // reload, the function is resolved again (rebinding to the new plugin).
+    // While it isn't loaded, the items are dropped: they aren't passed on as
+    // NULL to the next stages.
+    reload_rdlock();
+    if ( ( resolved == false ) || ( (*s->pipeline->cpf)->generation != generation ) ) {
+      generation = (*s->pipeline->cpf)->generation;
+      resolved = true;
+      func_addr = get_func_addr_proto( *s->pipeline->cpf, s->plugin_name,
+                                       s->func_name, s->fproto );
+      if ( func_addr == NULL ) {
+        LOG_ERROR( "Pipeline stage \"%s\" of \"%s\" isn't loaded: items dropped until the next reload",
+                   s->func_name, s->plugin_name )
+      }
+    }
+    if ( func_addr == NULL ) {
+      reload_unlock();
+      atomic_fetch_add( &s->dropped, n );
+      continue;
+    }
+    for ( i = 0 ; i < n ; i++ ) {
+      if ( s->item_type <= PT_INT ) {
+        args.arg[0].i = (int)(int64_t)batch[i];
+      } else {
+        args.arg[0].vp = batch[i];
+      }
+      batch[i] = CPF_wrapper_call_func_by_args( func_addr, &args );
+    }
+    reload_unlock();
+
+    for ( i = 0 ; i < n ; i++ ) {
+      queue_push( s->out, batch[i] );
+    }
+  }
+  FREE( batch )
+  if ( atomic_fetch_sub( &s->running, 1 ) == 1 ) {
+    queue_close( s->out ); // last thread of the stage
+  }
+  return NULL;
+}
+
+
+/*
+ * Create a pipeline: "stages" is an array finished with a NULL plugin_name.
+ * The stage function must have one parameter, the item returned by the
+ * previous stage function (or pushed with CPF_pipeline_push()).
+*/
+cpf_pipeline_t *
+CPF_pipeline_create( cpf_t ** cpf,
+                     cpf_stage_t * stages,
+                     uint32_t queue_size,
+                     uint16_t batch_size )
+{
+  cpf_pipeline_t  * p;
+  const fp_desc_t * desc;
+  uint16_t          i, t;
+
+
+  if ( ( cpf == NULL ) || ( *cpf == NULL ) || ( stages == NULL ) ) {
+    LOG_ERROR( "CPF_pipeline_create(): Parameters cannot be NULL!" )
+    return NULL;
+  }
+  if ( ( p = (cpf_pipeline_t *)calloc( 1, sizeof( cpf_pipeline_t ) ) ) == NULL ) {
+    LOG_ERROR( "CPF_pipeline_create(): Cannot allocate memory for the pipeline!" )
+    exit( EXIT_FAILURE );
+  }
+  for ( p->num_stages = 0 ; stages[p->num_stages].plugin_name != NULL ; p->num_stages++ ) {
+    desc = CPF_wrapper_get_desc( stages[p->num_stages].fproto );
+    if ( ( desc == NULL ) || ( desc->num_args != 1 ) ||
+         ( desc->arg[0] == PT_FLOAT ) || ( desc->arg[0] == PT_DOUBLE ) ||
+         ( desc->arg[0] == PT_LONG_DOUBLE ) ) {
+      LOG_ERROR( "CPF_pipeline_create(): stage \"%s\" function \"%s\" must have "
+                 "one integer or pointer parameter!",
+                 stages[p->num_stages].plugin_name,
+                 stages[p->num_stages].func_name )
+      FREE( p )
+      return NULL;
+    }
+    if ( get_func_addr_proto( *cpf,
+                              stages[p->num_stages].plugin_name,
+                              stages[p->num_stages].func_name,
+                              stages[p->num_stages].fproto ) == NULL ) {
+      FREE( p )
+      return NULL;
+    }
+  }
+  if ( p->num_stages == 0 ) {
+    LOG_ERROR( "CPF_pipeline_create(): There is no stage!" )
+    FREE( p )
+    return NULL;
+  }
+  p->cpf = cpf;
+  p->batch_size = ( batch_size > 0 ) ? batch_size : 1;
+  p->stage = (stage_t *)calloc( p->num_stages, sizeof( stage_t ) );
+  p->queue = (queue_t *)aligned_alloc( CACHE_LINE_SIZE, ( p->num_stages + 1 ) * sizeof( queue_t ) );
+  if ( ( p->stage == NULL ) || ( p->queue == NULL ) ) {
+    LOG_ERROR( "CPF_pipeline_create(): Cannot allocate memory for the pipeline!" )
+    exit( EXIT_FAILURE );
+  }
+  memset( p->queue, 0, ( p->num_stages + 1 ) * sizeof( queue_t ) );
+  for ( i = 0 ; i <= p->num_stages ; i++ ) {
+    if ( queue_init( &p->queue[i], ( queue_size > 1 ) ? queue_size : 2 ) == false ) {
+      LOG_ERROR( "CPF_pipeline_create(): Cannot allocate memory for the queues!" )
+      exit( EXIT_FAILURE );
+    }
+  }
+
+  for ( i = 0 ; i < p->num_stages ; i++ ) {
+    p->stage[i].pipeline = p;
+    p->stage[i].plugin_name = strdup( stages[i].plugin_name );
+    p->stage[i].func_name = strdup( stages[i].func_name );
+    p->stage[i].fproto = stages[i].fproto;
+    p->stage[i].item_type = CPF_wrapper_get_desc( stages[i].fproto )->arg[0];
+    p->stage[i].num_threads = ( stages[i].num_threads > 0 ) ? stages[i].num_threads : 1;
+    p->stage[i].in = &p->queue[i];
+    p->stage[i].out = &p->queue[i + 1];
+    p->stage[i].thread = (pthread_t *)calloc( p->stage[i].num_threads, sizeof( pthread_t ) );
+    if ( ( p->stage[i].plugin_name == NULL ) || ( p->stage[i].func_name == NULL ) ||
+         ( p->stage[i].thread == NULL ) ) {
+      LOG_ERROR( "CPF_pipeline_create(): Cannot allocate memory for the stages!" )
+      exit( EXIT_FAILURE );
+    }
+    atomic_store( &p->stage[i].running, p->stage[i].num_threads );
+    for ( t = 0 ; t < p->stage[i].num_threads ; t++ ) {
+      if ( pthread_create( &p->stage[i].thread[t], NULL, stage_thread, &p->stage[i] ) != 0 ) {
+        LOG_ERROR( "CPF_pipeline_create(): Cannot create stage thread!" )
+        exit( EXIT_FAILURE );
+      }
+    }
+  }
+  return p;
+}
+
+
+// blocks while the first stage queue is full
+void
+CPF_pipeline_push( cpf_pipeline_t * p, void * item )
+{
+  queue_push( &p->queue[0], item );
+}
+
+
+bool
+CPF_pipeline_try_push( cpf_pipeline_t * p, void * item )
+{
+  if ( queue_try_push( &p->queue[0], item ) == false ) {
+    return false;
+  }
+  event_signal( &p->queue[0].not_empty );
+  return true;
+}
+
+
+// blocks until the last stage returns an item. Returns false at the end of
+// the stream (after CPF_pipeline_close()).
+bool
+CPF_pipeline_pop( cpf_pipeline_t * p, void ** item )
+{
+  return queue_pop( &p->queue[p->num_stages], item );
+}
+
+
+bool
+CPF_pipeline_try_pop( cpf_pipeline_t * p, void ** item )
+{
+  if ( queue_try_pop( &p->queue[p->num_stages], item ) == false ) {
+    return false;
+  }
+  event_signal( &p->queue[p->num_stages].not_full );
+  return true;
+}
+
+
+// items dropped by the stages whose function wasn't loaded (see stage_thread())
+uint64_t
+CPF_pipeline_dropped( cpf_pipeline_t * p )
+{
+  uint64_t dropped = 0;
+  uint16_t i;
+
+
+  for ( i = 0 ; i < p->num_stages ; i++ ) {
+    dropped += atomic_load( &p->stage[i].dropped );
+  }
+  return dropped;
+}
+
+
+// end of the input stream: the stages finish the queued items and exit
+void
+CPF_pipeline_close( cpf_pipeline_t * p )
+{
+  queue_close( &p->queue[0] );
+}
+
+
+// close the pipeline, discard the remaining output items and free it
+void
+CPF_pipeline_free( cpf_pipeline_t ** p )
+{
+  void   * item;
+  uint16_t i, t;
+
+
+  if ( (*p) == NULL ) {
+    return;
+  }
+  CPF_pipeline_close( *p );
+  while ( CPF_pipeline_pop( *p, &item ) == true ); // unblock the last stage
+  for ( i = 0 ; i < (*p)->num_stages ; i++ ) {
+    for ( t = 0 ; t < (*p)->stage[i].num_threads ; t++ ) {
+      pthread_join( (*p)->stage[i].thread[t], NULL );
+    }
+    FREE( (*p)->stage[i].thread )
+    FREE( (*p)->stage[i].plugin_name )
+    FREE( (*p)->stage[i].func_name )
+  }
+  for ( i = 0 ; i <= (*p)->num_stages ; i++ ) {
+    FREE( (*p)->queue[i].cell )
+  }
+  FREE( (*p)->queue )
+  FREE( (*p)->stage )
+  FREE( (*p) )
+}
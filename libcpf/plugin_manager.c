@@ -21,16 +21,39 @@
 #ifndef _GNU_SOURCE
 #define _GNU_SOURCE
 #endif
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <link.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <dirent.h>
 #include <dlfcn.h>
 #include <elf.h>
+#include <gnu/lib-names.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include "plugin_manager.h"
 #include "log.h"
 #include "blake2.h"
+#include "bundle.h"
+#include "hotpatch.h"
+#include "manifest.h"
+#include "prefault.h"
+#include "rdeps.h"
+#include "services.h"
+#include "shared_registry.h"
+#include "static_plugin.h"
+#include "usdt.h"
+
+
+struct cpf_pin {                          // keeps a plugin version mapped while calls run it
+  _Atomic uint32_t   refs;                // 1 while in the registry, + 1 per running call
+  void             * dlhandle;            // closed by the last call, once out of the registry
+  int                memfd;
+};
 
 
 static int
@@ -51,230 +74,803 @@ sort_plugins( cpf_t * cpf )
 }
 
 
-void
-load_plugins_2_reload( cpf_t * cpf )
+/*
+ * Copy a plugin image in a new memfd. dlopen() of "/proc/self/fd/<fd>" maps a
+ * new file each time. The memfd stays open while the plugin is loaded: glibc
+ * would hand back the mapping of a closed memfd whose number is reused.
+*/
+static int
+memfd_from_buffer( const char * name, const void * data, size_t len )
+{
+  ssize_t n;
+  size_t  done = 0;
+  int     fd;
+
+
+  if ( ( fd = memfd_create( name, MFD_CLOEXEC ) ) == -1 ) {
+    LOG_ERROR( "memfd_create(): %s", strerror( errno ) )
+    return -1;
+  }
+  if ( fd == 0 ) { // stdin was closed: 0 means "no memfd" in plugin_t
+    fd = fcntl( 0, F_DUPFD_CLOEXEC, 3 );
+    close( 0 );
+    if ( fd == -1 ) {
+      LOG_ERROR( "fcntl(): %s", strerror( errno ) )
+      return -1;
+    }
+  }
+  while ( done < len ) {
+    if ( ( n = write( fd, (const char *)data + done, len - done ) ) <= 0 ) {
+      if ( ( n == -1 ) && ( errno == EINTR ) ) {
+        continue;
+      }
+      LOG_ERROR( "Cannot write \"%s\" in memfd: %s", name, strerror( errno ) )
+      close( fd );
+      return -1;
+    }
+    done += n;
+  }
+  return fd;
+}
+
+
+// shadow copy of a plugin file (CPF_FLAG_SHADOW_COPY)
+static int
+memfd_from_file( const char * path )
+{
+  struct stat st;
+  void      * data;
+  int         fd, mfd;
+
+
+  if ( ( fd = open( path, O_RDONLY | O_CLOEXEC ) ) == -1 ) {
+    LOG_ERROR( "Couldn't open plugin \"%s\"", path )
+    return -1;
+  }
+  if ( ( fstat( fd, &st ) == -1 ) ||
+       ( ( data = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 ) ) == MAP_FAILED ) ) {
+    LOG_ERROR( "Couldn't map plugin \"%s\": %s", path, strerror( errno ) )
+    close( fd );
+    return -1;
+  }
+  mfd = memfd_from_buffer( path, data, st.st_size );
+  munmap( data, st.st_size );
+  close( fd );
+  return mfd;
+}
+
+
+/*
+ * With RTLD_GLOBAL, the symbols of every plugin are added to the global scope:
+ * each symbol lookup searches all the loaded plugins, and same-named functions
+ * interpose each other. Plugins only reach each other through their
+ * dependencies (deps_t), so they can be kept out of the global scope
+ * (CPF_FLAG_RTLD_LOCAL), or loaded in one dlmopen() namespace per registry
+ * (CPF_FLAG_DLMOPEN), with its own copy of the plugin libraries (e.g. libc).
+*/
+static void *
+dlopen_plugin( cpf_t * cpf, const char * path )
+{
+  void * handle;
+  Lmid_t lmid;
+
+
+  if ( ( cpf->flags & CPF_FLAG_DLMOPEN ) == 0 ) {
+    return dlopen( path,
+                   RTLD_NOW | ( ( ( cpf->flags & CPF_FLAG_RTLD_LOCAL ) != 0 ) ?
+                                RTLD_LOCAL : RTLD_GLOBAL ) );
+  }
+  if ( cpf->lmid != 0 ) { // a failure is reported as is: no other namespace
+    return dlmopen( cpf->lmid, path, RTLD_NOW | RTLD_LOCAL );
+  }
+  // first plugin of the registry: new namespace
+  if ( ( handle = dlmopen( LM_ID_NEWLM, path, RTLD_NOW | RTLD_LOCAL ) ) == NULL ) {
+    return NULL;
+  }
+  if ( dlinfo( handle, RTLD_DI_LMID, &lmid ) == -1 ) {
+    LOG_ERROR( "RTLD_DI_LMID failed: %s", dlerror() )
+    exit( EXIT_FAILURE );
+  }
+  cpf->lmid = lmid;
+  // keeps the namespace when all the plugins are closed (unload, reload)
+  if ( ( cpf->lmid_anchor = dlmopen( lmid, LIBC_SO, RTLD_NOW | RTLD_LOCAL ) ) == NULL ) {
+    LOG_ERROR( "dlmopen(): %s", dlerror() )
+    exit( EXIT_FAILURE );
+  }
+  return handle;
+}
+
+
+/*
+ * True if "path" is already mapped in the namespace of the registry: dlopen()
+ * returns the live mapping (e.g. an unmodified plugin on reload), which other
+ * threads may be running.
+*/
+static bool
+already_mapped( cpf_t * cpf, const char * path )
+{
+  void * handle;
+
+
+  if ( ( cpf->flags & CPF_FLAG_DLMOPEN ) == 0 ) {
+    handle = dlopen( path, RTLD_NOW | RTLD_NOLOAD );
+  } else {
+    handle = ( cpf->lmid != 0 ) ? dlmopen( cpf->lmid, path, RTLD_NOW | RTLD_NOLOAD ) : NULL;
+  }
+  if ( handle == NULL ) {
+    return false;
+  }
+  dlclose( handle );
+  return true;
+}
+
+
+/*
+ * dlopen the plugin (from "dlpath", "p->path" if NULL) and check its ELF header.
+ * "mapped" is set if dlopen() returned a mapping already loaded. NULL if the
+ * plugin can't be opened (p->dlhandle is NULL).
+*/
+static ElfW(Dyn) *
+open_plugin( cpf_t * cpf, plugin_t * p, const char * dlpath, bool * mapped )
 {
   ElfW(Ehdr)      * elf_header;
-  //ElfW(Phdr)      * prog_header;
-  ElfW(Dyn)       * dynamic;
-  ElfW(Sym)       * symtable;
-  void            * strtable;
-  void            * fcn_addr;
-  uint16_t          i, j,
-                    num_funcs,
-                    p_count, // plugin counter
-                    symtbltotalsize,
-                    symtblentrysize = 0;
   struct link_map * lnkmap;
 
 
-  if ( cpf == NULL ) {
-    return;
+  *mapped = already_mapped( cpf, ( dlpath != NULL ) ? dlpath : p->path );
+  USDT_PROBE2( plugin_open_start, p->name, p->path );
+  p->dlhandle = dlopen_plugin( cpf, ( dlpath != NULL ) ? dlpath : p->path );
+  USDT_PROBE3( plugin_open_end, p->name, p->path, p->dlhandle );
+  if ( p->dlhandle == NULL ) {
+    LOG_ERROR( "dlopen(): %s", dlerror() )
+    return NULL;
   }
-  if ( cpf->num_plugins == 0 ) {
-    return;
+
+  if ( dlinfo( p->dlhandle, RTLD_DI_LINKMAP, &lnkmap ) == -1 ) {
+    LOG_ERROR( "RTLD_DI_LINKMAP failed: %s", dlerror() )
+    goto invalid;
   }
 
-  for( p_count = 0 ; p_count < cpf->num_plugins ; p_count++ ) {
-    num_funcs = 0;
-    cpf->plugin[p_count].dlhandle =
-      dlopen( cpf->plugin[p_count].path, RTLD_NOW | RTLD_GLOBAL );
-    if ( cpf->plugin[p_count].dlhandle == NULL ) {
-      LOG_ERROR( "dlopen(): %s", dlerror() )
-      exit( EXIT_FAILURE );
+  p->base_addr = (void *)lnkmap->l_addr;
+
+  elf_header = (ElfW(Ehdr)*) p->base_addr;
+
+  /* ELF magic number */
+  if (memcmp(elf_header->e_ident, ELFMAG, SELFMAG) != 0) {
+    LOG_ERROR( "ELF magic number not found!" )
+    goto invalid;
+  }
+
+  // AMD x86-64 architecture only
+  if ( elf_header->e_machine != EM_X86_64 ) {
+    LOG_ERROR( "Architecture not compatible!" )
+    goto invalid;
+  }
+
+  // Shared Library
+  if ( elf_header->e_type != ET_DYN ) {
+    LOG_ERROR( "This file \"%s\" isn't shared lib!", p->path )
+    goto invalid;
+  }
+
+  return lnkmap->l_ld;
+
+invalid:
+  dlclose( p->dlhandle );
+  p->dlhandle = NULL;
+  return NULL;
+}
+
+
+// call "fcn" for each CPF_EXPORT() note of the plugin. Returns the number of notes.
+static uint16_t
+for_each_export_note( plugin_t * p,
+                      void ( *fcn )( plugin_t *, const cpf_export_note_t *, uint16_t ) )
+{
+  ElfW(Ehdr)              * elf_header = (ElfW(Ehdr) *)p->base_addr;
+  ElfW(Phdr)              * phdr = (ElfW(Phdr) *)( p->base_addr + elf_header->e_phoff );
+  const ElfW(Nhdr)        * nhdr;
+  const char              * note, * end;
+  uint16_t                  i, n = 0;
+
+
+  for ( i = 0 ; i < elf_header->e_phnum ; i++ ) {
+    if ( phdr[i].p_type != PT_NOTE ) {
+      continue;
     }
+    note = (const char *)( p->base_addr + phdr[i].p_vaddr );
+    end = note + phdr[i].p_memsz;
+    while ( note + sizeof( ElfW(Nhdr) ) <= end ) {
+      nhdr = (const ElfW(Nhdr) *)note;
+      if ( ( nhdr->n_type == CPF_NOTE_EXPORT ) &&
+           ( nhdr->n_namesz == sizeof( CPF_NOTE_NAME ) ) &&
+           ( nhdr->n_descsz == sizeof( cpf_export_note_t ) - offsetof( cpf_export_note_t, flags ) ) &&
+           ( memcmp( note + sizeof( ElfW(Nhdr) ), CPF_NOTE_NAME, sizeof( CPF_NOTE_NAME ) ) == 0 ) ) {
+        if ( fcn != NULL ) {
+          fcn( p, (const cpf_export_note_t *)note, n );
+        }
+        n++;
+      }
+      note += sizeof( ElfW(Nhdr) ) +
+              ( ( nhdr->n_namesz + 3 ) & ~3 ) + ( ( nhdr->n_descsz + 3 ) & ~3 );
+    }
+  }
+  return n;
+}
 
-    if ( dlinfo(cpf->plugin[p_count].dlhandle, RTLD_DI_LINKMAP, &lnkmap) == -1 ) {
-      LOG_ERROR( "RTLD_DI_LINKMAP failed: %s", dlerror() )
-      exit( EXIT_FAILURE );
+
+static void
+bind_export( plugin_t * p, const cpf_export_note_t * export, uint16_t n )
+{
+  const fp_desc_t * desc;
+  void            * fcn_addr;
+
+
+  if ( ( memchr( export->name, '\0', sizeof( export->name ) ) == NULL ) ||
+       ( memchr( export->proto, '\0', sizeof( export->proto ) ) == NULL ) ) {
+    LOG_ERROR( "Invalid export manifest in plugin \"%s"PLUGIN_EXTENSION"\"!", p->name )
+    return; // func_addr stays NULL: see read_export_manifest()
+  }
+  if ( ( fcn_addr = dlsym( p->dlhandle, export->name ) ) == NULL ) {
+    LOG_ERROR( "Exported function \"%s\" not found in plugin \"%s"PLUGIN_EXTENSION"\"!",
+               export->name, p->name )
+    return;
+  }
+  p->lib_func[n].func_addr = fcn_addr;
+  p->lib_func[n].func_offset = (uint64_t)( fcn_addr - p->base_addr );
+  p->lib_func[n].func_name = (char *)export->name; // mapped with the plugin
+  p->lib_func[n].flags = export->flags;
+  if ( ( desc = CPF_wrapper_get_desc_by_name( export->proto ) ) != NULL ) {
+    p->lib_func[n].fproto = desc->fproto;
+  } else {
+    LOG_ERROR( "Unknown prototype \"%s\" of \"%s\" in plugin \"%s"PLUGIN_EXTENSION"\": "
+               "not checked!",
+               export->proto, export->name, p->name )
+  }
+}
+
+
+/*
+ * Bind the plugin functions from the export manifest (CPF_EXPORT() notes), if
+ * the plugin has one ("found"): the work depends on the number of exported
+ * functions, not on the size of the dynamic symbol table. False if the
+ * manifest is invalid.
+*/
+static bool
+read_export_manifest( plugin_t * p, bool * found )
+{
+  uint16_t num_funcs,
+           i;
+
+
+  if ( ( *found = ( ( num_funcs = for_each_export_note( p, NULL ) ) > 0 ) ) == false ) {
+    return true;
+  }
+  // num_funcs + 1 = will be used to detect the end of struct (NULL value)
+  p->lib_func = (func_t *)calloc( num_funcs + 1, sizeof( func_t ) );
+  if ( p->lib_func == NULL ) {
+    LOG_ERROR( "Cannot allocate memory for plugins' functions!!" )
+    exit( EXIT_FAILURE );
+  }
+  for_each_export_note( p, bind_export );
+  for ( i = 0 ; i < num_funcs ; i++ ) {
+    if ( p->lib_func[i].func_addr == NULL ) {
+      FREE( p->lib_func )
+      return false;
     }
+  }
 
-    cpf->plugin[p_count].base_addr = (void *)lnkmap->l_addr;
-    dynamic = lnkmap->l_ld;
+  p->ctor = dlsym( p->dlhandle, PLUGIN_CONSTRUCTOR_FUNC );
+  p->dtor = dlsym( p->dlhandle, PLUGIN_DESTRUCTOR_FUNC );
+  p->export_state = dlsym( p->dlhandle, PLUGIN_EXPORT_STATE_FUNC );
+  p->import_state = dlsym( p->dlhandle, PLUGIN_IMPORT_STATE_FUNC );
+  p->prefork = dlsym( p->dlhandle, PLUGIN_PREFORK_FUNC );
+  p->postfork_parent = dlsym( p->dlhandle, PLUGIN_POSTFORK_FUNC );
+  p->ctor_child = dlsym( p->dlhandle, PLUGIN_CTOR_CHILD_FUNC );
+  if ( ( p->init_ctx = dlsym( p->dlhandle, PLUGIN_INIT_CTX_FUNC ) ) == NULL ) {
+    LOG_ERROR( "\""PLUGIN_INIT_CTX_FUNC"\"() not found in plugin "
+               "\"%s"PLUGIN_EXTENSION"\".\n"
+               "Cannot initializate plugin system!",
+               p->name )
+    FREE( p->lib_func )
+    return false;
+  }
+  return true;
+}
 
-    elf_header = (ElfW(Ehdr)*) cpf->plugin[p_count].base_addr;
-	
-    /* ELF magic number */
-    if (memcmp(elf_header->e_ident, ELFMAG, SELFMAG) != 0) {
-      LOG_ERROR( "ELF magic number not found!" )
-      dlclose(cpf->plugin[p_count].dlhandle);
-      exit( EXIT_FAILURE );
+
+// scan the dynamic symbol table: bind the constructor, destructor and ctx
+// functions, if exits, and set the plugin functions (lib_func). False if the
+// plugin has no ctx function or no function.
+static bool
+scan_plugin_symbols( plugin_t * p, ElfW(Dyn) * dynamic )
+{
+  ElfW(Sym)       * symtable;
+  void            * strtable;
+  void            * fcn_addr;
+  char            * sym_name;
+  uint16_t          i, j,
+                    num_funcs = 0,
+                    symtbltotalsize,
+                    symtblentrysize = 0;
+
+
+  symtable = NULL;
+  strtable = NULL;
+  for ( i = 0 ; dynamic[i].d_tag != DT_NULL ; i++ ) {
+    if ( dynamic[i].d_tag == DT_SYMTAB ) {
+      symtable = (ElfW(Sym) *)dynamic[i].d_un.d_val;
+      continue;
     }
-	
-    // AMD x86-64 architecture only
-    if ( elf_header->e_machine != EM_X86_64 ) {
-      LOG_ERROR( "Architecture not compatible!" )
-      dlclose(cpf->plugin[p_count].dlhandle);
-      exit( EXIT_FAILURE );
+    if (dynamic[i].d_tag == DT_STRTAB ) {
+      strtable = (void *)dynamic[i].d_un.d_val;
+      continue;
     }
-
-    // Shared Library
-    if ( elf_header->e_type != ET_DYN ) {
-      LOG_ERROR( "This file \"%s\" isn't shared lib!", cpf->plugin[p_count].path )
-      dlclose( cpf->plugin[p_count].dlhandle );
-      exit( EXIT_FAILURE );
+    if ( dynamic[i].d_tag == DT_SYMENT ) {
+      symtblentrysize = dynamic[i].d_un.d_val;
+      continue;
     }
+  }
 
-    symtable = NULL;
-    strtable = NULL;
-    for ( i = 0 ; dynamic[i].d_tag != DT_NULL ; i++ ) {
-      if ( dynamic[i].d_tag == DT_SYMTAB ) {
-        symtable = (ElfW(Sym) *)dynamic[i].d_un.d_val;
+  // count the number of plugin functions, without constructor, destructor and
+  // context (ctx), and bind the constructor, destructor and ctx functions,
+  // if exits.
+  symtbltotalsize = ( (strtable - (void *)symtable)/symtblentrysize );
+  for ( i = 0 ; i < symtbltotalsize ; i++ ) {
+    if ( ( ELF64_ST_TYPE( symtable[i].st_info ) == STT_FUNC ) &&
+         ( symtable[i].st_value > 0 ) ) {
+      fcn_addr = p->base_addr + symtable[i].st_value;
+      sym_name = ( symtable[i].st_name != 0 ) ?
+                 (char *)(strtable + symtable[i].st_name) : "";
+      if ( strcmp( sym_name, PLUGIN_CONSTRUCTOR_FUNC ) == 0 ) {
+        p->ctor = fcn_addr;
         continue;
       }
-      if (dynamic[i].d_tag == DT_STRTAB ) {
-        strtable = (void *)dynamic[i].d_un.d_val;
-	      continue;
-	    }
-      if ( dynamic[i].d_tag == DT_SYMENT ) {
-        symtblentrysize = dynamic[i].d_un.d_val;
+      if ( strcmp( sym_name, PLUGIN_DESTRUCTOR_FUNC ) == 0 ) {
+        p->dtor = fcn_addr;
         continue;
       }
+      if ( strcmp( sym_name, PLUGIN_INIT_CTX_FUNC ) == 0 ) {
+        p->init_ctx = fcn_addr;
+        continue;
+      }
+      if ( strcmp( sym_name, PLUGIN_EXPORT_STATE_FUNC ) == 0 ) {
+        p->export_state = fcn_addr;
+        continue;
+      }
+      if ( strcmp( sym_name, PLUGIN_IMPORT_STATE_FUNC ) == 0 ) {
+        p->import_state = fcn_addr;
+        continue;
+      }
+      if ( strcmp( sym_name, PLUGIN_PREFORK_FUNC ) == 0 ) {
+        p->prefork = fcn_addr;
+        continue;
+      }
+      if ( strcmp( sym_name, PLUGIN_POSTFORK_FUNC ) == 0 ) {
+        p->postfork_parent = fcn_addr;
+        continue;
+      }
+      if ( strcmp( sym_name, PLUGIN_CTOR_CHILD_FUNC ) == 0 ) {
+        p->ctor_child = fcn_addr;
+        continue;
+      }
+      // "valid" function found
+      num_funcs++;
     }
+  }
+  if ( p->init_ctx == NULL ) {
+    LOG_ERROR( "\""PLUGIN_INIT_CTX_FUNC"\"() not found in plugin "
+               "\"%s"PLUGIN_EXTENSION"\".\n"
+               "Cannot initializate plugin system!",
+               p->name )
+    return false;
+  }
 
-    // count the number of plugin functions, without constructor, destructor and
-    // context (ctx), and bind the constructor, destructor and ctx functions,
-    // if exits.
-    symtbltotalsize = ( (strtable - (void *)symtable)/symtblentrysize );
-    for ( i = 0 ; i < symtbltotalsize ; i++ ) {
-      if ( ( ELF64_ST_TYPE( symtable[i].st_info ) == STT_FUNC ) &&
-           ( symtable[i].st_value > 0 ) ) {
-        fcn_addr = cpf->plugin[p_count].base_addr + symtable[i].st_value;
-        if ( ( symtable[i].st_name != 0 ) &&
-             ( *(char *)(strtable + symtable[i].st_name) != 0 ) &&
-             ( strcmp( (char *)(strtable + symtable[i].st_name),
-                       PLUGIN_CONSTRUCTOR_FUNC ) == 0 ) ) {
-          cpf->plugin[p_count].ctor = fcn_addr;
-          continue;
-        }
-        if ( ( symtable[i].st_name != 0 ) &&
-             ( *(char *)(strtable + symtable[i].st_name) != 0 ) &&
-             ( strcmp( (char *)(strtable + symtable[i].st_name),
-                       PLUGIN_DESTRUCTOR_FUNC ) == 0 ) ) {
-          cpf->plugin[p_count].dtor = fcn_addr;
-          continue;
-        }
-        if ( ( symtable[i].st_name != 0 ) &&
-             ( *(char *)(strtable + symtable[i].st_name) != 0 ) &&
-             ( strcmp( (char *)(strtable + symtable[i].st_name),
-                       PLUGIN_INIT_CTX_FUNC ) == 0 ) ) {
-          cpf->plugin[p_count].init_ctx = fcn_addr;
-          // call CPF_init_ctx() from plugin, using function ptr "init_plugin_ctx"
-          plugin_ctx_t * (*init_plugin_ctx)() = fcn_addr;
-          if ( ( cpf->plugin[p_count].ctx = init_plugin_ctx() ) == NULL ) {
-            LOG_ERROR( "Cannot initializate plugin \"%s"PLUGIN_EXTENSION"\" context! "
-                       "Look at \""PLUGIN_INIT_CTX_FUNC"()\" function.",
-                       cpf->plugin[p_count].name )
-            exit( EXIT_FAILURE );
-          }
-          if ( cpf->plugin[p_count].ctx->deps == NULL ) {
-            LOG_ERROR( "Cannot initializate plugin \"%s"PLUGIN_EXTENSION"\" dependencies! "
-                       "Look at \""PLUGIN_INIT_CTX_FUNC"()\" function and "
-                       "set the plugin context dependency!",
-                       cpf->plugin[p_count].name )
-            exit( EXIT_FAILURE );
-          }         
-          continue;
-        }
-        // "valid" function found
-        num_funcs++;
+  if ( num_funcs == 0 ) {
+    LOG_ERROR( "No functions found in plugin \"%s"PLUGIN_EXTENSION"\"!",
+               p->name )
+    return false;
+  }
+
+  // num_funcs + 1 = will be used to detect the end of struct (NULL value)
+  p->lib_func = (func_t *)calloc( num_funcs + 1, sizeof( func_t ) );
+  if ( p->lib_func == NULL ) {
+    LOG_ERROR( "Cannot allocate memory for plugins' functions!!" )
+    exit( EXIT_FAILURE );
+  }
+
+  j=0;
+  for ( i = 0 ; i < symtbltotalsize ; i++ ) {
+    fcn_addr = p->base_addr + symtable[i].st_value;
+    if ( ( ELF64_ST_TYPE( symtable[i].st_info ) == STT_FUNC ) &&
+         ( symtable[i].st_value > 0 ) &&
+         ( p->ctor != fcn_addr ) &&
+         ( p->dtor != fcn_addr ) &&
+         ( p->init_ctx != fcn_addr ) &&
+         ( p->export_state != fcn_addr ) &&
+         ( p->import_state != fcn_addr ) &&
+         ( p->prefork != fcn_addr ) &&
+         ( p->postfork_parent != fcn_addr ) &&
+         ( p->ctor_child != fcn_addr ) ) {
+      p->lib_func[j].func_addr = fcn_addr;
+      p->lib_func[j].func_offset = (uint64_t)symtable[i].st_value;
+      p->lib_func[j].func_name = NULL;
+      if ( ( symtable[i].st_name != 0 ) &&
+           ( *(char *)(strtable + symtable[i].st_name) != 0 ) ) {
+        p->lib_func[j].func_name = (char *)(strtable + symtable[i].st_name);
       }
+      j++;
     }
-    if ( cpf->plugin[p_count].init_ctx == NULL ) {
-      LOG_ERROR( "\""PLUGIN_INIT_CTX_FUNC"\"() not found in plugin "
-                 "\"%s"PLUGIN_EXTENSION"\".\n"
-                 "Cannot initializate plugin system!",
-                 cpf->plugin[p_count].name )
-      exit( EXIT_FAILURE );
+  }
+  return true;
+}
+
+
+// call CPF_init_ctx() from plugin, using function ptr "init_plugin_ctx".
+// False if the plugin context is invalid.
+bool
+init_plugin_ctx( plugin_t * p )
+{
+  plugin_ctx_t * (*init_plugin_ctx)() = p->init_ctx;
+
+
+  if ( ( p->ctx = init_plugin_ctx() ) == NULL ) {
+    LOG_ERROR( "Cannot initializate plugin \"%s"PLUGIN_EXTENSION"\" context! "
+               "Look at \""PLUGIN_INIT_CTX_FUNC"()\" function.",
+               p->name )
+    return false;
+  }
+  if ( p->ctx->deps == NULL ) {
+    LOG_ERROR( "Cannot initializate plugin \"%s"PLUGIN_EXTENSION"\" dependencies! "
+               "Look at \""PLUGIN_INIT_CTX_FUNC"()\" function and "
+               "set the plugin context dependency!",
+               p->name )
+    return false;
+  }
+  // version default value, if not defined
+  if ( p->ctx->version[0] == '\0' ) {
+    strcpy( p->ctx->version, NOT_DEFINED );
+  }
+  // host services (allocator, arenas, output buffers), before the constructor
+  p->ctx->services = services_get( p->name );
+  return true;
+}
+
+
+// bind the plugin functions, from the export manifest or the symbol scan.
+// False if the plugin is invalid.
+static bool
+bind_plugin( plugin_t * p, ElfW(Dyn) * dynamic )
+{
+  bool found;
+
+
+  if ( read_export_manifest( p, &found ) == false ) {
+    return false;
+  }
+  return ( found == true ) || ( scan_plugin_symbols( p, dynamic ) == true );
+}
+
+
+/*
+ * Load one plugin. If the manifest cache has a fresh entry for the plugin file
+ * (same path, inode, size and mtime), the symbol scan and the hash calculation
+ * are skipped and the plugin is only dlopen'd. False if the plugin can't be
+ * loaded: nothing is left open.
+*/
+static bool
+load_plugin( cpf_t * cpf, plugin_t * p, manifest_t * m )
+{
+  const manifest_entry_t * e = NULL;
+  ElfW(Dyn)              * dynamic;
+  char                     dlpath[32];
+  int                      fd = -1;
+  bool                     mapped,
+                           identified = false;
+
+
+  // the file identity is checked even against the shared registry: a plugin
+  // file can be replaced before the publisher reloads
+  if ( ( m != NULL ) &&
+       ( ( ( cpf->flags & CPF_FLAG_MANIFEST_CACHE ) != 0 ) || ( m->shared == true ) ) &&
+       ( ( identified = manifest_stat_plugin( p ) ) == true ) ) {
+    e = manifest_find( m, p );
+  }
+  // hot patch: dlopen() of the same path would return the old mapping
+  if ( ( ( cpf->flags & ( CPF_FLAG_SHADOW_COPY | CPF_FLAG_HOT_PATCH ) ) != 0 ) &&
+       ( ( fd = memfd_from_file( p->path ) ) == -1 ) ) {
+    return false;
+  }
+  if ( ( cpf->flags & CPF_FLAG_HOT_PATCH ) != 0 ) {
+    hotpatch_prepare( fd, p->name );
+  }
+  snprintf( dlpath, sizeof( dlpath ), "/proc/self/fd/%d", fd );
+  if ( ( dynamic = open_plugin( cpf, p, ( fd != -1 ) ? dlpath : NULL, &mapped ) ) == NULL ) {
+    if ( fd != -1 ) {
+      close( fd );
+    }
+    return false;
+  }
+  p->memfd = ( fd != -1 ) ? fd : 0;
+  // the entry (and the identity cached with the scan) is the one of the file
+  // stat'ed above: not used if the path was replaced before the file was opened
+  if ( ( identified == true ) && ( manifest_check_plugin( p ) == false ) ) {
+    LOG_INFO( "\"%s\" replaced while loaded: symbols scanned", p->path )
+    memset( &p->file_id, 0, sizeof( file_id_t ) ); // the mapped file is unknown: not cached
+    e = NULL;
+  }
+  prefault_plugin( cpf, p, mapped == false );
+  if ( ( e == NULL ) || ( manifest_apply( m, e, p ) == false ) ) {
+    if ( bind_plugin( p, dynamic ) == false ) {
+      close_plugin( p );
+      return false;
     }
-    if ( cpf->plugin[p_count].ctx == NULL ) {
-      LOG_ERROR( "Plugin context not defined in plugin "
-                 "\"%s"PLUGIN_EXTENSION"\".\n"
-                 "Cannot initializate plugin system!",
-                 cpf->plugin[p_count].name )
+    calc_blake2( p );
+  }
+  if ( init_plugin_ctx( p ) == false ) {
+    close_plugin( p );
+    return false;
+  }
+  return true;
+}
+
+
+/*
+ * Pin the plugin "p" for a call made without the reload lock (e.g. by the
+ * executor): a reload can close it meanwhile, but it stays mapped until
+ * unpin_plugin(). Called with the reload lock held for reading.
+*/
+struct cpf_pin *
+pin_plugin( plugin_t * p )
+{
+  struct cpf_pin * pin = __atomic_load_n( &p->pin, __ATOMIC_ACQUIRE ),
+                 * expected = NULL;
+
+
+  if ( pin == NULL ) { // the first pin: the other readers may race
+    if ( ( pin = (struct cpf_pin *)calloc( 1, sizeof( struct cpf_pin ) ) ) == NULL ) {
+      LOG_ERROR( "Cannot allocate memory for the plugin pin!" )
       exit( EXIT_FAILURE );
     }
-    // version default value, if not defined
-    if ( cpf->plugin[p_count].ctx->version[0] == '\0' ) {
-      strcpy(cpf->plugin[p_count].ctx->version, NOT_DEFINED);
+    atomic_init( &pin->refs, 1 );
+    if ( __atomic_compare_exchange_n( &p->pin, &expected, pin, false,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) == false ) {
+      FREE( pin )
+      pin = expected;
     }
+  }
+  atomic_fetch_add( &pin->refs, 1 );
+  return pin;
+}
 
-    if ( num_funcs == 0 ) {
-      LOG_ERROR( "No functions found in plugin \"%s"PLUGIN_EXTENSION"\"!",
-                 cpf->plugin[p_count].name )
-      exit( EXIT_FAILURE );
+
+void
+unpin_plugin( struct cpf_pin * pin )
+{
+  if ( atomic_fetch_sub( &pin->refs, 1 ) != 1 ) {
+    return;
+  }
+  if ( pin->dlhandle != NULL ) {
+    dlclose( pin->dlhandle );
+  }
+  if ( pin->memfd > 0 ) {
+    close( pin->memfd );
+  }
+  FREE( pin )
+}
+
+
+void
+close_plugin( plugin_t * p )
+{
+  if ( p->pin != NULL ) { // the last running call closes it
+    p->pin->dlhandle = p->dlhandle;
+    p->pin->memfd = p->memfd;
+    p->dlhandle = NULL;
+    p->memfd = 0;
+    unpin_plugin( p->pin );
+    p->pin = NULL;
+  }
+  if ( p->dlhandle != NULL ) { // the moved plugin_t copies have no handle
+    dlclose( p->dlhandle );
+    p->dlhandle = NULL;
+    if ( p->memfd > 0 ) {
+      close( p->memfd );
     }
+  }
+  p->memfd = 0;
+  FREE( p->lib_func )
+}
 
-    // num_funcs + 1 = will be used to detect the end of struct (NULL value)
-    cpf->plugin[p_count].lib_func = (func_t *)calloc( num_funcs + 1, sizeof( func_t ) );
-    if ( cpf->plugin[p_count].lib_func == NULL ) {
-      LOG_ERROR( "Cannot allocate memory for plugins' functions!!" )
+
+/*
+ * Load a plugin image from memory, through a memfd: no file is written. The
+ * hash is calculated from the buffer, unless it's given ("blake2s256" not NULL,
+ * e.g. from a bundle index). p->path and p->name must be set.
+*/
+bool
+load_buffer_plugin( cpf_t * cpf,
+                    plugin_t * p,
+                    const void * data,
+                    size_t len,
+                    const uint8_t * blake2s256 )
+{
+  ElfW(Dyn) * dynamic;
+  char        dlpath[32];
+  int         fd;
+  bool        mapped;
+
+
+  if ( ( fd = memfd_from_buffer( p->name, data, len ) ) == -1 ) {
+    return false;
+  }
+  if ( ( cpf->flags & CPF_FLAG_HOT_PATCH ) != 0 ) {
+    hotpatch_prepare( fd, p->name );
+  }
+  snprintf( dlpath, sizeof( dlpath ), "/proc/self/fd/%d", fd );
+  if ( ( dynamic = open_plugin( cpf, p, dlpath, &mapped ) ) == NULL ) {
+    close( fd );
+    return false;
+  }
+  p->memfd = fd;
+  prefault_plugin( cpf, p, mapped == false );
+  if ( bind_plugin( p, dynamic ) == false ) {
+    close_plugin( p );
+    return false;
+  }
+  if ( blake2s256 != NULL ) {
+    memcpy( p->blake2s256, blake2s256, sizeof( p->blake2s256 ) );
+  } else {
+    calc_blake2_buffer( p, data, len );
+  }
+  if ( init_plugin_ctx( p ) == false ) {
+    close_plugin( p );
+    return false;
+  }
+  return true;
+}
+
+
+// load one plugin, without the manifest cache. p->path and p->name must be set.
+// False if the plugin can't be loaded: nothing is left open.
+bool
+load_single_plugin( cpf_t * cpf, plugin_t * p )
+{
+  return load_plugin( cpf, p, NULL );
+}
+
+
+void
+load_plugins_2_reload( cpf_t * cpf )
+{
+  manifest_t m;
+  uint16_t   p_count; // plugin counter
+
+
+  if ( cpf == NULL ) {
+    return;
+  }
+  if ( cpf->bundle != NULL ) { // no manifest cache: the bundle index has the hashes
+    bundle_load_plugins( cpf );
+    sort_plugins( cpf );
+    return;
+  }
+  if ( cpf->num_plugins == 0 ) {
+    return;
+  }
+
+  manifest_open( cpf, &m );
+  for( p_count = 0 ; p_count < cpf->num_plugins ; p_count++ ) {
+    if ( load_plugin( cpf, &cpf->plugin[p_count], &m ) == false ) {
       exit( EXIT_FAILURE );
     }
+  }
+  sort_plugins( cpf );
+  manifest_close( cpf, &m );
+}
 
-    j=0;
-    for ( i = 0 ; i < symtbltotalsize ; i++ ) {
-      fcn_addr = cpf->plugin[p_count].base_addr + symtable[i].st_value;
-      if ( ( ELF64_ST_TYPE( symtable[i].st_info ) == STT_FUNC ) &&
-           ( symtable[i].st_value > 0 ) &&
-           ( cpf->plugin[p_count].ctor != fcn_addr ) &&
-           ( cpf->plugin[p_count].dtor != fcn_addr ) &&
-           ( cpf->plugin[p_count].init_ctx != fcn_addr ) ) {
-        cpf->plugin[p_count].lib_func[j].func_addr = fcn_addr;
-        cpf->plugin[p_count].lib_func[j].func_offset =
-          (uint64_t)symtable[i].st_value;
-        cpf->plugin[p_count].lib_func[j].func_name = NULL;
-        if ( ( symtable[i].st_name != 0 ) &&
-             ( *(char *)(strtable + symtable[i].st_name) != 0 ) ) {
-          cpf->plugin[p_count].lib_func[j].func_name =
-            (char *)(strtable + symtable[i].st_name);
+
+static int
+name_comparator( const void * p, const void * q )
+{
+  return strcmp( (*(plugin_t **)p)->name, (*(plugin_t **)q)->name );
+}
+
+
+static int
+name_key_comparator( const void * key, const void * q )
+{
+  return strcmp( (const char *)key, (*(plugin_t **)q)->name );
+}
+
+
+// set the plugin dependencies functions pointers. The plugins are searched in
+// "by_name" (sorted by name) if not NULL, or in the whole registry.
+static bool
+bind_deps( cpf_t * cpf, plugin_t * p, plugin_t ** by_name )
+{
+  plugin_t ** found;
+  func_t    * funcs;
+  uint16_t    i, j;
+
+
+  //for( i = 0 ; i < calc_num_dep( p->ctx->deps ) ; i++ ) {
+  for( i = 0 ; (void *)(*(uint64_t *)(p->ctx->deps+i)) != NULL ; i++ ) {
+    funcs = NULL;
+    if ( strcmp( p->name, p->ctx->deps[i].dep_lib_name ) == 0 ) {
+      LOG_ERROR("Dependency check error in plugin \"%s"PLUGIN_EXTENSION"\": "
+                "same dependency declared!",
+                p->name )
+      return false;
+    }
+    if ( by_name != NULL ) {
+      found = (plugin_t **)bsearch( p->ctx->deps[i].dep_lib_name, by_name, cpf->num_plugins,
+                                    sizeof( plugin_t * ), name_key_comparator );
+      funcs = ( found != NULL ) ? (*found)->lib_func : NULL;
+    } else {
+      for( j = 0 ; j < cpf->num_plugins ; j++ ) {
+        if ( strcmp( cpf->plugin[j].name, p->ctx->deps[i].dep_lib_name ) == 0 ) {
+          funcs = cpf->plugin[j].lib_func;
+          break;
         }
-        j++;
       }
     }
-    calc_blake2( &cpf->plugin[p_count] );
-  } // end for
-  sort_plugins( cpf );
+    if ( funcs == NULL ) {
+      LOG_ERROR(
+        "Dependency check error: \"%s\" not found in \"%s"PLUGIN_EXTENSION"\"!",
+        p->ctx->deps[i].dep_lib_name,
+        p->name )
+      return false;
+    }
+    // read without the reload lock by CPF_get_extern_lib_func_by_dep()
+    __atomic_store_n( &p->ctx->deps[i].funcs, funcs, __ATOMIC_RELEASE );
+    USDT_PROBE2( plugin_bind, p->name, p->ctx->deps[i].dep_lib_name );
+  }
+  return true;
 }
 
 
+bool
+bind_plugin_deps( cpf_t * cpf, plugin_t * p )
+{
+  return bind_deps( cpf, p, NULL );
+}
+
+
+/*
+ * Bind the dependencies of all plugins, and rebuild the reverse dependency
+ * index used by the single plugin reloads. The dependencies are searched by
+ * name in a sorted array: O(P.D.log P) instead of comparing every plugin.
+*/
 void
 check_and_set_dep( cpf_t * cpf )
 {
-  uint16_t  i, j,
-            p_count; // plugin counter
-  bool      dep_ok;
+  plugin_t ** by_name;
+  uint16_t    p_count; // plugin counter
+
 
+  rdeps_free( cpf );
+  if ( cpf->num_plugins == 0 ) {
+    return;
+  }
+  by_name = (plugin_t **)malloc( cpf->num_plugins * sizeof( plugin_t * ) );
+  if ( by_name == NULL ) {
+    LOG_ERROR( "Cannot allocate memory for the plugins dependencies!" )
+    exit( EXIT_FAILURE );
+  }
+  for( p_count = 0 ; p_count < cpf->num_plugins ; p_count++ ) {
+    by_name[p_count] = &cpf->plugin[p_count];
+  }
+  qsort( by_name, cpf->num_plugins, sizeof( plugin_t * ), name_comparator );
 
   // check all libs dependencies AND set dep functions pointers
   for( p_count = 0 ; p_count < cpf->num_plugins ; p_count++ ) {
-    //for( i = 0 ; i < calc_num_dep( cpf->plugin[p_count].ctx->deps ) ; i++ ) {
-    for( i = 0 ; (void *)(*(uint64_t *)(cpf->plugin[p_count].ctx->deps+i)) != NULL ; i++ ) {
-      dep_ok = false;
-      for( j = 0 ; j < cpf->num_plugins ; j++ ) {
-        if ( ( cpf->plugin[p_count].ctx->deps[i].dep_lib_name != NULL ) &&
-             ( strcmp( cpf->plugin[j].name,
-                       cpf->plugin[p_count].ctx->deps[i].dep_lib_name ) == 0 ) ) {
-          if ( p_count == j ) {
-            LOG_ERROR("Dependency check error in plugin \"%s"PLUGIN_EXTENSION"\": "
-                      "same dependency declared!",
-                      cpf->plugin[j].name )
-            exit( EXIT_FAILURE );
-          }
-          cpf->plugin[p_count].ctx->deps[i].funcs = cpf->plugin[j].lib_func;
-          dep_ok = true;
-          break;
-        }
-      }
-      if ( dep_ok == false ) {
-        LOG_ERROR(
-          "Dependency check error: \"%s\" not found in \"%s"PLUGIN_EXTENSION"\"!",
-          cpf->plugin[p_count].ctx->deps[i].dep_lib_name,
-          cpf->plugin[p_count].name )
-        exit( EXIT_FAILURE );
-      }
+    if ( bind_deps( cpf, &cpf->plugin[p_count], by_name ) == false ) {
+      exit( EXIT_FAILURE );
     }
+    rdeps_link( cpf, &cpf->plugin[p_count] );
   }
+  FREE( by_name )
 }
 
 
@@ -282,6 +878,7 @@ void
 load_plugins( cpf_t * cpf )
 {
   load_plugins_2_reload( cpf );
+  static_load_plugins( cpf );
   check_and_set_dep( cpf );
 }
 
@@ -379,6 +976,14 @@ bind_plugins( cpf_t * cpf )
     exit( EXIT_FAILURE );
   }
 
+  if ( bundle_is_bundle( cpf->path ) == true ) {
+    bundle_bind_plugins( cpf );
+    return;
+  }
+  if ( ( ( cpf->flags & CPF_FLAG_SHARED_ATTACH ) != 0 ) && ( shreg_bind_plugins( cpf ) == true ) ) {
+    return; // no directory walk
+  }
+
   if ( snprintf( path, sizeof( path ), "%s", cpf->path ) < 0 ) {
     LOG_ERROR( "snprintf() error!" )
     exit( EXIT_FAILURE );
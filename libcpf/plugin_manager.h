@@ -26,7 +26,34 @@
 void sort_plugins( cpf_t * cpf );
 void load_plugins( cpf_t * cpf );
 void load_plugins_2_reload( cpf_t * cpf );
+bool load_single_plugin( cpf_t * cpf, plugin_t * p );
+bool load_buffer_plugin( cpf_t * cpf,
+                         plugin_t * p,
+                         const void * data,
+                         size_t len,
+                         const uint8_t * blake2s256 );
+void close_plugin( plugin_t * p );
+struct cpf_pin * pin_plugin( plugin_t * p );
+void unpin_plugin( struct cpf_pin * pin );
+bool init_plugin_ctx( plugin_t * p );
+bool bind_plugin_deps( cpf_t * cpf, plugin_t * p );
 void bind_plugins( cpf_t * cpf );
 void check_and_set_dep( cpf_t * cpf );
+bool check_func_proto( func_t * func, char * plugin_name, enum func_prototype_t fproto );
+func_t * get_func_proto( cpf_t * cpf,
+                         char * plugin_name,
+                         char * func_name,
+                         enum func_prototype_t fproto,
+                         plugin_t ** plugin );
+void * get_func_addr_proto( cpf_t * cpf,
+                            char * plugin_name,
+                            char * func_name,
+                            enum func_prototype_t fproto );
+void reload_rdlock( void );
+void reload_wrlock( void );
+void reload_unlock( void );
+void reload_fork_prepare( void );
+void reload_fork_parent( void );
+void reload_fork_child( void );
 
 #endif
\ No newline at end of file
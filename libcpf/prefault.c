@@ -0,0 +1,157 @@
+/*
+  libcpf - C Plugin Framework
+
+  prefault.c - page-fault warmup and huge-page remapping of plugin segments
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sys/mman.h>
+#include <link.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include "prefault.h"
+#include "log.h"
+
+#define HUGE_PAGE_SIZE          ( 2UL * 1024 * 1024 )
+
+
+typedef struct {
+  cpf_t    * cpf;
+  plugin_t * plugin;
+  bool       remap_text;
+  bool       found;
+} phdr_arg_t;
+
+
+static void
+touch_pages( uintptr_t start, uintptr_t end, size_t page_size )
+{
+  volatile uint8_t * addr;
+
+
+#ifdef MADV_POPULATE_READ
+  if ( madvise( (void *)start, end - start, MADV_POPULATE_READ ) == 0 ) {
+    return;
+  }
+#endif
+  // kernel < 5.14: read one byte of each page
+  for ( addr = (uint8_t *)start ; (uintptr_t)addr < end ; addr += page_size ) {
+    (void)*addr;
+  }
+}
+
+
+/*
+ * Copy the 2MB aligned part of the text segment into an anonymous mapping
+ * advised with MADV_HUGEPAGE, at the same address. Only for a mapping created
+ * by this load, before the plugin context is initialized: only the ELF
+ * constructors of the plugin have run (they must not start threads running
+ * the plugin code). A live mapping returned again by dlopen() isn't remapped.
+*/
+static void
+remap_huge_text( plugin_t * p, uintptr_t start, uintptr_t end )
+{
+  uintptr_t hstart = ( start + HUGE_PAGE_SIZE - 1 ) & ~( HUGE_PAGE_SIZE - 1 ),
+            hend = end & ~( HUGE_PAGE_SIZE - 1 );
+  size_t    len;
+  void    * tmp;
+
+
+  if ( hend <= hstart ) {
+    return; // text segment smaller than a huge page
+  }
+  len = hend - hstart;
+  tmp = mmap( NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+  if ( tmp == MAP_FAILED ) {
+    LOG_ERROR( "Cannot remap \"%s\" text segment: %s", p->path, strerror( errno ) )
+    return;
+  }
+  memcpy( tmp, (void *)hstart, len );
+  if ( mmap( (void *)hstart, len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0 ) == MAP_FAILED ) {
+    LOG_ERROR( "Cannot remap \"%s\" text segment: %s", p->path, strerror( errno ) )
+    exit( EXIT_FAILURE ); // the original text mapping may be gone
+  }
+  madvise( (void *)hstart, len, MADV_HUGEPAGE );
+  memcpy( (void *)hstart, tmp, len );
+  mprotect( (void *)hstart, len, PROT_READ | PROT_EXEC );
+  munmap( tmp, len );
+}
+
+
+static int
+prefault_phdr( struct dl_phdr_info * info, size_t size, void * data )
+{
+  phdr_arg_t * arg = (phdr_arg_t *)data;
+  size_t       page_size = sysconf( _SC_PAGESIZE );
+  uintptr_t    start, end;
+  uint16_t     i;
+
+
+  if ( (void *)info->dlpi_addr != arg->plugin->base_addr ) {
+    return 0; // next object
+  }
+  arg->found = true;
+  for ( i = 0 ; i < info->dlpi_phnum ; i++ ) {
+    if ( info->dlpi_phdr[i].p_type != PT_LOAD ) {
+      continue;
+    }
+    start = ( info->dlpi_addr + info->dlpi_phdr[i].p_vaddr ) & ~( page_size - 1 );
+    end = ( info->dlpi_addr + info->dlpi_phdr[i].p_vaddr + info->dlpi_phdr[i].p_memsz +
+            page_size - 1 ) & ~( page_size - 1 );
+
+    if ( ( ( arg->cpf->flags & CPF_FLAG_HUGEPAGE_TEXT ) != 0 ) && ( arg->remap_text == true ) &&
+         ( ( info->dlpi_phdr[i].p_flags & PF_X ) != 0 ) &&
+         ( ( info->dlpi_phdr[i].p_flags & PF_W ) == 0 ) ) {
+      remap_huge_text( arg->plugin, start, end );
+    }
+    if ( ( arg->cpf->flags & CPF_FLAG_PREFAULT ) != 0 ) {
+      madvise( (void *)start, end - start, MADV_WILLNEED );
+      touch_pages( start, end, page_size );
+    }
+    if ( ( ( arg->cpf->flags & CPF_FLAG_MLOCK ) != 0 ) &&
+         ( mlock( (void *)start, end - start ) == -1 ) ) {
+      LOG_ERROR( "Cannot mlock() \"%s\" segment: %s", arg->plugin->path, strerror( errno ) )
+    }
+  }
+  return 1; // stop
+}
+
+
+/*
+ * The first calls into a freshly loaded plugin take minor faults and iTLB
+ * misses. Prefault (and optionally lock and remap onto huge pages) the
+ * PT_LOAD segments, so the latency after a load or reload is the steady one.
+ * "remap_text" is false if the plugin mapping was already live.
+*/
+void
+prefault_plugin( cpf_t * cpf, plugin_t * p, bool remap_text )
+{
+  phdr_arg_t arg = { cpf, p, remap_text, false };
+
+
+  if ( ( cpf->flags & ( CPF_FLAG_PREFAULT | CPF_FLAG_MLOCK | CPF_FLAG_HUGEPAGE_TEXT ) ) == 0 ) {
+    return;
+  }
+  dl_iterate_phdr( prefault_phdr, &arg );
+  if ( arg.found == false ) {
+    LOG_ERROR( "Cannot find \"%s\" segments!", p->path )
+  }
+}
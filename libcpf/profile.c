@@ -0,0 +1,547 @@
+/*
+  libcpf - C Plugin Framework
+
+  profile.c - sampling profiler of the plugin code (CPF_profile_start())
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sys/time.h>
+#include <link.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include "fnv.h"
+#include "plugin_manager.h"
+#include "profile.h"
+
+#define PROFILE_TABLE_SIZE      1024      // function buckets, power of 2
+
+
+typedef struct {                          // executable segments of a plugin
+  uintptr_t base;
+  uintptr_t start;
+  uintptr_t end;
+} text_t;
+
+typedef struct {                          // plugin share of the samples (report)
+  const char * name;
+  uint64_t     samples;
+} plugin_share_t;
+
+
+static pthread_mutex_t            profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static cpf_t                   ** profiled = NULL;
+static uint32_t                   profile_hz = 0;
+static profile_index_t * _Atomic  current_index = NULL;
+static _Atomic uint32_t           handler_epoch = 0;    // parity of the handlers started
+static _Atomic uint32_t           in_handler[2];        // handlers running, per epoch parity
+static profile_func_t           * func_table[PROFILE_TABLE_SIZE];
+static _Atomic uint64_t           total_samples = 0;
+static _Atomic uint64_t           outside_samples = 0;  // PC outside the plugins code
+static struct sigaction           old_action;
+static bool                       handler_set = false;
+static plugin_share_t           * report_plugins = NULL; // for report_comparator()
+static uint32_t                   report_num_plugins = 0;
+
+
+static inline uintptr_t
+context_pc( void * context )
+{
+#if defined(__x86_64__)
+  return (uintptr_t)( (ucontext_t *)context )->uc_mcontext.gregs[REG_RIP];
+#elif defined(__aarch64__)
+  return (uintptr_t)( (ucontext_t *)context )->uc_mcontext.pc;
+#else
+  return 0;
+#endif
+}
+
+
+/*
+ * Sample of the PC in the current index: only lock-free reads of the index
+ * and atomic increments (async-signal-safe). The index is never modified, a
+ * rebuild publishes a new one.
+*/
+static void
+profile_sample( uintptr_t pc )
+{
+  profile_index_t * idx = atomic_load( &current_index ); // after in_handler[] (see publish_index())
+  uint32_t          low = 0, high, mid;
+
+
+  atomic_fetch_add_explicit( &total_samples, 1, memory_order_relaxed );
+  if ( ( idx == NULL ) || ( idx->num_ranges == 0 ) ) {
+    atomic_fetch_add_explicit( &outside_samples, 1, memory_order_relaxed );
+    return;
+  }
+  high = idx->num_ranges;
+  while ( high - low > 1 ) { // last range starting at or before "pc"
+    mid = ( low + high ) / 2;
+    if ( idx->range[mid].start <= pc ) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  if ( ( pc >= idx->range[low].start ) && ( pc < idx->range[low].end ) ) {
+    atomic_fetch_add_explicit( &idx->range[low].func->samples, 1, memory_order_relaxed );
+  } else {
+    atomic_fetch_add_explicit( &outside_samples, 1, memory_order_relaxed );
+  }
+}
+
+
+// SIGPROF handler: counted in the epoch it starts in, while it reads an index
+static void
+profile_handler( int sig, siginfo_t * info, void * context )
+{
+  uint32_t epoch = atomic_load( &handler_epoch ) & 1;
+
+
+  atomic_fetch_add( &in_handler[epoch], 1 );
+  profile_sample( context_pc( context ) );
+  atomic_fetch_sub( &in_handler[epoch], 1 );
+}
+
+
+// counters of a function, created on its first index (profile_lock held)
+static profile_func_t *
+get_func( const char * plugin_name, const char * func_name )
+{
+  uint32_t         h;
+  profile_func_t * f;
+
+
+  h = fnv1a_32_str( fnv1a_32_str( FNV32_BASIS, plugin_name ), func_name ) & ( PROFILE_TABLE_SIZE - 1 );
+  for ( f = func_table[h] ; f != NULL ; f = f->next ) {
+    if ( ( strcmp( f->func_name, func_name ) == 0 ) && ( strcmp( f->plugin_name, plugin_name ) == 0 ) ) {
+      return f;
+    }
+  }
+  if ( ( f = (profile_func_t *)calloc( 1, sizeof( profile_func_t ) ) ) == NULL ) {
+    LOG_ERROR( "Cannot allocate memory for the profiler!" )
+    exit( EXIT_FAILURE );
+  }
+  snprintf( f->plugin_name, sizeof( f->plugin_name ), "%s", plugin_name );
+  snprintf( f->func_name, sizeof( f->func_name ), "%s", func_name );
+  f->next = func_table[h];
+  func_table[h] = f;
+  return f;
+}
+
+
+static int
+find_text( struct dl_phdr_info * info, size_t size, void * data )
+{
+  text_t * t = (text_t *)data;
+  uint16_t i;
+
+
+  if ( info->dlpi_addr != t->base ) {
+    return 0;
+  }
+  for ( i = 0 ; i < info->dlpi_phnum ; i++ ) {
+    if ( ( info->dlpi_phdr[i].p_type != PT_LOAD ) || ( ( info->dlpi_phdr[i].p_flags & PF_X ) == 0 ) ) {
+      continue;
+    }
+    if ( ( t->start == 0 ) || ( info->dlpi_addr + info->dlpi_phdr[i].p_vaddr < t->start ) ) {
+      t->start = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+    }
+    if ( info->dlpi_addr + info->dlpi_phdr[i].p_vaddr + info->dlpi_phdr[i].p_memsz > t->end ) {
+      t->end = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr + info->dlpi_phdr[i].p_memsz;
+    }
+  }
+  return 1;
+}
+
+
+static int
+func_comparator( const void * p, const void * q )
+{
+  uintptr_t a = (uintptr_t)( *(func_t **)p )->func_addr,
+            b = (uintptr_t)( *(func_t **)q )->func_addr;
+
+
+  return ( a > b ) - ( a < b );
+}
+
+
+static int
+range_comparator( const void * p, const void * q )
+{
+  uintptr_t a = ( (profile_range_t *)p )->start,
+            b = ( (profile_range_t *)q )->start;
+
+
+  return ( a > b ) - ( a < b );
+}
+
+
+static void
+add_range( profile_index_t * idx, uintptr_t start, uintptr_t end, plugin_t * p, func_t * f )
+{
+  char name[PROFILE_NAME_SIZE];
+
+
+  if ( start >= end ) {
+    return;
+  }
+  if ( f == NULL ) {
+    snprintf( name, sizeof( name ), PROFILE_UNKNOWN_FUNC );
+  } else if ( f->func_name == NULL ) { // called by offset only
+    snprintf( name, sizeof( name ), "+0x%lx", (unsigned long)( (uintptr_t)f->func_addr - (uintptr_t)p->base_addr ) );
+  } else {
+    snprintf( name, sizeof( name ), "%s", f->func_name );
+  }
+  idx->range[idx->num_ranges].start = start;
+  idx->range[idx->num_ranges].end = end;
+  idx->range[idx->num_ranges].func = get_func( p->name, name );
+  idx->num_ranges++;
+}
+
+
+/*
+ * Interval index of the plugins code: each exported function covers the code
+ * up to the next one (the static functions after it are counted with it), the
+ * last one up to the end of the executable segments. The static plugins are
+ * part of the binary: not indexed.
+*/
+static profile_index_t *
+build_index( cpf_t * cpf )
+{
+  profile_index_t * idx;
+  func_t         ** funcs;
+  func_t          * f;
+  text_t            t;
+  uint32_t          max = 0, n, i;
+  uint16_t          j;
+
+
+  for ( j = 0 ; j < cpf->num_plugins ; j++ ) {
+    for ( f = cpf->plugin[j].lib_func ; ( f != NULL ) && ( f->func_addr != NULL ) ; f++ ) {
+      max++;
+    }
+    max++;
+  }
+  if ( ( ( idx = (profile_index_t *)calloc( 1, sizeof( profile_index_t ) + max * sizeof( profile_range_t ) ) ) == NULL ) ||
+       ( ( funcs = (func_t **)calloc( max + 1, sizeof( func_t * ) ) ) == NULL ) ) {
+    LOG_ERROR( "Cannot allocate memory for the profiler!" )
+    exit( EXIT_FAILURE );
+  }
+  for ( j = 0 ; j < cpf->num_plugins ; j++ ) {
+    if ( cpf->plugin[j].base_addr == NULL ) {
+      continue;
+    }
+    memset( &t, 0, sizeof( t ) );
+    t.base = (uintptr_t)cpf->plugin[j].base_addr;
+    if ( ( dl_iterate_phdr( find_text, &t ) == 0 ) || ( t.start >= t.end ) ) {
+      continue;
+    }
+    for ( n = 0, f = cpf->plugin[j].lib_func ; ( f != NULL ) && ( f->func_addr != NULL ) ; f++ ) {
+      if ( ( (uintptr_t)f->func_addr >= t.start ) && ( (uintptr_t)f->func_addr < t.end ) ) {
+        funcs[n++] = f;
+      }
+    }
+    qsort( funcs, n, sizeof( func_t * ), func_comparator );
+    add_range( idx, t.start, ( n > 0 ) ? (uintptr_t)funcs[0]->func_addr : t.end, &cpf->plugin[j], NULL );
+    for ( i = 0 ; i < n ; i++ ) {
+      if ( ( i + 1 < n ) && ( funcs[i + 1]->func_addr == funcs[i]->func_addr ) ) {
+        continue; // alias: the next one is indexed
+      }
+      add_range( idx,
+                 (uintptr_t)funcs[i]->func_addr,
+                 ( i + 1 < n ) ? (uintptr_t)funcs[i + 1]->func_addr : t.end,
+                 &cpf->plugin[j],
+                 funcs[i] );
+    }
+  }
+  FREE( funcs )
+  qsort( idx->range, idx->num_ranges, sizeof( profile_range_t ), range_comparator );
+  return idx;
+}
+
+
+/*
+ * Publish a new index and free the previous one after a grace period: the
+ * handlers that can read it started before the publication, in the previous
+ * epoch. A handler that reads the epoch before the flip but the index after the
+ * publication reads the new index. The handlers are short: the wait is too.
+*/
+static void
+publish_index( profile_index_t * idx )
+{
+  profile_index_t * retired = atomic_exchange( &current_index, idx );
+  uint32_t          epoch = atomic_fetch_add( &handler_epoch, 1 ) & 1;
+
+
+  while ( atomic_load( &in_handler[epoch] ) != 0 ) {
+    sched_yield();
+  }
+  FREE( retired )
+}
+
+
+// called with the reload lock held, when the plugins of "cpf" changed
+void
+profile_rebuild( cpf_t * cpf )
+{
+  pthread_mutex_lock( &profile_lock );
+  if ( ( profiled != NULL ) && ( *profiled == cpf ) ) {
+    publish_index( build_index( cpf ) );
+  }
+  pthread_mutex_unlock( &profile_lock );
+}
+
+
+// no sample can be using them: the timer was stopped
+static void
+free_profile( void )
+{
+  profile_index_t * idx = atomic_exchange( &current_index, NULL );
+  profile_func_t  * f, * next;
+  uint32_t          i;
+
+
+  FREE( idx )
+  for ( i = 0 ; i < PROFILE_TABLE_SIZE ; i++ ) {
+    for ( f = func_table[i] ; f != NULL ; f = next ) {
+      next = f->next;
+      FREE( f )
+    }
+    func_table[i] = NULL;
+  }
+  atomic_store( &total_samples, 0 );
+  atomic_store( &outside_samples, 0 );
+}
+
+
+/*
+ * Sample the CPU time of the process "hz" times per second (PROFILE_DEFAULT_HZ
+ * if 0) with SIGPROF, and attribute each sample to the plugin function whose
+ * code was running. The previous profile is dropped.
+*/
+int
+CPF_profile_start( cpf_t ** cpf, uint32_t hz )
+{
+  struct sigaction action;
+  struct itimerval timer;
+
+
+  if ( ( cpf == NULL ) || ( (*cpf) == NULL ) ) {
+    LOG_ERROR( "CPF_profile_start(): Parameter cannot be NULL!" )
+    return EXIT_FAILURE;
+  }
+  if ( hz == 0 ) {
+    hz = PROFILE_DEFAULT_HZ;
+  }
+  if ( hz > 1000000 ) {
+    LOG_ERROR( "CPF_profile_start(): Sampling frequency must be up to 1 MHz!" )
+    return EXIT_FAILURE;
+  }
+  reload_rdlock();
+  pthread_mutex_lock( &profile_lock );
+  if ( profiled != NULL ) {
+    pthread_mutex_unlock( &profile_lock );
+    reload_unlock();
+    LOG_ERROR( "CPF_profile_start(): The profiler is already running!" )
+    return EXIT_FAILURE;
+  }
+  free_profile();
+  publish_index( build_index( *cpf ) );
+  profiled = cpf;
+  profile_hz = hz;
+  pthread_mutex_unlock( &profile_lock );
+  reload_unlock();
+
+  if ( handler_set == false ) {
+    memset( &action, 0, sizeof( action ) );
+    action.sa_sigaction = profile_handler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset( &action.sa_mask );
+    if ( sigaction( SIGPROF, &action, &old_action ) == -1 ) {
+      LOG_ERROR( "CPF_profile_start(): Cannot set the SIGPROF handler!" )
+      CPF_profile_stop();
+      return EXIT_FAILURE;
+    }
+    handler_set = true;
+  }
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = 1000000 / hz;
+  timer.it_value = timer.it_interval;
+  if ( setitimer( ITIMER_PROF, &timer, NULL ) == -1 ) {
+    LOG_ERROR( "CPF_profile_start(): Cannot start the profiling timer!" )
+    CPF_profile_stop();
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+
+// the samples are kept for CPF_profile_report()
+void
+CPF_profile_stop( void )
+{
+  struct itimerval timer;
+  struct sigaction ignore;
+
+
+  memset( &timer, 0, sizeof( timer ) );
+  setitimer( ITIMER_PROF, &timer, NULL );
+  pthread_mutex_lock( &profile_lock );
+  profiled = NULL;
+  if ( handler_set == true ) {
+    if ( old_action.sa_handler == SIG_DFL ) { // a pending SIGPROF would kill the process
+      memset( &ignore, 0, sizeof( ignore ) );
+      ignore.sa_handler = SIG_IGN;
+      sigaction( SIGPROF, &ignore, NULL );
+    } else {
+      sigaction( SIGPROF, &old_action, NULL );
+    }
+    handler_set = false;
+  }
+  pthread_mutex_unlock( &profile_lock );
+}
+
+
+static double
+share( uint64_t samples, uint64_t total )
+{
+  return ( total == 0 ) ? 0.0 : (double)samples * 100.0 / (double)total;
+}
+
+
+static uint64_t
+plugin_samples( plugin_share_t * plugins, uint32_t num_plugins, const char * name )
+{
+  uint32_t i;
+
+
+  for ( i = 0 ; i < num_plugins ; i++ ) {
+    if ( strcmp( plugins[i].name, name ) == 0 ) {
+      return plugins[i].samples;
+    }
+  }
+  return 0;
+}
+
+
+// plugins by share, then functions by share
+static int
+report_comparator( const void * p, const void * q )
+{
+  const profile_func_t * a = *(profile_func_t **)p,
+                       * b = *(profile_func_t **)q;
+  uint64_t               sa = plugin_samples( report_plugins, report_num_plugins, a->plugin_name ),
+                         sb = plugin_samples( report_plugins, report_num_plugins, b->plugin_name ),
+                         fa = atomic_load_explicit( &a->samples, memory_order_relaxed ),
+                         fb = atomic_load_explicit( &b->samples, memory_order_relaxed );
+  int                    c;
+
+
+  if ( sa != sb ) {
+    return ( sa < sb ) - ( sa > sb );
+  }
+  if ( ( c = strcmp( a->plugin_name, b->plugin_name ) ) != 0 ) {
+    return c;
+  }
+  return ( fa < fb ) - ( fa > fb );
+}
+
+
+/*
+ * CPU share of the plugins, and of their functions (self time: the code a
+ * plugin calls in other libraries isn't counted).
+*/
+void
+CPF_profile_report( void )
+{
+  profile_func_t ** funcs = NULL,
+                  * f;
+  uint64_t          total, samples;
+  uint32_t          num_funcs = 0, i, j;
+
+
+  pthread_mutex_lock( &profile_lock );
+  for ( i = 0 ; i < PROFILE_TABLE_SIZE ; i++ ) {
+    for ( f = func_table[i] ; f != NULL ; f = f->next ) {
+      num_funcs++;
+    }
+  }
+  if ( ( ( funcs = (profile_func_t **)calloc( num_funcs + 1, sizeof( profile_func_t * ) ) ) == NULL ) ||
+       ( ( report_plugins = (plugin_share_t *)calloc( num_funcs + 1, sizeof( plugin_share_t ) ) ) == NULL ) ) {
+    LOG_ERROR( "Cannot allocate memory for the profiler report!" )
+    exit( EXIT_FAILURE );
+  }
+  num_funcs = 0;
+  report_num_plugins = 0;
+  for ( i = 0 ; i < PROFILE_TABLE_SIZE ; i++ ) {
+    for ( f = func_table[i] ; f != NULL ; f = f->next ) {
+      if ( ( samples = atomic_load_explicit( &f->samples, memory_order_relaxed ) ) == 0 ) {
+        continue;
+      }
+      funcs[num_funcs++] = f;
+      for ( j = 0 ; ( j < report_num_plugins ) && ( strcmp( report_plugins[j].name, f->plugin_name ) != 0 ) ; j++ );
+      if ( j == report_num_plugins ) {
+        report_plugins[report_num_plugins++].name = f->plugin_name;
+      }
+      report_plugins[j].samples += samples;
+    }
+  }
+  qsort( funcs, num_funcs, sizeof( profile_func_t * ), report_comparator );
+
+  total = atomic_load( &total_samples );
+  LOG_INFO( "Profile: %lu samples at %u Hz (%.1f s of CPU), %.1f%% in the plugins:",
+            total, profile_hz, ( profile_hz > 0 ) ? (double)total / profile_hz : 0.0,
+            share( total - atomic_load( &outside_samples ), total ) )
+  for ( i = 0 ; i < num_funcs ; i++ ) {
+    if ( ( i == 0 ) || ( strcmp( funcs[i]->plugin_name, funcs[i - 1]->plugin_name ) != 0 ) ) {
+      LOG_INFO( "  %5.1f%% \"%s\"",
+                share( plugin_samples( report_plugins, report_num_plugins, funcs[i]->plugin_name ), total ),
+                funcs[i]->plugin_name )
+    }
+    LOG_INFO( "    %5.1f%% %s", share( atomic_load( &funcs[i]->samples ), total ), funcs[i]->func_name )
+  }
+  FREE( funcs )
+  FREE( report_plugins )
+  pthread_mutex_unlock( &profile_lock );
+}
+
+
+// restart the counts, the profiler keeps running
+void
+CPF_profile_reset( void )
+{
+  profile_func_t * f;
+  uint32_t         i;
+
+
+  pthread_mutex_lock( &profile_lock );
+  for ( i = 0 ; i < PROFILE_TABLE_SIZE ; i++ ) {
+    for ( f = func_table[i] ; f != NULL ; f = f->next ) {
+      atomic_store( &f->samples, 0 );
+    }
+  }
+  atomic_store( &total_samples, 0 );
+  atomic_store( &outside_samples, 0 );
+  pthread_mutex_unlock( &profile_lock );
+}
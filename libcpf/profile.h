@@ -0,0 +1,52 @@
+/*
+  libcpf - C Plugin Framework
+
+  profile.h - header file
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <stdatomic.h>
+#include "cpf.h"
+
+#define PROFILE_DEFAULT_HZ      99        // not a divisor of the usual timer ticks
+#define PROFILE_UNKNOWN_FUNC    "?"       // plugin code before its first function
+#define PROFILE_NAME_SIZE       256
+
+
+typedef struct profile_func {             // samples of one function (kept across the reloads)
+  struct profile_func * next;
+  char                  plugin_name[MAX_PLUGIN_NAME_SIZE];
+  char                  func_name[PROFILE_NAME_SIZE]; // "+0x<offset>" if unnamed
+  _Atomic uint64_t      samples;
+} profile_func_t;
+
+typedef struct {                          // code range of a function
+  uintptr_t        start;
+  uintptr_t        end;
+  profile_func_t * func;
+} profile_range_t;
+
+typedef struct {                          // sorted ranges, read by the signal handler
+  uint32_t               num_ranges;
+  profile_range_t        range[];
+} profile_index_t;
+
+void profile_rebuild( cpf_t * cpf );
+
+#endif
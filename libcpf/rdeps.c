@@ -0,0 +1,205 @@
+/*
+  libcpf - C Plugin Framework
+
+  rdeps.c - reverse dependency index: which plugins depend on a plugin
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "fnv.h"
+#include "rdeps.h"
+#include "log.h"
+
+
+static uint32_t
+hash_name( const char * name )
+{
+  return fnv1a_32_str( FNV32_BASIS, name );
+}
+
+
+static void
+rdeps_resize( struct cpf_rdeps * r, uint32_t num_buckets )
+{
+  rdeps_entry_t ** bucket,
+                 * e,
+                 * next;
+  uint32_t         i, b;
+
+
+  if ( ( bucket = (rdeps_entry_t **)calloc( num_buckets, sizeof( rdeps_entry_t * ) ) ) == NULL ) {
+    LOG_ERROR( "Cannot allocate memory for the reverse dependency index!" )
+    exit( EXIT_FAILURE );
+  }
+  for ( i = 0 ; i < r->num_buckets ; i++ ) {
+    for ( e = r->bucket[i] ; e != NULL ; e = next ) {
+      next = e->next;
+      b = hash_name( e->name ) & ( num_buckets - 1 );
+      e->next = bucket[b];
+      bucket[b] = e;
+    }
+  }
+  FREE( r->bucket )
+  r->bucket = bucket;
+  r->num_buckets = num_buckets;
+}
+
+
+// entry of the plugin "name", created if "create" is true
+static rdeps_entry_t *
+rdeps_find( cpf_t * cpf, const char * name, bool create )
+{
+  struct cpf_rdeps * r = cpf->rdeps;
+  rdeps_entry_t    * e;
+  uint32_t           b;
+
+
+  if ( r == NULL ) {
+    if ( create == false ) {
+      return NULL;
+    }
+    if ( ( r = (struct cpf_rdeps *)calloc( 1, sizeof( struct cpf_rdeps ) ) ) == NULL ) {
+      LOG_ERROR( "Cannot allocate memory for the reverse dependency index!" )
+      exit( EXIT_FAILURE );
+    }
+    rdeps_resize( r, RDEPS_MIN_BUCKETS );
+    cpf->rdeps = r;
+  }
+  b = hash_name( name ) & ( r->num_buckets - 1 );
+  for ( e = r->bucket[b] ; e != NULL ; e = e->next ) {
+    if ( strcmp( e->name, name ) == 0 ) {
+      return e;
+    }
+  }
+  if ( create == false ) {
+    return NULL;
+  }
+  if ( ( ( e = (rdeps_entry_t *)calloc( 1, sizeof( rdeps_entry_t ) ) ) == NULL ) ||
+       ( ( e->name = strdup( name ) ) == NULL ) ) {
+    LOG_ERROR( "Cannot allocate memory for the reverse dependency index!" )
+    exit( EXIT_FAILURE );
+  }
+  e->next = r->bucket[b];
+  r->bucket[b] = e;
+  if ( ++r->num_entries > r->num_buckets ) {
+    rdeps_resize( r, r->num_buckets * 2 );
+  }
+  return e;
+}
+
+
+// add the dependencies of "p" to the index. Called when "p" is bound.
+void
+rdeps_link( cpf_t * cpf, plugin_t * p )
+{
+  rdeps_entry_t * e;
+  deps_t       ** deps;
+  uint16_t        i;
+
+
+  for ( i = 0 ; (void *)(*(uint64_t *)(p->ctx->deps+i)) != NULL ; i++ ) {
+    e = rdeps_find( cpf, p->ctx->deps[i].dep_lib_name, true );
+    if ( e->num_deps == e->size ) {
+      deps = (deps_t **)realloc( e->deps, ( e->size + 4 ) * sizeof( deps_t * ) );
+      if ( deps == NULL ) {
+        LOG_ERROR( "Cannot allocate memory for the reverse dependency index!" )
+        exit( EXIT_FAILURE );
+      }
+      e->deps = deps;
+      e->size += 4;
+    }
+    e->deps[e->num_deps++] = &p->ctx->deps[i];
+  }
+}
+
+
+// remove the dependencies of "p" from the index, before "p" is closed
+void
+rdeps_unlink( cpf_t * cpf, plugin_t * p )
+{
+  rdeps_entry_t * e;
+  uint16_t        i, j;
+
+
+  for ( i = 0 ; (void *)(*(uint64_t *)(p->ctx->deps+i)) != NULL ; i++ ) {
+    if ( ( e = rdeps_find( cpf, p->ctx->deps[i].dep_lib_name, false ) ) == NULL ) {
+      continue;
+    }
+    for ( j = 0 ; j < e->num_deps ; j++ ) {
+      if ( e->deps[j] == &p->ctx->deps[i] ) {
+        e->deps[j] = e->deps[--e->num_deps]; // order doesn't matter
+        break;
+      }
+    }
+  }
+}
+
+
+/*
+ * Point the dependencies on "p" to its functions: only the plugins that depend
+ * on "p" are visited. Plugins read deps_t.funcs without the reload lock
+ * (CPF_get_extern_lib_func_by_dep()), so each pointer is stored atomically.
+*/
+void
+rdeps_rebind( cpf_t * cpf, plugin_t * p )
+{
+  rdeps_entry_t * e;
+  uint16_t        i;
+
+
+  if ( ( e = rdeps_find( cpf, p->name, false ) ) == NULL ) {
+    return;
+  }
+  for ( i = 0 ; i < e->num_deps ; i++ ) {
+    __atomic_store_n( &e->deps[i]->funcs, p->lib_func, __ATOMIC_RELEASE );
+  }
+}
+
+
+// number of dependencies on "plugin_name" declared by the loaded plugins
+uint16_t
+rdeps_count( cpf_t * cpf, char * plugin_name )
+{
+  rdeps_entry_t * e = rdeps_find( cpf, plugin_name, false );
+
+
+  return ( e != NULL ) ? e->num_deps : 0;
+}
+
+
+void
+rdeps_free( cpf_t * cpf )
+{
+  rdeps_entry_t * e,
+                * next;
+  uint32_t        i;
+
+
+  if ( cpf->rdeps == NULL ) {
+    return;
+  }
+  for ( i = 0 ; i < cpf->rdeps->num_buckets ; i++ ) {
+    for ( e = cpf->rdeps->bucket[i] ; e != NULL ; e = next ) {
+      next = e->next;
+      FREE( e->name )
+      FREE( e->deps )
+      FREE( e )
+    }
+  }
+  FREE( cpf->rdeps->bucket )
+  FREE( cpf->rdeps )
+}
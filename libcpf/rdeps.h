@@ -0,0 +1,49 @@
+/*
+  libcpf - C Plugin Framework
+
+  rdeps.h - header file
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __RDEPS_H__
+#define __RDEPS_H__
+
+#include "cpf.h"
+
+#define RDEPS_MIN_BUCKETS       16
+
+
+typedef struct rdeps_entry {              // plugins that depend on "name"
+  struct rdeps_entry * next;
+  char               * name;              // dependency (target) plugin name
+  deps_t            ** deps;              // deps_t entries naming it, inside the dependents
+  uint16_t             num_deps;
+  uint16_t             size;
+} rdeps_entry_t;
+
+struct cpf_rdeps {                        // reverse dependency index (hash table)
+  rdeps_entry_t ** bucket;
+  uint32_t         num_buckets;           // power of 2
+  uint32_t         num_entries;
+};
+
+void     rdeps_link( cpf_t * cpf, plugin_t * p );
+void     rdeps_unlink( cpf_t * cpf, plugin_t * p );
+void     rdeps_rebind( cpf_t * cpf, plugin_t * p );
+uint16_t rdeps_count( cpf_t * cpf, char * plugin_name );
+void     rdeps_free( cpf_t * cpf );
+
+#endif
@@ -0,0 +1,319 @@
+/*
+  libcpf - C Plugin Framework
+
+  record.c - call trace recording (CPF_record_start(), see tools/cpf-replay)
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fnv.h"
+#include "record.h"
+
+#define RECORD_TABLE_SIZE       ( 2 * RECORD_MAX_FUNCS ) // power of 2
+
+
+typedef struct {                          // function already defined in the trace
+  char                * plugin_name;      // NULL = free slot
+  char                * func_name;
+  enum func_prototype_t fproto;
+  uint16_t              id;
+} record_func_entry_t;
+
+
+bool record_enabled = false;
+
+static pthread_mutex_t       record_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE                * trace = NULL;
+static struct timespec       trace_start;
+static record_func_entry_t * table = NULL;
+static uint16_t              num_funcs = 0;
+
+// arguments of the calls in progress of this thread (nested calls are appended)
+static __thread uint8_t    * buffer = NULL;
+static __thread size_t       buffer_size = 0;
+static __thread size_t       buffer_len = 0;
+
+
+static void
+buffer_append( const void * data, size_t len )
+{
+  uint8_t * b;
+
+
+  if ( buffer_len + len > buffer_size ) {
+    if ( ( b = (uint8_t *)realloc( buffer, ( buffer_len + len ) * 2 ) ) == NULL ) {
+      LOG_ERROR( "Cannot allocate memory for the call recording!" )
+      exit( EXIT_FAILURE );
+    }
+    buffer = b;
+    buffer_size = ( buffer_len + len ) * 2;
+  }
+  memcpy( buffer + buffer_len, data, len );
+  buffer_len += len;
+}
+
+
+/*
+ * Bytes recorded for the pointer argument "i" (see record.h). A char pointer
+ * is read up to its NUL only if the prototype declares it an input string: an
+ * output buffer may not be terminated yet, and its size isn't known.
+*/
+static uint32_t
+pointee_size( const fp_desc_t * desc, uint8_t i, const void * p )
+{
+  switch ( desc->arg[i] ) {
+    case PT_POINTER_TO_CHAR:
+    case PT_POINTER_TO_UNSIGNED_CHAR:
+      if ( ( desc->in_str & FP_IN_STR( i ) ) == 0 ) {
+        return 0;
+      }
+      return strnlen( (const char *)p, RECORD_MAX_BUFFER - 1 ) + 1;
+    case PT_POINTER_TO_SHORT_INT:
+    case PT_POINTER_TO_UNSIGNED_SHORT_INT:
+      return sizeof( short );
+    case PT_POINTER_TO_INT:
+    case PT_POINTER_TO_UNSIGNED_INT:
+      return sizeof( int );
+    case PT_POINTER_TO_LONG:
+    case PT_POINTER_TO_UNSIGNED_LONG:
+      return sizeof( long );
+    case PT_POINTER_TO_FLOAT:
+      return sizeof( float );
+    case PT_POINTER_TO_DOUBLE:
+      return sizeof( double );
+    case PT_POINTER_TO_LONG_DOUBLE:
+      return sizeof( long double );
+    default:
+      return 0;
+  }
+}
+
+
+/*
+ * Copy the arguments before the call: the buffers are recorded as the plugin
+ * gets them, not as it leaves them. "varglist" is consumed.
+*/
+void
+record_begin( record_ctx_t * r,
+              const char * plugin_name,
+              const char * func_name,
+              enum func_prototype_t fproto,
+              va_list varglist )
+{
+  const fp_desc_t * desc = CPF_wrapper_get_desc( fproto );
+  uint32_t          len;
+  uint8_t           i;
+
+
+  CPF_wrapper_get_args( &r->args, fproto, varglist );
+  r->plugin_name = ( desc != NULL ) ? plugin_name : NULL;
+  r->func_name = func_name;
+  r->off = buffer_len;
+  for ( i = 0 ; ( desc != NULL ) && ( i < desc->num_args ) ; i++ ) {
+    if ( desc->arg[i] < PT_POINTER_TO_VOID ) {
+      buffer_append( &r->args.arg[i], sizeof( fp_arg_t ) );
+    } else if ( r->args.arg[i].vp == NULL ) {
+      len = RECORD_NULL_PTR;
+      buffer_append( &len, sizeof( len ) );
+    } else {
+      len = pointee_size( desc, i, r->args.arg[i].vp );
+      buffer_append( &len, sizeof( len ) );
+      buffer_append( r->args.arg[i].vp, len );
+      if ( ( len == RECORD_MAX_BUFFER ) && ( desc->arg[i] <= PT_POINTER_TO_UNSIGNED_CHAR ) ) {
+        buffer[buffer_len - 1] = '\0'; // truncated string
+      }
+    }
+  }
+  r->len = buffer_len - r->off;
+  clock_gettime( CLOCK_MONOTONIC, &r->t0 );
+}
+
+
+static uint64_t
+elapsed_ns( struct timespec * from, struct timespec * to )
+{
+  return (uint64_t)( to->tv_sec - from->tv_sec ) * 1000000000ULL + to->tv_nsec - from->tv_nsec;
+}
+
+
+static uint32_t
+func_hash( const char * plugin_name, const char * func_name, enum func_prototype_t fproto )
+{
+  uint32_t h;
+
+
+  h = fnv1a_32_str( FNV32_BASIS, plugin_name );
+  h = fnv1a_32( h, "/", 1 );
+  h = fnv1a_32_str( h, func_name );
+  return fnv1a_32( h, &fproto, sizeof( fproto ) );
+}
+
+
+// id of the function in the trace, defined on its first call (record_lock held)
+static bool
+func_id( record_ctx_t * r, uint16_t * id )
+{
+  record_func_entry_t * e;
+  record_func_t         rf;
+  const char          * proto = CPF_wrapper_get_desc( r->args.fproto )->name;
+  uint32_t              i;
+
+
+  i = func_hash( r->plugin_name, r->func_name, r->args.fproto ) & ( RECORD_TABLE_SIZE - 1 );
+  for ( e = &table[i] ; e->plugin_name != NULL ; e = &table[i] ) {
+    if ( ( e->fproto == r->args.fproto ) &&
+         ( strcmp( e->func_name, r->func_name ) == 0 ) &&
+         ( strcmp( e->plugin_name, r->plugin_name ) == 0 ) ) {
+      *id = e->id;
+      return true;
+    }
+    i = ( i + 1 ) & ( RECORD_TABLE_SIZE - 1 );
+  }
+  if ( num_funcs == RECORD_MAX_FUNCS ) {
+    return false;
+  }
+  if ( ( ( e->plugin_name = strdup( r->plugin_name ) ) == NULL ) ||
+       ( ( e->func_name = strdup( r->func_name ) ) == NULL ) ) {
+    LOG_ERROR( "Cannot allocate memory for the call recording!" )
+    exit( EXIT_FAILURE );
+  }
+  e->fproto = r->args.fproto;
+  e->id = num_funcs++;
+
+  memset( &rf, 0, sizeof( rf ) );
+  rf.type = RECORD_TYPE_FUNC;
+  rf.id = e->id;
+  rf.plugin_len = strlen( r->plugin_name );
+  rf.func_len = strlen( r->func_name );
+  rf.fproto_len = strlen( proto );
+  fwrite( &rf, sizeof( rf ), 1, trace );
+  fwrite( r->plugin_name, 1, rf.plugin_len, trace );
+  fwrite( r->func_name, 1, rf.func_len, trace );
+  fwrite( proto, 1, rf.fproto_len, trace );
+  *id = e->id;
+  return true;
+}
+
+
+void
+record_end( record_ctx_t * r )
+{
+  struct timespec t1;
+  record_call_t   rc;
+  uint64_t        ns;
+
+
+  clock_gettime( CLOCK_MONOTONIC, &t1 );
+  if ( r->plugin_name == NULL ) { // no prototype description: not recorded
+    buffer_len = r->off;
+    return;
+  }
+  ns = elapsed_ns( &r->t0, &t1 );
+  memset( &rc, 0, sizeof( rc ) );
+  rc.type = RECORD_TYPE_CALL;
+  rc.num_args = r->args.num_args;
+  rc.duration_ns = ( ns > UINT32_MAX ) ? UINT32_MAX : (uint32_t)ns;
+
+  pthread_mutex_lock( &record_lock );
+  if ( ( trace != NULL ) && ( func_id( r, &rc.id ) == true ) ) {
+    rc.start_ns = ( ( r->t0.tv_sec > trace_start.tv_sec ) ||
+                    ( ( r->t0.tv_sec == trace_start.tv_sec ) && ( r->t0.tv_nsec >= trace_start.tv_nsec ) ) )
+                  ? elapsed_ns( &trace_start, &r->t0 ) : 0;
+    fwrite( &rc, sizeof( rc ), 1, trace );
+    fwrite( buffer + r->off, 1, r->len, trace );
+    if ( ferror( trace ) ) {
+      LOG_ERROR( "Cannot write the call trace: recording stopped!" )
+      __atomic_store_n( &record_enabled, false, __ATOMIC_RELAXED );
+      clearerr( trace );
+    }
+  }
+  pthread_mutex_unlock( &record_lock );
+  buffer_len = r->off;
+}
+
+
+/*
+ * Record the calls made with CPF_call_func_by_name(), CPF_call_func_by_offset()
+ * and the resolved handles in "path", until CPF_record_stop(). The calls made
+ * by address can't be recorded: they have no plugin and function name.
+*/
+int
+CPF_record_start( const char * path )
+{
+  record_hdr_t hdr;
+
+
+  if ( path == NULL ) {
+    LOG_ERROR( "CPF_record_start(): Parameter cannot be NULL!" )
+    return EXIT_FAILURE;
+  }
+  pthread_mutex_lock( &record_lock );
+  if ( trace != NULL ) {
+    pthread_mutex_unlock( &record_lock );
+    LOG_ERROR( "CPF_record_start(): Already recording!" )
+    return EXIT_FAILURE;
+  }
+  if ( ( table = (record_func_entry_t *)calloc( RECORD_TABLE_SIZE, sizeof( record_func_entry_t ) ) ) == NULL ) {
+    LOG_ERROR( "Cannot allocate memory for the call recording!" )
+    exit( EXIT_FAILURE );
+  }
+  memset( &hdr, 0, sizeof( hdr ) );
+  memcpy( hdr.magic, RECORD_MAGIC, sizeof( hdr.magic ) );
+  hdr.version = RECORD_VERSION;
+  if ( ( ( trace = fopen( path, "w" ) ) == NULL ) ||
+       ( fwrite( &hdr, sizeof( hdr ), 1, trace ) != 1 ) ) {
+    LOG_ERROR( "CPF_record_start(): Cannot write \"%s\"!", path )
+    if ( trace != NULL ) {
+      fclose( trace );
+      trace = NULL;
+    }
+    FREE( table )
+    pthread_mutex_unlock( &record_lock );
+    return EXIT_FAILURE;
+  }
+  num_funcs = 0;
+  clock_gettime( CLOCK_MONOTONIC, &trace_start );
+  __atomic_store_n( &record_enabled, true, __ATOMIC_RELEASE );
+  pthread_mutex_unlock( &record_lock );
+  return EXIT_SUCCESS;
+}
+
+
+// the calls in progress are dropped
+void
+CPF_record_stop( void )
+{
+  uint32_t i;
+
+
+  __atomic_store_n( &record_enabled, false, __ATOMIC_RELEASE );
+  pthread_mutex_lock( &record_lock );
+  if ( trace != NULL ) {
+    if ( fclose( trace ) != 0 ) {
+      LOG_ERROR( "CPF_record_stop(): Cannot write the call trace!" )
+    }
+    trace = NULL;
+    for ( i = 0 ; i < RECORD_TABLE_SIZE ; i++ ) {
+      FREE( table[i].plugin_name )
+      FREE( table[i].func_name )
+    }
+    FREE( table )
+  }
+  pthread_mutex_unlock( &record_lock );
+}
@@ -0,0 +1,97 @@
+/*
+  libcpf - C Plugin Framework
+
+  record.h - header file
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __RECORD_H__
+#define __RECORD_H__
+
+#include <stdarg.h>
+#include <time.h>
+#include "cpf.h"
+
+/*
+ * Call trace layout (host byte order), written by CPF_record_start() and read
+ * by tools/cpf-replay:
+ *
+ *   record_hdr_t
+ *   records, each one starting with its type:
+ *     record_func_t + plugin name + function name + prototype name
+ *                                  <== first call of a function, not NUL terminated
+ *     record_call_t + arguments    <== one per call
+ *
+ * Each argument of a call is a fp_arg_t (8 bytes) for a scalar, or a uint32_t
+ * length followed by the bytes for a pointer (RECORD_NULL_PTR if NULL): the
+ * string for an input string (FP_IN_STR() in the prototype description), one
+ * value for a pointer to a scalar, nothing for a void pointer or another char
+ * pointer. The plugin name of a tuned handle (CPF_resolve_tuned()) is
+ * empty.
+*/
+#define RECORD_MAGIC            "CPFTRACE"
+#define RECORD_VERSION          1
+#define RECORD_TYPE_FUNC        'F'
+#define RECORD_TYPE_CALL        'C'
+#define RECORD_MAX_FUNCS        4096      // functions per trace
+#define RECORD_MAX_BUFFER       4096      // bytes recorded per pointer argument
+#define RECORD_NULL_PTR         0xffffffff
+
+typedef struct {
+  char     magic[8];
+  uint32_t version;
+  uint32_t reserved;
+} record_hdr_t;
+
+typedef struct {                          // function definition
+  uint8_t  type;                          // RECORD_TYPE_FUNC
+  uint8_t  reserved;
+  uint16_t id;                            // referenced by the calls
+  uint16_t plugin_len;
+  uint16_t func_len;
+  uint16_t fproto_len;
+  uint16_t reserved2;
+} record_func_t;
+
+typedef struct {                          // call
+  uint8_t  type;                          // RECORD_TYPE_CALL
+  uint8_t  num_args;
+  uint16_t id;
+  uint32_t duration_ns;                   // recorded latency, saturated
+  uint64_t start_ns;                      // since CPF_record_start()
+} record_call_t;
+
+typedef struct {                          // call in progress (see record_begin())
+  const char    * plugin_name;
+  const char    * func_name;
+  fp_args_t       args;
+  size_t          off;                    // arguments serialized in the thread buffer
+  size_t          len;
+  struct timespec t0;
+} record_ctx_t;
+
+extern bool record_enabled;
+
+#define RECORDING() __builtin_expect( __atomic_load_n( &record_enabled, __ATOMIC_RELAXED ), 0 )
+
+void record_begin( record_ctx_t * r,
+                   const char * plugin_name,
+                   const char * func_name,
+                   enum func_prototype_t fproto,
+                   va_list varglist );
+void record_end( record_ctx_t * r );
+
+#endif
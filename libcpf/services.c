@@ -0,0 +1,411 @@
+/*
+  libcpf - C Plugin Framework
+
+  services.c - host allocator and scratch-memory services for plugins
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "services.h"
+
+#define POOL_MIN_SHIFT          4         // smallest pooled block: 16 bytes
+#define POOL_NUM_CLASSES        9         // 16 bytes .. 4KB
+#define POOL_MAX_CACHED         256       // cached blocks per class and thread
+#define POOL_LARGE              0xffff    // class of the blocks not pooled
+#define ARENA_ALIGN             16
+
+
+typedef struct plugin_services {          // one per plugin name, never freed
+  cpf_services_t            pub;          // 1st struct field!!!
+  struct plugin_services  * next;
+  char                      name[MAX_PLUGIN_NAME_SIZE];
+  _Atomic uint64_t          allocs;
+  _Atomic uint64_t          frees;
+  _Atomic uint64_t          alloc_bytes;
+  _Atomic uint64_t          pool_hits;
+  _Atomic uint64_t          arena_allocs;
+  _Atomic uint64_t          arena_bytes;
+  _Atomic uint64_t          out_buffers;
+} plugin_services_t;
+
+typedef struct {                          // precedes each pooled block (keeps 16 bytes alignment)
+  plugin_services_t * owner;
+  uint32_t            class;
+  uint32_t            size;               // requested size, for the statistics
+} block_hdr_t;
+
+typedef struct free_block {
+  struct free_block * next;
+} free_block_t;
+
+typedef struct {                          // per-thread block cache
+  free_block_t * head[POOL_NUM_CLASSES];
+  uint32_t       count[POOL_NUM_CLASSES];
+} pool_t;
+
+typedef struct arena_chunk {              // the data follows, ARENA_ALIGN aligned
+  _Alignas( ARENA_ALIGN ) struct arena_chunk * next;
+  size_t               size;
+  size_t               used;
+} arena_chunk_t;
+
+struct cpf_arena {
+  arena_chunk_t * head;
+  arena_chunk_t * current;
+  size_t          chunk_size;
+};
+
+
+static plugin_services_t * services_list = NULL;
+static pthread_mutex_t     services_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread pool_t      * tl_pool = NULL;
+static __thread cpf_arena_t * tl_arena = NULL;
+static __thread void        * tl_out_buffer = NULL;
+static __thread size_t        tl_out_size = 0;
+static pthread_key_t          pool_key;
+static pthread_once_t         pool_once = PTHREAD_ONCE_INIT;
+
+
+static void
+pool_release( void * ptr )
+{
+  pool_t       * pool = (pool_t *)ptr;
+  free_block_t * b;
+  uint16_t       c;
+
+
+  for ( c = 0 ; c < POOL_NUM_CLASSES ; c++ ) {
+    while ( ( b = pool->head[c] ) != NULL ) {
+      pool->head[c] = b->next;
+      free( (block_hdr_t *)b - 1 );
+    }
+  }
+  free( pool );
+  tl_pool = NULL;
+}
+
+
+static void
+pool_init_once( void )
+{
+  pthread_key_create( &pool_key, pool_release );
+}
+
+
+static pool_t *
+get_pool( void )
+{
+  if ( tl_pool != NULL ) {
+    return tl_pool;
+  }
+  pthread_once( &pool_once, pool_init_once );
+  if ( ( tl_pool = (pool_t *)calloc( 1, sizeof( pool_t ) ) ) != NULL ) {
+    pthread_setspecific( pool_key, tl_pool );
+  }
+  return tl_pool;
+}
+
+
+static uint32_t
+size_class( size_t size )
+{
+  uint32_t c = 0;
+
+
+  if ( size > ( (size_t)1 << ( POOL_MIN_SHIFT + POOL_NUM_CLASSES - 1 ) ) ) {
+    return POOL_LARGE;
+  }
+  while ( ( (size_t)1 << ( POOL_MIN_SHIFT + c ) ) < size ) {
+    c++;
+  }
+  return c;
+}
+
+
+static void *
+svc_alloc( const cpf_services_t * s, size_t size )
+{
+  plugin_services_t * ps = (plugin_services_t *)s;
+  pool_t            * pool;
+  block_hdr_t       * hdr = NULL;
+  uint32_t            c = size_class( size );
+
+
+  if ( ( c != POOL_LARGE ) && ( ( pool = get_pool() ) != NULL ) && ( pool->head[c] != NULL ) ) {
+    hdr = (block_hdr_t *)pool->head[c] - 1;
+    pool->head[c] = pool->head[c]->next;
+    pool->count[c]--;
+    atomic_fetch_add_explicit( &ps->pool_hits, 1, memory_order_relaxed );
+  } else {
+    hdr = (block_hdr_t *)malloc( sizeof( block_hdr_t ) +
+                                 ( ( c == POOL_LARGE ) ? size : (size_t)1 << ( POOL_MIN_SHIFT + c ) ) );
+    if ( hdr == NULL ) {
+      return NULL;
+    }
+  }
+  hdr->owner = ps;
+  hdr->class = c;
+  hdr->size = ( size > UINT32_MAX ) ? UINT32_MAX : (uint32_t)size;
+  atomic_fetch_add_explicit( &ps->allocs, 1, memory_order_relaxed );
+  atomic_fetch_add_explicit( &ps->alloc_bytes, size, memory_order_relaxed );
+  return hdr + 1;
+}
+
+
+// the block goes to the pool of the freeing thread
+void
+CPF_mem_free( void * ptr )
+{
+  block_hdr_t  * hdr;
+  pool_t       * pool;
+  free_block_t * b;
+  uint32_t       c;
+
+
+  if ( ptr == NULL ) {
+    return;
+  }
+  hdr = (block_hdr_t *)ptr - 1;
+  c = hdr->class;
+  atomic_fetch_add_explicit( &hdr->owner->frees, 1, memory_order_relaxed );
+  if ( ( c == POOL_LARGE ) || ( ( pool = get_pool() ) == NULL ) ||
+       ( pool->count[c] >= POOL_MAX_CACHED ) ) {
+    free( hdr );
+    return;
+  }
+  b = (free_block_t *)ptr;
+  b->next = pool->head[c];
+  pool->head[c] = b;
+  pool->count[c]++;
+}
+
+
+static void
+svc_free( const cpf_services_t * s, void * ptr )
+{
+  CPF_mem_free( ptr );
+}
+
+
+static void *
+svc_arena_alloc( const cpf_services_t * s, size_t size )
+{
+  plugin_services_t * ps = (plugin_services_t *)s;
+  cpf_arena_t       * a = tl_arena;
+  arena_chunk_t     * chunk,
+                    * next;
+  size_t              csize;
+  void              * ptr;
+
+
+  if ( a == NULL ) {
+    return NULL;
+  }
+  size = ( size + ARENA_ALIGN - 1 ) & ~( (size_t)ARENA_ALIGN - 1 );
+  // next chunk with room (the chunks are kept by CPF_arena_reset())
+  for ( chunk = a->current ; chunk != NULL ; chunk = chunk->next ) {
+    if ( chunk->size - chunk->used >= size ) {
+      break;
+    }
+    if ( chunk->next != NULL ) {
+      chunk->next->used = 0;
+    }
+  }
+  if ( chunk == NULL ) {
+    csize = ( size > a->chunk_size ) ? size : a->chunk_size;
+    if ( ( chunk = (arena_chunk_t *)malloc( sizeof( arena_chunk_t ) + csize ) ) == NULL ) {
+      return NULL;
+    }
+    chunk->size = csize;
+    chunk->used = 0;
+    chunk->next = NULL;
+    // append after the current chunk
+    if ( a->current == NULL ) {
+      a->head = chunk;
+    } else {
+      for ( next = a->current ; next->next != NULL ; next = next->next );
+      next->next = chunk;
+    }
+  }
+  a->current = chunk;
+  ptr = (char *)( chunk + 1 ) + chunk->used;
+  chunk->used += size;
+  atomic_fetch_add_explicit( &ps->arena_allocs, 1, memory_order_relaxed );
+  atomic_fetch_add_explicit( &ps->arena_bytes, size, memory_order_relaxed );
+  return ptr;
+}
+
+
+static void *
+svc_out_buffer( const cpf_services_t * s, size_t size )
+{
+  plugin_services_t * ps = (plugin_services_t *)s;
+  void              * buf = tl_out_buffer;
+
+
+  if ( ( buf == NULL ) || ( tl_out_size < size ) ) {
+    return NULL;
+  }
+  tl_out_buffer = NULL;
+  tl_out_size = 0;
+  atomic_fetch_add_explicit( &ps->out_buffers, 1, memory_order_relaxed );
+  return buf;
+}
+
+
+static void *
+svc_dep_func( const cpf_services_t * s, deps_t * d, char * plugin_name, char * func_name )
+{
+  return CPF_get_extern_lib_func_by_dep( d, plugin_name, func_name );
+}
+
+
+// services of a plugin name: kept across reloads, so pooled blocks can outlive
+// the plugin that allocated them
+const cpf_services_t *
+services_get( char * plugin_name )
+{
+  plugin_services_t * ps;
+
+
+  pthread_mutex_lock( &services_lock );
+  for ( ps = services_list ; ps != NULL ; ps = ps->next ) {
+    if ( strcmp( ps->name, plugin_name ) == 0 ) {
+      break;
+    }
+  }
+  if ( ps == NULL ) {
+    if ( ( ps = (plugin_services_t *)calloc( 1, sizeof( plugin_services_t ) ) ) == NULL ) {
+      LOG_ERROR( "Cannot allocate memory for plugin services!" )
+      exit( EXIT_FAILURE );
+    }
+    ps->pub.version = CPF_SERVICES_VERSION;
+    ps->pub.alloc = svc_alloc;
+    ps->pub.free = svc_free;
+    ps->pub.arena_alloc = svc_arena_alloc;
+    ps->pub.out_buffer = svc_out_buffer;
+    ps->pub.dep_func = svc_dep_func;
+    snprintf( ps->name, sizeof( ps->name ), "%s", plugin_name );
+    ps->next = services_list;
+    services_list = ps;
+  }
+  pthread_mutex_unlock( &services_lock );
+  return &ps->pub;
+}
+
+
+int
+CPF_get_alloc_stats( char * plugin_name, cpf_alloc_stats_t * stats )
+{
+  plugin_services_t * ps;
+
+
+  if ( ( plugin_name == NULL ) || ( stats == NULL ) ) {
+    LOG_ERROR( "CPF_get_alloc_stats(): Parameters cannot be NULL!" )
+    return EXIT_FAILURE;
+  }
+  pthread_mutex_lock( &services_lock );
+  for ( ps = services_list ; ps != NULL ; ps = ps->next ) {
+    if ( strcmp( ps->name, plugin_name ) == 0 ) {
+      break;
+    }
+  }
+  pthread_mutex_unlock( &services_lock );
+  if ( ps == NULL ) {
+    LOG_ERROR( "CPF_get_alloc_stats(): Plugin \"%s\" not found!", plugin_name )
+    return EXIT_FAILURE;
+  }
+  stats->allocs = atomic_load_explicit( &ps->allocs, memory_order_relaxed );
+  stats->frees = atomic_load_explicit( &ps->frees, memory_order_relaxed );
+  stats->alloc_bytes = atomic_load_explicit( &ps->alloc_bytes, memory_order_relaxed );
+  stats->pool_hits = atomic_load_explicit( &ps->pool_hits, memory_order_relaxed );
+  stats->arena_allocs = atomic_load_explicit( &ps->arena_allocs, memory_order_relaxed );
+  stats->arena_bytes = atomic_load_explicit( &ps->arena_bytes, memory_order_relaxed );
+  stats->out_buffers = atomic_load_explicit( &ps->out_buffers, memory_order_relaxed );
+  return EXIT_SUCCESS;
+}
+
+
+/*
+ * Per-request arena: the plugins allocate from it with CPF_ARENA_ALLOC() while
+ * it's the current arena of the calling thread, and the host frees everything
+ * with CPF_arena_reset(). An arena is used by one thread at a time.
+*/
+cpf_arena_t *
+CPF_arena_create( size_t chunk_size )
+{
+  cpf_arena_t * a;
+
+
+  if ( ( a = (cpf_arena_t *)calloc( 1, sizeof( cpf_arena_t ) ) ) == NULL ) {
+    LOG_ERROR( "CPF_arena_create(): Cannot allocate memory!" )
+    return NULL;
+  }
+  a->chunk_size = ( chunk_size == 0 ) ? 64 * 1024 : chunk_size;
+  return a;
+}
+
+
+// keep the chunks for the next request
+void
+CPF_arena_reset( cpf_arena_t * a )
+{
+  if ( ( a == NULL ) || ( a->head == NULL ) ) {
+    return;
+  }
+  a->head->used = 0;
+  a->current = a->head;
+}
+
+
+void
+CPF_arena_destroy( cpf_arena_t ** a )
+{
+  arena_chunk_t * chunk;
+
+
+  if ( (*a) == NULL ) {
+    return;
+  }
+  if ( tl_arena == (*a) ) {
+    tl_arena = NULL;
+  }
+  while ( ( chunk = (*a)->head ) != NULL ) {
+    (*a)->head = chunk->next;
+    FREE( chunk )
+  }
+  FREE( (*a) )
+}
+
+
+void
+CPF_arena_set_current( cpf_arena_t * a )
+{
+  tl_arena = a;
+}
+
+
+// the next CPF_OUT_BUFFER() of this thread may return "buffer"
+void
+CPF_set_out_buffer( void * buffer, size_t size )
+{
+  tl_out_buffer = buffer;
+  tl_out_size = ( buffer == NULL ) ? 0 : size;
+}
@@ -0,0 +1,275 @@
+/*
+  libcpf - C Plugin Framework
+
+  shared_registry.c - registry metadata shared by the processes of a server
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fnv.h"
+#include "manifest.h"
+#include "shared_registry.h"
+
+
+// "/cpf-<uid>-<path hash>" (control), or "/cpf-<uid>-<path hash>.<generation>" (image)
+static void
+shreg_name( cpf_t * cpf, uint32_t generation, char * name, size_t size )
+{
+  uint64_t h = fnv1a_64_str( FNV64_BASIS, cpf->path );
+
+
+  if ( generation == 0 ) {
+    snprintf( name, size, "/cpf-%u-%016llx", (unsigned)geteuid(), (unsigned long long)h );
+  } else {
+    snprintf( name, size, "/cpf-%u-%016llx.%u", (unsigned)geteuid(), (unsigned long long)h, generation );
+  }
+}
+
+
+/*
+ * The names are predictable: only the objects created by this user, and not
+ * writable by the others, are used. Otherwise another user could point the
+ * workers to any image (plugin paths and function offsets).
+*/
+static bool
+shreg_trusted( int fd, const char * name )
+{
+  struct stat st;
+
+
+  if ( fstat( fd, &st ) == -1 ) {
+    return false;
+  }
+  if ( ( st.st_uid != geteuid() ) || ( ( st.st_mode & ( S_IWGRP | S_IWOTH ) ) != 0 ) ) {
+    LOG_ERROR( "Shared registry \"%s\" isn't owned by this user or is writable by others: ignored", name )
+    return false;
+  }
+  return true;
+}
+
+
+// generation of the published image, 0 if there's none
+static uint32_t
+shreg_generation( cpf_t * cpf )
+{
+  char        name[SHREG_NAME_SIZE];
+  shreg_ctl_t ctl;
+  int         fd;
+
+
+  shreg_name( cpf, 0, name, sizeof( name ) );
+  if ( ( fd = shm_open( name, O_RDONLY | O_CLOEXEC, 0 ) ) == -1 ) {
+    return 0;
+  }
+  if ( ( shreg_trusted( fd, name ) == false ) ||
+       ( pread( fd, &ctl, sizeof( ctl ), 0 ) != sizeof( ctl ) ) ||
+       ( memcmp( ctl.magic, SHREG_MAGIC, sizeof( ctl.magic ) ) != 0 ) ||
+       ( ctl.version != SHREG_VERSION ) ) {
+    ctl.generation = 0;
+  }
+  close( fd );
+  return ctl.generation;
+}
+
+
+static bool
+shreg_attach( cpf_t * cpf )
+{
+  char        name[SHREG_NAME_SIZE];
+  struct stat st;
+  uint32_t    generation;
+  uint16_t    tries;
+  void      * map;
+  int         fd;
+
+
+  for ( tries = 0 ; tries < SHREG_ATTACH_TRIES ; tries++ ) {
+    if ( ( generation = shreg_generation( cpf ) ) == 0 ) {
+      return false;
+    }
+    shreg_name( cpf, generation, name, sizeof( name ) );
+    if ( ( fd = shm_open( name, O_RDONLY | O_CLOEXEC, 0 ) ) == -1 ) {
+      if ( errno == ENOENT ) { // replaced by a newer generation: read it again
+        continue;
+      }
+      return false;
+    }
+    if ( ( shreg_trusted( fd, name ) == false ) ||
+         ( fstat( fd, &st ) == -1 ) || ( st.st_size == 0 ) ) {
+      close( fd );
+      return false;
+    }
+    map = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    if ( map == MAP_FAILED ) {
+      return false;
+    }
+    if ( ( cpf->shreg = (struct cpf_shreg *)calloc( 1, sizeof( struct cpf_shreg ) ) ) == NULL ) {
+      LOG_ERROR( "Cannot allocate memory for the shared registry!" )
+      exit( EXIT_FAILURE );
+    }
+    cpf->shreg->map = map;
+    cpf->shreg->size = st.st_size;
+    cpf->shared_generation = generation;
+    return true;
+  }
+  return false;
+}
+
+
+void
+shreg_detach( cpf_t * cpf )
+{
+  if ( cpf->shreg == NULL ) {
+    return;
+  }
+  munmap( cpf->shreg->map, cpf->shreg->size );
+  FREE( cpf->shreg )
+}
+
+
+/*
+ * Set the plugins from the published image, instead of walking the plugin
+ * directory. The image stays mapped until the plugins are loaded (see
+ * manifest_open()). False if there's no valid image.
+*/
+bool
+shreg_bind_plugins( cpf_t * cpf )
+{
+  if ( shreg_attach( cpf ) == false ) {
+    return false;
+  }
+  if ( manifest_bind_plugins( cpf, cpf->shreg->map, cpf->shreg->size ) == false ) {
+    LOG_INFO( "Shared registry of \"%s\" is empty or invalid: scanning the directory", cpf->path )
+    shreg_detach( cpf );
+    cpf->shared_generation = 0;
+    return false;
+  }
+  return true;
+}
+
+
+/*
+ * Publish a new generation: the image object is written before the control
+ * object points to it, and the previous image is unlinked (the processes that
+ * mapped it keep their mapping).
+*/
+void
+shreg_publish( cpf_t * cpf, const void * image, size_t size )
+{
+  char          name[SHREG_NAME_SIZE];
+  shreg_ctl_t * ctl;
+  uint32_t      generation;
+  int           fd, ctl_fd;
+
+
+  // the control object is created, or the one of a previous publisher is reused if it's trusted
+  shreg_name( cpf, 0, name, sizeof( name ) );
+  if ( ( ( ctl_fd = shm_open( name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, SHREG_MODE ) ) == -1 ) &&
+       ( errno == EEXIST ) &&
+       ( ( ctl_fd = shm_open( name, O_RDWR | O_CLOEXEC, 0 ) ) != -1 ) &&
+       ( shreg_trusted( ctl_fd, name ) == false ) ) {
+    close( ctl_fd );
+    return;
+  }
+  if ( ( ctl_fd == -1 ) || ( ftruncate( ctl_fd, sizeof( shreg_ctl_t ) ) == -1 ) ) {
+    LOG_ERROR( "Cannot publish the shared registry \"%s\": %s", name, strerror( errno ) )
+    if ( ctl_fd != -1 ) {
+      close( ctl_fd );
+    }
+    return;
+  }
+  ctl = (shreg_ctl_t *)mmap( NULL, sizeof( shreg_ctl_t ), PROT_READ | PROT_WRITE, MAP_SHARED, ctl_fd, 0 );
+  close( ctl_fd );
+  if ( ctl == MAP_FAILED ) {
+    LOG_ERROR( "Cannot map the shared registry \"%s\": %s", name, strerror( errno ) )
+    return;
+  }
+  if ( memcmp( ctl->magic, SHREG_MAGIC, sizeof( ctl->magic ) ) != 0 ) {
+    ctl->generation = 0;
+  }
+  if ( ( generation = ctl->generation + 1 ) == 0 ) {
+    generation = 1;
+  }
+
+  shreg_name( cpf, generation, name, sizeof( name ) );
+  shm_unlink( name ); // left by a publisher that crashed
+  if ( ( fd = shm_open( name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, SHREG_MODE ) ) == -1 ) {
+    LOG_ERROR( "Cannot publish the shared registry \"%s\": %s", name, strerror( errno ) )
+    munmap( ctl, sizeof( shreg_ctl_t ) );
+    return;
+  }
+  if ( write( fd, image, size ) != (ssize_t)size ) {
+    LOG_ERROR( "Cannot write the shared registry \"%s\"!", name )
+    close( fd );
+    shm_unlink( name );
+    munmap( ctl, sizeof( shreg_ctl_t ) );
+    return;
+  }
+  close( fd );
+
+  memcpy( ctl->magic, SHREG_MAGIC, sizeof( ctl->magic ) );
+  ctl->version = SHREG_VERSION;
+  __atomic_store_n( &ctl->generation, generation, __ATOMIC_RELEASE );
+  munmap( ctl, sizeof( shreg_ctl_t ) );
+  if ( generation > 1 ) {
+    shreg_name( cpf, generation - 1, name, sizeof( name ) );
+    shm_unlink( name );
+  }
+  cpf->shared_generation = generation;
+}
+
+
+// true if a newer generation was published since "cpf" was loaded
+bool
+CPF_shared_changed( cpf_t * cpf )
+{
+  uint32_t generation;
+
+
+  if ( ( cpf == NULL ) || ( ( cpf->flags & CPF_FLAG_SHARED_ATTACH ) == 0 ) ) {
+    return false;
+  }
+  generation = shreg_generation( cpf );
+  return ( generation != 0 ) && ( generation != cpf->shared_generation );
+}
+
+
+// remove the shared objects of the registry (publisher, on shutdown)
+void
+CPF_shared_unlink( cpf_t * cpf )
+{
+  char     name[SHREG_NAME_SIZE];
+  uint32_t generation;
+
+
+  if ( cpf == NULL ) {
+    return;
+  }
+  if ( ( generation = shreg_generation( cpf ) ) != 0 ) {
+    shreg_name( cpf, generation, name, sizeof( name ) );
+    shm_unlink( name );
+  }
+  shreg_name( cpf, 0, name, sizeof( name ) );
+  shm_unlink( name );
+}
@@ -0,0 +1,53 @@
+/*
+  libcpf - C Plugin Framework
+
+  shared_registry.h - header file
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __SHARED_REGISTRY_H__
+#define __SHARED_REGISTRY_H__
+
+#include "cpf.h"
+
+/*
+ * Shared registry: the publisher writes the registry metadata (the manifest
+ * cache image, see manifest.h) in a POSIX shared memory object per generation,
+ * "/cpf-<path hash>.<generation>", and the current generation in the control
+ * object "/cpf-<path hash>". The other processes map the image read-only.
+*/
+#define SHREG_MAGIC             "CPFSHREG"
+#define SHREG_VERSION           1
+#define SHREG_NAME_SIZE         48
+#define SHREG_MODE              0600              // the workers run as the publisher's user
+#define SHREG_ATTACH_TRIES      3                 // the image can be unlinked by a new publish
+
+typedef struct {                          // control object
+  char     magic[8];
+  uint32_t version;
+  uint32_t generation;                    // current image, 0 = none (atomic)
+} shreg_ctl_t;
+
+struct cpf_shreg {                        // image attached while the plugins are loaded
+  void   * map;
+  size_t   size;
+};
+
+bool shreg_bind_plugins( cpf_t * cpf );
+void shreg_detach( cpf_t * cpf );
+void shreg_publish( cpf_t * cpf, const void * image, size_t size );
+
+#endif
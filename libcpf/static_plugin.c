@@ -0,0 +1,144 @@
+/*
+  libcpf - C Plugin Framework
+
+  static_plugin.c - plugins linked into the binary (CPF_STATIC_PLUGIN())
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "plugin_manager.h"
+#include "static_plugin.h"
+
+
+// registered descriptors, in registration order
+static pthread_mutex_t              registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static const cpf_static_plugin_t ** registry = NULL;
+static uint16_t                     num_registered = 0;
+
+
+// called by the constructor of CPF_STATIC_PLUGIN(), before main()
+void
+CPF_register_static_plugin( const cpf_static_plugin_t * sp )
+{
+  const cpf_static_plugin_t ** r;
+
+
+  if ( ( sp == NULL ) || ( sp->name == NULL ) || ( sp->init_ctx == NULL ) || ( sp->funcs == NULL ) ) {
+    LOG_ERROR( "CPF_register_static_plugin(): Invalid static plugin descriptor!" )
+    return;
+  }
+  if ( strlen( STATIC_PLUGIN_PATH ) + strlen( sp->name ) + 1 > MAX_PLUGIN_NAME_SIZE ) {
+    LOG_ERROR( "CPF_register_static_plugin(): Plugin name \"%s\" too long!", sp->name )
+    return;
+  }
+  pthread_mutex_lock( &registry_lock );
+  r = (const cpf_static_plugin_t **)realloc( registry,
+                                             ( num_registered + 1 ) * sizeof( cpf_static_plugin_t * ) );
+  if ( r == NULL ) {
+    LOG_ERROR( "Cannot allocate memory for the static plugins!" )
+    exit( EXIT_FAILURE );
+  }
+  registry = r;
+  registry[num_registered++] = sp;
+  pthread_mutex_unlock( &registry_lock );
+}
+
+
+static bool
+is_loaded( cpf_t * cpf, const char * name )
+{
+  uint16_t i;
+
+
+  for ( i = 0 ; i < cpf->num_plugins ; i++ ) {
+    if ( strcmp( cpf->plugin[i].name, name ) == 0 ) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+// the function table is copied, as if it had been read from the symbol table
+static void
+bind_static_plugin( plugin_t * p, const cpf_static_plugin_t * sp )
+{
+  uint16_t n;
+
+
+  for ( n = 0 ; sp->funcs[n].func_name != NULL ; n++ );
+  if ( ( p->lib_func = (func_t *)calloc( n + 1, sizeof( func_t ) ) ) == NULL ) {
+    LOG_ERROR( "Cannot allocate memory for the static plugin functions!" )
+    exit( EXIT_FAILURE );
+  }
+  for ( n = 0 ; sp->funcs[n].func_name != NULL ; n++ ) {
+    p->lib_func[n].func_addr = sp->funcs[n].func_addr;
+    p->lib_func[n].func_name = (char *)sp->funcs[n].func_name;
+    p->lib_func[n].flags = sp->funcs[n].flags;
+    p->lib_func[n].fproto = sp->funcs[n].fproto;
+  }
+  snprintf( p->name, sizeof( p->name ), "%s", sp->name );
+  snprintf( p->path, sizeof( p->path ), STATIC_PLUGIN_PATH"%s", sp->name );
+  p->origin = CPF_ORIGIN_STATIC;
+  p->init_ctx = (void *)sp->init_ctx;
+  p->ctor = (void *)sp->ctor;
+  p->dtor = (void *)sp->dtor;
+  if ( init_plugin_ctx( p ) == false ) {
+    exit( EXIT_FAILURE );
+  }
+}
+
+
+/*
+ * Add the static plugins to the plugins found in the directory. A plugin file
+ * with the same name takes precedence, as it does on reload.
+*/
+void
+static_load_plugins( cpf_t * cpf )
+{
+  plugin_t * plugin;
+  uint16_t   i, n = 0;
+
+
+  pthread_mutex_lock( &registry_lock );
+  if ( num_registered == 0 ) {
+    pthread_mutex_unlock( &registry_lock );
+    return;
+  }
+  plugin = (plugin_t *)realloc( cpf->plugin, ( cpf->num_plugins + num_registered ) * sizeof( plugin_t ) );
+  if ( plugin == NULL ) {
+    LOG_ERROR( "Cannot allocate memory for the static plugins!" )
+    exit( EXIT_FAILURE );
+  }
+  cpf->plugin = plugin;
+  for ( i = 0 ; i < num_registered ; i++ ) {
+    if ( is_loaded( cpf, registry[i]->name ) == true ) {
+      LOG_INFO( "Static plugin \"%s\" overridden by the plugin directory", registry[i]->name )
+      continue;
+    }
+    memset( &cpf->plugin[cpf->num_plugins], 0, sizeof( plugin_t ) );
+    bind_static_plugin( &cpf->plugin[cpf->num_plugins], registry[i] );
+    cpf->num_plugins++;
+    n++;
+  }
+  pthread_mutex_unlock( &registry_lock );
+  if ( n > 0 ) {
+    sort_plugins( cpf );
+  }
+}
@@ -0,0 +1,31 @@
+/*
+  libcpf - C Plugin Framework
+
+  static_plugin.h - header file
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __STATIC_PLUGIN_H__
+#define __STATIC_PLUGIN_H__
+
+#include "cpf.h"
+
+#define STATIC_PLUGIN_PATH      "<static>/"       // plugin_t.path prefix of the static plugins
+
+
+void static_load_plugins( cpf_t * cpf );
+
+#endif
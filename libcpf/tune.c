@@ -0,0 +1,210 @@
+/*
+  libcpf - C Plugin Framework
+
+  tune.c - auto-tuned selection among the plugins exporting a function name
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "plugin_manager.h"
+#include "tune.h"
+
+
+static func_t *
+find_func( plugin_t * p, char * func_name )
+{
+  func_t * f;
+
+
+  for ( f = p->lib_func ; f->func_addr != NULL ; f++ ) {
+    if ( ( f->func_name != NULL ) && ( strcmp( f->func_name, func_name ) == 0 ) ) {
+      return f;
+    }
+  }
+  return NULL;
+}
+
+
+/*
+ * Providers of "func_name": every loaded plugin exporting it with the
+ * prototype "fproto", in the registry order. Until the first exploration
+ * round completes, the calls go to the provider selected by the "previous"
+ * resolution if it's still there, to the first one otherwise.
+*/
+struct cpf_tune *
+tune_resolve( cpf_t * cpf,
+              char * func_name,
+              enum func_prototype_t fproto,
+              struct cpf_tune * previous )
+{
+  const char      * selected = ( previous != NULL ) ? tune_selected( previous ) : NULL;
+  struct cpf_tune * t;
+  func_t          * f;
+  uint16_t          i, n = 0;
+
+
+  for ( i = 0 ; i < cpf->num_plugins ; i++ ) {
+    if ( find_func( &cpf->plugin[i], func_name ) != NULL ) {
+      n++;
+    }
+  }
+  if ( ( t = (struct cpf_tune *)calloc( 1, sizeof( struct cpf_tune ) + n * sizeof( tune_provider_t ) ) ) == NULL ) {
+    LOG_ERROR( "Cannot allocate memory for the tuned function \"%s\"!", func_name )
+    exit( EXIT_FAILURE );
+  }
+  for ( i = 0 ; i < cpf->num_plugins ; i++ ) {
+    if ( ( ( f = find_func( &cpf->plugin[i], func_name ) ) == NULL ) ||
+         ( check_func_proto( f, cpf->plugin[i].name, fproto ) == false ) ) {
+      continue;
+    }
+    snprintf( t->provider[t->num_providers].plugin_name,
+              sizeof( t->provider[t->num_providers].plugin_name ),
+              "%s", cpf->plugin[i].name );
+    t->provider[t->num_providers].func_addr = f->func_addr;
+    if ( ( selected != NULL ) && ( strcmp( cpf->plugin[i].name, selected ) == 0 ) ) {
+      t->selected = t->num_providers;
+    }
+    t->num_providers++;
+  }
+  return t;
+}
+
+
+/*
+ * End of an exploration round: select the provider with the lowest median
+ * latency (the median ignores the calls slowed down by a preemption or a page
+ * fault) and start the next round. A provider with less than TUNE_MIN_SAMPLES
+ * timed calls (calls still running when the round ended) isn't selectable.
+ * The next round records in the other statistics, zeroed here: they were last
+ * used by the previous round, so only a call late by a whole period can still
+ * record in them.
+*/
+static void
+tune_select( struct cpf_tune * t )
+{
+  uint32_t     old = atomic_load_explicit( &t->selected, memory_order_relaxed ),
+               best = old,
+               round = atomic_load_explicit( &t->rounds, memory_order_relaxed );
+  ab_stats_t * s;
+  bool         found = false;
+  uint16_t     i;
+
+
+  for ( i = 0 ; i < t->num_providers ; i++ ) {
+    s = &t->provider[i].stats[round & 1];
+    if ( atomic_load_explicit( &s->calls, memory_order_relaxed ) < TUNE_MIN_SAMPLES ) {
+      continue;
+    }
+    t->provider[i].p50_ns = ab_percentile( s, 50 );
+    if ( ( found == false ) || ( t->provider[i].p50_ns < t->provider[best].p50_ns ) ) {
+      best = i;
+      found = true;
+    }
+  }
+  for ( i = 0 ; i < t->num_providers ; i++ ) {
+    ab_reset( &t->provider[i].stats[( round + 1 ) & 1] );
+  }
+  if ( best != old ) {
+    LOG_INFO( "Tuned function: \"%s\" (%lu ns) replaces \"%s\" (%lu ns)",
+              t->provider[best].plugin_name, t->provider[best].p50_ns,
+              t->provider[old].plugin_name, t->provider[old].p50_ns )
+  }
+  atomic_store_explicit( &t->selected, best, memory_order_relaxed );
+  atomic_fetch_add_explicit( &t->rounds, 1, memory_order_release );
+}
+
+
+/*
+ * Each period starts with an exploration round: TUNE_SAMPLES timed calls per
+ * provider, interleaved so that they see the same load. The next
+ * TUNE_EXPLOIT_CALLS calls go to the selected provider, untimed.
+*/
+void *
+tune_call( struct cpf_tune * t, enum func_prototype_t fproto, va_list varglist )
+{
+  uint64_t        explore = (uint64_t)t->num_providers * TUNE_SAMPLES,
+                  n;
+  uint16_t        i;
+  struct timespec t0, t1;
+  void          * ret;
+
+
+  if ( t->num_providers < 2 ) {
+    return CPF_wrapper_call_func_by_addr( t->provider[0].func_addr, fproto, varglist );
+  }
+  n = atomic_fetch_add_explicit( &t->calls, 1, memory_order_relaxed ) % ( explore + TUNE_EXPLOIT_CALLS );
+  if ( n >= explore ) {
+    i = atomic_load_explicit( &t->selected, memory_order_relaxed );
+    return CPF_wrapper_call_func_by_addr( t->provider[i].func_addr, fproto, varglist );
+  }
+
+  i = n % t->num_providers;
+  clock_gettime( CLOCK_MONOTONIC, &t0 );
+  ret = CPF_wrapper_call_func_by_addr( t->provider[i].func_addr, fproto, varglist );
+  clock_gettime( CLOCK_MONOTONIC, &t1 );
+  ab_record( &t->provider[i].stats[atomic_load_explicit( &t->rounds, memory_order_acquire ) & 1],
+             (uint64_t)( t1.tv_sec - t0.tv_sec ) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec );
+  if ( ( atomic_fetch_add_explicit( &t->sampled, 1, memory_order_acq_rel ) + 1 ) % explore == 0 ) {
+    tune_select( t );
+  }
+  return ret;
+}
+
+
+const char *
+tune_selected( struct cpf_tune * t )
+{
+  if ( t->num_providers == 0 ) {
+    return NULL;
+  }
+  return t->provider[atomic_load_explicit( &t->selected, memory_order_relaxed )].plugin_name;
+}
+
+
+void
+tune_report( struct cpf_tune * t, char * func_name )
+{
+  uint32_t selected = atomic_load_explicit( &t->selected, memory_order_relaxed );
+  uint16_t i;
+
+
+  LOG_INFO( "Tuning report for \"%s\" (%u providers, %u rounds):",
+            func_name, t->num_providers, atomic_load( &t->rounds ) )
+  for ( i = 0 ; i < t->num_providers ; i++ ) {
+    LOG_INFO( "  %c \"%s\": p50 %lu ns",
+              ( i == selected ) ? '*' : ' ',
+              t->provider[i].plugin_name,
+              t->provider[i].p50_ns )
+  }
+}
+
+
+// the retired resolutions may still be used by a call started before a reload
+void
+tune_free( struct cpf_tune ** t )
+{
+  struct cpf_tune * retired;
+
+
+  while ( (*t) != NULL ) {
+    retired = (*t)->retired;
+    FREE( (*t) )
+    *t = retired;
+  }
+}
@@ -0,0 +1,58 @@
+/*
+  libcpf - C Plugin Framework
+
+  tune.h - header file
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __TUNE_H__
+#define __TUNE_H__
+
+#include <stdarg.h>
+#include "ab.h"
+
+#define TUNE_SAMPLES            64        // timed calls per provider and exploration round
+#define TUNE_EXPLOIT_CALLS      65536     // calls to the selected provider between two rounds
+#define TUNE_MIN_SAMPLES        ( TUNE_SAMPLES / 2 ) // timed calls for a provider to be selectable
+
+
+typedef struct {                          // one implementation of the tuned function
+  char       plugin_name[MAX_PLUGIN_NAME_SIZE];
+  void     * func_addr;
+  ab_stats_t stats[2];                    // [rounds & 1]: exploration round in progress
+  uint64_t   p50_ns;                      // median of the last round completed
+} tune_provider_t;
+
+struct cpf_tune {                         // providers of a function name (CPF_resolve_tuned())
+  struct cpf_tune  * retired;             // previous resolution, freed with the handle
+  _Atomic uint64_t   calls;               // calls since the resolution
+  _Atomic uint64_t   sampled;             // timed calls recorded
+  _Atomic uint32_t   selected;            // provider called outside the exploration rounds
+  _Atomic uint32_t   rounds;              // exploration rounds completed
+  uint16_t           num_providers;
+  tune_provider_t    provider[];
+};
+
+struct cpf_tune * tune_resolve( cpf_t * cpf,
+                               char * func_name,
+                               enum func_prototype_t fproto,
+                               struct cpf_tune * previous );
+void *            tune_call( struct cpf_tune * t, enum func_prototype_t fproto, va_list varglist );
+const char *      tune_selected( struct cpf_tune * t );
+void              tune_report( struct cpf_tune * t, char * func_name );
+void              tune_free( struct cpf_tune ** t );
+
+#endif
@@ -0,0 +1,87 @@
+/*
+  libcpf - C Plugin Framework
+
+  usdt.h - USDT probes (provider "libcpf")
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __USDT_H__
+#define __USDT_H__
+
+#include <stdint.h>
+
+/*
+ * Each probe is a NOP at the probe site and an ELF note (.note.stapsdt, the
+ * SystemTap format of <sys/sdt.h>) giving its address and where its arguments
+ * are: the tracers (bpftrace, perf, bcc) replace the NOP by a breakpoint when
+ * they attach. Without semaphore, the arguments are computed even when no
+ * tracer is attached: only pass values already at hand.
+ * All arguments are 8 bytes ("8@"): the strings are pointers (str() in bpftrace).
+ * Build with -DCPF_NO_USDT to remove the probes.
+*/
+#if !defined( CPF_NO_USDT ) && ( defined( __x86_64__ ) || defined( __aarch64__ ) )
+
+#define USDT_STR( x )           #x
+
+#define USDT_ASM( name, args )                                                   \
+  "990: nop\n"                                                                   \
+  ".pushsection .note.stapsdt,\"?\",\"note\"\n"                                  \
+  ".balign 4\n"                                                                  \
+  ".4byte 992f-991f, 994f-993f, 3\n"                                             \
+  "991: .asciz \"stapsdt\"\n"                                                    \
+  "992: .balign 4\n"                                                             \
+  "993: .8byte 990b\n"                                                           \
+  ".8byte _.stapsdt.base\n"                                                      \
+  ".8byte 0\n"                                                                   \
+  ".asciz \"libcpf\"\n"                                                          \
+  ".asciz \"" USDT_STR( name ) "\"\n"                                            \
+  ".asciz \"" args "\"\n"                                                        \
+  "994: .balign 4\n"                                                             \
+  ".popsection\n"                                                                \
+  ".ifndef _.stapsdt.base\n"                                                     \
+  ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"        \
+  ".weak _.stapsdt.base\n"                                                       \
+  ".hidden _.stapsdt.base\n"                                                     \
+  "_.stapsdt.base: .space 1\n"                                                   \
+  ".size _.stapsdt.base, 1\n"                                                    \
+  ".popsection\n"                                                                \
+  ".endif\n"
+
+#define USDT_ARG( x )           "nor"( (uint64_t)(uintptr_t)( x ) )
+
+#define USDT_PROBE0( name )                                                      \
+  __asm__ __volatile__ ( USDT_ASM( name, "" ) )
+#define USDT_PROBE1( name, a1 )                                                  \
+  __asm__ __volatile__ ( USDT_ASM( name, "8@%[usdt1]" )                          \
+                         :: [usdt1] USDT_ARG( a1 ) )
+#define USDT_PROBE2( name, a1, a2 )                                              \
+  __asm__ __volatile__ ( USDT_ASM( name, "8@%[usdt1] 8@%[usdt2]" )               \
+                         :: [usdt1] USDT_ARG( a1 ), [usdt2] USDT_ARG( a2 ) )
+#define USDT_PROBE3( name, a1, a2, a3 )                                          \
+  __asm__ __volatile__ ( USDT_ASM( name, "8@%[usdt1] 8@%[usdt2] 8@%[usdt3]" )    \
+                         :: [usdt1] USDT_ARG( a1 ), [usdt2] USDT_ARG( a2 ),      \
+                            [usdt3] USDT_ARG( a3 ) )
+
+#else
+
+#define USDT_PROBE0( name )                     do { } while ( 0 )
+#define USDT_PROBE1( name, a1 )                 do { (void)( a1 ); } while ( 0 )
+#define USDT_PROBE2( name, a1, a2 )             do { (void)( a1 ); (void)( a2 ); } while ( 0 )
+#define USDT_PROBE3( name, a1, a2, a3 )         do { (void)( a1 ); (void)( a2 ); (void)( a3 ); } while ( 0 )
+
+#endif
+
+#endif
@@ -48,8 +48,9 @@ concat_char_int(char * c, int i)
 {
   void * ret;
 
-  if ( ( ret = malloc( strlen( c ) + 100 ) ) == NULL ) {
-    printf("concat_char_int() from lib1: cannot malloc!\n");
+  // allocated by the host pool: freed with CPF_mem_free()
+  if ( ( ret = CPF_ALLOC( p_ctx, strlen( c ) + 100 ) ) == NULL ) {
+    printf("concat_char_int() from lib1: cannot allocate memory!\n");
     exit( EXIT_FAILURE );
   }
 
@@ -66,10 +67,8 @@ get_lib_name() {
 static int
 call_lib2_fcn() {
 
-  int (*lib2_do_oper)(int) = CPF_get_extern_lib_func_by_dep(
-                                arr_deps,
-                                DEP_LIB2,
-                                "do_operation" );
+  // through the host services: no libcpf symbol imported (CPF_FLAG_DLMOPEN)
+  int (*lib2_do_oper)(int) = CPF_DEP_FUNC( p_ctx, DEP_LIB2, "do_operation" );
   return lib2_do_oper( 1 );
 }
 
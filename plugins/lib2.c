@@ -31,9 +31,11 @@ get_lib_name()
 {
   return "Msg from lib2!";
 }
+CPF_EXPORT( get_lib_name, FP_CHARPTR, CPF_EXPORT_PURE | CPF_EXPORT_THREAD_SAFE )
 
 int
 do_operation(int i)
 {
   return i+2;
-}
\ No newline at end of file
+}
+CPF_EXPORT( do_operation, FP_INT_INT, CPF_EXPORT_PURE | CPF_EXPORT_THREAD_SAFE )
\ No newline at end of file
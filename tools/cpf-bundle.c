@@ -0,0 +1,209 @@
+/*
+  libcpf - C Plugin Framework
+
+  cpf-bundle.c - pack a plugin directory into one bundle file
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sys/stat.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bundle.h"
+
+/*
+ * Usage: cpf-bundle <plugin directory> <bundle file>
+ *
+ * Every "*"PLUGIN_EXTENSION file of the directory (and its subdirectories) is
+ * packed with the name CPF_init() would give it. The bundle is written in a
+ * temporary file renamed over <bundle file>: a running CPF_reload_libs() sees
+ * the old bundle or the new one, never a partial one.
+*/
+
+
+typedef struct {
+  char      name[MAX_PLUGIN_NAME_SIZE];
+  uint8_t * data;
+  size_t    size;
+  uint8_t   blake2s256[BLAKE2S256SIZE];
+} member_t;
+
+
+static member_t * members = NULL;
+static uint32_t   num_members = 0;
+static size_t     dir_len;
+
+
+static void
+hash_member( member_t * m )
+{
+  unsigned int md_len;
+  EVP_MD_CTX * mdctx;
+
+
+  if ( ( ( mdctx = EVP_MD_CTX_new() ) == NULL ) ||
+       ( EVP_DigestInit_ex( mdctx, EVP_blake2s256(), NULL ) == 0 ) ||
+       ( EVP_DigestUpdate( mdctx, m->data, m->size ) == 0 ) ||
+       ( EVP_DigestFinal_ex( mdctx, m->blake2s256, &md_len ) == 0 ) ) {
+    fprintf( stderr, "Couldn't digest \"%s\"\n", m->name );
+    exit( EXIT_FAILURE );
+  }
+  EVP_MD_CTX_free( mdctx );
+}
+
+
+static int
+add_member( const char * path, const struct stat * st, int type, struct FTW * ftw )
+{
+  member_t * m;
+  FILE     * f;
+  size_t     len;
+
+
+  if ( ( type != FTW_F ) || ( strstr( path + ftw->base, PLUGIN_EXTENSION ) == NULL ) ) {
+    return 0;
+  }
+  if ( ( m = (member_t *)realloc( members, ( num_members + 1 ) * sizeof( member_t ) ) ) == NULL ) {
+    fprintf( stderr, "Cannot allocate memory!\n" );
+    exit( EXIT_FAILURE );
+  }
+  members = m;
+  m = &members[num_members];
+  memset( m, 0, sizeof( member_t ) );
+
+  // plugin name: path relative to the directory, without extension (as dir_content())
+  len = strlen( path ) - dir_len - 1 - ( sizeof( PLUGIN_EXTENSION ) - 1 );
+  if ( len + 1 > sizeof( m->name ) ) {
+    fprintf( stderr, "Plugin name too long: \"%s\"\n", path );
+    exit( EXIT_FAILURE );
+  }
+  memcpy( m->name, path + dir_len + 1, len );
+
+  m->size = st->st_size;
+  if ( ( m->size == 0 ) || ( ( m->data = (uint8_t *)malloc( m->size ) ) == NULL ) ) {
+    fprintf( stderr, "Cannot read \"%s\"\n", path );
+    exit( EXIT_FAILURE );
+  }
+  if ( ( ( f = fopen( path, "r" ) ) == NULL ) ||
+       ( fread( m->data, 1, m->size, f ) != m->size ) ) {
+    fprintf( stderr, "Cannot read \"%s\"\n", path );
+    exit( EXIT_FAILURE );
+  }
+  fclose( f );
+  hash_member( m );
+  num_members++;
+  return 0;
+}
+
+
+static int
+comparator( const void * p, const void * q )
+{
+  return strcmp( ( (member_t *)p )->name, ( (member_t *)q )->name );
+}
+
+
+static uint64_t
+align( uint64_t off )
+{
+  return ( off + BUNDLE_ALIGN - 1 ) & ~( (uint64_t)BUNDLE_ALIGN - 1 );
+}
+
+
+int
+main( int argc, char ** argv )
+{
+  char             tmp_path[MAX_PLUGIN_PATH_SIZE + 32];
+  bundle_hdr_t     hdr;
+  bundle_entry_t * e;
+  uint64_t         name_off, off;
+  uint32_t         i;
+  FILE           * f;
+
+
+  if ( argc != 3 ) {
+    fprintf( stderr, "Usage: %s <plugin directory> <bundle file>\n", argv[0] );
+    return EXIT_FAILURE;
+  }
+  dir_len = strlen( argv[1] );
+  while ( ( dir_len > 1 ) && ( argv[1][dir_len - 1] == '/' ) ) {
+    argv[1][--dir_len] = '\0';
+  }
+  if ( nftw( argv[1], add_member, 16, FTW_PHYS ) == -1 ) {
+    fprintf( stderr, "Cannot read directory \"%s\"\n", argv[1] );
+    return EXIT_FAILURE;
+  }
+  qsort( members, num_members, sizeof( member_t ), comparator );
+
+  if ( ( e = (bundle_entry_t *)calloc( num_members + 1, sizeof( bundle_entry_t ) ) ) == NULL ) {
+    fprintf( stderr, "Cannot allocate memory!\n" );
+    return EXIT_FAILURE;
+  }
+  // index, names, then the page aligned images
+  name_off = sizeof( hdr ) + num_members * sizeof( bundle_entry_t );
+  off = name_off;
+  for ( i = 0 ; i < num_members ; i++ ) {
+    off += strlen( members[i].name ) + 1;
+  }
+  for ( i = 0 ; i < num_members ; i++ ) {
+    memcpy( e[i].blake2s256, members[i].blake2s256, sizeof( e[i].blake2s256 ) );
+    e[i].name_off = name_off;
+    name_off += strlen( members[i].name ) + 1;
+    e[i].offset = off = align( off );
+    e[i].size = members[i].size;
+    off += members[i].size;
+  }
+  memset( &hdr, 0, sizeof( hdr ) );
+  memcpy( hdr.magic, BUNDLE_MAGIC, sizeof( hdr.magic ) );
+  hdr.version = BUNDLE_VERSION;
+  hdr.num_entries = num_members;
+  hdr.file_size = off;
+
+  snprintf( tmp_path, sizeof( tmp_path ), "%s.%d", argv[2], (int)getpid() );
+  if ( ( f = fopen( tmp_path, "w" ) ) == NULL ) {
+    fprintf( stderr, "Cannot write \"%s\"\n", tmp_path );
+    return EXIT_FAILURE;
+  }
+  fwrite( &hdr, sizeof( hdr ), 1, f );
+  fwrite( e, sizeof( bundle_entry_t ), num_members, f );
+  for ( i = 0 ; i < num_members ; i++ ) {
+    fwrite( members[i].name, strlen( members[i].name ) + 1, 1, f );
+  }
+  for ( i = 0 ; i < num_members ; i++ ) {
+    fseek( f, e[i].offset, SEEK_SET ); // zero filled gap
+    fwrite( members[i].data, 1, members[i].size, f );
+  }
+  if ( ( fflush( f ) != 0 ) || ( ferror( f ) ) || ( fsync( fileno( f ) ) == -1 ) ) {
+    fprintf( stderr, "Cannot write \"%s\"\n", tmp_path );
+    fclose( f );
+    unlink( tmp_path );
+    return EXIT_FAILURE;
+  }
+  fclose( f );
+  if ( rename( tmp_path, argv[2] ) == -1 ) {
+    fprintf( stderr, "Cannot rename \"%s\"\n", tmp_path );
+    unlink( tmp_path );
+    return EXIT_FAILURE;
+  }
+  printf( "%u plugins packed in \"%s\" (%lu bytes)\n",
+          num_members, argv[2], (unsigned long)hdr.file_size );
+  return EXIT_SUCCESS;
+}
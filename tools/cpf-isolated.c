@@ -0,0 +1,42 @@
+/*
+  libcpf - C Plugin Framework
+
+  cpf-isolated.c - isolated plugin process (see CPF_isolated_init())
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include "isolated.h"
+
+/*
+ * Usage: cpf-isolated <ring fd> <plugin directory> <flags>
+ *
+ * Started by CPF_isolated_init(), not by hand: loads the plugin directory and
+ * runs the calls posted in the shared call ring "ring fd", until the host
+ * frees the isolated registry or dies.
+*/
+
+
+int
+main( int argc, char ** argv )
+{
+  if ( argc != 4 ) {
+    fprintf( stderr, "Usage: %s <ring fd> <plugin directory> <flags>\n", argv[0] );
+    return EXIT_FAILURE;
+  }
+  return isolated_serve( atoi( argv[1] ), argv[2], (uint32_t)strtoul( argv[3], NULL, 0 ) );
+}
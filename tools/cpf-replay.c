@@ -0,0 +1,386 @@
+/*
+  libcpf - C Plugin Framework
+
+  cpf-replay.c - replay a call trace against a plugin directory
+
+  Copyright (C) 2021 libcpf authors
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "record.h"
+
+/*
+ * Usage: cpf-replay [-m] [-n <passes>] <plugin directory> <trace file>
+ *
+ * Loads the plugin directory with CPF_init(), and calls the functions of the
+ * trace (see CPF_record_start()) with the recorded arguments, at the recorded
+ * pace, or as fast as possible with -m. The buffers are copied before each
+ * call; a void pointer, or a char pointer that isn't an input string, gets a
+ * zeroed buffer of RECORD_MAX_BUFFER bytes. The report compares the latency
+ * of each function with the recorded one: replay the same trace against two
+ * builds of a plugin for a before/after comparison.
+*/
+
+
+typedef struct {                          // function of the trace
+  char            * plugin_name;          // "" = any plugin exporting it (tuned handle)
+  char            * func_name;
+  const fp_desc_t * desc;
+  void            * func_addr;            // NULL = not loaded, calls skipped
+  uint32_t        * ns;                   // replayed latencies
+  uint64_t          calls;
+  uint64_t          size;
+  uint64_t          recorded_ns;          // sum of the recorded latencies
+  uint64_t          skipped;
+} replay_func_t;
+
+
+static replay_func_t * funcs = NULL;
+static uint32_t        num_funcs = 0;
+static uint8_t       * arg_buffer[FP_MAX_ARGS];
+
+
+static uint64_t
+now_ns( void )
+{
+  struct timespec t;
+
+
+  clock_gettime( CLOCK_MONOTONIC, &t );
+  return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+
+static void
+truncated( void )
+{
+  fprintf( stderr, "Truncated or invalid trace\n" );
+  exit( EXIT_FAILURE );
+}
+
+
+static char *
+read_name( const uint8_t ** p, const uint8_t * end, uint16_t len )
+{
+  char * s;
+
+
+  if ( (size_t)( end - *p ) < len ) {
+    truncated();
+  }
+  if ( ( s = (char *)calloc( 1, len + 1 ) ) == NULL ) {
+    fprintf( stderr, "Cannot allocate memory!\n" );
+    exit( EXIT_FAILURE );
+  }
+  memcpy( s, *p, len );
+  *p += len;
+  return s;
+}
+
+
+static void *
+find_func_addr( cpf_t * cpf, replay_func_t * f )
+{
+  func_t * lf;
+  uint16_t i;
+
+
+  for ( i = 0 ; i < cpf->num_plugins ; i++ ) {
+    if ( ( f->plugin_name[0] != '\0' ) && ( strcmp( f->plugin_name, cpf->plugin[i].name ) != 0 ) ) {
+      continue;
+    }
+    for ( lf = cpf->plugin[i].lib_func ; lf->func_addr != NULL ; lf++ ) {
+      if ( ( lf->func_name != NULL ) && ( strcmp( lf->func_name, f->func_name ) == 0 ) ) {
+        return lf->func_addr;
+      }
+    }
+  }
+  return NULL;
+}
+
+
+static void
+define_func( cpf_t * cpf, const uint8_t ** p, const uint8_t * end )
+{
+  record_func_t   rf;
+  replay_func_t * f;
+  char          * proto;
+
+
+  if ( (size_t)( end - *p ) < sizeof( rf ) ) {
+    truncated();
+  }
+  memcpy( &rf, *p, sizeof( rf ) );
+  *p += sizeof( rf );
+  if ( rf.id != num_funcs ) {
+    truncated();
+  }
+  if ( ( f = (replay_func_t *)realloc( funcs, ( num_funcs + 1 ) * sizeof( replay_func_t ) ) ) == NULL ) {
+    fprintf( stderr, "Cannot allocate memory!\n" );
+    exit( EXIT_FAILURE );
+  }
+  funcs = f;
+  f = &funcs[num_funcs++];
+  memset( f, 0, sizeof( replay_func_t ) );
+  f->plugin_name = read_name( p, end, rf.plugin_len );
+  f->func_name = read_name( p, end, rf.func_len );
+  proto = read_name( p, end, rf.fproto_len );
+  if ( ( f->desc = CPF_wrapper_get_desc_by_name( proto ) ) == NULL ) {
+    fprintf( stderr, "Unknown prototype %s of \"%s\": calls skipped\n", proto, f->func_name );
+  } else if ( ( f->func_addr = find_func_addr( cpf, f ) ) == NULL ) {
+    fprintf( stderr, "\"%s\" of \"%s\" is not loaded: calls skipped\n", f->func_name, f->plugin_name );
+  }
+  free( proto );
+}
+
+
+// the functions are defined on the first pass
+static void
+skip_func( const uint8_t ** p, const uint8_t * end )
+{
+  record_func_t rf;
+
+
+  if ( (size_t)( end - *p ) < sizeof( rf ) ) {
+    truncated();
+  }
+  memcpy( &rf, *p, sizeof( rf ) );
+  *p += sizeof( rf ) + rf.plugin_len + rf.func_len + rf.fproto_len;
+}
+
+
+static void
+add_ns( replay_func_t * f, uint64_t ns )
+{
+  uint32_t * n;
+
+
+  if ( f->calls == f->size ) {
+    f->size = ( f->size == 0 ) ? 1024 : f->size * 2;
+    if ( ( n = (uint32_t *)realloc( f->ns, f->size * sizeof( uint32_t ) ) ) == NULL ) {
+      fprintf( stderr, "Cannot allocate memory!\n" );
+      exit( EXIT_FAILURE );
+    }
+    f->ns = n;
+  }
+  f->ns[f->calls++] = ( ns > UINT32_MAX ) ? UINT32_MAX : (uint32_t)ns;
+}
+
+
+static void
+replay_call( const uint8_t ** p, const uint8_t * end, uint64_t replay_start, bool max_speed )
+{
+  record_call_t   rc;
+  replay_func_t * f;
+  fp_args_t       args;
+  struct timespec ts;
+  uint32_t        len;
+  uint64_t        t0, wait;
+  uint8_t         i;
+
+
+  if ( (size_t)( end - *p ) < sizeof( rc ) ) {
+    truncated();
+  }
+  memcpy( &rc, *p, sizeof( rc ) );
+  *p += sizeof( rc );
+  if ( ( rc.id >= num_funcs ) || ( rc.num_args > FP_MAX_ARGS ) ||
+       ( ( funcs[rc.id].desc != NULL ) && ( funcs[rc.id].desc->num_args != rc.num_args ) ) ) {
+    truncated();
+  }
+  f = &funcs[rc.id];
+  memset( &args, 0, sizeof( args ) );
+  args.num_args = rc.num_args;
+  if ( f->desc != NULL ) {
+    args.fproto = f->desc->fproto;
+  }
+  for ( i = 0 ; i < rc.num_args ; i++ ) {
+    if ( ( f->desc == NULL ) || ( f->desc->arg[i] < PT_POINTER_TO_VOID ) ) {
+      if ( (size_t)( end - *p ) < sizeof( fp_arg_t ) ) {
+        truncated();
+      }
+      memcpy( &args.arg[i], *p, sizeof( fp_arg_t ) );
+      *p += sizeof( fp_arg_t );
+      continue;
+    }
+    if ( (size_t)( end - *p ) < sizeof( len ) ) {
+      truncated();
+    }
+    memcpy( &len, *p, sizeof( len ) );
+    *p += sizeof( len );
+    if ( len == RECORD_NULL_PTR ) {
+      continue;
+    }
+    if ( ( len > RECORD_MAX_BUFFER ) || ( (size_t)( end - *p ) < len ) ) {
+      truncated();
+    }
+    memset( arg_buffer[i], 0, RECORD_MAX_BUFFER );
+    memcpy( arg_buffer[i], *p, len );
+    args.arg[i].vp = arg_buffer[i];
+    *p += len;
+  }
+  f->recorded_ns += rc.duration_ns;
+  if ( f->func_addr == NULL ) {
+    f->skipped++;
+    return;
+  }
+
+  if ( max_speed == false ) {
+    while ( ( t0 = now_ns() ) < replay_start + rc.start_ns ) {
+      wait = replay_start + rc.start_ns - t0;
+      ts.tv_sec = wait / 1000000000ULL;
+      ts.tv_nsec = wait % 1000000000ULL;
+      nanosleep( &ts, NULL );
+    }
+  }
+  t0 = now_ns();
+  CPF_wrapper_call_func_by_args( f->func_addr, &args );
+  add_ns( f, now_ns() - t0 );
+}
+
+
+static int
+comparator( const void * p, const void * q )
+{
+  uint32_t a = *(const uint32_t *)p, b = *(const uint32_t *)q;
+
+
+  return ( a > b ) - ( a < b );
+}
+
+
+static void
+report( uint64_t elapsed_ns )
+{
+  replay_func_t * f;
+  char            name[MAX_PLUGIN_NAME_SIZE + CPF_EXPORT_NAME_SIZE];
+  uint64_t        total, recorded_mean, mean, j;
+  uint32_t        i;
+
+
+  printf( "%-40s %10s %12s %10s %10s %10s %12s %8s\n",
+          "function", "calls", "calls/s", "mean ns", "p50 ns", "p99 ns", "recorded ns", "delta" );
+  for ( i = 0 ; i < num_funcs ; i++ ) {
+    f = &funcs[i];
+    snprintf( name, sizeof( name ), "%s:%s", ( f->plugin_name[0] != '\0' ) ? f->plugin_name : "*",
+              f->func_name );
+    if ( f->calls == 0 ) {
+      printf( "%-40s %10s (%lu calls skipped)\n", name, "-", f->skipped );
+      continue;
+    }
+    qsort( f->ns, f->calls, sizeof( uint32_t ), comparator );
+    for ( total = 0, j = 0 ; j < f->calls ; j++ ) {
+      total += f->ns[j];
+    }
+    mean = total / f->calls;
+    recorded_mean = f->recorded_ns / ( f->calls + f->skipped );
+    printf( "%-40s %10lu %12.0f %10lu %10u %10u %12lu %+7.1f%%\n",
+            name, f->calls,
+            ( total > 0 ) ? (double)f->calls * 1e9 / (double)total : 0.0,
+            mean,
+            f->ns[( f->calls - 1 ) / 2],
+            f->ns[( f->calls * 99 + 99 ) / 100 - 1],
+            recorded_mean,
+            ( recorded_mean > 0 ) ? ( (double)mean - (double)recorded_mean ) * 100.0 / (double)recorded_mean : 0.0 );
+  }
+  printf( "Replayed in %.3f s\n", (double)elapsed_ns / 1e9 );
+}
+
+
+int
+main( int argc, char ** argv )
+{
+  cpf_t         * cpf;
+  record_hdr_t    hdr;
+  struct stat     st;
+  const uint8_t * p, * end;
+  uint8_t       * trace;
+  uint64_t        start, pass_start;
+  uint32_t        passes = 1, pass, i;
+  bool            max_speed = false;
+  FILE          * f;
+  int             opt;
+
+
+  while ( ( opt = getopt( argc, argv, "mn:" ) ) != -1 ) {
+    switch ( opt ) {
+      case 'm':
+        max_speed = true;
+        break;
+      case 'n':
+        passes = (uint32_t)strtoul( optarg, NULL, 10 );
+        break;
+      default:
+        passes = 0;
+    }
+  }
+  if ( ( argc - optind != 2 ) || ( passes == 0 ) ) {
+    fprintf( stderr, "Usage: %s [-m] [-n <passes>] <plugin directory> <trace file>\n", argv[0] );
+    return EXIT_FAILURE;
+  }
+  if ( ( stat( argv[optind + 1], &st ) == -1 ) || ( st.st_size < (off_t)sizeof( hdr ) ) ||
+       ( ( trace = (uint8_t *)malloc( st.st_size ) ) == NULL ) ||
+       ( ( f = fopen( argv[optind + 1], "r" ) ) == NULL ) ) {
+    fprintf( stderr, "Cannot read \"%s\"\n", argv[optind + 1] );
+    return EXIT_FAILURE;
+  }
+  if ( fread( trace, 1, st.st_size, f ) != (size_t)st.st_size ) {
+    fprintf( stderr, "Cannot read \"%s\"\n", argv[optind + 1] );
+    return EXIT_FAILURE;
+  }
+  fclose( f );
+  memcpy( &hdr, trace, sizeof( hdr ) );
+  if ( ( memcmp( hdr.magic, RECORD_MAGIC, sizeof( hdr.magic ) ) != 0 ) || ( hdr.version != RECORD_VERSION ) ) {
+    fprintf( stderr, "\"%s\" is not a call trace (version %u)\n", argv[optind + 1], RECORD_VERSION );
+    return EXIT_FAILURE;
+  }
+  if ( ( cpf = CPF_init( argv[optind] ) ) == NULL ) {
+    fprintf( stderr, "Cannot load \"%s\"\n", argv[optind] );
+    return EXIT_FAILURE;
+  }
+  for ( i = 0 ; i < FP_MAX_ARGS ; i++ ) {
+    if ( ( arg_buffer[i] = (uint8_t *)malloc( RECORD_MAX_BUFFER ) ) == NULL ) {
+      fprintf( stderr, "Cannot allocate memory!\n" );
+      return EXIT_FAILURE;
+    }
+  }
+
+  start = now_ns();
+  end = trace + st.st_size;
+  for ( pass = 0 ; pass < passes ; pass++ ) {
+    pass_start = now_ns();
+    for ( p = trace + sizeof( hdr ) ; p < end ; ) {
+      if ( ( *p == RECORD_TYPE_FUNC ) && ( pass > 0 ) ) {
+        skip_func( &p, end );
+      } else if ( *p == RECORD_TYPE_FUNC ) {
+        define_func( cpf, &p, end );
+      } else if ( *p == RECORD_TYPE_CALL ) {
+        replay_call( &p, end, pass_start, max_speed );
+      } else {
+        truncated();
+      }
+    }
+  }
+  report( now_ns() - start );
+
+  CPF_call_dtor( cpf );
+  CPF_free( &cpf );
+  return EXIT_SUCCESS;
+}